@@ -56,8 +56,14 @@
  not share the default UVAVER behavior of discarding
  completely-flagged records.
 
- LIMITATIONS: CHANAVER only works with datasets containing a single
- spectral window.
+ CHANAVER can average several spectral windows at once, and with the
+ "bins" keyword, it can average different ranges of channels by
+ different amounts, or drop channels altogether. Each range becomes
+ a spectral window in the output dataset.
+
+ LIMITATIONS: CHANAVER can't handle datasets with wideband channels.
+ The "lst" and "ut" variables of the output are recomputed from the
+ record timestamps rather than copied.
 
 @ vis
  The input dataset or datasets. For more information, see
@@ -68,9 +74,21 @@
 
 @ naver
  The number of channels to average together. This number must divide
- evenly into the number of spectral channels. A value of one is
- acceptable, meaning that calibrations will be applied and flagged
- data will be zeroed out in the output dataset.
+ evenly into the number of channels in each spectral window. A value
+ of one is acceptable, meaning that calibrations will be applied and
+ flagged data will be zeroed out in the output dataset. Either naver
+ or bins must be given, but not both.
+
+@ bins
+ Up to 32 triplets of numbers, each describing a range of channels to
+ average: the first channel of the range, counting from one across
+ all of the spectral windows; the number of channels in the range;
+ and the number of channels to average together within it. Each range
+ must lie inside one spectral window, and its width must be a
+ multiple of the number of channels to average. Channels that aren't
+ in any range are dropped. For instance, "bins=1,64,8,65,64,1"
+ averages the first 64 channels by 8 and copies the next 64 as they
+ are.
 
 @ slop
  The fraction of channels in each averaging bin that must be present
@@ -126,6 +144,22 @@ DEFAULT_SLOP = 0.5
 DEFAULT_BANNER = 'PYTHON chanaver: channel average after applying bandpass'
 UVDAT_OPTIONS = '3'
 
+# The spectral variables are checked and rewritten to describe the
+# averaged channels. The others are copied through as they are. The
+# data are read in batches, so we can't copy the variables record by
+# record with the usual VarCopy logic; instead, every variable of the
+# input is tracked, a batch ends whenever one of them changes, and the
+# values that apply to it are written out along with it. The
+# exceptions are "lst" and "ut", which change with every integration
+# and so are worked out for each record from its timestamp.
+
+SPECTRAL_VARS = 'nspect nwide sdf nschan ischan sfreq'.split ()
+
+# Copied variables with a value, or a set of values, per spectral
+# window. These are rearranged to match the output windows.
+
+WINDOW_VARS = 'restfreq systemp xtsys xyphase ytsys'.split ()
+
 
 class InputStructureError (Exception):
     def __init__ (self, path, why, *whyargs):
@@ -145,29 +179,46 @@ class _CreateFailedError (Exception):
         self.subexc = subexc
 
 
+def _checkBinning (naver, bins, slop):
+    if bins is None:
+        if naver is None or naver < 1:
+            raise ValueError ('must average at least one channel (got naver=%s)' % naver)
+    else:
+        if naver is not None:
+            raise ValueError ('cannot specify both naver and bins')
+        if len (bins) == 0 or len (bins) % 3 != 0:
+            raise ValueError ('bins must be a nonempty list of triplets')
+        for i in xrange (0, len (bins), 3):
+            if bins[i] < 1 or bins[i+1] < 1 or bins[i+2] < 1:
+                raise ValueError ('illegal bin specification %s' %
+                                  (tuple (bins[i:i+3]), ))
+    if slop < 0 or slop > 1:
+        raise ValueError ('slop must be between 0 and 1 (got slop=%f)' % slop)
+
+
 def channelAverage (out, naver, slop=DEFAULT_SLOP, banner=DEFAULT_BANNER,
-                    args=['undefined']):
+                    args=['undefined'], bins=None):
     """Read data from the uvdat subsystem and channel average into an output dataset.
 
     out: dataset handle; the output dataset to be created
-  naver: int; the number of channels to average together (see task docs)
+  naver: int or None; the number of channels to average together (see task docs)
    slop: float; tolerance for partially flagged bins (see task docs)
  banner: string; a message to write into the output's history
    args: list of strings; command-line arguments to write into the output's history,
          not including the program name (i.e. no traditional argv[0])
+   bins: list of int or None; channel ranges to average, in place of naver
+         (see task docs)
 returns: None
 
 Contrast with channelAverageWithSetup, which sets up the uvdat subsytem itself
 rather than assuming that it's been initialized.
 """
 
-    if naver < 1:
-        raise ValueError ('must average at least one channel (got naver=%d)' % naver)
-    if slop < 0 or slop > 1:
-        raise ValueError ('slop must be between 0 and 1 (got slop=%f)' % slop)
+    _checkBinning (naver, bins, slop)
 
     try:
-        _channelAverage (uvdat.read (), out, naver, slop, banner, args)
+        gen = uvdat.readBatches (trackVars=None)
+        _channelAverage (gen, out, naver, bins, slop, banner, args)
     except _CreateFailedError, e:
         # Don't delete the existing dataset!
         raise e.subexc
@@ -177,32 +228,32 @@ rather than assuming that it's been initialized.
 
 
 def channelAverageWithSetup (toread, out, naver, slop=DEFAULT_SLOP,
-                             banner=DEFAULT_BANNER, **uvdargs):
+                             banner=DEFAULT_BANNER, bins=None, **uvdargs):
     """Read UV data and channel average into an output dataset.
 
    toread: dataset handle or iterable thereof; input dataset(s)
       out: dataset handle; the output dataset to be created
-    naver: int; the number of channels to average together (see task docs)
+    naver: int or None; the number of channels to average together (see task docs)
      slop: float; tolerance for partially flagged bins (see task docs)
    banner: string; a message to write into the output's history
+     bins: list of int or None; channel ranges to average, in place of naver
+           (see task docs)
 **uvdargs: keyword arguments passed through to the uvdat subsystem
-           initialization (mirtask.uvdat.setupAndRead)
+           initialization (mirtask.uvdat.setupAndReadBatches)
   returns: None
 
 Contrast with channelAverage, which performs no extra initialization
 of the uvdat subsystem.
 """
 
-    if naver < 1:
-        raise ValueError ('must average at least one channel (got naver=%d)' % naver)
-    if slop < 0 or slop > 1:
-        raise ValueError ('slop must be between 0 and 1 (got slop=%f)' % slop)
+    _checkBinning (naver, bins, slop)
 
     try:
-        gen = uvdat.setupAndRead (toread, UVDAT_OPTIONS, False, **uvdargs)
+        gen = uvdat.setupAndReadBatches (toread, UVDAT_OPTIONS,
+                                         trackVars=None, **uvdargs)
         args = ['vis=' + ','.join (str (x) for x in ensureiterable (toread))]
         args += ['%s=%s' % (k, uvdargs[k]) for k in sorted (uvdargs.iterkeys ())]
-        _channelAverage (gen, out, naver, slop, banner, args)
+        _channelAverage (gen, out, naver, bins, slop, banner, args)
     except _CreateFailedError, e:
         # Don't delete the existing dataset!
         raise e.subexc
@@ -211,23 +262,132 @@ of the uvdat subsystem.
         raise
 
 
-def _channelAverage (gen, out, naver, slop, banner, args):
+def _snapArray (snap, name, default):
+    if name not in snap:
+        return N.atleast_1d (default)
+    return N.atleast_1d (snap[name][1])
+
+
+class _BinPlan (object):
+    """The channel binning for one spectral configuration.
+
+This works out which input channels go into each output channel, in
+the form needed by util.binChannels, and the spectral variables that
+describe the output windows.
+"""
+    def __init__ (self, path, nchan, vars, naver, bins, slop):
+        nspect = int (_snapArray (vars, 'nspect', 0)[0])
+        nwide = int (_snapArray (vars, 'nwide', 0)[0])
+
+        if nspect < 1:
+            raise InputStructureError (path, 'no spectral windows')
+        if nwide != 0:
+            raise InputStructureError (path, 'require no wideband windows')
+
+        nschan = _snapArray (vars, 'nschan', 0)[:nspect]
+        ischan = _snapArray (vars, 'ischan', 0)[:nspect]
+        sfreq = _snapArray (vars, 'sfreq', 0.)[:nspect]
+        sdf = _snapArray (vars, 'sdf', 0.)[:nspect]
+
+        if nschan.size != nspect or ischan.size != nspect:
+            raise InputStructureError (path, 'inconsistent spectral window '
+                                       'variables')
+
+        for w in xrange (nspect):
+            if ischan[w] < 1 or ischan[w] + nschan[w] - 1 > nchan:
+                raise InputStructureError (path, 'spectral window %d (channels '
+                                           '%d-%d) extends beyond the %d '
+                                           'channels of the data', w + 1,
+                                           ischan[w], ischan[w] + nschan[w] - 1,
+                                           nchan)
+
+        # Each range is (first channel, number of channels, number to
+        # average), with channels counted from one.
+
+        if bins is None:
+            ranges = [(ischan[w], nschan[w], naver) for w in xrange (nspect)]
+        else:
+            ranges = [tuple (bins[i:i+3]) for i in xrange (0, len (bins), 3)]
+
+        starts = []
+        widths = []
+        self.windows = []
+        self.nschan = []
+        self.sfreq = []
+        self.sdf = []
+
+        for first, n, width in ranges:
+            inwin = (first >= ischan) & (first + n <= ischan + nschan)
+            if not inwin.any ():
+                raise InputStructureError (path, 'channel range %d-%d is not '
+                                           'inside one spectral window',
+                                           first, first + n - 1)
+            w = N.nonzero (inwin)[0][0]
+
+            if n % width != 0:
+                raise InputStructureError (path, 'require the number of '
+                                           'channels in the range starting '
+                                           'at %d (%d) to be a multiple of '
+                                           'the number to average (%d)',
+                                           first, n, width)
+
+            nout = n // width
+            starts.append (N.arange (nout) * width + first - 1)
+            widths.append (N.zeros (nout, dtype=N.intp) + width)
+            self.windows.append (w)
+            self.nschan.append (nout)
+            self.sdf.append (sdf[w] * width)
+            self.sfreq.append (sfreq[w] + sdf[w] * (first - ischan[w] +
+                                                    0.5 * (width - 1)))
+
+        self.nspectIn = nspect
+        self.starts = N.concatenate (starts).astype (N.intp)
+        self.ends = self.starts + N.concatenate (widths)
+        self.nmin = N.maximum (N.round (slop * (self.ends - self.starts)),
+                               1).astype (N.intc)
+        self.nout = self.starts.size
+
+
+    def writeVars (self, outhnd, vars):
+        """Write the variables of a snapshot, with the spectral ones
+replaced by those of the output windows."""
+
+        snap = {}
+        nspect = self.nspectIn
+        windows = N.asarray (self.windows)
+
+        for name, (type, val) in vars.iteritems ():
+            if name in SPECTRAL_VARS:
+                continue
+            if name in WINDOW_VARS and type != 'a' and val.size % nspect == 0:
+                val = val.reshape ((nspect, -1))[windows].ravel ()
+            snap[name] = (type, val)
+
+        outhnd.writeVars (snap)
+        outhnd.writeVarInt ('nspect', len (self.windows))
+        outhnd.writeVarInt ('nschan', N.asarray (self.nschan, dtype=N.int32))
+        outhnd.writeVarInt ('ischan', (N.cumsum (self.nschan) -
+                                       self.nschan + 1).astype (N.int32))
+        outhnd.writeVarDouble ('sdf', N.asarray (self.sdf, dtype=N.double))
+        outhnd.writeVarDouble ('sfreq', N.asarray (self.sfreq, dtype=N.double))
+
+
+def _channelAverage (gen, out, naver, bins, slop, banner, args):
     """Implementation of the channel averaging.
 
-    gen: iterable of (hnd, pream, data, flags); source of UV records
+    gen: iterable of (hnd, batch); source of batches of UV records
     out: dataset handle; the output dataset to be created
-  naver: int; the number of channels to average together (see task docs)
+  naver: int or None; the number of channels to average together (see task docs)
+   bins: list of int or None; channel ranges to average (see task docs)
    slop: float; tolerance for partially flagged bins (see task docs)
  banner: string; a message to write into the output's history
    args: list of strings; command-line args to write into the output history
 returns: None
 """
-    from numpy import sum, greater_equal, maximum
-
-    nmin = max (int (round (slop * naver)), 1) # min num. chans to avoid flagging
-
     firstiteration = True
     prevhnd = None
+    prevvars = None
+    plans = {} # binning plans, cached by spectral configuration
     prevnpol = 0 # for writing correct polarization metadata
     npolvaried = False # ditto
 
@@ -237,7 +397,7 @@ returns: None
         raise _CreateFailedError (e)
     outhnd.setPreambleType ('uvw', 'time', 'baseline')
 
-    for vishnd, preamble, data, flags in gen:
+    for vishnd, batch in gen:
         if firstiteration:
             firstiteration = False
 
@@ -252,100 +412,60 @@ returns: None
             outhnd.openHistory ()
             outhnd.writeHistory (banner)
             outhnd.logInvocation ('PYTHON chanaver', args)
-            outhnd.writeHistory ('PYTHON chanaver: naver=%d slop=%f' % (naver, slop))
+            if bins is None:
+                outhnd.writeHistory ('PYTHON chanaver: naver=%d slop=%f' % (naver, slop))
+            else:
+                outhnd.writeHistory ('PYTHON chanaver: bins=%s slop=%f' %
+                                     (','.join (str (b) for b in bins), slop))
             outhnd.closeHistory ()
 
         if vishnd is not prevhnd:
-            # Started reading new input dataset.
+            # Only write the times that the input has.
             prevhnd = vishnd
-            npol = 0
-
-            tracker = vishnd.makeVarTracker ()
-            tracker.track ('nchan', 'nspect', 'nwide', 'sdf', 'nschan',
-                           'ischan', 'sfreq')
-
-            # We don't care about these, but they would normally be copied
-            # by the VarCopy(line=channel) logic.
-            for var in 'restfreq systemp xtsys ytsys xyphase'.split ():
-                vishnd.trackVar (var, False, True)
-
-            vishnd.initVarsAsInput (' ') # set up to copy basic variables
-            outhnd.initVarsAsOutput (vishnd, ' ')
-
-        if tracker.updated ():
-            # Potentially new spectral configuration. Verify.
-            nspect = vishnd.getScalar ('nspect', 0)
-            nwide = vishnd.getScalar ('nwide', 0)
-            nchan = vishnd.getScalar ('nchan', 0)
-
-            if nspect != 1:
-                raise InputStructureError (vishnd.path (),
-                                           'require exactly one spectral window')
-            if nwide != 0:
-                raise InputStructureError (vishnd.path (),
-                                           'require no wideband windows')
-
-            sdf = vishnd.getVarDouble ('sdf', nspect)
-            nschan = vishnd.getVarInt ('nschan', nspect)
-            ischan = vishnd.getVarInt ('ischan', nspect)
-            sfreq = vishnd.getVarDouble ('sfreq', nspect)
-
-            if nschan != nchan:
-                raise InputStructureError (vishnd.path (),
-                                           'require nchan (%d) = nschan (%d)',
-                                           nchan, nschan)
-            if ischan != 1:
-                raise InputStructureError (vishnd.path (),
-                                           'require ischan (%d) = 1', ischan)
-
-            if nchan % naver != 0:
-                raise InputStructureError (vishnd.path (),
-                                           'require nchan (%d) to be a multiple '
-                                           'of naver (%d)', nchan, naver)
-
-            # OK, everything is hunky-dory. Compute new setup.
-
-            nout = nchan // naver
-            sdfout = sdf * naver
-            sfreqout = sfreq + 0.5 * sdf * (naver - 1)
-
-            outdata = N.empty (nout, dtype=N.complex64)
-            outflags = N.empty (nout, dtype=N.int32)
-            counts = N.empty (nout, dtype=N.int32)
-
-            outhnd.writeVarInt ('nspect', 1)
-            outhnd.writeVarInt ('nschan', nout)
-            outhnd.writeVarInt ('ischan', 1)
-            outhnd.writeVarDouble ('sdf', sdfout)
-            outhnd.writeVarDouble ('sfreq', sfreqout)
-
-        # Do the averaging. This is as fast as I know how to make it
-        # within numpy. Have no idea if there's a way to take advantage
-        # of multicore processors that is robustly faster and not a
-        # ton of effort.
-
-        data *= flags # zero out flagged data
-        sum (data.reshape ((nout, naver)), axis=1, out=outdata)
-        sum (flags.reshape ((nout, naver)), axis=1, out=counts)
-        greater_equal (counts, nmin, outflags)
-        maximum (counts, 1, counts) # avoid div-by-zero
-        outdata /= counts
-
-        # Write, with the usual npol tomfoolery.
-
-        vishnd.copyLineVars (outhnd)
-        vishnd.copyMarkedVars (outhnd)
-
-        if npol == 0:
-            npol = vishnd.getNPol ()
-            if npol != prevnpol:
-                outhnd.writeVarInt ('npol', npol)
-                npolvaried = npolvaried or prevnpol != 0
-                prevnpol = npol
-
-        outhnd.writeVarInt ('pol', vishnd.getPol ())
-        outhnd.write (preamble, outdata, outflags)
-        npol -= 1
+            haslst = vishnd.probeVar ('lst') is not None
+            hasut = vishnd.probeVar ('ut') is not None
+
+        if batch.vars is not prevvars:
+            # Potentially new spectral configuration. Look up or work
+            # out its binning.
+            prevvars = batch.vars
+            key = [batch.nchan]
+            for var in SPECTRAL_VARS:
+                key.append (tuple (_snapArray (batch.vars, var, 0)))
+            key = tuple (key)
+
+            plan = plans.get (key)
+            if plan is None:
+                plan = plans[key] = _BinPlan (vishnd.path (), batch.nchan,
+                                              batch.vars, naver, bins, slop)
+
+            plan.writeVars (outhnd, batch.vars)
+
+        # Do the averaging, all records of the batch at once.
+
+        batch.data, batch.flags = util.binChannels (batch.data, batch.flags,
+                                                    plan.starts, plan.ends,
+                                                    plan.nmin)
+        batch.nchan = plan.nout
+
+        # Write, with the usual npol tomfoolery. The handle has moved on
+        # by now, so the npol of the batch is used rather than that of
+        # the handle.
+
+        npol = batch.npol
+        if npol != prevnpol:
+            outhnd.writeVarInt ('npol', npol)
+            npolvaried = npolvaried or prevnpol != 0
+            prevnpol = npol
+
+        time = batch.time[:batch.count]
+        lst = ut = None
+        if haslst and 'longitu' in batch.vars:
+            lst = util.jdToLSTArray (time, batch.vars['longitu'][1][0])
+        if hasut:
+            ut = 2 * N.pi * ((time - 0.5) % 1)
+
+        outhnd.writeBatch (batch, lst=lst, ut=ut)
 
     # All done.
 
@@ -369,6 +489,7 @@ Will call mirtask.util.die on some errors.
     ks = keys.KeySpec ()
     ks.keyword ('out', 'f', ' ')
     ks.keyword ('naver', 'i', -1)
+    ks.mkeyword ('bins', 'i', 96)
     ks.keyword ('slop', 'd', DEFAULT_SLOP)
     ks.uvdat (UVDAT_OPTIONS + 'dslr')
     opts = ks.process (args)
@@ -378,12 +499,20 @@ Will call mirtask.util.die on some errors.
 
     out = VisData (opts.out)
 
-    if opts.naver == -1:
+    if opts.naver == -1 and not len (opts.bins):
         util.wrongusage (__doc__,
                          'must specify the number of channels to average (naver=...)')
+    if opts.naver != -1 and len (opts.bins):
+        util.wrongusage (__doc__, 'cannot specify both naver and bins')
+
+    if len (opts.bins):
+        naver, bins = None, opts.bins
+    else:
+        naver, bins = opts.naver, None
 
     try:
-        channelAverage (out, opts.naver, opts.slop, banner=DEFAULT_BANNER, args=args)
+        channelAverage (out, naver, opts.slop, banner=DEFAULT_BANNER, args=args,
+                        bins=bins)
     except (InputStructureError, ValueError), e:
         util.die (str (e))
 
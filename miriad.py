@@ -456,6 +456,59 @@ the dataset in the correct manner for their corresponding data types.
 
         return self._openImpl (mode)
 
+
+    def fullHash (self, hash=None, hex=False, manifestPath=None,
+                  chunkSize=None):
+        """Compute a cryptographic hash of the full contents of the dataset.
+
+:arg hash: (optional) an object that computes hashes
+:type hash: compatible with :class:`hashlib.HASH`
+:arg hex: whether to return the digest encoded as hexadecimal or not
+:type hex: :class:`bool`
+:arg manifestPath: where to keep the :class:`HashManifest` of the
+  dataset; defaults to a file next to the dataset, named after it with
+  ".hashes" appended
+:type manifestPath: :class:`str`
+:arg chunkSize: the chunk size for a new manifest, in bytes; defaults
+  to :data:`DEFAULT_HASH_CHUNKSIZE`. An existing manifest keeps its
+  own chunk size.
+:type chunkSize: :class:`int`
+:returns: the hash value
+:rtype: :class:`str`
+
+Like :meth:`quickHash`, but every byte of the hashed items is taken
+into account, so in-place modifications are noticed as well as
+appends. The items are hashed in chunks with the help of a
+:class:`HashManifest`, which is loaded from *manifestPath* if it
+exists and saved back if anything had to be rehashed, so that only
+the items modified since the last call are read again.
+"""
+        if manifestPath is None:
+            manifestPath = self.base.rstrip (os.sep) + '.hashes'
+
+        manifest = None
+        if os.path.exists (manifestPath):
+            try:
+                manifest = HashManifest.load (manifestPath)
+            except Exception:
+                # A damaged or outdated manifest just costs a rehash.
+                pass
+        if manifest is None:
+            manifest = HashManifest (chunkSize or DEFAULT_HASH_CHUNKSIZE)
+
+        if hash is None:
+            import hashlib
+            hash = hashlib.sha1 ()
+
+        self.updateHash (hash.update, manifest=manifest)
+
+        if manifest.dirty:
+            manifest.save (manifestPath)
+
+        if hex:
+            return hash.hexdigest ()
+        return hash.digest ()
+
 __all__ += ['Data']
 
 
@@ -501,6 +554,171 @@ def _tail_update (filename, updatefunc):
         updatefunc (s)
 
 
+# Full-content hashing of dataset items in fixed-size chunks. Each
+# chunk is hashed with a fast non-cryptographic hash in native code,
+# several chunks at once, and the resulting chunk digests are what
+# get fed into the cryptographic hash.
+
+DEFAULT_HASH_CHUNKSIZE = 4 * 1024 * 1024
+
+# A file modified this recently (in seconds) when it's hashed might be
+# modified again without its size or mtime changing, so its digests
+# aren't remembered.
+
+_HASH_RACY_SECONDS = 2
+
+def _chunk_digests (filename, chunkSize):
+    import numpy as N
+    from mirtask import _kernels
+
+    size = os.path.getsize (filename)
+    digests = N.empty ((size + chunkSize - 1) // chunkSize, dtype=N.uint64)
+
+    # Map the file a window at a time to keep the address space used
+    # reasonable on 32-bit systems.
+
+    window = 64 * chunkSize
+
+    for ofs in xrange (0, size, window):
+        n = min (window, size - ofs)
+        m = N.memmap (filename, dtype=N.uint8, mode='r', offset=ofs,
+                      shape=(n, ))
+        i = ofs // chunkSize
+        _kernels.hash_chunks (m, chunkSize,
+                              digests[i:i + (n + chunkSize - 1) // chunkSize])
+        del m
+
+    return digests
+
+
+class HashManifest (object):
+    """:synopsis: remembered chunk digests of dataset items
+
+:arg int chunkSize: the size of the chunks that items are hashed in,
+  in bytes
+
+A :class:`HashManifest` records, for each file that it has hashed,
+the file's size, modification time, and inode number, along with the
+digests of the file's chunks. Hashing a file again only reads it if
+one of those has changed; otherwise the recorded digests are reused.
+The chunks are hashed with XXH64 on several threads at once (see
+:func:`mirtask.util.setNumThreads`), so even a changed file is hashed
+at close to the speed it can be read.
+
+Pass a manifest to the *manifest* argument of the :meth:`updateHash`
+methods of :class:`VisData`, :class:`ImData`, and :class:`CalData` to
+hash the full contents of the items, or use :meth:`Data.fullHash`,
+which keeps a manifest next to the dataset.
+
+Attributes:
+
+* **chunkSize** -- the chunk size, in bytes.
+* **dirty** -- whether any digests have been computed since the
+  manifest was created or loaded.
+"""
+
+    def __init__ (self, chunkSize=DEFAULT_HASH_CHUNKSIZE):
+        self.chunkSize = int (chunkSize)
+        if self.chunkSize < 1:
+            raise ValueError ('chunkSize must be positive')
+        self.dirty = False
+        self._items = {}
+
+
+    def digests (self, filename):
+        """Get the chunk digests of a file.
+
+:arg str filename: the file
+:rtype: uint64 ndarray
+:returns: the digest of each chunk of the file
+:raises: :exc:`OSError` if the file can't be read
+"""
+        import time
+
+        key = os.path.abspath (filename)
+        st = os.stat (filename)
+        stamp = (st.st_size, st.st_mtime, st.st_ino)
+
+        entry = self._items.get (key)
+        if entry is not None and entry[0] == stamp:
+            return entry[1]
+
+        digests = _chunk_digests (filename, self.chunkSize)
+        self.dirty = True
+
+        if time.time () - st.st_mtime > _HASH_RACY_SECONDS:
+            self._items[key] = (stamp, digests)
+        elif entry is not None:
+            del self._items[key]
+
+        return digests
+
+
+    def update (self, filename, updatefunc):
+        """Feed the chunk digests of a file into a hash.
+
+:arg str filename: the file; nothing happens if it doesn't exist
+:arg updatefunc: the object to update with the digests
+:type updatefunc: callable, taking 1 :class:`str` argument
+:returns: *self*
+"""
+        try:
+            digests = self.digests (filename)
+        except OSError, e:
+            if e.errno == 2:
+                return self
+            raise
+
+        updatefunc ('%d:' % digests.size)
+        updatefunc (digests.astype ('<u8').tostring ())
+        return self
+
+
+    @classmethod
+    def load (klass, path):
+        """Load a manifest saved with :meth:`save`.
+
+:arg str path: the file to read
+:rtype: :class:`HashManifest`
+:returns: the manifest
+"""
+        import cPickle
+
+        f = open (path, 'rb')
+        try:
+            inst = cPickle.load (f)
+        finally:
+            f.close ()
+
+        if not isinstance (inst, klass):
+            raise ValueError ('%s doesn\'t contain a hash manifest' % path)
+        inst.dirty = False
+        return inst
+
+
+    def save (self, path):
+        """Save the manifest.
+
+:arg str path: the file to write
+:rtype: :const:`None`
+
+The file is written under a temporary name and then renamed, so a
+concurrent :meth:`load` never sees a partial manifest.
+"""
+        import cPickle
+
+        tmp = '%s.tmp%d' % (path, os.getpid ())
+        f = open (tmp, 'wb')
+        try:
+            cPickle.dump (self, f, cPickle.HIGHEST_PROTOCOL)
+        finally:
+            f.close ()
+        os.rename (tmp, path)
+        self.dirty = False
+
+__all__ += ['DEFAULT_HASH_CHUNKSIZE', 'HashManifest']
+
+
 class VisData (Data):
     """:synopsis: Reference to a MIRIAD visibility dataset.
 
@@ -536,11 +754,14 @@ specified arguments.
         return uvdat.setupAndRead (self, uvdOptions, saveFlags, **kwargs)
 
 
-    def updateHash (self, updatefunc):
+    def updateHash (self, updatefunc, manifest=None):
         """Update a cryptographic hash with information about the dataset, cheating a bit.
 
 :arg updatefunc: the object to update with hash data from the dataset
 :type updatefunc: callable, taking 1 :class:`str` argument
+:arg manifest: if not :const:`None`, hash the full contents of the
+  items through this manifest instead of cheating
+:type manifest: :class:`HashManifest`
 :returns: *self*
 
 This function aids in the computation of a cryptographic hash of a
@@ -557,7 +778,11 @@ dataset items are hashed. The last megabyte (or entire contents, if
 they are smaller) of the following items are hashed as well: visdata,
 flags, wflags, gains, leakage, bandpass. (The ends of these
 potentially-large files are hashed so that in the not-uncommon case
-that a visibility dataset is appended to, its hash will change.)
+that a visibility dataset is appended to, its hash will change.) If
+*manifest* is given, the full contents of all of these items are
+hashed instead, in chunks, with the chunk digests of items that
+haven't changed since the manifest last saw them reused; see
+:class:`HashManifest`.
 
 The "history" item of the dataset is explicitly *not* included in the
 hash because it has no bearing on the interpretation of the UV data.
@@ -569,6 +794,15 @@ approach.
 In the common case that you're just interested in extracting a
 cryptographic hash with minimal fuss, use :meth:`quickHash`.
 """
+        if manifest is not None:
+            for item in ('vartable', 'header', 'visdata'):
+                manifest.update (self.path (item), updatefunc)
+            for optitem in ('flags', 'wflags', 'gains', 'leakage',
+                            'bandpass'):
+                updatefunc (optitem)
+                manifest.update (self.path (optitem), updatefunc)
+            return self
+
         # Header and vartable are small enough to read in their
         # entirety without worry.
         updatefunc (file (self.path ('vartable')).read ())
@@ -672,6 +906,33 @@ interval={interval} {params...}`.
         self.apply (TaskUVAver (), out=dest, interval=interval,
                     **params).run ()
 
+    def timeAverTo (self, dest, interval, refLength=None, maxInterval=None,
+                    **uvdargs):
+        """Time-average this dataset to *dest* in-process.
+
+:arg dest: the destination dataset
+:type dest: :class:`Data`, str, or any other stringable
+:arg interval: the averaging interval, in minutes
+:type interval: numeric
+:arg refLength: if not :const:`None`, average baselines shorter than
+  this many meters for longer; see :class:`mirtask.timeaver.TimeAverager`
+:arg maxInterval: the longest interval for short baselines, in minutes
+:arg uvdargs: extra arguments for the UVDAT subsystem, such as
+  *select* or *nocal*
+:rtype: :const:`None`
+
+Like :meth:`averTo`, but does the averaging in this process with
+:func:`mirtask.timeaver.averageData` instead of running
+:command:`uvaver`, and can average in a baseline-dependent way.
+Checks if the source dataset exists but does no checking on the
+destination dataset.
+"""
+        self.checkExists ()
+
+        from mirtask.timeaver import averageData
+        averageData (self, VisData (dest), interval, refLength, maxInterval,
+                     **uvdargs)
+
     def lwcpTo (self, dest, skip=(), forceabs=False):
         """Make a lightweight copy of this dataset in *dest*.
 
@@ -786,11 +1047,14 @@ parameters.
         return task.set (in_=self, **params)
 
 
-    def updateHash (self, updatefunc):
+    def updateHash (self, updatefunc, manifest=None):
         """Update a cryptographic hash with information about the dataset.
 
 :arg updatefunc: the object to update with hash data from the dataset
 :type updatefunc: callable, taking 1 :class:`str` argument
+:arg manifest: if not :const:`None`, hash the items in chunks through
+  this manifest; see :class:`HashManifest`
+:type manifest: :class:`HashManifest`
 :returns: *self*
 
 This function aids in the computation of a cryptographic hash of an
@@ -809,8 +1073,14 @@ approach.
 In the common case that you're just interested in extracting a
 cryptographic hash with minimal fuss, use :meth:`quickHash`.
 """
+        if manifest is not None:
+            manifest.update (self.path ('header'), updatefunc)
+            manifest.update (self.path ('image'), updatefunc)
+            return self
+
         _full_update (self.path ('header'), updatefunc)
         _full_update (self.path ('image'), updatefunc)
+        return self
 
 
     def quickHash (self, hash=None, hex=False):
@@ -854,7 +1124,16 @@ class CalData (Data):
         return task.set (vis=self, **params)
 
 
-    def updateHash (self, updatefunc):
+    def updateHash (self, updatefunc, manifest=None):
+        if manifest is not None:
+            manifest.update (self.path ('header'), updatefunc)
+            for item in ('flags', 'wflags', 'gains', 'leakage',
+                         'bandpass'):
+                if os.path.exists (self.path (item)):
+                    updatefunc (item)
+                    manifest.update (self.path (item), updatefunc)
+            return self
+
         updatefunc (file (self.path ('header')).read ())
 
         for item in ('flags', 'wflags', 'gains', 'leakage',
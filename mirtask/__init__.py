@@ -708,6 +708,58 @@ class UVDataSet (DataSet):
         self._checkOpen ()
         _miriad_c.uvwrite (self.tno, preamble, data, flags, length)
 
+    def writeBatch (self, batch, inttime=None, lst=None, ut=None):
+        """Write a block of visibility records in one call.
+
+:arg batch: the records to write
+:type batch: :class:`mirtask.uvdat.VisBatch`
+:arg inttime: the integration times of the records in seconds, or
+  :const:`None` (the default) to leave the "inttime" variable alone
+:type inttime: scalar, *nrec*-element array-like of float, or
+  :const:`None`
+:arg lst: the local sidereal times of the records in radians, or
+  :const:`None` (the default) to leave the "lst" variable alone
+:type lst: *nrec*-element array-like of double, or :const:`None`
+:arg ut: the universal times of the records in radians, likewise for
+  the "ut" variable
+:type ut: *nrec*-element array-like of double, or :const:`None`
+
+The records are written with one native call rather than one call per
+record. The "pol" variable is set from *batch.pol*, and "inttime",
+"lst", and "ut" from the corresponding arguments; each is only written
+when it changes. Any other variables must be set up before the call.
+The preambles are built from the *u*, *v*, *w*, time, and baseline
+columns of the batch, or without *w* if *batch.hasW* is false, so the
+preamble type of this dataset should be set to match (see
+:meth:`setPreambleType`).
+"""
+        n = batch.count
+        if batch.hasW:
+            preambles = N.empty ((n, 5), dtype=N.double)
+            preambles[:,:3] = batch.uvw[:n]
+        else:
+            preambles = N.empty ((n, 4), dtype=N.double)
+            preambles[:,:2] = batch.uvw[:n,:2]
+        preambles[:,-2] = batch.time[:n]
+        preambles[:,-1] = batch.baseline[:n]
+
+        data = N.ascontiguousarray (batch.data[:n], dtype=N.complex64)
+        flags = N.ascontiguousarray (batch.flags[:n], dtype=N.int32)
+        pols = N.ascontiguousarray (batch.pol[:n], dtype=N.int32)
+
+        if inttime is not None:
+            it = N.empty (n, dtype=N.float32)
+            it[:] = N.asarray (inttime, dtype=N.float32)
+            inttime = it
+        if lst is not None:
+            lst = N.ascontiguousarray (lst, dtype=N.double).ravel ()
+        if ut is not None:
+            ut = N.ascontiguousarray (ut, dtype=N.double).ravel ()
+
+        self._checkOpen ()
+        _miriad_c.uvwrite_batch (self.tno, preambles, data, flags, pols,
+                                 inttime, lst, ut)
+
     def rewriteFlags (self, flags):
         """Rewrite the channel flagging data for the current
         visibility record. 'flags' should be a 1D integer ndarray of the
@@ -902,6 +954,27 @@ Returns zero if the variance could not be determined.
         return info[0]
 
 
+    def getSkyFrequencies (self, nchan=None):
+        """Get the sky frequencies of the channels of the current UV record.
+
+:arg int nchan: the number of channels in the record; if :const:`None`
+  (the default), it is determined with :meth:`getLineInfo`
+:returns: the frequencies, in GHz
+:rtype: *nchan*-element double ndarray
+
+These are the frequencies of the channels as read out, i.e., after
+any channel selection or averaging implied by the linetype.
+"""
+        self._checkOpen ()
+
+        if nchan is None:
+            nchan = self.getLineInfo ()[1]
+
+        info = N.zeros (nchan, dtype=N.double)
+        _miriad_c.uvinfo (self.tno, 'sfreq', info)
+        return info
+
+
     def baselineShadowed (self, diameter_meters):
         """Returns whether the most recently-read UV record comes from
         antennas that were shadowed, assuming a given antenna
@@ -922,6 +995,10 @@ Returns zero if the variance could not be determined.
         :func:`mirtask._miriad_c.probe_uvchkshadow`, :const:`True`
         indicating availability.
 
+        To work out the shadowing of many records at once, without
+        the selection hack, see :meth:`mirtask.uvdat.VisBatch.shadowed`
+        and :func:`mirtask.uvdat.setupAndFindShadowed`.
+
         *diameter_meters* - the diameter within which an antenna is
           considered shadowed, measured in meters.
 
@@ -1148,6 +1225,56 @@ Returns zero if the variance could not be determined.
         self._checkOpen ()
         _miriad_c.uvputvra (self.tno, name, str (val))
 
+    def snapshotVars (self, names):
+        """Record the current values of some UV variables.
+
+:arg names: the names of the variables
+:type names: iterable of str
+:rtype: dict
+:returns: a mapping from the names of the variables that are defined
+  to tuples of their type characters and values
+
+Complex-valued variables are skipped. The snapshot can be written
+into another dataset with :meth:`writeVars`.
+"""
+        snap = {}
+
+        for name in names:
+            info = self.probeVar (name)
+            if info is None:
+                continue
+
+            type, length = info[:2]
+            if type == 'a':
+                snap[name] = (type, self.getVarString (name))
+            elif length == 0:
+                continue
+            elif type in 'ij':
+                snap[name] = (type, N.atleast_1d (self.getVarInt (name, length)))
+            elif type == 'r':
+                snap[name] = (type, N.atleast_1d (self.getVarFloat (name, length)))
+            elif type == 'd':
+                snap[name] = (type, N.atleast_1d (self.getVarDouble (name, length)))
+
+        return snap
+
+    def writeVars (self, snap):
+        """Write UV variables recorded by :meth:`snapshotVars`.
+
+:arg dict snap: the snapshot
+"""
+        for name in sorted (snap.iterkeys ()):
+            type, val = snap[name]
+
+            if type == 'a':
+                self.writeVarString (name, val)
+            elif type in 'ij':
+                self.writeVarInt (name, N.asarray (val, dtype=N.int32))
+            elif type == 'r':
+                self.writeVarFloat (name, N.asarray (val, dtype=N.float32))
+            elif type == 'd':
+                self.writeVarDouble (name, N.asarray (val, dtype=N.float64))
+
 
 class UVVarTracker (object):
     def __init__ (self, owner):
@@ -1246,6 +1373,261 @@ class MaskItem (object):
 __all__ += ['MaskItem', 'MASK_MODE_FLAGS', 'MASK_MODE_RUNS']
 
 
+def _flagsToRuns (flags):
+    """Convert an array of flags into the MASK_MODE_RUNS encoding:
+pairs of the first and last (one-based) indices of each run of good
+values."""
+
+    edges = N.diff (N.concatenate (([0], (flags != 0).view (N.int8), [0])))
+    starts = N.nonzero (edges == 1)[0] + 1
+    ends = N.nonzero (edges == -1)[0]
+    return N.column_stack ((starts, ends)).ravel ().astype (N.int32)
+
+
+class FlagEditor (object):
+    """:synopsis: flag UV data by editing the flags of a dataset directly
+
+:arg dataset: the dataset to edit, opened in "rw" mode
+:type dataset: :class:`UVDataSet`
+:arg int nchan: the number of spectral channels in each record
+:arg nrec: the number of records in the dataset, used to check the
+  edits; or :const:`None` to skip the checks
+:arg int chunkSize: the most flags to handle at once
+
+A :class:`FlagEditor` collects flagging edits and then applies them
+all at once, reading and rewriting the "flags" mask item of the dataset
+without going through the visibility data. Records are numbered from
+zero in the order they're stored, as in
+:meth:`UVDataSet.getCurrentVisNum`, and channels are numbered from zero
+too. Edits only ever flag data, so data flagged already stay flagged.
+
+:meth:`apply` visits the stretches of records touched by the edits in
+order, in chunks of at most *chunkSize* flags. Each chunk is read in,
+has all of its edits applied, and is written back with a single
+run-length encoded (:data:`MASK_MODE_RUNS`) write, so the cost is
+independent of the number of edits and of records.
+
+Every record must have *nchan* channels, since otherwise the position
+of a record in the flags item can't be worked out without reading
+through the data. The wideband flags ("wflags") aren't touched. The
+dataset shouldn't be read or written while the edits are being
+applied.
+"""
+
+    def __init__ (self, dataset, nchan, nrec=None, chunkSize=4194304):
+        self.dataset = dataset
+        self.nchan = int (nchan)
+        self.nrec = nrec
+        self.chunkSize = int (chunkSize)
+        self._boxes = []
+        self._masks = []
+
+
+    def _checkRecs (self, rec0, rec1):
+        if rec0 < 0 or rec1 < rec0:
+            raise ValueError ('bad record range [%d, %d)' % (rec0, rec1))
+        if self.nrec is not None and rec1 > self.nrec:
+            raise ValueError ('record range [%d, %d) extends past the %d '
+                              'records of the dataset' % (rec0, rec1,
+                                                          self.nrec))
+
+
+    def flagRange (self, rec0, rec1, chan0=0, chan1=None):
+        """Flag a block of records and channels.
+
+:arg int rec0: the first record to flag
+:arg int rec1: one past the last record to flag
+:arg int chan0: the first channel to flag
+:arg chan1: one past the last channel to flag, or :const:`None` for
+  the last channel
+:rtype: :class:`FlagEditor`
+:returns: *self*
+"""
+        if chan1 is None:
+            chan1 = self.nchan
+        return self.flagRanges ([(rec0, rec1, chan0, chan1)])
+
+
+    def flagRanges (self, ranges):
+        """Flag a number of blocks of records and channels.
+
+:arg ranges: the blocks, as in :meth:`flagRange`
+:type ranges: iterable of ``(rec0, rec1, chan0, chan1)``
+:rtype: :class:`FlagEditor`
+:returns: *self*
+"""
+        b = N.array (ranges, dtype=N.int64).reshape ((-1, 4))
+        b = b[(b[:,1] > b[:,0]) & (b[:,3] > b[:,2])]
+        if b.shape[0] == 0:
+            return self
+
+        self._checkRecs (b[:,0].min (), b[:,1].max ())
+        if b[:,2].min () < 0 or b[:,3].max () > self.nchan:
+            raise ValueError ('channel range outside of [0, %d)' % self.nchan)
+
+        self._boxes.append (b)
+        return self
+
+
+    def flagRecords (self, recnums):
+        """Flag all of the channels of some records.
+
+:arg recnums: the numbers of the records to flag
+:type recnums: array-like of int
+:rtype: :class:`FlagEditor`
+:returns: *self*
+
+The records are gathered into runs of consecutive numbers, so, for
+instance, the *visno* values of the records found to be shadowed by
+:func:`mirtask.uvdat.setupAndFindShadowed` can be passed straight in.
+"""
+        r = N.unique (N.asarray (recnums, dtype=N.int64))
+        if r.size == 0:
+            return self
+
+        brk = N.nonzero (N.diff (r) != 1)[0] + 1
+        starts = r[N.concatenate (([0], brk))]
+        ends = r[N.concatenate ((brk - 1, [r.size - 1]))] + 1
+        b = N.zeros ((starts.size, 4), dtype=N.int64)
+        b[:,0] = starts
+        b[:,1] = ends
+        b[:,3] = self.nchan
+        return self.flagRanges (b)
+
+
+    def flagMask (self, mask, first=0):
+        """Flag data according to a boolean mask.
+
+:arg mask: the mask, true where data should be flagged, with one row
+  per record; a one-dimensional mask flags whole records
+:type mask: (*n*, *nchan*) or (*n*, ) bool array-like
+:arg int first: the number of the record corresponding to the first
+  row of *mask*
+:rtype: :class:`FlagEditor`
+:returns: *self*
+"""
+        mask = N.asarray (mask, dtype=N.bool_)
+        if mask.ndim == 1:
+            return self.flagRecords (N.nonzero (mask)[0] + first)
+        if mask.ndim != 2 or mask.shape[1] != self.nchan:
+            raise ValueError ('mask must have shape (n, %d)' % self.nchan)
+
+        rows = N.nonzero (mask.any (axis=1))[0]
+        if rows.size == 0:
+            return self
+
+        mask = mask[rows[0]:rows[-1] + 1]
+        first += rows[0]
+        self._checkRecs (first, first + mask.shape[0])
+        self._masks.append ((first, mask))
+        return self
+
+
+    def _chunks (self):
+        ext = [b[:,:2] for b in self._boxes]
+        ext += [N.array ([[f, f + m.shape[0]]]) for f, m in self._masks]
+        if not len (ext):
+            return []
+
+        ext = N.concatenate (ext)
+        ext = ext[N.argsort (ext[:,0], kind='mergesort')]
+
+        # Merge the record ranges into spans, in order. Nearby ranges
+        # are merged too, since rewriting a few untouched records costs
+        # less than another read and write. Then split long spans into
+        # chunks.
+
+        perchunk = max (self.chunkSize // max (self.nchan, 1), 1)
+        maxgap = perchunk // 16
+        spans = []
+        r0, r1 = ext[0]
+
+        for a, b in ext[1:]:
+            if a > r1 + maxgap:
+                spans.append ((r0, r1))
+                r0, r1 = a, b
+            else:
+                r1 = max (r1, b)
+        spans.append ((r0, r1))
+
+        chunks = []
+        for r0, r1 in spans:
+            for c0 in xrange (r0, r1, perchunk):
+                chunks.append ((int (c0), int (min (c0 + perchunk, r1))))
+        return chunks
+
+
+    def _boxesByChunk (self, chunks):
+        """For each chunk, the boxes that overlap it. A box can span
+several chunks, so each is entered once for every chunk it touches."""
+
+        if not len (self._boxes):
+            return [N.zeros ((0, 4), dtype=N.int64)] * len (chunks)
+
+        boxes = N.concatenate (self._boxes)
+        starts = N.array ([c[0] for c in chunks])
+        k0 = N.searchsorted (starts, boxes[:,0], 'right') - 1
+        k1 = N.searchsorted (starts, boxes[:,1] - 1, 'right') - 1
+        nk = k1 - k0 + 1
+        which = N.repeat (N.arange (boxes.shape[0]), nk)
+        first = N.cumsum (nk) - nk
+        k = N.repeat (k0 - first, nk) + N.arange (which.size)
+        order = N.argsort (k, kind='mergesort')
+        bounds = N.searchsorted (k[order], N.arange (len (chunks) + 1))
+        which = which[order]
+        return [boxes[which[bounds[i]:bounds[i+1]]]
+                for i in xrange (len (chunks))]
+
+
+    def apply (self):
+        """Write the edits into the dataset.
+
+:rtype: int
+:returns: the number of flags that were changed from good to bad
+
+The pending edits are cleared afterwards.
+"""
+        chunks = self._chunks ()
+        if not len (chunks):
+            return 0
+
+        nchan = self.nchan
+        boxes = self._boxesByChunk (chunks)
+        buf = N.empty (max (r1 - r0 for r0, r1 in chunks) * nchan,
+                       dtype=N.int32)
+        nchanged = 0
+        item = MaskItem (self.dataset, 'flags', 'rw')
+
+        try:
+            for (r0, r1), hit in zip (chunks, boxes):
+                n = (r1 - r0) * nchan
+                flags = buf[:n]
+                item.read (MASK_MODE_FLAGS, flags, r0 * nchan, n)
+                grid = flags.reshape ((r1 - r0, nchan))
+                before = N.count_nonzero (flags)
+
+                for a, b, c0, c1 in hit:
+                    grid[max (a, r0) - r0:min (b, r1) - r0,c0:c1] = 0
+
+                for f, m in self._masks:
+                    a, b = max (f, r0), min (f + m.shape[0], r1)
+                    if a < b:
+                        grid[a - r0:b - r0][m[a - f:b - f]] = 0
+
+                nchanged += before - N.count_nonzero (flags)
+                item.write (MASK_MODE_RUNS, _flagsToRuns (flags), r0 * nchan,
+                            n)
+        finally:
+            item.close ()
+
+        self._boxes = []
+        self._masks = []
+        return nchanged
+
+
+__all__ += ['FlagEditor']
+
+
 _AXTYPE_LAT, _AXTYPE_LONG, _AXTYPE_SPEC, _AXTYPE_LIN = range (4)
 
 _axinfo_map = {
@@ -1335,6 +1717,51 @@ use :meth:`miriad.ImData.open`.
         _miriad_c.xyclose (self.tno)
 
 
+    _planeflagbuf = None
+
+    def _getPlaneFlagBuf (self):
+        if self._planeflagbuf is None:
+            self._planeflagbuf = N.empty ((self.axes[1], self.axes[0]),
+                                          dtype=N.intc)
+        return self._planeflagbuf
+
+
+    _headerItems = ('bunit btype bmaj bmin bpa cellscal epoch instrume '
+                    'niters object obsdec obsra observer obstime pbfwhm '
+                    'pbtype restfreq telescop vobs').split ()
+
+    def copyHeader (self, dest, exclude=()):
+        """Copy the standard header items of this image to another.
+
+:arg dest: the opened destination image
+:type dest: :class:`XYDataSet`
+:arg exclude: the names of items not to copy
+:type exclude: sequence of str
+:returns: *self*
+
+This is similar to the MIRIAD HEADCP routine: it copies the
+descriptions of all of the axes of this image (the *ctype*, *crval*,
+*cdelt*, *crpix*, and *crota* items) and common items such as the
+beam parameters, the observing frequency, and the pointing center,
+skipping those that aren't present. The image dimensions are not
+copied, since they're fixed when *dest* is created.
+"""
+        self._checkOpen ()
+        dest._checkOpen ()
+
+        names = list (self._headerItems)
+
+        for i in xrange (1, self.getScalarItem ('naxis', 0) + 1):
+            for pfx in ('ctype', 'crval', 'cdelt', 'crpix', 'crota'):
+                names.append (pfx + str (i))
+
+        for name in names:
+            if name not in exclude and self.hasItem (name):
+                self.copyItem (dest, name)
+
+        return self
+
+
     def wcs (self):
         """Retrieve a :class:`pywcs.WCS` object representing the coordinate system
 of this image.
@@ -1668,16 +2095,17 @@ See also :meth:`readRows` and :meth:`readRow`.
         if axes is not None:
             self.setPlane (axes)
 
-        if not topIsZero:
-            for i in xrange (1, nrow + 1):
-                _miriad_c.xyread (self.tno, i, data[i-1])
-                _miriad_c.xyflgrd (self.tno, i, self._flagbuf)
-                N.logical_not (self._flagbuf, mask[i-1])
+        if data.dtype == N.float32 and data.flags.c_contiguous:
+            work = data
         else:
-            for i in xrange (1, nrow + 1):
-                _miriad_c.xyread (self.tno, i, data[nrow - i])
-                _miriad_c.xyflgrd (self.tno, i, self._flagbuf)
-                N.logical_not (self._flagbuf, mask[nrow - i])
+            work = N.empty ((nrow, ncol), dtype=N.float32)
+
+        flags = self._getPlaneFlagBuf ()
+        _miriad_c.xyread_plane (self.tno, work, flags, int (topIsZero))
+        N.logical_not (flags, mask)
+
+        if work is not data:
+            data[:] = work
 
         return buf
 
@@ -1764,23 +2192,15 @@ See also :meth:`writeRow`.
         if axes is not None:
             self.setPlane (axes)
 
+        flags = self._getPlaneFlagBuf ()
+
         if maskeddata.mask is N.ma.nomask:
-            self._flagbuf.fill (True)
-            fillbuf = lambda i: i # can't have a pass lambda
+            flags.fill (1)
         else:
-            fillbuf = lambda i: N.logical_not (maskeddata.mask[i],
-                                               self._flagbuf)
+            N.logical_not (maskeddata.mask, flags)
 
-        if not topIsZero:
-            for i in xrange (1, nrow + 1):
-                fillbuf (i - 1)
-                _miriad_c.xywrite (self.tno, i, maskeddata[i-1])
-                _miriad_c.xyflgwr (self.tno, i, self._flagbuf)
-        else:
-            for i in xrange (1, nrow + 1):
-                fillbuf (nrow - i)
-                _miriad_c.xywrite (self.tno, i, maskeddata[nrow - i])
-                _miriad_c.xyflgwr (self.tno, i, self._flagbuf)
+        data = N.ascontiguousarray (maskeddata.data, dtype=N.float32)
+        _miriad_c.xywrite_plane (self.tno, data, flags, int (topIsZero))
 
         return self
 
@@ -0,0 +1,50 @@
+'''Small helpers shared by the in-process imaging and transform modules.'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import numpy as N
+
+
+def fftSize (n):
+    """Return the smallest power of two that is at least @n."""
+
+    m = 1
+    while m < n:
+        m <<= 1
+    return m
+
+
+def pair (x, name):
+    """Split a scalar or a two-element sequence into a pair of values,
+complaining about argument @name otherwise."""
+
+    x = N.atleast_1d (N.asarray (x))
+
+    if x.size == 1:
+        return x[0], x[0]
+    if x.size == 2:
+        return x[0], x[1]
+    raise ValueError ('"%s" must be one or two numbers' % name)
+
+
+def planeIndices (ds):
+    """List the indices of the planes of an image, in storage order, as
+tuples with the slowest-varying axis first."""
+
+    naxis = ds.getScalarItem ('naxis', 2)
+    return list (N.ndindex (*tuple (ds.axes[2:naxis][::-1])))
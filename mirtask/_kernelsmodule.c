@@ -0,0 +1,241 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The _kernels module: array-at-a-time compute loops backing the
+ * vectorized functions in mirtask.util and friends. The loops
+ * themselves live in the kern_*.c files; this file just holds the
+ * method table and module initialization. The Python-level API is
+ * deliberately raw: callers must pass in correctly-typed, contiguous
+ * arrays, including preallocated output arrays. */
+
+#define __MIR_KERNELS_MODULE_C
+#include "kernels.h"
+
+/* Threading control */
+
+static PyObject *
+py_get_nthreads (PyObject *self, PyObject *args)
+{
+    if (!PyArg_ParseTuple (args, ""))
+	return NULL;
+
+    return PyInt_FromLong ((long) kern_nthreads);
+}
+
+static PyObject *
+py_set_nthreads (PyObject *self, PyObject *args)
+{
+    int n;
+
+    if (!PyArg_ParseTuple (args, "i", &n))
+	return NULL;
+
+    if (n < 1) {
+	PyErr_SetString (PyExc_ValueError, "number of threads must be positive");
+	return NULL;
+    }
+
+    if (n > KERN_MAX_THREADS)
+	n = KERN_MAX_THREADS;
+
+    kern_nthreads = n;
+    Py_RETURN_NONE;
+}
+
+
+/* Method table */
+
+#define DEF(name, signature) \
+    { #name, py_##name, METH_VARARGS, #name " " signature }
+
+static PyMethodDef methods[] = {
+    DEF(get_nthreads, "() => int n"),
+    DEF(set_nthreads, "(int n) => void"),
+
+    /* kern_basepol.c */
+
+    DEF(decode_baselines, "(double-ndarray bl, int-ndarray m1, int-ndarray m2, "
+	"int check) => void"),
+    DEF(encode_baselines, "(int-ndarray m1, int-ndarray m2, double-ndarray bl) "
+	"=> void"),
+    DEF(aap_to_bp, "(int-ndarray m1, int-ndarray m2, int-ndarray pol, "
+	"int-ndarray ap1, int-ndarray ap2) => void"),
+    DEF(bp_to_aap, "(int-ndarray ap1, int-ndarray ap2, int-ndarray m1, "
+	"int-ndarray m2, int-ndarray pol) => void"),
+    DEF(blpol_to_bp, "(double-ndarray bl, int-ndarray pol, int-ndarray ap1, "
+	"int-ndarray ap2) => void"),
+    DEF(blpol_to_pbp32, "(double-ndarray bl, int-ndarray pol, "
+	"uint-ndarray pbp32) => void"),
+    DEF(pbp32_to_aap, "(uint-ndarray pbp32, int-ndarray m1, int-ndarray m2, "
+	"int-ndarray pol) => void"),
+
+    /* kern_astro.c */
+
+    DEF(jd_format, "(double-ndarray jd, str form, str-ndarray out) => void"),
+    DEF(jd_to_lst, "(double-ndarray jd, double-ndarray longitude, "
+	"double-ndarray lst) => void"),
+    DEF(precess, "(double-ndarray jd1, double-ndarray ra1, double-ndarray dec1, "
+	"double-ndarray jd2, double-ndarray ra2, double-ndarray dec2) => void"),
+    DEF(equ_to_horizon, "(double-ndarray ra, double-ndarray dec, "
+	"double-ndarray lst, double-ndarray lat, double-ndarray az, "
+	"double-ndarray el) => void"),
+
+    /* kern_lsq.c */
+
+    DEF(lm_step, "(intp-ndarray active, double-ndarray jac, "
+	"double-ndarray resid, double-ndarray params, double-ndarray lambda, "
+	"double-ndarray trial, int-ndarray status) => void"),
+    DEF(lm_update, "(intp-ndarray active, double-ndarray tresid, "
+	"double-ndarray resid, double-ndarray params, double-ndarray trial, "
+	"double-ndarray lambda, double-ndarray chisq, int-ndarray status, "
+	"int-ndarray iters, int-ndarray needjac, int maxiter, double abscrit, "
+	"double relcrit) => void"),
+    DEF(lm_covar, "(double-ndarray jac, double-ndarray covar) => void"),
+    DEF(lm_fit_model, "(int model, double-ndarray x, double-ndarray y, "
+	"double-ndarray w, double-ndarray params, double-ndarray resid, "
+	"double-ndarray chisq, int-ndarray status, int-ndarray iters, "
+	"double-ndarray covar, int maxiter, double abscrit, double relcrit) "
+	"=> void"),
+
+    /* kern_grid.c */
+
+    DEF(grid_vis, "(double-ndarray u, double-ndarray v, double-ndarray freq, "
+	"complex64-ndarray data, float-ndarray wt, double-ndarray gcf, "
+	"int width, double du, double dv, int hermitian, "
+	"complex128-ndarray grid, double-ndarray-or-None wgrid) "
+	"=> (double sumwt, int ndropped)"),
+
+    /* kern_dft.c */
+
+    DEF(dft_predict, "(double-ndarray uvw, double-ndarray freq, "
+	"double-ndarray comps, double-ndarray amp, int mode, "
+	"complex64-ndarray data, int-ndarray-or-None flags) => void"),
+
+    /* kern_fft.c */
+
+    DEF(fft_lines, "(complex128-ndarray arr, int outer, int n, int inner, "
+	"int sign) => void"),
+
+    /* kern_weight.c */
+
+    DEF(density_grid, "(double-ndarray u, double-ndarray v, "
+	"double-ndarray freq, float-ndarray wt, double du, double dv, "
+	"int hermitian, double-ndarray density) => void"),
+    DEF(density_weights, "(double-ndarray u, double-ndarray v, "
+	"double-ndarray freq, float-ndarray wt, double du, double dv, "
+	"double-ndarray density, int mode, double f2, float-ndarray out) "
+	"=> void"),
+
+    /* kern_aver.c */
+
+    DEF(aver_slots, "(int64-ndarray keys, intp-ndarray vals, "
+	"double-ndarray bl, int-ndarray pol, int nused, intp-ndarray slots) "
+	"=> int nused"),
+    DEF(aver_accum, "(intp-ndarray slots, double-ndarray wt, "
+	"complex64-ndarray data, int-ndarray flags, complex128-ndarray sums, "
+	"double-ndarray wsum) => void"),
+    DEF(chan_bin, "(complex64-ndarray data, int-ndarray flags, "
+	"intp-ndarray starts, intp-ndarray ends, int-ndarray nmin, "
+	"complex64-ndarray outdata, int-ndarray outflags) => void"),
+
+    /* kern_closure.c */
+
+    DEF(closure_triples, "(complex64-ndarray data, int-ndarray flags, "
+	"intp-ndarray index, complex128-ndarray sum, double-ndarray sum2, "
+	"double-ndarray count) => void"),
+    DEF(closure_quads, "(complex64-ndarray data, int-ndarray flags, "
+	"intp-ndarray index, double-ndarray sum, double-ndarray sum2, "
+	"double-ndarray count) => void"),
+
+    /* kern_shadow.c */
+
+    DEF(shadow_ants, "(double-ndarray antpos, double-ndarray ha, "
+	"double-ndarray dec, double limit, int-ndarray out) => void"),
+
+    /* kern_flag.c */
+
+    DEF(sumthreshold, "(complex64-ndarray data, int-ndarray flags, "
+	"double chi1, double rho, int maxwin, int medhw, int medhwt, "
+	"int niter) => void"),
+
+    /* kern_stats.c */
+
+    DEF(stats_accum, "(intp-ndarray slots, complex64-ndarray data, "
+	"int-ndarray flags, int64-ndarray count, complex128-ndarray mean, "
+	"double-ndarray m2, double-ndarray amean, double-ndarray am2, "
+	"double-ndarray amin, double-ndarray amax) => void"),
+
+    /* kern_stokes.c */
+
+    DEF(stokes_convert, "(complex64-ndarray data, int-ndarray flags, "
+	"complex128-ndarray coeffs, complex64-ndarray outdata, "
+	"int-ndarray outflags) => void"),
+
+    /* kern_clean.c */
+
+    DEF(hogbom, "(float-ndarray resid, float-ndarray model, "
+	"bool-ndarray-or-None region, float-ndarray beam, int bcy, int bcx, "
+	"int py, int px, double gain, double cutoff, int niter, int flags, "
+	"intp-ndarray niters, float-ndarray peaks) => void"),
+    DEF(clark_minor, "(float-ndarray vals, int-ndarray iy, int-ndarray ix, "
+	"float-ndarray beam, int bcy, int bcx, int py, int px, double gain, "
+	"double limit, int niter, int flags, float-ndarray comps) "
+	"=> int ndone"),
+
+    /* kern_hash.c */
+
+    DEF(hash_chunks, "(uint8-ndarray data, int chunksize, "
+	"uint64-ndarray digests) => void"),
+
+    /* kern_pack.c */
+
+    DEF(pack_encode, "(list-of-ndarray columns, list-of-uint8-ndarray bufs, "
+	"intp-ndarray sizes, int-ndarray deltas, int level) => void"),
+    DEF(pack_decode, "(list-of-uint8-ndarray bufs, list-of-ndarray columns, "
+	"int-ndarray deltas) => void"),
+
+    /* Done. Sentinel. */
+
+    {NULL, NULL, 0, NULL}
+};
+
+/* See the comment in _miriad_cmodule.c. */
+
+#ifndef PyMODINIT_FUNC
+#  if defined(__cplusplus)
+#    define PyMODINIT_FUNC extern "C" void
+#  else
+#    define PyMODINIT_FUNC void
+#  endif
+#endif
+
+PyMODINIT_FUNC
+init_kernels (void)
+{
+    import_array ();
+
+    if (PyErr_Occurred ()) {
+	PyErr_SetString (PyExc_ImportError,
+			 "Can't initialize module _kernels: failed to import numpy");
+	return;
+    }
+
+    kern_init_threads ();
+    Py_InitModule ("_kernels", methods);
+}
@@ -1096,6 +1096,143 @@ py_uvwrite (PyObject *self, PyObject *args)
     Py_RETURN_NONE;
 }
 
+/* Write a block of records in one call. The "pol", "inttime", "lst",
+ * and "ut" variables are optional per-record arrays; each is only
+ * written when its value changes from one record to the next. */
+
+static PyObject *
+py_uvwrite_batch (PyObject *self, PyObject *args)
+{
+    int tno, nrec, nchan, npream, i, pol, lastpol = 0;
+    float inttime, lastinttime = -1;
+    double lst, lastlst = 0, ut, lastut = 0;
+    PyObject *preambles, *data, *flags, *pols, *inttimes, *lsts = Py_None;
+    PyObject *uts = Py_None;
+    double *p;
+    float *d;
+    int *f;
+
+    if (!PyArg_ParseTuple (args, "iO!O!O!OO|OO", &tno, &PyArray_Type,
+			   &preambles, &PyArray_Type, &data, &PyArray_Type,
+			   &flags, &pols, &inttimes, &lsts, &uts))
+	return NULL;
+
+    if (check_double_array (preambles, "preambles"))
+	return NULL;
+
+    if (check_complexf_array (data, "data"))
+	return NULL;
+
+    if (check_int_array (flags, "flags"))
+	return NULL;
+
+    if (PyArray_NDIM (preambles) != 2 || PyArray_NDIM (data) != 2) {
+	PyErr_SetString (PyExc_ValueError, "preambles and data arrays must "
+			 "be two-dimensional");
+	return NULL;
+    }
+
+    nrec = PyArray_DIM (preambles, 0);
+    npream = PyArray_DIM (preambles, 1);
+    nchan = PyArray_DIM (data, 1);
+
+    if (npream != 4 && npream != 5) {
+	PyErr_SetString (PyExc_ValueError, "preambles must have 4 or 5 columns");
+	return NULL;
+    }
+
+    if (PyArray_DIM (data, 0) != nrec || PyArray_SIZE (flags) != nrec * nchan) {
+	PyErr_SetString (PyExc_ValueError, "preambles, data, and flags arrays "
+			 "have inconsistent shapes");
+	return NULL;
+    }
+
+    if (pols != Py_None) {
+	if (!PyArray_Check (pols) || check_int_array (pols, "pols"))
+	    return NULL;
+	if (PyArray_SIZE (pols) != nrec) {
+	    PyErr_Format (PyExc_ValueError, "pols array must have %d elements",
+			  nrec);
+	    return NULL;
+	}
+    }
+
+    if (inttimes != Py_None) {
+	if (!PyArray_Check (inttimes) || check_float_array (inttimes, "inttimes"))
+	    return NULL;
+	if (PyArray_SIZE (inttimes) != nrec) {
+	    PyErr_Format (PyExc_ValueError, "inttimes array must have %d "
+			  "elements", nrec);
+	    return NULL;
+	}
+    }
+
+    if (lsts != Py_None) {
+	if (!PyArray_Check (lsts) || check_double_array (lsts, "lsts"))
+	    return NULL;
+	if (PyArray_SIZE (lsts) != nrec) {
+	    PyErr_Format (PyExc_ValueError, "lsts array must have %d elements",
+			  nrec);
+	    return NULL;
+	}
+    }
+
+    if (uts != Py_None) {
+	if (!PyArray_Check (uts) || check_double_array (uts, "uts"))
+	    return NULL;
+	if (PyArray_SIZE (uts) != nrec) {
+	    PyErr_Format (PyExc_ValueError, "uts array must have %d elements",
+			  nrec);
+	    return NULL;
+	}
+    }
+
+    MTS_CHECK_BUG;
+
+    p = PyArray_DATA (preambles);
+    d = PyArray_DATA (data);
+    f = PyArray_DATA (flags);
+
+    for (i = 0; i < nrec; i++) {
+	if (pols != Py_None) {
+	    pol = ((int *) PyArray_DATA (pols))[i];
+	    if (i == 0 || pol != lastpol) {
+		uvputvri_c (tno, "pol", &pol, 1);
+		lastpol = pol;
+	    }
+	}
+
+	if (inttimes != Py_None) {
+	    inttime = ((float *) PyArray_DATA (inttimes))[i];
+	    if (i == 0 || inttime != lastinttime) {
+		uvputvrr_c (tno, "inttime", &inttime, 1);
+		lastinttime = inttime;
+	    }
+	}
+
+	if (lsts != Py_None) {
+	    lst = ((double *) PyArray_DATA (lsts))[i];
+	    if (i == 0 || lst != lastlst) {
+		uvputvrd_c (tno, "lst", &lst, 1);
+		lastlst = lst;
+	    }
+	}
+
+	if (uts != Py_None) {
+	    ut = ((double *) PyArray_DATA (uts))[i];
+	    if (i == 0 || ut != lastut) {
+		uvputvrd_c (tno, "ut", &ut, 1);
+		lastut = ut;
+	    }
+	}
+
+	uvwrite_c (tno, p + i * npream, d + 2 * i * nchan, f + i * nchan,
+		   nchan);
+    }
+
+    Py_RETURN_NONE;
+}
+
 /* skip uvwwrite_c ... lazy */
 /* skip uvsela_c, ... too lowlevel */
 
@@ -1426,6 +1563,91 @@ py_xysetpl (PyObject *self, PyObject *args)
 }
 
 
+/* Whole-plane I/O, to avoid two Python-level calls per row. The data
+ * and flags arrays have shape (nrow, ncol); if topiszero is set, row 0
+ * of the arrays is the top row of the image rather than the bottom. */
+
+static int
+check_plane_arrays (PyObject *data, PyObject *flags, int *nrow, int *ncol)
+{
+    if (check_float_array (data, "data") || check_int_array (flags, "flags"))
+	return 1;
+
+    if (PyArray_NDIM (data) != 2 || PyArray_NDIM (flags) != 2) {
+	PyErr_SetString (PyExc_ValueError, "data and flags must be 2d");
+	return 1;
+    }
+
+    if (PyArray_DIM (data, 0) != PyArray_DIM (flags, 0) ||
+	PyArray_DIM (data, 1) != PyArray_DIM (flags, 1)) {
+	PyErr_SetString (PyExc_ValueError, "data and flags must have the same shape");
+	return 1;
+    }
+
+    *nrow = (int) PyArray_DIM (data, 0);
+    *ncol = (int) PyArray_DIM (data, 1);
+    return 0;
+}
+
+
+static PyObject *
+py_xyread_plane (PyObject *self, PyObject *args)
+{
+    int tno, topiszero, nrow, ncol, i, row;
+    PyObject *data, *flags;
+    float *d;
+    int *f;
+
+    if (!PyArg_ParseTuple (args, "iO!O!i", &tno, &PyArray_Type, &data,
+			   &PyArray_Type, &flags, &topiszero))
+	return NULL;
+
+    if (check_plane_arrays (data, flags, &nrow, &ncol))
+	return NULL;
+
+    d = PyArray_DATA (data);
+    f = PyArray_DATA (flags);
+
+    MTS_CHECK_BUG;
+    for (i = 0; i < nrow; i++) {
+	row = topiszero ? nrow - 1 - i : i;
+	xyread_c (tno, i + 1, d + row * ncol);
+	xyflgrd_c (tno, i + 1, f + row * ncol);
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+py_xywrite_plane (PyObject *self, PyObject *args)
+{
+    int tno, topiszero, nrow, ncol, i, row;
+    PyObject *data, *flags;
+    float *d;
+    int *f;
+
+    if (!PyArg_ParseTuple (args, "iO!O!i", &tno, &PyArray_Type, &data,
+			   &PyArray_Type, &flags, &topiszero))
+	return NULL;
+
+    if (check_plane_arrays (data, flags, &nrow, &ncol))
+	return NULL;
+
+    d = PyArray_DATA (data);
+    f = PyArray_DATA (flags);
+
+    MTS_CHECK_BUG;
+    for (i = 0; i < nrow; i++) {
+	row = topiszero ? nrow - 1 - i : i;
+	xywrite_c (tno, i + 1, d + row * ncol);
+	xyflgwr_c (tno, i + 1, f + row * ncol);
+    }
+
+    Py_RETURN_NONE;
+}
+
+
 /* maskio */
 
 static PyObject *
@@ -2220,6 +2442,10 @@ static PyMethodDef methods[] = {
 	" int-ndarray flags, int n) => int retval"),
     DEF(uvwrite, "(int tno, double-ndarray preamble, float-ndarray data,\n"
 	" int-ndarray flags, int n) => void"),
+    DEF(uvwrite_batch, "(int tno, double-ndarray preambles, complex-ndarray data,\n"
+	" int-ndarray flags, int-ndarray-or-None pols,\n"
+	" float-ndarray-or-None inttimes, [double-ndarray-or-None lsts,\n"
+	" double-ndarray-or-None uts]) => void"),
     DEF(uvselect, "(int tno, str object, double p1, double p2, int flag) => None"),
     DEF(uvset, "(int tno, str object, str type, int n, double p1,\n"
 	" double p2, double p3) => void"),
@@ -2245,6 +2471,10 @@ static PyMethodDef methods[] = {
     DEF(xyflgrd, "(int tno, int index, int-ndarray flags) => void"),
     DEF(xyflgwr, "(int tno, int index, int-ndarray flags) => void"),
     DEF(xysetpl, "(int tno, int naxis, int-ndarray axes) => void"),
+    DEF(xyread_plane, "(int tno, float-ndarray data, int-ndarray flags, "
+	"int topiszero) => void"),
+    DEF(xywrite_plane, "(int tno, float-ndarray data, int-ndarray flags, "
+	"int topiszero) => void"),
 
     /* maskio */
 
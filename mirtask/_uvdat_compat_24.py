@@ -82,3 +82,29 @@ def _read_gen (saveFlags, UVDatDataSet, maxchan):
     else:
         if inp is not None and inp.isOpen ():
             inp.close ()
+
+
+def _read_batch_gen (UVDatDataSet, Reader, readerArgs):
+    from mirtask._miriad_f import uvdatopn
+    inp = None
+    try:
+        while True:
+            if inp is not None and inp.isOpen ():
+                inp.close ()
+            (status, tin) = uvdatopn ()
+            if not status:
+                break
+            inp = UVDatDataSet (tin)
+            reader = Reader (inp, *readerArgs)
+            while True:
+                batch = reader.next ()
+                if batch is None:
+                    break
+                yield inp, batch
+    except:
+        if inp is not None and inp.isOpen ():
+            inp.close ()
+        raise
+    else:
+        if inp is not None and inp.isOpen ():
+            inp.close ()
@@ -98,3 +98,30 @@ def _read_gen (saveFlags, UVDatDataSet, maxchan):
     finally:
         if inp is not None and inp.isOpen ():
             inp.close ()
+
+
+def _read_batch_gen (UVDatDataSet, Reader, readerArgs):
+    from mirtask._miriad_f import uvdatopn
+
+    inp = None
+
+    try:
+        while True:
+            if inp is not None and inp.isOpen ():
+                inp.close ()
+
+            (status, tin) = uvdatopn ()
+            if not status:
+                break
+
+            inp = UVDatDataSet (tin)
+            reader = Reader (inp, *readerArgs)
+
+            while True:
+                batch = reader.next ()
+                if batch is None:
+                    break
+                yield inp, batch
+    finally:
+        if inp is not None and inp.isOpen ():
+            inp.close ()
@@ -0,0 +1,569 @@
+'''mirtask.archive - compressed column-wise archives of UV data'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import os
+import numpy as N
+from mirtask import _kernels, util
+
+__all__ = ['ArchiveWriter', 'Archive', 'archiveData']
+
+
+FORMAT_VERSION = 2
+
+DEFAULT_CHUNKSIZE = 4096
+
+# The columns of a chunk, in the order they're stored, and whether
+# each is delta-encoded along the records. The visibilities are split
+# into planes of real and imaginary parts, which compress much better
+# separately, and the flags are packed into bits.
+
+_columns = [('time', True), ('baseline', True), ('uvw', True), ('pol', True),
+            ('variance', False), ('visno', True), ('real', False),
+            ('imag', False), ('flags', False)]
+
+_deltas = N.array ([d for name, d in _columns], dtype=N.intc)
+
+
+def _bound (nbytes):
+    # zlib's compressBound (), for a buffer that's sure to be big enough.
+    return nbytes + (nbytes >> 12) + (nbytes >> 14) + (nbytes >> 25) + 13
+
+
+class _Chunk (object):
+    # The directory entry of one chunk: where it is, what's in it, and
+    # the range of times it covers, so that readers can skip it.
+
+    def __init__ (self, seg, nrec, nchan, tmin, tmax):
+        self.seg = seg
+        self.nrec = nrec
+        self.nchan = nchan
+        self.tmin = tmin
+        self.tmax = tmax
+        self.offset = None
+        self.sizes = None
+
+
+class _Segment (object):
+    # The setup shared by a run of chunks.
+
+    def __init__ (self, hasW, npol, vars, freqs, lineinfo, specvars):
+        self.hasW = hasW
+        self.npol = npol
+        self.vars = vars
+        self.freqs = freqs
+        self.lineinfo = lineinfo
+        self.specvars = specvars
+
+
+def _batchSegment (batch):
+    spec = batch.spec
+    if spec is None:
+        return _Segment (batch.hasW, batch.npol, batch.vars,
+                         N.array (batch.freqs), None, None)
+    return _Segment (batch.hasW, batch.npol, batch.vars,
+                     N.array (batch.freqs), N.array (spec.lineinfo), spec.vars)
+
+
+# The index is a set of plain arrays in NumPy's .npz format, so that
+# reading it never needs unpickling. The chunk directory is one array
+# per field; each segment's axes are stored under its number; and the
+# variable snapshots, which many segments may share, are stored once
+# each, one array per variable, and referred to by number.
+
+def _writeIndex (path, segments, chunks):
+    snaps, snapnums = [], {}
+    arrays = {'version': N.array (FORMAT_VERSION)}
+
+    def snapnum (snap):
+        if snap is None:
+            return -1
+        k = snapnums.get (id (snap))
+        if k is None:
+            k = snapnums[id (snap)] = len (snaps)
+            snaps.append (snap)
+        return k
+
+    arrays['seg_hasW'] = N.array ([s.hasW for s in segments], dtype=N.bool_)
+    arrays['seg_npol'] = N.array ([s.npol for s in segments], dtype=N.int64)
+    arrays['seg_vars'] = N.array ([snapnum (s.vars) for s in segments],
+                                  dtype=N.int64)
+    arrays['seg_specvars'] = N.array ([snapnum (s.specvars)
+                                       for s in segments], dtype=N.int64)
+
+    for i, s in enumerate (segments):
+        arrays['seg%d_freqs' % i] = s.freqs
+        if s.lineinfo is not None:
+            arrays['seg%d_lineinfo' % i] = s.lineinfo
+
+    for k, snap in enumerate (snaps):
+        for name, (type, value) in snap.iteritems ():
+            arrays['snap%d_%s_%s' % (k, type, name)] = N.asarray (value)
+
+    for name in ('seg', 'nrec', 'nchan', 'offset'):
+        arrays['chunk_' + name] = N.array ([getattr (c, name) for c in chunks],
+                                           dtype=N.int64)
+    for name in ('tmin', 'tmax'):
+        arrays['chunk_' + name] = N.array ([getattr (c, name) for c in chunks],
+                                           dtype=N.double)
+    sizes = N.array ([c.sizes for c in chunks], dtype=N.int64)
+    arrays['chunk_sizes'] = sizes.reshape ((-1, len (_columns)))
+
+    f = open (os.path.join (path, 'index'), 'wb')
+    try:
+        N.savez (f, **arrays)
+    finally:
+        f.close ()
+
+
+def _readIndex (path):
+    f = open (os.path.join (path, 'index'), 'rb')
+    try:
+        if f.read (2) != 'PK':
+            raise ValueError ('archive %s has an index from an older format '
+                              'version, not %d' % (path, FORMAT_VERSION))
+        f.seek (0)
+
+        try:
+            npz = N.load (f, allow_pickle=False)
+        except TypeError:
+            # NumPy before 1.10 has no allow_pickle, and never writes
+            # object arrays into the index anyway.
+            npz = N.load (f)
+
+        arrays = dict ((name, npz[name]) for name in npz.files)
+        npz.close ()
+    finally:
+        f.close ()
+
+    version = int (arrays['version'])
+    if version != FORMAT_VERSION:
+        raise ValueError ('archive %s has format version %d, not %d' %
+                          (path, version, FORMAT_VERSION))
+
+    snaps = {}
+    for key, value in arrays.iteritems ():
+        if not key.startswith ('snap'):
+            continue
+        k, type, name = key[4:].split ('_', 2)
+        if type == 'a':
+            value = str (value[()])
+        snaps.setdefault (int (k), {})[name] = (type, value)
+
+    segments = []
+    for i in xrange (arrays['seg_hasW'].size):
+        vars = snaps.get (int (arrays['seg_vars'][i]), {})
+        k = int (arrays['seg_specvars'][i])
+        specvars = None if k < 0 else snaps.get (k, {})
+        segments.append (_Segment (bool (arrays['seg_hasW'][i]),
+                                   int (arrays['seg_npol'][i]), vars,
+                                   arrays['seg%d_freqs' % i],
+                                   arrays.get ('seg%d_lineinfo' % i),
+                                   specvars))
+
+    chunks = []
+    for i in xrange (arrays['chunk_seg'].size):
+        c = _Chunk (int (arrays['chunk_seg'][i]),
+                    int (arrays['chunk_nrec'][i]),
+                    int (arrays['chunk_nchan'][i]),
+                    float (arrays['chunk_tmin'][i]),
+                    float (arrays['chunk_tmax'][i]))
+        c.offset = int (arrays['chunk_offset'][i])
+        c.sizes = [int (x) for x in arrays['chunk_sizes'][i]]
+        chunks.append (c)
+
+    return segments, chunks
+
+
+class ArchiveWriter (object):
+    """:synopsis: write UV data into a compressed archive
+
+:arg str path: the directory to create; it must not exist
+:arg int chunkSize: the number of records in each chunk
+:arg int level: the zlib compression level, from 1 (fastest) to 9
+  (smallest)
+
+An :class:`ArchiveWriter` stores batches of UV data, as read by
+:func:`mirtask.uvdat.readBatches`, in a directory that can be read
+back with :class:`Archive`. The records are grouped into chunks of up
+to *chunkSize* records, and each chunk is stored column by column: the
+times, baselines, *uvw* coordinates, polarizations, and serial numbers
+are delta-encoded along the records, the variances are stored as they
+are, the visibilities are split into planes of real and imaginary
+parts, and the flags are packed into bits. Each column has its bytes
+shuffled so that like bytes of neighboring values are stored together,
+and is then compressed with zlib. All of this is done in native code,
+with the columns of several chunks compressed at once on separate
+threads (see :func:`mirtask.util.setNumThreads`). Everything
+round-trips exactly, apart from flags being stored only as good or
+bad.
+
+A chunk is also ended whenever the number of channels or
+polarizations, the spectral setup, or the tracked variables of the
+batches change, so every chunk has a single setup. The chunk
+directory, with the time range covered by each chunk, is written by
+:meth:`close`; until then, the archive can't be read.
+"""
+
+    def __init__ (self, path, chunkSize=DEFAULT_CHUNKSIZE, level=6):
+        self.path = str (path)
+        self.chunkSize = int (chunkSize)
+        self.level = int (level)
+
+        if self.chunkSize < 1:
+            raise ValueError ('chunkSize must be positive')
+        if self.level < 1 or self.level > 9:
+            raise ValueError ('level must be between 1 and 9')
+
+        os.mkdir (self.path)
+        self._data = open (os.path.join (self.path, 'chunks'), 'wb')
+        self._offset = 0
+        self._chunks = []
+        self._segments = []
+        self._batches = []
+        self._nbuf = 0
+        self._pending = []
+        self._last = None
+
+
+    def _sameSetup (self, batch):
+        last = self._last
+        return (batch.nchan == last.nchan and batch.npol == last.npol and
+                batch.hasW == last.hasW and
+                batch.vars is last.vars and batch.spec is last.spec and
+                (batch.spec is not None or
+                 N.array_equal (batch.freqs, last.freqs)))
+
+
+    def writeBatch (self, batch):
+        """Add a batch of records to the archive.
+
+:arg batch: the records
+:type batch: :class:`mirtask.uvdat.VisBatch`
+:rtype: :const:`None`
+"""
+        if self._data is None:
+            raise ValueError ('archive is closed')
+
+        if self._last is None or not self._sameSetup (batch):
+            self._endChunk ()
+            self._segments.append (_batchSegment (batch))
+            self._last = batch
+
+        n = batch.count
+        start = 0
+
+        while start < n:
+            m = min (n - start, self.chunkSize - self._nbuf)
+            self._batches.append ((batch, start, start + m))
+            self._nbuf += m
+            start += m
+            if self._nbuf == self.chunkSize:
+                self._endChunk ()
+
+
+    def _endChunk (self):
+        if not self._nbuf:
+            return
+
+        parts = self._batches
+        first = parts[0][0]
+
+        def gather (name, dtype):
+            col = N.concatenate ([getattr (b, name)[lo:hi]
+                                  for b, lo, hi in parts])
+            return N.ascontiguousarray (col, dtype=dtype)
+
+        data = gather ('data', N.complex64)
+        flags = gather ('flags', N.int32)
+        time = gather ('time', N.double)
+
+        cols = [time, gather ('baseline', N.double),
+                gather ('uvw', N.double), gather ('pol', N.int32),
+                gather ('variance', N.double), gather ('visno', N.int64),
+                N.ascontiguousarray (data.real),
+                N.ascontiguousarray (data.imag),
+                N.packbits (flags != 0, axis=1)]
+
+        chunk = _Chunk (len (self._segments) - 1, self._nbuf, first.nchan,
+                        time.min (), time.max ())
+        self._pending.append ((chunk, cols))
+        self._chunks.append (chunk)
+        self._batches = []
+        self._nbuf = 0
+
+        if len (self._pending) >= util.getNumThreads ():
+            self._flushPending ()
+
+
+    def _flushPending (self):
+        if not len (self._pending):
+            return
+
+        raws, bufs = [], []
+        for chunk, cols in self._pending:
+            raws += cols
+            bufs += [N.empty (_bound (c.nbytes), dtype=N.uint8) for c in cols]
+
+        sizes = N.empty (len (raws), dtype=N.intp)
+        deltas = N.tile (_deltas, len (self._pending))
+        _kernels.pack_encode (raws, bufs, sizes, deltas, self.level)
+
+        i = 0
+        for chunk, cols in self._pending:
+            chunk.offset = self._offset
+            chunk.sizes = [int (s) for s in sizes[i:i+len (cols)]]
+            for buf, size in zip (bufs[i:i+len (cols)], chunk.sizes):
+                buf[:size].tofile (self._data)
+                self._offset += size
+            i += len (cols)
+
+        self._pending = []
+
+
+    def close (self):
+        """Finish writing the archive.
+
+:rtype: :const:`None`
+"""
+        if self._data is None:
+            return
+
+        self._endChunk ()
+        self._flushPending ()
+        self._data.close ()
+        self._data = None
+        _writeIndex (self.path, self._segments, self._chunks)
+
+
+    def abort (self):
+        """Stop writing and delete the archive.
+
+:rtype: :const:`None`
+"""
+        import shutil
+
+        if self._data is not None:
+            self._data.close ()
+            self._data = None
+        shutil.rmtree (self.path, ignore_errors=True)
+
+
+class Archive (object):
+    """:synopsis: read UV data from a compressed archive
+
+:arg str path: the directory written by an :class:`ArchiveWriter`
+
+An :class:`Archive` reads UV data back out of an archive with the
+same batched interface as the UVDAT readers: :meth:`readBatches`
+yields ``(handle, batch)`` tuples of the archive itself and
+:class:`mirtask.uvdat.VisBatch` objects, like
+:func:`mirtask.uvdat.readBatches`, and :meth:`readSnapshots` groups
+them into integrations, like :func:`mirtask.uvdat.readSnapshots`, so
+code written against those functions can read archives unchanged.
+Several chunks are read and decompressed at once in native code, with
+the columns shared out between threads.
+
+Attributes:
+
+* **path** -- the directory of the archive.
+* **nrec** -- the total number of records.
+* **nchunk** -- the number of chunks.
+* **timeRange** -- a tuple of the earliest and latest record
+  timestamps, as Julian dates, or :const:`None` if the archive is
+  empty.
+"""
+
+    def __init__ (self, path):
+        self.path = str (path)
+        self._segments, self._chunks = _readIndex (self.path)
+        self.nchunk = len (self._chunks)
+        self.nrec = sum (c.nrec for c in self._chunks)
+
+        if self.nchunk:
+            self.timeRange = (min (c.tmin for c in self._chunks),
+                              max (c.tmax for c in self._chunks))
+        else:
+            self.timeRange = None
+
+
+    def _decode (self, f, chunks):
+        bufs, raws = [], []
+
+        for c in chunks:
+            f.seek (c.offset)
+            blob = f.read (sum (c.sizes))
+            start = 0
+            for size in c.sizes:
+                bufs.append (N.frombuffer (blob, dtype=N.uint8, count=size,
+                                           offset=start))
+                start += size
+
+            n, nchan = c.nrec, c.nchan
+            raws += [N.empty (n, dtype=N.double), N.empty (n, dtype=N.double),
+                     N.empty ((n, 3), dtype=N.double),
+                     N.empty (n, dtype=N.int32), N.empty (n, dtype=N.double),
+                     N.empty (n, dtype=N.int64),
+                     N.empty ((n, nchan), dtype=N.float32),
+                     N.empty ((n, nchan), dtype=N.float32),
+                     N.empty ((n, (nchan + 7) // 8), dtype=N.uint8)]
+
+        deltas = N.tile (_deltas, len (chunks))
+        _kernels.pack_decode (bufs, raws, deltas)
+        ncol = len (_columns)
+        return [raws[i*ncol:(i+1)*ncol] for i in xrange (len (chunks))]
+
+
+    def readBatches (self, startTime=None, endTime=None, specCache=None,
+                     readAhead=None):
+        """Read the data in batches of records.
+
+:arg startTime: if not :const:`None`, skip records before this time
+:type startTime: float Julian date or :const:`None`
+:arg endTime: if not :const:`None`, skip records after this time
+:type endTime: float Julian date or :const:`None`
+:arg specCache: the cache of spectral setups; see
+  :func:`mirtask.uvdat.readBatches`
+:type specCache: :class:`mirtask.uvdat.SpectralCache`
+:arg readAhead: the number of chunks to decompress at once, or
+  :const:`None` for the number of compute threads
+:type readAhead: int or :const:`None`
+:rtype: generator of ``(archive, batch)``
+:returns: generator yielding tuples of *self* and a
+  :class:`mirtask.uvdat.VisBatch`
+
+Each batch holds one chunk of the archive, less any records outside
+the time range, and is newly allocated. Chunks that lie entirely
+outside the time range are skipped without being read.
+"""
+        from mirtask.uvdat import SpectralCache, VisBatch
+
+        if specCache is None:
+            specCache = SpectralCache ()
+        if readAhead is None:
+            readAhead = util.getNumThreads ()
+        readAhead = max (int (readAhead), 1)
+
+        chunks = [c for c in self._chunks
+                  if (startTime is None or c.tmax >= startTime) and
+                  (endTime is None or c.tmin <= endTime)]
+        specs = {}
+
+        f = open (os.path.join (self.path, 'chunks'), 'rb')
+
+        for i in xrange (0, len (chunks), readAhead):
+            group = chunks[i:i+readAhead]
+
+            for c, cols in zip (group, self._decode (f, group)):
+                seg = self._segments[c.seg]
+                spec = specs.get (c.seg)
+                if spec is None and seg.specvars is not None:
+                    spec = specs[c.seg] = specCache.intern (seg.freqs,
+                                                            seg.lineinfo,
+                                                            seg.specvars)
+                freqs = seg.freqs if spec is None else spec.freqs
+
+                time, bl, uvw, pol, var, visno, re, im, packed = cols
+                flags = N.unpackbits (packed, axis=1)[:,:c.nchan]
+
+                keep = None
+                if startTime is not None or endTime is not None:
+                    keep = N.ones (c.nrec, dtype=N.bool_)
+                    if startTime is not None:
+                        keep &= time >= startTime
+                    if endTime is not None:
+                        keep &= time <= endTime
+                    if keep.all ():
+                        keep = None
+
+                b = VisBatch (0, c.nchan, seg.hasW, freqs, spec)
+                b.npol = seg.npol
+                b.vars = seg.vars
+                b.time, b.baseline, b.uvw, b.pol = time, bl, uvw, pol
+                b.variance, b.visno = var, visno
+                b.data = N.empty ((c.nrec, c.nchan), dtype=N.complex64)
+                b.data.real = re
+                b.data.imag = im
+                b.flags = flags.astype (N.int32)
+
+                if keep is not None:
+                    for name in ('time', 'baseline', 'uvw', 'pol', 'variance',
+                                 'visno', 'data', 'flags'):
+                        setattr (b, name, getattr (b, name)[keep])
+
+                b.count = b.time.size
+                b.specid = N.empty (b.count, dtype=N.int32)
+                b.specid.fill (-1 if spec is None else spec.id)
+                if b.count:
+                    yield self, b
+
+        f.close ()
+
+
+    def readSnapshots (self, startTime=None, endTime=None, specCache=None,
+                       readAhead=None):
+        """Read the data one integration at a time.
+
+The arguments are as in :meth:`readBatches`, and the return value is
+as in :func:`mirtask.uvdat.readSnapshots`, except that the first
+element of each tuple is *self*.
+"""
+        from mirtask.uvdat import _read_snapshot_gen
+
+        return _read_snapshot_gen (self.readBatches (startTime, endTime,
+                                                     specCache, readAhead))
+
+
+def archiveData (toread, path, uvdOptions='', chunkSize=DEFAULT_CHUNKSIZE,
+                 level=6, batchSize=1024, trackVars=(), **uvdargs):
+    """Read UV data with UVDAT and write them into an archive.
+
+:arg toread: the dataset or datasets to read
+:type toread: :class:`miriad.VisData`, or iterable thereof
+:arg str path: the archive directory to create
+:arg str uvdOptions: options for the UVDAT subsystem
+:arg int chunkSize: see :class:`ArchiveWriter`
+:arg int level: see :class:`ArchiveWriter`
+:arg int batchSize: the number of records to read at once
+:arg trackVars: the names of extra UV variables to save with the data
+:type trackVars: iterable of str
+:arg uvdargs: extra arguments for the UVDAT subsystem, as in
+  :func:`mirtask.uvdat.setupAndReadBatches`
+:rtype: :class:`Archive`
+:returns: the new archive
+
+The data are archived as UVDAT delivers them, so calibrations are
+applied unless turned off with *nocal*, *nopass*, and *nopol*. If
+something goes wrong, the archive is deleted.
+"""
+    from mirtask import uvdat
+
+    w = ArchiveWriter (path, chunkSize, level)
+
+    try:
+        for inp, batch in uvdat.setupAndReadBatches (toread, uvdOptions,
+                                                     batchSize=batchSize,
+                                                     trackVars=trackVars,
+                                                     **uvdargs):
+            w.writeBatch (batch)
+        w.close ()
+    except Exception:
+        w.abort ()
+        raise
+
+    return Archive (path)
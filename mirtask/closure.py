@@ -0,0 +1,367 @@
+'''mirtask.closure - closure phases and amplitudes'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import numpy as N
+from mirtask import _kernels
+
+__all__ = ['ClosureTables', 'ClosureSet', 'ClosureEngine', 'readClosures']
+
+
+def _combinations (n, k):
+    """All of the *k*-element subsets of ``range (n)``, as the rows of
+an array, with increasing indices along each row and the rows in
+lexicographic order."""
+
+    c = N.arange (n, dtype=N.intp)[:,N.newaxis]
+
+    for i in xrange (k - 1):
+        # Extend each row by every index greater than its last one.
+        last = c[:,-1]
+        counts = n - 1 - last
+        offset = N.cumsum (counts) - counts - last - 1
+        c = N.column_stack ((N.repeat (c, counts, axis=0),
+                             N.arange (counts.sum ()) -
+                             N.repeat (offset, counts)))
+
+    return c.astype (N.intp)
+
+
+class ClosureTables (object):
+    """:synopsis: baseline index tables for the closures of a set of antennas
+
+:arg ant1: the first antenna numbers of the baselines
+:type ant1: array-like of int
+:arg ant2: the second antenna numbers of the baselines
+:type ant2: array-like of int
+:arg bool quads: whether to build the quad tables too
+
+The tables describe every triangle and, optionally, every quad of the
+antennas that appear in the cross-correlation baselines given, with
+the closures referring to the baselines by their positions in *ant1*
+and *ant2*. Autocorrelations are ignored, and the baselines must have
+``ant1 < ant2``, as UV data do. Closures involving baselines that
+aren't in the list refer to row -1.
+
+Attributes:
+
+* **ants** -- the sorted antenna numbers.
+* **triAnts** -- a (*ntri*, 3) int array of the antennas *i* < *j* <
+  *k* of each triangle.
+* **triIndex** -- a (*ntri*, 3) intp array of the rows of the
+  baselines *ij*, *jk*, and *ik* of each triangle.
+* **quadAnts** -- a (*nquad*, 4) int array of the antennas *i* < *j*
+  < *k* < *l* of each quad, or :const:`None` if *quads* is false.
+* **quadIndex** -- a (*nquad*, 4) intp array of the rows of the
+  baselines *ij*, *kl*, *ik*, and *jl* of each quad, or :const:`None`.
+"""
+
+    def __init__ (self, ant1, ant2, quads=False):
+        ant1 = N.asarray (ant1)
+        ant2 = N.asarray (ant2)
+        cross = N.nonzero (ant1 != ant2)[0]
+
+        if N.any (ant1[cross] > ant2[cross]):
+            raise ValueError ('baselines must have ant1 < ant2')
+
+        self.ants = N.unique (N.concatenate ((ant1[cross], ant2[cross])))
+        na = self.ants.size
+        rows = N.empty ((na, na), dtype=N.intp)
+        rows.fill (-1)
+        rows[N.searchsorted (self.ants, ant1[cross]),
+             N.searchsorted (self.ants, ant2[cross])] = cross
+
+        t = _combinations (na, 3)
+        self.triAnts = self.ants[t]
+        self.triIndex = N.column_stack ((rows[t[:,0],t[:,1]],
+                                         rows[t[:,1],t[:,2]],
+                                         rows[t[:,0],t[:,2]]))
+
+        if not quads:
+            self.quadAnts = self.quadIndex = None
+        else:
+            q = _combinations (na, 4)
+            self.quadAnts = self.ants[q]
+            self.quadIndex = N.column_stack ((rows[q[:,0],q[:,1]],
+                                              rows[q[:,2],q[:,3]],
+                                              rows[q[:,0],q[:,2]],
+                                              rows[q[:,1],q[:,3]]))
+
+
+class ClosureSet (object):
+    """:synopsis: averaged closure quantities of one time interval
+
+Each quantity is stored as a column with one row for every
+combination of closure and polarization that had any good data.
+
+Attributes:
+
+* **time** -- the mean timestamp of the integrations that went in, as
+  a Julian date.
+* **ntimes** -- the number of integrations that went in.
+* **triAnts** -- a (*ntri*, 3) int array of the antennas of each
+  triangle.
+* **triPol** -- a *ntri*-element int32 array of the polarization
+  codes.
+* **phase** -- a *ntri*-element double array of the closure phases,
+  in radians: the phase of the average of the bispectrum
+  V_ij V_jk conj(V_ik) over channels and time.
+* **triAmp** -- a *ntri*-element double array of the amplitudes of
+  the average bispectrum.
+* **coherence** -- a *ntri*-element double array of the ratio of the
+  amplitude of the average bispectrum to the average of its amplitude.
+  It is 1 if the closure phase is the same in every channel and
+  integration, and falls towards 0 as the scatter grows.
+* **triCount** -- a *ntri*-element int array of the number of
+  channel samples averaged.
+* **quadAnts** -- a (*nquad*, 4) int array of the antennas of each
+  quad.
+* **quadPol** -- a *nquad*-element int32 array of the polarization
+  codes.
+* **logAmp** -- a *nquad*-element double array of the averages of the
+  natural log of the closure amplitude |V_ij V_kl| / |V_ik V_jl|.
+* **logAmpRms** -- a *nquad*-element double array of the scatter of
+  the log closure amplitude about its average.
+* **quadCount** -- a *nquad*-element int array of the number of
+  channel samples averaged.
+
+The quad columns are empty if quads weren't computed.
+"""
+
+    def closureAmp (self):
+        """Get the closure amplitudes.
+
+:rtype: double ndarray
+:returns: the geometric means of the closure amplitudes, ``exp (logAmp)``
+"""
+        return N.exp (self.logAmp)
+
+
+class ClosureEngine (object):
+    """:synopsis: compute closure quantities from snapshots of UV data
+
+:arg interval: the averaging interval, in minutes, or :const:`None`
+  (the default) to compute closures for each integration separately
+:arg bool quads: whether to compute closure amplitudes of quads as
+  well as closure phases of triangles
+
+A :class:`ClosureEngine` computes closure quantities for all of the
+triangles and quads of the antennas in a stream of
+:class:`mirtask.uvdat.VisSnapshot` objects, in native code, with the
+closures shared out between threads (see
+:func:`mirtask.util.setNumThreads`). The closures are averaged over
+all channels and over the integrations in each interval, and handed
+back as :class:`ClosureSet` objects. The baseline index tables are
+computed once and reused for as long as the baselines don't change.
+
+Time is divided into intervals counted from the first integration
+seen. An average ends when the first integration of a later interval
+arrives, or when the set of antennas or polarizations changes.
+
+The average for a triangle only includes the channels that are good
+on all three of its baselines, and likewise for quads. Autocorrelation
+baselines are ignored. With many antennas there are a lot of quads:
+*n* (*n* - 1) (*n* - 2) (*n* - 3) / 24 of them, so they should only
+be requested when needed.
+"""
+
+    def __init__ (self, interval=None, quads=False):
+        if interval is None:
+            self.interval = self._dt = None
+        else:
+            if not interval > 0:
+                raise ValueError ('averaging interval must be positive')
+            self.interval = float (interval)
+            self._dt = self.interval / 1440
+
+        self.quads = bool (quads)
+        self._tref = None
+        self._bin = None
+        self._ants = None
+        self._pols = None
+        self._tables = None
+        self._tablebl = None
+        self._ntimes = 0
+
+
+    def _getTables (self, snap):
+        if self._tables is None or not N.array_equal (snap.baseline,
+                                                      self._tablebl):
+            self._tables = ClosureTables (snap.ant1, snap.ant2, self.quads)
+            self._tablebl = N.array (snap.baseline)
+        return self._tables
+
+
+    def _start (self, tables, pols):
+        npol = pols.size
+        ntri = tables.triAnts.shape[0]
+        self._ants = tables.ants
+        self._pols = N.array (pols)
+        self._triAnts = tables.triAnts
+        self._tsum = N.zeros ((ntri, npol), dtype=N.complex128)
+        self._tsum2 = N.zeros ((ntri, npol))
+        self._tcount = N.zeros ((ntri, npol))
+
+        if self.quads:
+            nquad = tables.quadAnts.shape[0]
+            self._quadAnts = tables.quadAnts
+            self._qsum = N.zeros ((nquad, npol))
+            self._qsum2 = N.zeros ((nquad, npol))
+            self._qcount = N.zeros ((nquad, npol))
+
+        self._ntimes = 0
+        self._timesum = 0.
+
+
+    def add (self, snap):
+        """Add an integration to the closures.
+
+:arg snap: the integration
+:type snap: :class:`mirtask.uvdat.VisSnapshot`
+:rtype: list of :class:`ClosureSet`
+:returns: the closures of the intervals that were ended by this
+  integration; often empty
+
+The closure sums are updated before this returns, so *snap* may be
+reused afterwards.
+"""
+        out = []
+        tables = self._getTables (snap)
+
+        if self._dt is None:
+            bin = None
+        else:
+            if self._tref is None:
+                self._tref = snap.time
+            bin = int (N.floor ((snap.time - self._tref) / self._dt))
+
+        if self._ants is not None and (bin != self._bin or
+                                       not N.array_equal (tables.ants,
+                                                          self._ants) or
+                                       not N.array_equal (snap.pols,
+                                                          self._pols)):
+            out += self.flush ()
+
+        if self._ants is None:
+            self._start (tables, snap.pols)
+
+        self._bin = bin
+        self._ntimes += 1
+        self._timesum += snap.time
+
+        data = N.ascontiguousarray (snap.data, dtype=N.complex64)
+        flags = N.ascontiguousarray (snap.flags, dtype=N.int32)
+        _kernels.closure_triples (data, flags, tables.triIndex, self._tsum,
+                                  self._tsum2, self._tcount)
+        if self.quads:
+            _kernels.closure_quads (data, flags, tables.quadIndex, self._qsum,
+                                    self._qsum2, self._qcount)
+
+        if self._dt is None:
+            out += self.flush ()
+        return out
+
+
+    def flush (self):
+        """End the average in progress.
+
+:rtype: list of :class:`ClosureSet`
+:returns: the closures of the average, if there was one
+"""
+        if self._ants is None:
+            return []
+
+        cs = ClosureSet ()
+        cs.time = self._timesum / self._ntimes
+        cs.ntimes = self._ntimes
+
+        npol = self._pols.size
+        ti, tp = N.nonzero (self._tcount > 0)
+        sums = self._tsum[ti,tp]
+        cs.triAnts = self._triAnts[ti]
+        cs.triPol = self._pols[tp]
+        cs.phase = N.angle (sums)
+        cs.triAmp = N.abs (sums) / self._tcount[ti,tp]
+        cs.coherence = N.abs (sums) / self._tsum2[ti,tp]
+        cs.triCount = self._tcount[ti,tp].astype (N.int)
+
+        if not self.quads:
+            cs.quadAnts = N.zeros ((0, 4), dtype=self._triAnts.dtype)
+            cs.quadPol = N.zeros (0, dtype=self._pols.dtype)
+            cs.logAmp = cs.logAmpRms = N.zeros (0)
+            cs.quadCount = N.zeros (0, dtype=N.int)
+        else:
+            qi, qp = N.nonzero (self._qcount > 0)
+            n = self._qcount[qi,qp]
+            mean = self._qsum[qi,qp] / n
+            cs.quadAnts = self._quadAnts[qi]
+            cs.quadPol = self._pols[qp]
+            cs.logAmp = mean
+            cs.logAmpRms = N.sqrt (N.maximum (self._qsum2[qi,qp] / n -
+                                              mean**2, 0))
+            cs.quadCount = n.astype (N.int)
+
+        self._ants = None
+        return [cs]
+
+
+    def process (self, snapshots):
+        """Compute closures for a stream of integrations as they're read.
+
+:arg snapshots: a stream of ``(handle, snapshot)`` tuples, as returned
+  by :func:`mirtask.uvdat.readSnapshots`
+:rtype: generator of :class:`ClosureSet`
+:returns: the closures
+
+The average still in progress at the end of the stream is flushed.
+"""
+        for inp, snap in snapshots:
+            for cs in self.add (snap):
+                yield cs
+
+        for cs in self.flush ():
+            yield cs
+
+
+def readClosures (toread, interval=None, quads=False, uvdOptions='x',
+                  batchSize=1024, **uvdargs):
+    """Compute closure quantities of UV data.
+
+:arg toread: the dataset or datasets to read
+:type toread: :class:`miriad.VisData`, or iterable thereof
+:arg interval: the averaging interval; see :class:`ClosureEngine`
+:arg bool quads: whether to compute closure amplitudes too
+:arg str uvdOptions: options for the UVDAT subsystem; defaults to
+  *x*, cross-correlations only
+:arg int batchSize: the number of records to read at once
+:arg uvdargs: extra arguments for the UVDAT subsystem, as in
+  :func:`mirtask.uvdat.setupAndReadSnapshots`
+:rtype: generator of :class:`ClosureSet`
+:returns: the closures
+
+This reads the data with :func:`mirtask.uvdat.setupAndReadSnapshots`
+and hands them to a :class:`ClosureEngine`, in one pass, without
+running the CLOSURE task (cf. :class:`mirexec.TaskClosure`).
+Calibrations are applied as the data are read, as usual.
+"""
+    from mirtask import uvdat
+
+    engine = ClosureEngine (interval, quads)
+    gen = uvdat.setupAndReadSnapshots (toread, uvdOptions,
+                                       batchSize=batchSize, **uvdargs)
+    return engine.process (gen)
@@ -0,0 +1,397 @@
+'''mirtask.convolve - FFT convolution of images'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import numpy as N
+from mirtask import util
+from mirtask._helpers import fftSize, pair, planeIndices
+
+__all__ = ['Convolver', 'gaussianKernel', 'fitBeam', 'convolveImage',
+           'restoreImage']
+
+
+class Convolver (object):
+    """:synopsis: convolve images with a fixed kernel by FFT
+
+:arg kernel: the convolution kernel
+:type kernel: 2D array-like of float
+:arg shape: the shape of the images to be convolved, (*ny*, *nx*)
+:arg center: the pixel of the kernel that corresponds to zero offset,
+  (*y*, *x*); defaults to the middle of the kernel
+:arg blockSize: the FFT size to use in overlap-save mode; either one
+  number or a pair (*y*, *x*). The default, :const:`None`, transforms
+  whole images at once.
+
+A :class:`Convolver` computes the transform of its kernel once and
+reuses it for every image it convolves, so it should be kept around
+when convolving many planes with the same kernel. The FFTs are done by
+:func:`mirtask.util.fftInPlace`, which caches its own tables and
+spreads the work over threads.
+
+By default each image is padded to the next power of two in size that
+avoids wraparound, and transformed in one piece. If *blockSize* is
+given, the image is instead processed in tiles with FFTs of that size
+(the overlap-save method), so that the working memory doesn't depend
+on the image size. The block must be bigger than the kernel, and is
+most efficient when it's several times bigger and a power of two.
+
+The output pixel (*y*, *x*) is the sum over input pixels (*j*, *i*) of
+``image[j,i] * kernel[y-j+cy,x-i+cx]``, where (*cy*, *cx*) is
+*center*; pixels beyond the edges of the image count as zero.
+"""
+
+    def __init__ (self, kernel, shape, center=None, blockSize=None):
+        kernel = N.asarray (kernel, dtype=N.double)
+        if kernel.ndim != 2:
+            raise ValueError ('kernel must be two-dimensional')
+
+        self.ny, self.nx = int (shape[0]), int (shape[1])
+        self.ky, self.kx = kernel.shape
+
+        if center is None:
+            self.cy, self.cx = self.ky // 2, self.kx // 2
+        else:
+            self.cy, self.cx = int (center[0]), int (center[1])
+
+        if blockSize is None:
+            self.my = fftSize (self.ny + self.ky - 1)
+            self.mx = fftSize (self.nx + self.kx - 1)
+        else:
+            my, mx = pair (blockSize, 'blockSize')
+            self.my, self.mx = int (my), int (mx)
+            if self.my <= self.ky or self.mx <= self.kx:
+                raise ValueError ('overlap-save blocks must be bigger than '
+                                  'the kernel')
+
+        # The size of the output produced by each block.
+        self.ly = self.my - self.ky + 1
+        self.lx = self.mx - self.kx + 1
+
+        self.kft = N.zeros ((self.my, self.mx), dtype=N.complex128)
+        self.kft[:self.ky,:self.kx] = kernel
+        util.fftInPlace (self.kft)
+        self.kft /= self.my * self.mx
+
+
+    def __call__ (self, image):
+        """Convolve one or more images.
+
+:arg image: the image or images
+:type image: (*ny*, *nx*) or (*nplane*, *ny*, *nx*) array-like of float
+:rtype: double ndarray
+:returns: the convolved images, with the same shape as *image*
+
+Masked pixels of a masked array count as zero. Several planes are
+transformed together, which uses threads more effectively than
+convolving them one at a time.
+"""
+        if isinstance (image, N.ma.MaskedArray):
+            image = image.filled (0)
+
+        image = N.asarray (image, dtype=N.double)
+        single = image.ndim == 2
+        if single:
+            image = image[N.newaxis]
+        if image.shape[1:] != (self.ny, self.nx):
+            raise ValueError ('image has the wrong shape for this Convolver')
+
+        ny, nx = self.ny, self.nx
+        out = N.empty (image.shape, dtype=N.double)
+        work = N.empty ((image.shape[0], self.my, self.mx), dtype=N.complex128)
+
+        for oy in xrange (0, ny, self.ly):
+            ey = min (oy + self.ly, ny)
+            sy = oy + self.cy - (self.ky - 1)
+            y0, y1 = max (sy, 0), min (sy + self.my, ny)
+
+            for ox in xrange (0, nx, self.lx):
+                ex = min (ox + self.lx, nx)
+                sx = ox + self.cx - (self.kx - 1)
+                x0, x1 = max (sx, 0), min (sx + self.mx, nx)
+
+                work.fill (0)
+                if y1 > y0 and x1 > x0:
+                    work[:,y0-sy:y1-sy,x0-sx:x1-sx] = image[:,y0:y1,x0:x1]
+
+                util.fftInPlace (work)
+                work *= self.kft
+                util.fftInPlace (work, sign=1)
+
+                # Outputs before ky - 1 (kx - 1) are polluted by wraparound.
+                out[:,oy:ey,ox:ex] = work.real[:,self.ky-1:self.ky-1+ey-oy,
+                                               self.kx-1:self.kx-1+ex-ox]
+
+        if single:
+            return out[0]
+        return out
+
+
+def gaussianKernel (bmaj, bmin, bpa, cdelt1, cdelt2, extent=None):
+    """Tabulate an elliptical Gaussian on an image pixel grid.
+
+:arg float bmaj: the major-axis FWHM, in radians
+:arg float bmin: the minor-axis FWHM, in radians
+:arg float bpa: the position angle of the major axis, in degrees
+  east of north, as with the MIRIAD *bpa* header item
+:arg float cdelt1: the pixel increment along the *x* axis of the
+  image, in radians; normally negative
+:arg float cdelt2: the pixel increment along the *y* axis, in radians
+:arg int extent: the number of pixels on each side of the center to
+  tabulate; the default reaches twice the FWHM along both axes
+:rtype: (2*extent+1, 2*extent+1) double ndarray
+:returns: the Gaussian, with its peak of one at the center pixel
+
+The result is suitable for a :class:`Convolver`: convolving an image in
+Jy per pixel with it gives one in Jy per beam.
+"""
+    if not (bmaj > 0 and bmin > 0):
+        raise ValueError ('beam sizes must be positive')
+
+    if extent is None:
+        extent = int (N.ceil (2 * bmaj / min (abs (cdelt1), abs (cdelt2))))
+
+    y, x = N.mgrid[-extent:extent+1,-extent:extent+1]
+    e = x * cdelt1
+    n = y * cdelt2
+    pa = bpa * N.pi / 180
+    a = n * N.cos (pa) + e * N.sin (pa)
+    b = e * N.cos (pa) - n * N.sin (pa)
+    return N.exp (-4 * N.log (2) * ((a / bmaj)**2 + (b / bmin)**2))
+
+
+def fitBeam (beam, cdelt1, cdelt2):
+    """Fit an elliptical Gaussian to the main lobe of a dirty beam.
+
+:arg beam: the dirty beam
+:type beam: 2D array-like of float
+:arg float cdelt1: the pixel increment along the *x* axis, in radians
+:arg float cdelt2: the pixel increment along the *y* axis, in radians
+:rtype: tuple of three floats
+:returns: (*bmaj*, *bmin*, *bpa*), with the FWHMs in radians and the
+  position angle in degrees, as with :func:`gaussianKernel`
+
+The logarithm of the beam in the pixels above half of its peak,
+around the peak, is fit with a quadratic form using
+:func:`mirtask.util.linLeastSquares`. This is similar in spirit to
+the beam fit done by RESTORE.
+"""
+    beam = N.asarray (beam, dtype=N.double)
+    cy, cx = N.unravel_index (beam.argmax (), beam.shape)
+    peak = beam[cy, cx]
+
+    # Only look at the main lobe: grow a box around the peak until its
+    # edge has no pixels above half power, so that we don't pick up
+    # sidelobes that happen to be above the threshold.
+
+    def box (r):
+        return (slice (max (cy - r, 0), cy + r + 1),
+                slice (max (cx - r, 0), cx + r + 1))
+
+    def nhigh (r):
+        return (beam[box (r)] > 0.5 * peak).sum ()
+
+    r = 1
+    while r < max (beam.shape) and nhigh (r) > nhigh (r - 1):
+        r += 1
+
+    by, bx = box (r)
+    sub = beam[by,bx] / peak
+    y, x = N.mgrid[by.start - cy:by.start - cy + sub.shape[0],
+                   bx.start - cx:bx.start - cx + sub.shape[1]]
+    ok = sub > 0.5
+    x, y, v = x[ok], y[ok], N.log (sub[ok])
+
+    if x.size < 3:
+        raise ValueError ('beam main lobe is too small to fit')
+
+    # ln b = -(A x^2 + B x y + C y^2), in pixels.
+
+    A, B, C = util.linLeastSquares (N.array ([x**2, x * y, y**2]), -v)
+
+    # Convert to the quadratic form in (east, north) offsets and find
+    # its principal axes.
+
+    m = N.array ([[A / cdelt1**2, 0.5 * B / (cdelt1 * cdelt2)],
+                  [0.5 * B / (cdelt1 * cdelt2), C / cdelt2**2]])
+    evals, evecs = N.linalg.eigh (m)
+
+    if not (evals > 0).all ():
+        raise ValueError ('beam main lobe is not a Gaussian peak')
+
+    bmaj = N.sqrt (4 * N.log (2) / evals[0])
+    bmin = N.sqrt (4 * N.log (2) / evals[1])
+    e, n = evecs[:,0]
+    bpa = N.arctan2 (e, n) * 180 / N.pi
+
+    if bpa > 90:
+        bpa -= 180
+    elif bpa <= -90:
+        bpa += 180
+
+    return bmaj, bmin, bpa
+
+
+def _stream (inputs, out, func, planesPerPass):
+    # Read chunks of planes from each of the input images, pass them to
+    # func, and write the result to out.
+
+    inp = inputs[0]
+    ny, nx = int (inp.axes[1]), int (inp.axes[0])
+    planes = planeIndices (inp)
+
+    if planesPerPass is None:
+        planesPerPass = 2 * util.getNumThreads ()
+    planesPerPass = max (int (planesPerPass), 1)
+
+    for start in xrange (0, len (planes), planesPerPass):
+        chunk = planes[start:start+planesPerPass]
+        data = []
+
+        for ds in inputs:
+            a = N.empty ((len (chunk), ny, nx), dtype=N.double)
+            for i, idx in enumerate (chunk):
+                a[i] = ds.readPlane (idx[::-1]).filled (0)
+            data.append (a)
+
+        result = func (*data)
+
+        for i, idx in enumerate (chunk):
+            out.writePlane (N.ma.asarray (result[i].astype (N.float32)),
+                            idx[::-1])
+
+
+def convolveImage (inp, out, kernel=None, fwhm=None, pa=0., center=None,
+                   blockSize=None, planesPerPass=None):
+    """Convolve a MIRIAD image with a kernel.
+
+:arg inp: the path of the image to convolve; it may be a cube
+:arg out: the path of the output image to create
+:arg kernel: an arbitrary 2D convolution kernel, as for
+  :class:`Convolver`, or :const:`None`
+:arg fwhm: if *kernel* is :const:`None`, the FWHM of a Gaussian to
+  convolve with, in radians; either one number or a pair (*bmaj*,
+  *bmin*)
+:arg float pa: the position angle of the Gaussian, in degrees
+:arg center: the center of *kernel*, as for :class:`Convolver`
+:arg blockSize: the FFT block size for overlap-save mode, as for
+  :class:`Convolver`
+:arg int planesPerPass: the number of planes to process at once;
+  defaults to twice the number of threads
+:returns: the :class:`Convolver` that was used
+
+The image is processed in a single streaming pass, *planesPerPass*
+planes at a time, with the kernel transform computed once. Flagged
+pixels count as zero. The output gets the header of the input. If a
+Gaussian is used and the input is in JY/PIXEL, the output is labeled
+JY/BEAM and given the Gaussian as its beam; otherwise any beam
+description is left as it was.
+"""
+    from mirtask import XYDataSet
+
+    ids = XYDataSet (str (inp), 'rw')
+    naxis = ids.getScalarItem ('naxis', 2)
+    ods = XYDataSet (str (out), 'c', ids.axes[:naxis])
+    ids.copyHeader (ods)
+
+    if kernel is None:
+        if fwhm is None:
+            raise ValueError ('need either a kernel or a Gaussian FWHM')
+
+        bmaj, bmin = pair (fwhm, 'fwhm')
+        kernel = gaussianKernel (bmaj, bmin, pa, ids.getScalarItem ('cdelt1'),
+                                 ids.getScalarItem ('cdelt2'))
+        center = None
+
+        if str (ids.getScalarItem ('bunit', '')).upper () == 'JY/PIXEL':
+            ods.setScalarItem ('bunit', str, 'JY/BEAM')
+            ods.setScalarItem ('bmaj', N.double, bmaj)
+            ods.setScalarItem ('bmin', N.double, bmin)
+            ods.setScalarItem ('bpa', N.double, pa)
+
+    conv = Convolver (kernel, (ids.axes[1], ids.axes[0]), center, blockSize)
+    _stream ([ids], ods, conv, planesPerPass)
+    ids.close ()
+    ods.close ()
+    return conv
+
+
+def restoreImage (model, out, beam=None, fwhm=None, pa=0., residual=None,
+                  blockSize=None, planesPerPass=None):
+    """Make a restored image from CLEAN components, without running RESTORE.
+
+:arg model: the path of the CLEAN component image, in JY/PIXEL
+:arg out: the path of the restored image to create
+:arg beam: the path of the dirty beam; used to fit the restoring beam
+  if *fwhm* is not given
+:arg fwhm: the FWHM of the restoring beam, in radians; either one
+  number or a pair (*bmaj*, *bmin*)
+:arg float pa: the position angle of the restoring beam, in degrees;
+  ignored if the beam is fit
+:arg residual: the path of the residual image to add to the result, or
+  :const:`None`
+:arg blockSize: the FFT block size for overlap-save mode, as for
+  :class:`Convolver`
+:arg int planesPerPass: the number of planes to process at once
+:rtype: tuple of three floats
+:returns: the restoring beam, (*bmaj*, *bmin*, *bpa*)
+
+The components are convolved with a Gaussian of peak one, using a
+single :class:`Convolver` for all of the planes, and the residuals are
+added. The output gets the header of *model*, in units of JY/BEAM and
+with the restoring beam recorded in it.
+"""
+    from mirtask import XYDataSet
+
+    mds = XYDataSet (str (model), 'rw')
+    cdelt1 = mds.getScalarItem ('cdelt1')
+    cdelt2 = mds.getScalarItem ('cdelt2')
+
+    if fwhm is not None:
+        bmaj, bmin = pair (fwhm, 'fwhm')
+        bpa = pa
+    elif beam is not None:
+        bds = XYDataSet (str (beam), 'rw')
+        bmaj, bmin, bpa = fitBeam (bds.readPlane ().filled (0), cdelt1, cdelt2)
+        bds.close ()
+    else:
+        raise ValueError ('need either a dirty beam or a restoring beam size')
+
+    naxis = mds.getScalarItem ('naxis', 2)
+    ods = XYDataSet (str (out), 'c', mds.axes[:naxis])
+    mds.copyHeader (ods)
+    ods.setScalarItem ('bunit', str, 'JY/BEAM')
+    ods.setScalarItem ('bmaj', N.double, bmaj)
+    ods.setScalarItem ('bmin', N.double, bmin)
+    ods.setScalarItem ('bpa', N.double, bpa)
+
+    conv = Convolver (gaussianKernel (bmaj, bmin, bpa, cdelt1, cdelt2),
+                      (mds.axes[1], mds.axes[0]), None, blockSize)
+    inputs = [mds]
+
+    if residual is None:
+        func = conv
+    else:
+        inputs.append (XYDataSet (str (residual), 'rw'))
+        func = lambda m, r: conv (m) + r
+
+    _stream (inputs, ods, func, planesPerPass)
+
+    for ds in inputs:
+        ds.close ()
+    ods.close ()
+    return bmaj, bmin, bpa
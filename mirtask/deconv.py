@@ -0,0 +1,314 @@
+'''mirtask.deconv - in-process CLEAN deconvolution of images'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import numpy as N
+from mirtask import _kernels, util
+from mirtask._helpers import planeIndices
+from mirtask.convolve import Convolver
+
+__all__ = ['hogbom', 'clark', 'cleanImage']
+
+
+# Flags understood by the CLEAN kernels.
+
+_POSITIVE = 1
+_NEGSTOP = 2
+
+# The default Clark beam patch, as in MIRIAD's CLEAN.
+
+CLARK_PATCH = 51
+
+# The largest number of pixels we'll put into a Clark minor cycle.
+
+CLARK_MAXLIST = 65536
+
+
+def _flags (positive, negstop):
+    f = 0
+    if positive:
+        f |= _POSITIVE
+    if negstop:
+        f |= _NEGSTOP
+    return f
+
+
+def _beamInfo (beam, patch, default):
+    beam = N.ascontiguousarray (beam, dtype=N.float32)
+    if beam.ndim != 2:
+        raise ValueError ('beam must be two-dimensional')
+
+    bcy, bcx = N.unravel_index (beam.argmax (), beam.shape)
+    peak = beam[bcy, bcx]
+    if not peak > 0:
+        raise ValueError ('beam must have a positive peak')
+    if abs (peak - 1) > 1e-3:
+        beam = beam / peak
+
+    if patch is None:
+        patch = default
+    if patch is None:
+        patch = 2 * max (beam.shape) + 1
+    patch = N.atleast_1d (patch)
+    if patch.size == 1:
+        py = px = int (patch[0]) // 2
+    else:
+        py, px = int (patch[0]) // 2, int (patch[1]) // 2
+
+    return beam, int (bcy), int (bcx), py, px
+
+
+def _regionArray (region, shape):
+    if region is None:
+        return None
+    region = N.ascontiguousarray (region, dtype=N.bool_)
+    if region.shape != shape:
+        raise ValueError ('region must have the same shape as the image planes')
+    return region
+
+
+def hogbom (dirty, beam, gain=0.1, niter=100, cutoff=0., region=None,
+            patch=None, positive=False, negstop=False):
+    """Deconvolve images with the Hogbom CLEAN algorithm.
+
+:arg dirty: the dirty image or images
+:type dirty: (*ny*, *nx*) or (*nplane*, *ny*, *nx*) array-like of float
+:arg beam: the dirty beam, with the same pixel scale as *dirty*; its
+  peak may be anywhere and is scaled to one if necessary
+:type beam: 2D array-like of float
+:arg float gain: the CLEAN loop gain
+:arg int niter: the maximum number of components per plane
+:arg float cutoff: stop when the largest residual falls to this level
+:arg region: the pixels in which components may be found, or
+  :const:`None` (the default) for the whole plane
+:type region: (*ny*, *nx*) array-like of bool, or :const:`None`
+:arg patch: the size of the beam patch subtracted for each component,
+  in pixels; either one number or a pair (*y*, *x*). The default,
+  :const:`None`, uses the whole beam.
+:arg bool positive: whether to only find positive components
+:arg bool negstop: whether to stop at the first negative component
+:rtype: tuple of (ndarray, ndarray, ndarray, ndarray)
+:returns: the CLEAN components, the residuals (both float32, with the
+  same shape as *dirty*), the number of iterations done in each plane,
+  and the peak of the final residuals of each plane. The peak is
+  measured the way components are searched for: it is the largest
+  absolute residual, or the largest positive one if *positive* is
+  set, within *region*; it is zero if there is nothing left to clean.
+
+The planes of a cube are cleaned independently and are shared out
+between threads (see :func:`mirtask.util.setNumThreads`). *dirty* is
+not modified, so it may be a read-only memory map of an image.
+"""
+    resid = N.array (dirty, dtype=N.float32, copy=True, order='C')
+    single = resid.ndim == 2
+    if single:
+        resid = resid[N.newaxis]
+    if resid.ndim != 3:
+        raise ValueError ('dirty must be two- or three-dimensional')
+
+    beam, bcy, bcx, py, px = _beamInfo (beam, patch, None)
+    region = _regionArray (region, resid.shape[1:])
+
+    model = N.zeros_like (resid)
+    niters = N.zeros (resid.shape[0], dtype=N.intp)
+    peaks = N.zeros (resid.shape[0], dtype=N.float32)
+
+    _kernels.hogbom (resid, model, region, beam, bcy, bcx, py, px,
+                     float (gain), float (cutoff), int (niter),
+                     _flags (positive, negstop), niters, peaks)
+
+    if single:
+        return model[0], resid[0], niters, peaks
+    return model, resid, niters, peaks
+
+
+def _residualPeak (resid, region, positive):
+    if positive:
+        score = resid.copy ()
+    else:
+        score = N.abs (resid)
+    if region is not None:
+        score[~region] = -1
+    return score, max (score.max (), 0)
+
+
+def clark (dirty, beam, gain=0.1, niter=100, cutoff=0., region=None,
+           patch=None, positive=False, negstop=False, maxlist=CLARK_MAXLIST):
+    """Deconvolve images with the Clark CLEAN algorithm.
+
+:arg patch: the size of the beam patch used in the minor cycles, in
+  pixels; either one number or a pair (*y*, *x*). Defaults to
+  :data:`CLARK_PATCH`.
+:arg int maxlist: the largest number of pixels considered in a minor
+  cycle
+:returns: as :func:`hogbom`
+
+The other arguments are as in :func:`hogbom`. Each minor cycle finds
+components among the brightest pixels of the residual image using a
+beam patch, and each major cycle subtracts them from the whole image
+with an FFT convolution. This is much faster than :func:`hogbom` for
+large images and beams. Planes are processed one at a time, with the
+FFTs and minor cycles running in native code.
+"""
+    dirty = N.asarray (dirty, dtype=N.float32)
+    single = dirty.ndim == 2
+    if single:
+        dirty = dirty[N.newaxis]
+    if dirty.ndim != 3:
+        raise ValueError ('dirty must be two- or three-dimensional')
+
+    beam, bcy, bcx, py, px = _beamInfo (beam, patch, CLARK_PATCH)
+    region = _regionArray (region, dirty.shape[1:])
+    flags = _flags (positive, negstop)
+
+    # The minor cycles can only go down to the largest sidelobe outside
+    # the patch before the approximation breaks down.
+
+    outside = N.abs (beam)
+    outside[max (bcy - py, 0):bcy + py + 1,max (bcx - px, 0):bcx + px + 1] = 0
+    sidelobe = outside.max ()
+
+    conv = Convolver (beam, dirty.shape[1:], (bcy, bcx))
+    model = N.zeros (dirty.shape, dtype=N.float32)
+    resid = N.empty (dirty.shape, dtype=N.float32)
+    niters = N.zeros (dirty.shape[0], dtype=N.intp)
+    peaks = N.zeros (dirty.shape[0], dtype=N.float32)
+
+    for p in xrange (dirty.shape[0]):
+        resid[p] = dirty[p]
+
+        while niters[p] < niter:
+            score, peak = _residualPeak (resid[p], region, positive)
+            if peak <= cutoff:
+                break
+
+            limit = max (cutoff, sidelobe * peak)
+            iy, ix = N.nonzero (score > limit)
+
+            if iy.size > maxlist:
+                s = N.sort (score[iy, ix])
+                limit = s[-maxlist - 1]
+                iy, ix = N.nonzero (score > limit)
+            elif iy.size == 0:
+                # The brightest pixel sits exactly at the limit.
+                limit = 0.999 * peak
+                iy, ix = N.nonzero (score > limit)
+
+            iy = iy.astype (N.intc)
+            ix = ix.astype (N.intc)
+            vals = N.ascontiguousarray (resid[p][iy, ix])
+            comps = N.zeros (iy.size, dtype=N.float32)
+
+            ndone = _kernels.clark_minor (vals, iy, ix, beam, bcy, bcx, py, px,
+                                          float (gain), float (limit),
+                                          int (niter - niters[p]), flags, comps)
+            if ndone == 0:
+                break
+
+            niters[p] += ndone
+            model[p][iy, ix] += comps
+            resid[p] = dirty[p] - conv (model[p])
+
+        peaks[p] = _residualPeak (resid[p], region, positive)[1]
+
+    if single:
+        return model[0], resid[0], niters, peaks
+    return model, resid, niters, peaks
+
+
+def cleanImage (map, beam, model, residual=None, mode='hogbom', gain=0.1,
+                niter=100, cutoff=0., region=None, patch=None,
+                positive=False, negstop=False, planesPerPass=None):
+    """Deconvolve a MIRIAD image with CLEAN, without running CLEAN.
+
+:arg map: the path of the dirty map, which may be a cube
+:arg beam: the path of the dirty beam; only its first plane is used
+:arg model: the path of the CLEAN component image to create
+:arg residual: the path of the residual image to create, or
+  :const:`None` (the default) to not write one
+:arg str mode: the algorithm to use: "hogbom" (the default) or
+  "clark"
+:arg int planesPerPass: how many planes of a cube to read and clean at
+  once; defaults to twice the number of threads
+:rtype: tuple of (int ndarray, float32 ndarray)
+:returns: the number of iterations done in each plane and the peak of
+  the final residuals of each plane, as in :func:`hogbom`
+
+The other arguments are as in :func:`hogbom` and :func:`clark`. The
+planes of *map* are streamed through memory *planesPerPass* at a
+time, read and written in bulk through :class:`mirtask.XYDataSet`,
+so the memory use doesn't depend on the number of planes. Flagged
+pixels are treated as zero. The output images get the header of
+*map*, with their units changed to JY/PIXEL for the model.
+"""
+    from mirtask import XYDataSet
+
+    if mode == 'hogbom':
+        func = hogbom
+    elif mode == 'clark':
+        func = clark
+    else:
+        raise ValueError ('unknown CLEAN mode "%s"' % mode)
+
+    if planesPerPass is None:
+        planesPerPass = 2 * util.getNumThreads ()
+    planesPerPass = max (int (planesPerPass), 1)
+
+    bds = XYDataSet (str (beam), 'rw')
+    b = bds.readPlane ().filled (0)
+    bds.close ()
+
+    mds = XYDataSet (str (map), 'rw')
+    naxis = mds.getScalarItem ('naxis', 2)
+    axes = mds.axes[:naxis]
+    planes = planeIndices (mds)
+
+    outs = [XYDataSet (str (model), 'c', axes)]
+    if residual is not None:
+        outs.append (XYDataSet (str (residual), 'c', axes))
+
+    for ds in outs:
+        mds.copyHeader (ds)
+    outs[0].setScalarItem ('bunit', str, 'JY/PIXEL')
+
+    ny, nx = int (axes[1]), int (axes[0])
+    niters = N.zeros (len (planes), dtype=N.intp)
+    peaks = N.zeros (len (planes), dtype=N.float32)
+
+    for start in xrange (0, len (planes), planesPerPass):
+        chunk = planes[start:start+planesPerPass]
+        dirty = N.empty ((len (chunk), ny, nx), dtype=N.float32)
+
+        for i, idx in enumerate (chunk):
+            dirty[i] = mds.readPlane (idx[::-1]).filled (0)
+
+        cc, res, n, pk = func (dirty, b, gain, niter, cutoff, region, patch,
+                               positive, negstop)
+        niters[start:start+len (chunk)] = n
+        peaks[start:start+len (chunk)] = pk
+
+        for i, idx in enumerate (chunk):
+            outs[0].writePlane (N.ma.asarray (cc[i]), idx[::-1])
+            if residual is not None:
+                outs[1].writePlane (N.ma.asarray (res[i]), idx[::-1])
+
+    mds.close ()
+    for ds in outs:
+        ds.close ()
+
+    return niters, peaks
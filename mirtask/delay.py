@@ -0,0 +1,418 @@
+'''mirtask.delay - delay and fringe-rate transforms of UV data'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import numpy as N
+from mirtask import util
+from mirtask._helpers import fftSize
+
+__all__ = ['WINDOWS', 'windowFunction', 'DelaySpectra', 'delayTransform',
+           'snapshotDelays', 'DelayRateMaps', 'delayRateMaps',
+           'antennaDelays', 'delayTauTerms']
+
+
+# The most complex128 elements to transform at once when making
+# delay/fringe-rate maps.
+
+_MAXBLOCK = 1 << 24
+
+WINDOWS = ('none', 'hann', 'hamming', 'blackman', 'blackmanharris')
+
+
+def windowFunction (name, n):
+    """Compute a tapering function.
+
+:arg str name: the name of the window; one of :data:`WINDOWS`
+:arg int n: the number of samples
+:rtype: double ndarray
+:returns: the *n*-element window
+"""
+    x = 2 * N.pi * N.arange (n) / max (n - 1, 1)
+
+    if name == 'none':
+        return N.ones (n)
+    if name == 'hann':
+        return 0.5 - 0.5 * N.cos (x)
+    if name == 'hamming':
+        return 0.54 - 0.46 * N.cos (x)
+    if name == 'blackman':
+        return 0.42 - 0.5 * N.cos (x) + 0.08 * N.cos (2 * x)
+    if name == 'blackmanharris':
+        return (0.35875 - 0.48829 * N.cos (x) + 0.14128 * N.cos (2 * x) -
+                0.01168 * N.cos (3 * x))
+
+    raise ValueError ('unknown window "%s"; choices are %s' %
+                      (name, ', '.join (WINDOWS)))
+
+
+def _regularStep (x, what):
+    """Check that @x is evenly spaced, to within a small fraction of a
+step, and return the step."""
+
+    if x.size < 2:
+        return 1.
+    step = (x[-1] - x[0]) / (x.size - 1)
+    if step == 0 or N.abs (N.diff (x) - step).max () > 1e-3 * abs (step):
+        raise ValueError ('the %s must be evenly spaced' % what)
+    return step
+
+
+def _transform (data, axis, step, oversample):
+    """Pad and transform @data along @axis. Returns the shifted axis of
+the transform and the unnormalized, shifted transform."""
+
+    n = data.shape[axis]
+    nfft = fftSize (int (oversample * n))
+    shape = list (data.shape)
+    shape[axis] = nfft
+
+    buf = N.zeros (shape, dtype=N.complex128)
+    idx = [slice (None)] * data.ndim
+    idx[axis] = slice (0, n)
+    buf[tuple (idx)] = data
+
+    util.fftInPlace (buf, axes=axis)
+    return (N.fft.fftshift (N.fft.fftfreq (nfft, step)),
+            N.fft.fftshift (buf, axes=axis))
+
+
+class DelaySpectra (object):
+    """:synopsis: delay spectra of a set of visibility spectra
+
+Attributes:
+
+* **delays** -- a *ndelay*-element double array of the delays, in
+  nanoseconds, in increasing order.
+* **spectra** -- a complex128 array of the delay spectra, with the
+  delay axis last; the other axes follow those of the input.
+* **weight** -- a double array of the sums of the tapering weights of
+  the unflagged channels of each spectrum; zero where all of the
+  channels were flagged.
+
+A :class:`DelaySpectra` made by :func:`snapshotDelays` also has the
+attributes **time**, **ant1**, **ant2**, and **pols** of its snapshot.
+"""
+
+    def peak (self):
+        """Find the peak of each delay spectrum.
+
+:rtype: ``(delay, amp)``
+:returns: double arrays of the delays, in nanoseconds, and amplitudes
+  of the peaks, of the shape of **weight**
+
+The peaks are refined by fitting a parabola through the three
+samples around the maximum. Where a spectrum is entirely flagged both
+are zero.
+"""
+        return _peak (N.abs (self.spectra), self.delays, self.weight)
+
+
+def _peak (amp, axis, weight):
+    n = amp.shape[-1]
+    flat = amp.reshape ((-1, n))
+    i = flat.argmax (axis=1)
+    r = N.arange (flat.shape[0])
+    y0 = flat[r,N.maximum (i - 1, 0)]
+    y1 = flat[r,i]
+    y2 = flat[r,N.minimum (i + 1, n - 1)]
+
+    denom = y0 - 2 * y1 + y2
+    ok = (i > 0) & (i < n - 1) & (denom < 0)
+    frac = N.zeros (flat.shape[0])
+    frac[ok] = 0.5 * (y0[ok] - y2[ok]) / denom[ok]
+
+    step = axis[1] - axis[0] if n > 1 else 0.
+    pos = axis[i] + frac * step
+    val = y1 - 0.25 * (y0 - y2) * frac
+
+    bad = (weight <= 0).reshape (-1)
+    pos[bad] = 0
+    val[bad] = 0
+    return pos.reshape (amp.shape[:-1]), val.reshape (amp.shape[:-1])
+
+
+def delayTransform (data, flags, freqs, window='blackmanharris',
+                    oversample=4):
+    """Compute the delay spectra of visibility spectra.
+
+:arg data: the visibilities, with the channel axis last
+:type data: complex array-like
+:arg flags: the flags, nonzero for good data, of the same shape
+:type flags: int or bool array-like
+:arg freqs: the sky frequencies of the channels, in GHz; must be
+  evenly spaced
+:type freqs: double array-like
+:arg str window: the tapering function to apply across the band; one
+  of :data:`WINDOWS`
+:arg float oversample: the factor by which to pad the spectra before
+  transforming them, so as to sample the delay spectra finely; the
+  padded length is rounded up to a power of two
+:rtype: :class:`DelaySpectra`
+:returns: the delay spectra
+
+The spectra are multiplied by the taper and by zero where flagged, so
+flagged channels don't contribute, and each delay spectrum is divided
+by the sum of the weights of its unflagged channels, so that a point
+source at the phase center with unit amplitude comes out with a peak
+of unit amplitude at zero delay, however the flagging falls. The
+transforms are done by :func:`mirtask.util.fftInPlace`, which caches
+its transform setup from call to call and shares out the spectra
+between threads.
+"""
+    data = N.asarray (data)
+    freqs = N.asarray (freqs, dtype=N.double)
+    flags = N.asarray (flags)
+
+    if data.shape[-1] != freqs.size or flags.shape != data.shape:
+        raise ValueError ('data, flags, and freqs must agree in their '
+                          'number of channels')
+
+    df = _regularStep (freqs, 'channel frequencies')
+    if df < 0:
+        data = data[...,::-1]
+        flags = flags[...,::-1]
+        df = -df
+
+    wt = windowFunction (window, freqs.size) * (flags != 0)
+    ds = DelaySpectra ()
+    ds.delays, ds.spectra = _transform (data * wt, -1, df, oversample)
+    ds.weight = wt.sum (axis=-1)
+    ds.spectra /= N.where (ds.weight > 0, ds.weight, 1)[...,N.newaxis]
+    return ds
+
+
+def snapshotDelays (snapshots, **kwargs):
+    """Compute delay spectra for a stream of snapshots.
+
+:arg snapshots: the snapshots
+:type snapshots: iterable of :class:`mirtask.uvdat.VisSnapshot`, or
+  of ``(handle, snapshot)`` tuples as yielded by
+  :func:`mirtask.uvdat.readSnapshots`
+:arg kwargs: extra arguments for :func:`delayTransform`
+:rtype: generator of :class:`DelaySpectra`
+:returns: one set of delay spectra for each snapshot, with the shape
+  (*nbl*, *npol*, *ndelay*), and the extra attributes **time**,
+  **ant1**, **ant2**, and **pols** copied from the snapshot
+"""
+    for snap in snapshots:
+        if isinstance (snap, tuple):
+            snap = snap[1]
+
+        ds = delayTransform (snap.data, snap.flags, snap.freqs, **kwargs)
+        ds.time = snap.time
+        ds.ant1 = snap.ant1.copy ()
+        ds.ant2 = snap.ant2.copy ()
+        ds.pols = snap.pols.copy ()
+        yield ds
+
+
+class DelayRateMaps (object):
+    """:synopsis: delay/fringe-rate maps of a set of waterfalls
+
+Attributes:
+
+* **delays** -- a *ndelay*-element double array of the delays, in
+  nanoseconds, in increasing order.
+* **rates** -- a *nrate*-element double array of the fringe rates, in
+  Hz, in increasing order.
+* **maps** -- a (*nwf*, *nrate*, *ndelay*) float32 array of the
+  amplitudes of the two-dimensional transforms of the waterfalls.
+* **weight** -- a *nwf*-element double array of the sums of the
+  tapering weights of the unflagged samples of each waterfall.
+* **baseline**, **ant1**, **ant2**, **pol** -- as in
+  :class:`mirtask.waterfall.WaterfallSet`.
+"""
+
+    def peak (self):
+        """Find the peak of each map.
+
+:rtype: ``(delay, rate, amp)``
+:returns: *nwf*-element double arrays of the delays, in nanoseconds,
+  fringe rates, in Hz, and amplitudes of the map peaks
+
+The peaks are refined by fitting parabolas through the samples on
+either side of the maximum along each axis. Where a waterfall is
+entirely flagged all three are zero.
+"""
+        nwf, nrate, ndelay = self.maps.shape
+        i = self.maps.reshape ((nwf, -1)).argmax (axis=1)
+        w = N.arange (nwf)
+
+        rows = self.maps[w,i // ndelay].astype (N.double)
+        delay, amp = _peak (rows, self.delays, self.weight)
+        cols = self.maps[w,:,i % ndelay].astype (N.double)
+        rate, junk = _peak (cols, self.rates, self.weight)
+        return delay, rate, amp
+
+
+def delayRateMaps (wf, window='blackmanharris', timeWindow='hann',
+                   oversample=2, timeOversample=1):
+    """Compute delay/fringe-rate maps of waterfalls.
+
+:arg wf: the waterfalls
+:type wf: :class:`mirtask.waterfall.WaterfallSet`
+:arg str window: the tapering function to apply across the band
+:arg str timeWindow: the tapering function to apply along time
+:arg float oversample: the padding factor along frequency, as in
+  :func:`delayTransform`
+:arg float timeOversample: the padding factor along time
+:rtype: :class:`DelayRateMaps`
+:returns: the maps
+
+Each waterfall is transformed along frequency to delay and along time
+to fringe rate, with flagged samples given zero weight. The timestamps
+of the waterfalls are put onto a regular grid whose step is the
+smallest interval between them, so gaps in the data are just treated
+as flagged; the timestamps must all fall on that grid. The waterfalls
+are transformed a block at a time, to limit the working memory.
+"""
+    freqs = N.asarray (wf.freqs, dtype=N.double)
+    df = _regularStep (freqs, 'channel frequencies')
+    chans = slice (None)
+    if df < 0:
+        chans = slice (None, None, -1)
+        df = -df
+
+    secs = (wf.time - wf.time[0]) * 86400
+    if secs.size > 1:
+        dt = N.diff (secs).min ()
+        rows = N.round (secs / dt).astype (N.int)
+        if N.abs (rows * dt - secs).max () > 1e-3 * dt:
+            raise ValueError ('the waterfall timestamps don\'t fall on a '
+                              'regular grid')
+    else:
+        dt = 1.
+        rows = N.zeros (secs.size, dtype=N.int)
+    ntgrid = rows[-1] + 1 if rows.size else 0
+
+    wc = windowFunction (window, freqs.size)
+    wt = windowFunction (timeWindow, ntgrid)[:,N.newaxis]
+    nfft = fftSize (int (oversample * freqs.size))
+    ntfft = fftSize (int (timeOversample * ntgrid))
+    per = max (_MAXBLOCK // max (nfft * ntfft, 1), 1)
+
+    rm = DelayRateMaps ()
+    rm.maps = N.empty ((wf.nwf, ntfft, nfft), dtype=N.float32)
+    rm.weight = N.empty (wf.nwf)
+    rm.baseline = wf.baseline
+    rm.ant1, rm.ant2, rm.pol = wf.ant1, wf.ant2, wf.pol
+
+    for w0 in xrange (0, wf.nwf, per):
+        w1 = min (w0 + per, wf.nwf)
+        data = N.zeros ((w1 - w0, ntgrid, freqs.size), dtype=N.complex64)
+        good = N.zeros (data.shape, dtype=N.bool_)
+        data[:,rows] = wf.data[w0:w1][...,chans]
+        good[:,rows] = wf.flags[w0:w1][...,chans] != 0
+        w = good * wc * wt
+        wsum = w.sum (axis=2).sum (axis=1)
+
+        rm.delays, spec = _transform (data * w, -1, df, oversample)
+        rm.rates, spec = _transform (spec, 1, dt, timeOversample)
+        spec /= N.where (wsum > 0, wsum, 1)[:,N.newaxis,N.newaxis]
+        rm.maps[w0:w1] = N.abs (spec)
+        rm.weight[w0:w1] = wsum
+
+    if wf.nwf == 0:
+        rm.delays = N.fft.fftshift (N.fft.fftfreq (nfft, df))
+        rm.rates = N.fft.fftshift (N.fft.fftfreq (ntfft, dt))
+
+    return rm
+
+
+def antennaDelays (ant1, ant2, delays, weights=None, refant=None):
+    """Solve for antenna delays from baseline delays.
+
+:arg ant1: the first antenna numbers of the baselines
+:type ant1: int array-like
+:arg ant2: the second antenna numbers
+:type ant2: int array-like
+:arg delays: the delays measured on the baselines, in nanoseconds, as
+  returned by :meth:`DelaySpectra.peak`
+:type delays: double array-like
+:arg weights: the weights of the measurements, such as the peak
+  amplitudes; baselines with zero weight are ignored. Defaults to
+  equal weights.
+:type weights: double array-like or :const:`None`
+:arg refant: the antenna whose delay is defined to be zero, or
+  :const:`None` to make the delays average to zero
+:type refant: int or :const:`None`
+:rtype: ``(ants, antdelays)``
+:returns: an int array of the antenna numbers that appear in the
+  usable baselines, and a double array of their delays in nanoseconds
+
+The baseline delays are modeled as the difference of the antenna
+delays, *tau1* - *tau2*, and fit by weighted least squares. The
+results make good starting guesses for a gain solution with delay
+terms; see :func:`delayTauTerms`.
+"""
+    ant1 = N.asarray (ant1, dtype=N.int).ravel ()
+    ant2 = N.asarray (ant2, dtype=N.int).ravel ()
+    delays = N.asarray (delays, dtype=N.double).ravel ()
+    if weights is None:
+        weights = N.ones (delays.size)
+    else:
+        weights = N.asarray (weights, dtype=N.double).ravel ()
+
+    use = (weights > 0) & (ant1 != ant2)
+    ant1, ant2, delays, weights = ant1[use], ant2[use], delays[use], \
+        weights[use]
+
+    ants, idx = N.unique (N.concatenate ((ant1, ant2)), return_inverse=True)
+    nant, nbl = ants.size, ant1.size
+    if nant == 0:
+        return ants, N.zeros (0)
+
+    sw = N.sqrt (weights)
+    a = N.zeros ((nbl + 1, nant))
+    a[N.arange (nbl),idx[:nbl]] = sw
+    a[N.arange (nbl),idx[nbl:]] = -sw
+    b = N.concatenate ((delays * sw, [0.]))
+
+    # The last row pins down the arbitrary overall offset.
+
+    if refant is None:
+        a[nbl] = 1.
+    else:
+        w = N.nonzero (ants == refant)[0]
+        if w.size == 0:
+            raise ValueError ('reference antenna %d has no usable '
+                              'baselines' % refant)
+        a[nbl,w[0]] = 1.
+
+    return ants, N.linalg.lstsq (a, b, rcond=-1)[0]
+
+
+def delayTauTerms (antdelays):
+    """Convert antenna delays into MIRIAD gain delay terms.
+
+:arg antdelays: the antenna delays, in nanoseconds, as from
+  :func:`antennaDelays`
+:type antdelays: double array-like
+:rtype: complex ndarray
+:returns: the values of the delay terms that remove the delays
+
+A gains table with *ntau* = 1 carries a complex delay term for each
+antenna, whose imaginary part is the slope of the phase correction
+against frequency, in radians per GHz (see
+:func:`mirtask.emucal.applyGain`). The corrections are applied as *g1*
+times the conjugate of *g2*, so an antenna delay of *tau*, which puts a
+phase of 2 pi *nu* *tau* into the data, is taken out by a slope of -2
+pi *tau*. The real parts, the spectral indices of the gain amplitudes,
+are zero.
+"""
+    return -2j * N.pi * N.asarray (antdelays, dtype=N.double)
@@ -0,0 +1,549 @@
+'''mirtask.imaging - in-process imaging of UV data'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import numpy as N
+from mirtask import _kernels, util
+from mirtask._helpers import pair
+
+__all__ = ['Gridder', 'Weighter', 'makeDirty']
+
+
+# The MIRIAD gridding parameters; see util.sphGridFunc.
+
+GCF_NSAMP = 2047
+GCF_WIDTH = 6
+GCF_ALPHA = 1.
+
+
+def _uvArrays (u, v, freqs):
+    u = N.ascontiguousarray (u, dtype=N.double).ravel ()
+    v = N.ascontiguousarray (v, dtype=N.double).ravel ()
+    freqs = N.ascontiguousarray (freqs, dtype=N.double).ravel ()
+
+    if v.size != u.size:
+        raise ValueError ('inconsistent visibility array shapes')
+    return u, v, freqs
+
+
+def _weightArray (weights, shape):
+    weights = N.asarray (weights, dtype=N.float32)
+    if weights.ndim == 1 and weights.size == shape[0]:
+        weights = weights[:,N.newaxis]
+    return N.ascontiguousarray (weights * N.ones (shape, dtype=N.float32))
+
+
+def _batchWeights (batch, weights):
+    if weights is None:
+        return batch.weights ()
+
+    weights = N.asarray (weights, dtype=N.float32)
+    if weights.ndim == 1 and weights.size == batch.count:
+        weights = weights[:,N.newaxis]
+    return N.where (batch.flags != 0, weights, 0).astype (N.float32)
+
+
+class Gridder (object):
+    """:synopsis: convolutionally grid visibilities onto a regular uv grid
+
+:arg imsize: the size of the image that the grid will be transformed
+  into, in pixels; either one number, or a pair (*nx*, *ny*).
+:arg cell: the angular size of the image pixels, in radians; either
+  one number, or a pair (*dx*, *dy*).
+:arg bool hermitian: whether to also grid the complex conjugate of
+  each visibility at (-*u*, -*v*), so that the grid is Hermitian and
+  transforms to a real image. Defaults to :const:`True`.
+:arg bool gridWeights: whether to also grid the visibility weights
+  into :attr:`wgrid`, for making a beam. Defaults to :const:`True`.
+:arg int width: the width of the gridding function, in cells; see
+  :func:`mirtask.util.sphGridFunc`
+:arg float alpha: the spheroidal parameter of the gridding function
+:arg int nsamp: the number of samples in the tabulated gridding function
+
+The grid is a (*ny*, *nx*) complex128 array, :attr:`grid`, with the
+origin of the uv plane at cell (*ny*//2, *nx*//2). The cell size in
+*u* is ``1 / (nx * dx)`` wavelengths, and likewise for *v*. The
+gridding function defaults to the one used by MIRIAD's INVERT.
+
+Visibilities are added with :meth:`add` or :meth:`addBatch`. The
+gridding is done in compiled code, with the grid split into bands of
+rows that are handled by separate threads (see
+:func:`mirtask.util.setNumThreads`). Visibilities whose gridding
+footprint would fall off the edge of the grid are dropped and counted
+in :attr:`ndropped`.
+
+Attributes:
+
+* **grid** -- the gridded, weighted visibilities
+* **wgrid** -- the gridded weights, a (*ny*, *nx*) double array; or
+  :const:`None` if *gridWeights* is :const:`False`
+* **sumwt** -- the sum of the weights of the gridded visibilities
+  (not counting their Hermitian conjugates)
+* **ndropped** -- the number of visibility samples that have been
+  dropped for lying off the grid
+"""
+
+    def __init__ (self, imsize, cell, hermitian=True, gridWeights=True,
+                  width=GCF_WIDTH, alpha=GCF_ALPHA, nsamp=GCF_NSAMP):
+        nx, ny = pair (imsize, 'imsize')
+        dx, dy = pair (cell, 'cell')
+
+        self.nx, self.ny = int (nx), int (ny)
+        if self.nx < 1 or self.ny < 1:
+            raise ValueError ('image dimensions must be positive')
+        if dx <= 0 or dy <= 0:
+            raise ValueError ('cell sizes must be positive')
+
+        self.dx, self.dy = float (dx), float (dy)
+        self.du = 1. / (self.nx * dx)
+        self.dv = 1. / (self.ny * dy)
+        self.hermitian = bool (hermitian)
+        self.width = int (width)
+        self.alpha = float (alpha)
+        self.gcf = N.ascontiguousarray (util.sphGridFunc (nsamp, width, alpha),
+                                        dtype=N.double)
+
+        self.grid = N.zeros ((self.ny, self.nx), dtype=N.complex128)
+        if gridWeights:
+            self.wgrid = N.zeros ((self.ny, self.nx), dtype=N.double)
+        else:
+            self.wgrid = None
+
+        self.sumwt = 0.
+        self.ndropped = 0
+
+
+    def reset (self):
+        """Zero out the grids so that the :class:`Gridder` can be reused.
+
+:returns: *self*
+"""
+        self.grid.fill (0)
+        if self.wgrid is not None:
+            self.wgrid.fill (0)
+        self.sumwt = 0.
+        self.ndropped = 0
+        return self
+
+
+    def add (self, u, v, freqs, data, weights):
+        """Grid a set of visibilities.
+
+:arg u: the *u* coordinates of the records, in nanoseconds
+:type u: *nrec*-element array-like of double
+:arg v: the *v* coordinates of the records, in nanoseconds
+:type v: *nrec*-element array-like of double
+:arg freqs: the sky frequencies of the channels, in GHz
+:type freqs: *nchan*-element array-like of double
+:arg data: the visibilities
+:type data: (*nrec*, *nchan*) array-like of complex
+:arg weights: the visibility weights, with zero for flagged data;
+  broadcast to the shape of *data*
+:type weights: array-like of float
+:returns: *self*
+"""
+        u, v, freqs = _uvArrays (u, v, freqs)
+        data = N.ascontiguousarray (data, dtype=N.complex64)
+
+        if data.shape != (u.size, freqs.size):
+            raise ValueError ('inconsistent visibility array shapes')
+
+        weights = _weightArray (weights, data.shape)
+
+        sumwt, ndropped = _kernels.grid_vis (u, v, freqs, data, weights,
+                                             self.gcf, self.width, self.du,
+                                             self.dv, int (self.hermitian),
+                                             self.grid, self.wgrid)
+        self.sumwt += sumwt
+        self.ndropped += ndropped
+        return self
+
+
+    def addBatch (self, batch, weights=None):
+        """Grid a batch of visibilities read by :mod:`mirtask.uvdat`.
+
+:arg batch: the visibilities
+:type batch: :class:`mirtask.uvdat.VisBatch`
+:arg weights: optional weights for the visibilities, broadcast to the
+  shape of *batch.data*. If :const:`None`, the default, the weights
+  computed by :meth:`mirtask.uvdat.VisBatch.weights` are used.
+  Otherwise the weights are combined with the flags of the batch.
+:returns: *self*
+
+The *u* and *v* coordinates of the batch must be in nanoseconds;
+i.e., the data must not have been read with the UVDAT *w* option.
+"""
+        return self.add (batch.uvw[:,0], batch.uvw[:,1], batch.freqs,
+                         batch.data, _batchWeights (batch, weights))
+
+
+    def _transform (self, grid):
+        # The grid origin is at the center, and so is the image origin.
+        # Image x increases toward lower RA, so the u axis is transformed
+        # with the opposite sign to the v axis.
+        img = N.ascontiguousarray (N.fft.ifftshift (grid), dtype=N.complex128)
+        util.fftInPlace (img, -1, -1)
+        util.fftInPlace (img, -2, 1)
+        return N.fft.fftshift (img).real
+
+
+    def _correction (self):
+        xc = util.sphCorrFunc (self.nx, self.width, self.alpha)
+        yc = util.sphCorrFunc (self.ny, self.width, self.alpha)
+        xc = N.asarray (xc, dtype=N.double) / xc[self.nx // 2]
+        yc = N.asarray (yc, dtype=N.double) / yc[self.ny // 2]
+        return N.outer (yc, xc)
+
+
+    def makeImages (self):
+        """Transform the grids into a dirty map and beam.
+
+:rtype: tuple of two (*ny*, *nx*) double ndarrays
+:returns: the dirty map and the dirty beam
+
+The grids are Fourier transformed and divided by the gridding
+correction function (see :func:`mirtask.util.sphCorrFunc`), and both
+images are scaled so that the peak of the beam is one; the map is
+therefore in units of Jy per beam. Pixel (*ny*//2, *nx*//2) is the
+phase center. Row 0 is at the bottom of the image (lowest declination)
+and column 0 is at its left (highest right ascension), as with
+:meth:`mirtask.XYDataSet.readPlane`.
+
+The :class:`Gridder` must have been created with *gridWeights* set.
+The grids are left untouched, so more data may be added afterwards.
+"""
+        if self.wgrid is None:
+            raise ValueError ('cannot make a beam without gridded weights')
+
+        corr = self._correction ()
+        beam = self._transform (self.wgrid) / corr
+        peak = beam[self.ny // 2, self.nx // 2]
+
+        if not peak > 0:
+            raise ValueError ('no data have been gridded')
+
+        beam /= peak
+        dirty = self._transform (self.grid) / corr
+        dirty /= peak
+        return dirty, beam
+
+
+class Weighter (object):
+    """:synopsis: compute uniform or robust imaging weights
+
+:arg imsize: the size of the image that will be made, in pixels;
+  either one number, or a pair (*nx*, *ny*).
+:arg cell: the angular size of the image pixels, in radians; either
+  one number, or a pair (*dx*, *dy*).
+:arg str scheme: the weighting scheme: "natural", "uniform", or
+  "robust". Defaults to "natural".
+:arg float robust: the Briggs robustness parameter, used by the
+  "robust" scheme. Defaults to 0. Large positive values approach
+  natural weighting and large negative ones uniform weighting.
+:arg bool hermitian: whether each visibility also counts at (-*u*,
+  -*v*), as it does when gridded by a Hermitian :class:`Gridder`.
+  Defaults to :const:`True`.
+
+Uniform and robust weighting depend on the total weight in each cell
+of the uv grid, so they take two passes over the data. First, every
+visibility is passed to :meth:`add` or :meth:`addBatch` to build up
+the density grid. Then, the imaging weights are computed with
+:meth:`weigh` or :meth:`weighBatch` and handed to the :class:`Gridder`.
+With natural weighting, the first pass may be skipped and the weights
+are passed through unchanged.
+
+The density grid is (*ny*, *nx*) with the same cells as a
+:class:`Gridder` of the same *imsize* and *cell*. The histogramming
+and weighting are done in compiled code spread over several threads
+(see :func:`mirtask.util.setNumThreads`). Visibilities that fall off
+the density grid get zero weight.
+
+Attributes:
+
+* **density** -- the density grid: the sum of the input weights that
+  fall in each cell; a (*ny*, *nx*) double array, or :const:`None`
+  for natural weighting
+* **sumwt** -- the sum of the input weights added to the grid
+"""
+
+    _modes = {'uniform': 0, 'robust': 1}
+
+    def __init__ (self, imsize, cell, scheme='natural', robust=0.,
+                  hermitian=True):
+        nx, ny = pair (imsize, 'imsize')
+        dx, dy = pair (cell, 'cell')
+
+        if scheme != 'natural' and scheme not in self._modes:
+            raise ValueError ('unknown weighting scheme "%s"' % scheme)
+        if dx <= 0 or dy <= 0:
+            raise ValueError ('cell sizes must be positive')
+
+        self.nx, self.ny = int (nx), int (ny)
+        self.du = 1. / (self.nx * dx)
+        self.dv = 1. / (self.ny * dy)
+        self.scheme = scheme
+        self.robust = float (robust)
+        self.hermitian = bool (hermitian)
+        self.sumwt = 0.
+        self._f2cache = None
+
+        if scheme == 'natural':
+            self.density = None
+        else:
+            self.density = N.zeros ((self.ny, self.nx), dtype=N.double)
+
+
+    def add (self, u, v, freqs, weights):
+        """Add visibilities to the density grid.
+
+:arg u: the *u* coordinates of the records, in nanoseconds
+:type u: *nrec*-element array-like of double
+:arg v: the *v* coordinates of the records, in nanoseconds
+:type v: *nrec*-element array-like of double
+:arg freqs: the sky frequencies of the channels, in GHz
+:type freqs: *nchan*-element array-like of double
+:arg weights: the visibility weights, with zero for flagged data;
+  broadcast to (*nrec*, *nchan*)
+:type weights: array-like of float
+:returns: *self*
+"""
+        if self.density is None:
+            return self
+
+        u, v, freqs = _uvArrays (u, v, freqs)
+        weights = _weightArray (weights, (u.size, freqs.size))
+        _kernels.density_grid (u, v, freqs, weights, self.du, self.dv,
+                               int (self.hermitian), self.density)
+        self.sumwt += weights.sum (dtype=N.double)
+        self._f2cache = None
+        return self
+
+
+    def addBatch (self, batch, weights=None):
+        """Add a batch of visibilities to the density grid.
+
+:arg batch: the visibilities
+:type batch: :class:`mirtask.uvdat.VisBatch`
+:arg weights: optional weights for the visibilities, treated as in
+  :meth:`Gridder.addBatch`
+:returns: *self*
+"""
+        return self.add (batch.uvw[:,0], batch.uvw[:,1], batch.freqs,
+                         _batchWeights (batch, weights))
+
+
+    def _f2 (self):
+        # Briggs' normalization, with the sums over the full, mirrored
+        # grid: f^2 = (5 * 10^-R)^2 / (sum_k W_k^2 / sum_k W_k).
+        sumd = self.density.sum ()
+        if not sumd > 0:
+            return 0.
+        return (5 * 10**-self.robust)**2 / ((self.density**2).sum () / sumd)
+
+
+    def weigh (self, u, v, freqs, weights):
+        """Compute imaging weights for visibilities.
+
+:arg u: the *u* coordinates of the records, in nanoseconds
+:type u: *nrec*-element array-like of double
+:arg v: the *v* coordinates of the records, in nanoseconds
+:type v: *nrec*-element array-like of double
+:arg freqs: the sky frequencies of the channels, in GHz
+:type freqs: *nchan*-element array-like of double
+:arg weights: the input visibility weights, with zero for flagged
+  data; broadcast to (*nrec*, *nchan*)
+:type weights: array-like of float
+:rtype: (*nrec*, *nchan*) float32 ndarray
+:returns: the imaging weights
+
+For uniform weighting, the imaging weight is the input weight divided
+by the total weight in its cell. For robust weighting, it is ``w / (1
++ W * f**2)``, where *W* is the total weight in the cell and *f* is
+set by the robustness parameter as in Briggs' thesis.
+"""
+        u, v, freqs = _uvArrays (u, v, freqs)
+        weights = _weightArray (weights, (u.size, freqs.size))
+
+        if self.density is None:
+            return weights
+
+        out = N.empty_like (weights)
+
+        if self.scheme != 'robust':
+            f2 = 0.
+        else:
+            if self._f2cache is None:
+                self._f2cache = self._f2 ()
+            f2 = self._f2cache
+
+        _kernels.density_weights (u, v, freqs, weights, self.du, self.dv,
+                                  self.density, self._modes[self.scheme],
+                                  f2, out)
+        return out
+
+
+    def weighBatch (self, batch, weights=None):
+        """Compute imaging weights for a batch of visibilities.
+
+:arg batch: the visibilities
+:type batch: :class:`mirtask.uvdat.VisBatch`
+:arg weights: optional weights for the visibilities, treated as in
+  :meth:`Gridder.addBatch`
+:rtype: (*nrec*, *nchan*) float32 ndarray
+:returns: the imaging weights, as computed by :meth:`weigh`
+"""
+        return self.weigh (batch.uvw[:,0], batch.uvw[:,1], batch.freqs,
+                           _batchWeights (batch, weights))
+
+
+def _writeImage (path, data, gridder, crval, freq, bunit):
+    from mirtask import XYDataSet
+
+    ds = XYDataSet (path, 'c', [gridder.nx, gridder.ny, 1])
+    ds.writePlane (N.ma.asarray (data.astype (N.float32)))
+
+    ds.setScalarItem ('ctype1', str, 'RA---SIN')
+    ds.setScalarItem ('ctype2', str, 'DEC--SIN')
+    ds.setScalarItem ('ctype3', str, 'FREQ')
+    ds.setScalarItem ('crval1', N.double, crval[0])
+    ds.setScalarItem ('crval2', N.double, crval[1])
+    ds.setScalarItem ('crval3', N.double, freq)
+    ds.setScalarItem ('cdelt1', N.double, -gridder.dx)
+    ds.setScalarItem ('cdelt2', N.double, gridder.dy)
+    ds.setScalarItem ('cdelt3', N.double, 0)
+    ds.setScalarItem ('crpix1', N.double, gridder.nx // 2 + 1)
+    ds.setScalarItem ('crpix2', N.double, gridder.ny // 2 + 1)
+    ds.setScalarItem ('crpix3', N.double, 1)
+
+    if bunit is not None:
+        ds.setScalarItem ('bunit', str, bunit)
+
+    ds.close ()
+
+
+def makeDirty (vis, imsize, cell, map, beam=None, weighting='natural',
+               robust=0., select=None, line=None, stokes='i', ref=None,
+               nopass=False, nocal=False, nopol=False, batchSize=1024,
+               maxchan=4096, maxCache=512*1024*1024):
+    """Make a dirty map and beam from UV data, without running INVERT.
+
+:arg vis: the input UV dataset or datasets
+:type vis: path-like or list of path-like
+:arg imsize: the size of the images in pixels; either one number,
+  or a pair (*nx*, *ny*)
+:arg cell: the pixel size in radians; either one number, or a
+  pair (*dx*, *dy*)
+:arg map: the path of the dirty map to create, or :const:`None`
+:arg beam: the path of the dirty beam to create, or :const:`None`
+  (the default)
+:arg str weighting: the visibility weighting scheme: "natural" (the
+  default), "uniform", or "robust"; see :class:`Weighter`
+:arg float robust: the Briggs robustness parameter for robust
+  weighting; defaults to 0
+:arg select: the UV data selection, or :const:`None`
+:arg line: the UVDAT linetype, or :const:`None`
+:arg stokes: the polarization to image; defaults to "i"
+:arg ref: the reference line, or :const:`None`
+:arg bool nopass: whether to skip bandpass calibration
+:arg bool nocal: whether to skip gain calibration
+:arg bool nopol: whether to skip polarization calibration
+:arg int batchSize: the number of records to read and grid at once
+:arg int maxchan: the maximum number of channels in a record
+:arg int maxCache: the most memory, in bytes, to spend on keeping the
+  data between the two passes of uniform or robust weighting; defaults
+  to 512 MiB
+:rtype: :class:`Gridder`
+:returns: the :class:`Gridder` holding the gridded data; its
+  :meth:`Gridder.makeImages` method will recompute the images
+
+The data are read through UVDAT in batches of *batchSize* records
+(see :func:`mirtask.uvdat.setupAndReadBatches`), so the memory use
+does not depend on the size of the input. Uniform and robust weighting
+need two passes over the data, one to build the weight density and
+one to grid. The batches read in the first pass are kept for the
+second if they fit in *maxCache* bytes; otherwise the data are read
+through UVDAT a second time, doubling the cost of reading (and
+calibrating) them. All channels are gridded
+into a single plane (multi-frequency synthesis). The images are
+written as MIRIAD datasets with a SIN projection about the pointing
+center of the first input dataset; the frequency axis gives the
+weighted mean sky frequency of the data.
+
+The gridding, the FFTs, and the gridding correction follow INVERT's
+defaults, and the work is spread over threads (see
+:func:`mirtask.util.setNumThreads`). Unlike INVERT, the data are not
+rotated to a common phase center, so all input datasets should share
+one.
+"""
+    from mirtask import uvdat
+
+    def batches ():
+        return uvdat.setupAndReadBatches (vis, 'x', nopass, nocal, nopol,
+                                          select, line, stokes, ref,
+                                          batchSize, maxchan)
+
+    w = Weighter (imsize, cell, weighting, robust)
+    g = Gridder (imsize, cell)
+    crval = None
+    sumfw = sumw = 0.
+    source = None
+
+    if w.density is not None:
+        cache = []
+        cached = 0
+
+        for inp, batch in batches ():
+            if crval is None:
+                crval = (inp.getVarDouble ('ra'), inp.getVarDouble ('dec'))
+
+            w.addBatch (batch)
+
+            if cache is not None:
+                cached += batch.data.nbytes + batch.flags.nbytes
+                if cached > maxCache:
+                    cache = None
+                else:
+                    cache.append (batch)
+
+        if cache is not None:
+            source = [(None, batch) for batch in cache]
+
+    if source is None:
+        source = batches ()
+
+    for inp, batch in source:
+        if crval is None:
+            crval = (inp.getVarDouble ('ra'), inp.getVarDouble ('dec'))
+
+        wt = w.weighBatch (batch)
+        g.addBatch (batch, wt)
+        chanwt = wt.sum (axis=0)
+        sumfw += (chanwt * batch.freqs).sum ()
+        sumw += chanwt.sum ()
+
+    if crval is None:
+        raise ValueError ('no UV data were read')
+
+    dirty, psf = g.makeImages ()
+
+    if map is not None:
+        _writeImage (str (map), dirty, g, crval, sumfw / sumw, 'JY/BEAM')
+    if beam is not None:
+        _writeImage (str (beam), psf, g, crval, sumfw / sumw, None)
+
+    return g
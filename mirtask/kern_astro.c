@@ -0,0 +1,344 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Time and coordinate conversions over whole arrays. These follow the
+ * MIRIAD routines wrapped by the scalar functions in mirtask/util.py
+ * (julday, jul2ut, jullst, precess, azel) so that the two give the same
+ * answers. */
+
+#include "kernels.h"
+
+#include <math.h>
+#include <stdio.h> /* snprintf */
+#include <string.h>
+
+#define GRAIN 4096
+#define FMT_BUFSZ 64
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define TWOPI (2 * M_PI)
+#define DEG2RAD (M_PI / 180)
+
+static const char *month_names[] = {
+    "JAN", "FEB", "MAR", "APR", "MAY", "JUN",
+    "JUL", "AUG", "SEP", "OCT", "NOV", "DEC"
+};
+
+
+/* Convert an integral Julian day number (that of the civil day, i.e.
+ * floor (jd + 0.5)) into a Gregorian calendar date. This is the same
+ * algorithm as used by julday, which switches to the Julian calendar
+ * before 1582 Oct 15. */
+
+static void
+jdn_to_calendar (double z, int *year, int *month, int *day)
+{
+    double a, b, c, d, e, alpha;
+
+    if (z < 2299161)
+	a = z;
+    else {
+	alpha = floor ((z - 1867216.25) / 36524.25);
+	a = z + 1 + alpha - floor (0.25 * alpha);
+    }
+
+    b = a + 1524;
+    c = floor ((b - 122.1) / 365.25);
+    d = floor (365.25 * c);
+    e = floor ((b - d) / 30.6001);
+
+    *day = (int) (b - d - floor (30.6001 * e));
+    *month = (int) (e < 14 ? e - 1 : e - 13);
+    *year = (int) (*month > 2 ? c - 4716 : c - 4715);
+}
+
+
+/* Format one date. @form is one of the jdToFull codes, or 'P' for the
+ * jdToPartial format. Returns nonzero if @form is unknown. */
+
+static int
+format_jd (double jd, char form, char *buf)
+{
+    double t, z, rem, hrs;
+    int year, month, day, hh, mm, ss;
+
+    switch (form) {
+    case 'H':
+    case 'T':
+	/* Round to tenths of a second before splitting, so that we
+	 * never print 60.0 seconds. */
+	t = floor ((jd + 0.5) * 864000 + 0.5);
+	z = floor (t / 864000);
+	rem = t - z * 864000;
+	jdn_to_calendar (z, &year, &month, &day);
+	hh = (int) (rem / 36000);
+	mm = (int) (fmod (rem, 36000) / 600);
+
+	if (form == 'H')
+	    snprintf (buf, FMT_BUFSZ, "%02d%s%02d:%02d:%02d:%04.1f",
+		      year % 100, month_names[month - 1], day, hh, mm,
+		      fmod (rem, 600) / 10);
+	else
+	    snprintf (buf, FMT_BUFSZ, "%04d-%02d-%02dT%02d:%02d:%04.1f",
+		      year, month, day, hh, mm, fmod (rem, 600) / 10);
+	return 0;
+    case 'D':
+	t = floor ((jd + 0.5) * 100 + 0.5);
+	z = floor (t / 100);
+	jdn_to_calendar (z, &year, &month, &day);
+	snprintf (buf, FMT_BUFSZ, "%02d%s%05.2f", year % 100,
+		  month_names[month - 1], day + (t - z * 100) / 100);
+	return 0;
+    case 'V':
+	jdn_to_calendar (floor (jd + 0.5), &year, &month, &day);
+	snprintf (buf, FMT_BUFSZ, "%02d-%s-%04d", day, month_names[month - 1],
+		  year);
+	return 0;
+    case 'F':
+	jdn_to_calendar (floor (jd + 0.5), &year, &month, &day);
+	snprintf (buf, FMT_BUFSZ, "%02d/%02d/%02d", day, month, year % 100);
+	return 0;
+    case 'P':
+	/* Same truncating arithmetic as jdToPartial. */
+	hrs = 24 * (jd - 0.5 - floor (jd - 0.5));
+	hh = (int) floor (hrs);
+	mm = (int) floor (60 * (hrs - hh));
+	ss = (int) (3600 * (hrs - hh - mm / 60.));
+	snprintf (buf, FMT_BUFSZ, "%02d:%02d:%02d", hh, mm, ss);
+	return 0;
+    }
+
+    return 1;
+}
+
+
+typedef struct {
+    const double *jd;
+    char form;
+    char *out;
+    npy_intp width;
+} jd_format_ctx;
+
+static void
+jd_format_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    jd_format_ctx *ctx = (jd_format_ctx *) vctx;
+    char buf[FMT_BUFSZ];
+    npy_intp i;
+
+    for (i = start; i < end; i++) {
+	format_jd (ctx->jd[i], ctx->form, buf);
+	strncpy (ctx->out + i * ctx->width, buf, ctx->width);
+    }
+}
+
+PyObject *
+py_jd_format (PyObject *self, PyObject *args)
+{
+    PyObject *jd, *out;
+    char *form, buf[FMT_BUFSZ];
+    jd_format_ctx ctx;
+    npy_intp n;
+
+    if (!PyArg_ParseTuple (args, "O!sO!", &PyArray_Type, &jd, &form,
+			   &PyArray_Type, &out))
+	return NULL;
+
+    KERN_CHECK (jd, NPY_DOUBLE, "jd");
+    KERN_CHECK_OUT (out, NPY_STRING, "out");
+
+    n = PyArray_SIZE (jd);
+    KERN_CHECK_SIZE (out, n, "out");
+
+    if (strlen (form) != 1 || format_jd (2451545., form[0], buf)) {
+	PyErr_Format (PyExc_ValueError, "unknown date format \"%s\"", form);
+	return NULL;
+    }
+
+    ctx.jd = PyArray_DATA (jd);
+    ctx.form = form[0];
+    ctx.out = PyArray_DATA (out);
+    ctx.width = PyArray_ITEMSIZE (out);
+
+    kern_parallel (n, GRAIN, jd_format_work, &ctx);
+    Py_RETURN_NONE;
+}
+
+
+/* The rest of the conversions are purely numerical. They take their
+ * inputs as up to four equal-sized arrays and produce one or two
+ * outputs. */
+
+typedef struct {
+    const double *in[4];
+    double *out[2];
+} coord_ctx;
+
+
+/* Local mean sidereal time, as in MIRIAD's jullst. */
+
+static void
+jd_to_lst_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    coord_ctx *ctx = (coord_ctx *) vctx;
+    const double *jday = ctx->in[0], *lng = ctx->in[1];
+    double *lst = ctx->out[0];
+    double ut, t, gmst;
+    npy_intp i;
+
+    for (i = start; i < end; i++) {
+	ut = jday[i] - 0.5 - floor (jday[i] - 0.5);
+	t = (jday[i] - ut - 2451545.) / 36525;
+	gmst = 24110.54841 + (8640184.812866 + (0.093104 - 6.2e-6 * t) * t) * t;
+	gmst = gmst / 86400 + ut * (1.002737909350795 +
+				    (5.9006e-11 - 5.9e-15 * t) * t);
+	gmst += lng[i] / TWOPI;
+	lst[i] = TWOPI * (gmst - floor (gmst));
+    }
+}
+
+
+/* Approximate precession, as in MIRIAD's precess: go from the first
+ * epoch to J2000, then from J2000 to the second epoch, using the
+ * formulae of the Explanatory Supplement (1993) pp. 105-106. */
+
+static void
+precess_m_n (double jday, double *m, double *n)
+{
+    double t = (jday - 2451545.) / 36525;
+
+    *m = DEG2RAD * (1.2812323 + (0.0003879 + 0.0000101 * t) * t) * t;
+    *n = DEG2RAD * (0.5567530 - (0.0001185 + 0.0000116 * t) * t) * t;
+}
+
+static void
+precess_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    coord_ctx *ctx = (coord_ctx *) vctx;
+    const double *jd1 = ctx->in[0], *ra1 = ctx->in[1], *dec1 = ctx->in[2];
+    const double *jd2 = ctx->in[3];
+    double m, n, r0, d0, r1, d1, rm, dm;
+    npy_intp i;
+
+    for (i = start; i < end; i++) {
+	r0 = ra1[i];
+	d0 = dec1[i];
+
+	precess_m_n (jd1[i], &m, &n);
+	rm = r0 - 0.5 * (m + n * sin (r0) * tan (d0));
+	dm = d0 - 0.5 * n * cos (rm);
+	r1 = r0 - m - n * sin (rm) * tan (dm);
+	d1 = d0 - n * cos (rm);
+
+	precess_m_n (jd2[i], &m, &n);
+	rm = r1 + 0.5 * (m + n * sin (r1) * tan (d1));
+	dm = d1 + 0.5 * n * cos (rm);
+	ctx->out[0][i] = r1 + m + n * sin (rm) * tan (dm);
+	ctx->out[1][i] = d1 + n * cos (rm);
+    }
+}
+
+
+/* Equatorial to horizon coordinates, as in MIRIAD's azel. */
+
+static void
+equ_to_horizon_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    coord_ctx *ctx = (coord_ctx *) vctx;
+    const double *ra = ctx->in[0], *dec = ctx->in[1], *lst = ctx->in[2];
+    const double *lat = ctx->in[3];
+    double ha, sind, cosd, sinl, cosl, cosha, az;
+    npy_intp i;
+
+    for (i = start; i < end; i++) {
+	ha = lst[i] - ra[i];
+	sind = sin (dec[i]);
+	cosd = cos (dec[i]);
+	sinl = sin (lat[i]);
+	cosl = cos (lat[i]);
+	cosha = cos (ha);
+
+	az = atan2 (-cosd * sin (ha), cosl * sind - sinl * cosd * cosha);
+	if (az < 0)
+	    az += TWOPI;
+
+	ctx->out[0][i] = az;
+	ctx->out[1][i] = asin (sinl * sind + cosl * cosd * cosha);
+    }
+}
+
+
+static PyObject *
+run_coord (PyObject *args, int nin, int nout, kern_work_func func)
+{
+    PyObject *arrays[6];
+    static char *names[] = { "in0", "in1", "in2", "in3" };
+    coord_ctx ctx;
+    npy_intp n;
+    int i;
+
+    if (!PyArg_ParseTuple (args, "O!O!|O!O!O!O!", &PyArray_Type, &arrays[0],
+			   &PyArray_Type, &arrays[1], &PyArray_Type, &arrays[2],
+			   &PyArray_Type, &arrays[3], &PyArray_Type, &arrays[4],
+			   &PyArray_Type, &arrays[5]))
+	return NULL;
+
+    if (PyTuple_GET_SIZE (args) != nin + nout) {
+	PyErr_Format (PyExc_TypeError, "expected %d array arguments", nin + nout);
+	return NULL;
+    }
+
+    n = PyArray_SIZE (arrays[0]);
+
+    for (i = 0; i < nin + nout; i++) {
+	if (kern_check_array (arrays[i], NPY_DOUBLE,
+			      i < nin ? names[i] : "output", i >= nin))
+	    return NULL;
+	KERN_CHECK_SIZE (arrays[i], n, i < nin ? names[i] : "output");
+    }
+
+    for (i = 0; i < nin; i++)
+	ctx.in[i] = PyArray_DATA (arrays[i]);
+    for (i = 0; i < nout; i++)
+	ctx.out[i] = PyArray_DATA (arrays[nin + i]);
+
+    kern_parallel (n, GRAIN, func, &ctx);
+    Py_RETURN_NONE;
+}
+
+PyObject *
+py_jd_to_lst (PyObject *self, PyObject *args)
+{
+    return run_coord (args, 2, 1, jd_to_lst_work);
+}
+
+PyObject *
+py_precess (PyObject *self, PyObject *args)
+{
+    return run_coord (args, 4, 2, precess_work);
+}
+
+PyObject *
+py_equ_to_horizon (PyObject *self, PyObject *args)
+{
+    return run_coord (args, 4, 2, equ_to_horizon_work);
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Averaging of visibilities in time and frequency.
+ *
+ * Each (baseline, pol) pair gets an accumulator slot. The slots are
+ * found through an open-addressing hash table that the caller owns,
+ * so that it persists from batch to batch; slot numbers are handed
+ * out in order of first appearance.
+ *
+ * The accumulation adds the weighted spectra of a batch of records
+ * into their slots. Several records may land in the same slot, so
+ * rather than splitting the records between threads we split the
+ * channels: each thread adds up its own range of channels for every
+ * record, and no two threads ever touch the same sums.
+ *
+ * Channel averaging is simpler, since every record is independent:
+ * the records are split between threads, and each record is reduced
+ * over a list of [start, end) channel ranges, one per output channel.
+ * The ranges may have any widths and may skip channels, so one kernel
+ * handles uniform averaging, several spectral windows, and arbitrary
+ * bins alike. */
+
+#include "kernels.h"
+
+#include <stdlib.h>
+
+#define EMPTY_KEY ((npy_int64) -1)
+
+typedef struct {
+    npy_intp nrec, nchan;
+    const npy_intp *slots;
+    const double *wt;
+    const float *data; /* complex64, interleaved */
+    const int *flags;
+    double *sums; /* complex128, interleaved */
+    double *wsum;
+} accum_ctx;
+
+
+/* Pol codes run from -8 to 4, so six bits leave room to spare. */
+
+static npy_int64
+slot_key (double bl, int pol)
+{
+    return ((npy_int64) (bl + 0.5)) * 64 + (pol + 32);
+}
+
+
+static npy_intp
+hash_key (npy_int64 key, npy_intp mask)
+{
+    npy_uint64 h = (npy_uint64) key * 0x9E3779B97F4A7C15ULL;
+    return (npy_intp) (h >> 32) & mask;
+}
+
+
+PyObject *
+py_aver_slots (PyObject *self, PyObject *args)
+{
+    PyObject *keys, *vals, *bl, *pol, *slots;
+    npy_int64 *k, key;
+    npy_intp *v, *s, cap, mask, n, i, h;
+    const double *b;
+    const int *p;
+    long nused;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!lO!", &PyArray_Type, &keys,
+			   &PyArray_Type, &vals, &PyArray_Type, &bl,
+			   &PyArray_Type, &pol, &nused, &PyArray_Type, &slots))
+	return NULL;
+
+    KERN_CHECK_OUT (keys, NPY_INT64, "keys");
+    KERN_CHECK_OUT (vals, NPY_INTP, "vals");
+    KERN_CHECK (bl, NPY_DOUBLE, "bl");
+    KERN_CHECK (pol, NPY_INT, "pol");
+    KERN_CHECK_OUT (slots, NPY_INTP, "slots");
+
+    cap = PyArray_SIZE (keys);
+    n = PyArray_SIZE (bl);
+
+    KERN_CHECK_SIZE (vals, cap, "vals");
+    KERN_CHECK_SIZE (pol, n, "pol");
+    KERN_CHECK_SIZE (slots, n, "slots");
+
+    if (cap == 0 || (cap & (cap - 1)) != 0) {
+	PyErr_SetString (PyExc_ValueError, "hash table size must be a power of 2");
+	return NULL;
+    }
+
+    if (nused + n >= cap) {
+	PyErr_SetString (PyExc_ValueError, "hash table is too small");
+	return NULL;
+    }
+
+    k = PyArray_DATA (keys);
+    v = PyArray_DATA (vals);
+    b = PyArray_DATA (bl);
+    p = PyArray_DATA (pol);
+    s = PyArray_DATA (slots);
+    mask = cap - 1;
+
+    for (i = 0; i < n; i++) {
+	key = slot_key (b[i], p[i]);
+	h = hash_key (key, mask);
+
+	while (k[h] != EMPTY_KEY && k[h] != key)
+	    h = (h + 1) & mask;
+
+	if (k[h] == EMPTY_KEY) {
+	    k[h] = key;
+	    v[h] = nused++;
+	}
+
+	s[i] = v[h];
+    }
+
+    return Py_BuildValue ("l", nused);
+}
+
+
+static void
+accum_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    accum_ctx *ctx = (accum_ctx *) vctx;
+    npy_intp i, c, nchan = ctx->nchan;
+    const float *d;
+    const int *f;
+    double *sum, *wsum, w;
+
+    for (i = 0; i < ctx->nrec; i++) {
+	w = ctx->wt[i];
+	if (w == 0)
+	    continue;
+
+	d = ctx->data + 2 * i * nchan;
+	f = ctx->flags + i * nchan;
+	sum = ctx->sums + 2 * ctx->slots[i] * nchan;
+	wsum = ctx->wsum + ctx->slots[i] * nchan;
+
+	for (c = start; c < end; c++) {
+	    if (f[c] == 0)
+		continue;
+	    sum[2*c] += w * d[2*c];
+	    sum[2*c+1] += w * d[2*c+1];
+	    wsum[c] += w;
+	}
+    }
+}
+
+
+PyObject *
+py_aver_accum (PyObject *self, PyObject *args)
+{
+    PyObject *slots, *wt, *data, *flags, *sums, *wsum;
+    accum_ctx ctx;
+    npy_intp nslot, i;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!O!O!", &PyArray_Type, &slots,
+			   &PyArray_Type, &wt, &PyArray_Type, &data,
+			   &PyArray_Type, &flags, &PyArray_Type, &sums,
+			   &PyArray_Type, &wsum))
+	return NULL;
+
+    KERN_CHECK (slots, NPY_INTP, "slots");
+    KERN_CHECK (wt, NPY_DOUBLE, "wt");
+    KERN_CHECK (data, NPY_CFLOAT, "data");
+    KERN_CHECK (flags, NPY_INT, "flags");
+    KERN_CHECK_OUT (sums, NPY_CDOUBLE, "sums");
+    KERN_CHECK_OUT (wsum, NPY_DOUBLE, "wsum");
+
+    if (PyArray_NDIM (data) != 2 || PyArray_NDIM (wsum) != 2) {
+	PyErr_SetString (PyExc_ValueError, "data and wsum must be "
+			 "two-dimensional");
+	return NULL;
+    }
+
+    ctx.nrec = PyArray_DIM (data, 0);
+    ctx.nchan = PyArray_DIM (data, 1);
+    nslot = PyArray_DIM (wsum, 0);
+
+    KERN_CHECK_SIZE (slots, ctx.nrec, "slots");
+    KERN_CHECK_SIZE (wt, ctx.nrec, "wt");
+    KERN_CHECK_SIZE (flags, ctx.nrec * ctx.nchan, "flags");
+    KERN_CHECK_SIZE (sums, nslot * ctx.nchan, "sums");
+    KERN_CHECK_SIZE (wsum, nslot * ctx.nchan, "wsum");
+
+    ctx.slots = PyArray_DATA (slots);
+    ctx.wt = PyArray_DATA (wt);
+    ctx.data = PyArray_DATA (data);
+    ctx.flags = PyArray_DATA (flags);
+    ctx.sums = PyArray_DATA (sums);
+    ctx.wsum = PyArray_DATA (wsum);
+
+    for (i = 0; i < ctx.nrec; i++) {
+	if (ctx.slots[i] < 0 || ctx.slots[i] >= nslot) {
+	    PyErr_Format (PyExc_ValueError, "slot %ld of record %ld is out "
+			  "of range", (long) ctx.slots[i], (long) i);
+	    return NULL;
+	}
+    }
+
+    if (ctx.nrec > 0)
+	kern_parallel (ctx.nchan, 65536 / ctx.nrec + 1, accum_work, &ctx);
+
+    Py_RETURN_NONE;
+}
+
+
+typedef struct {
+    npy_intp nrec, nchan, nout;
+    const npy_intp *starts, *ends;
+    const int *nmin;
+    const float *data; /* complex64, interleaved */
+    const int *flags;
+    float *outdata;
+    int *outflags;
+} chan_ctx;
+
+
+static void
+chan_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    chan_ctx *ctx = (chan_ctx *) vctx;
+    npy_intp i, b, c;
+    const float *d;
+    const int *f;
+    float *od, sre, sim;
+    int *of, n;
+
+    for (i = start; i < end; i++) {
+	d = ctx->data + 2 * i * ctx->nchan;
+	f = ctx->flags + i * ctx->nchan;
+	od = ctx->outdata + 2 * i * ctx->nout;
+	of = ctx->outflags + i * ctx->nout;
+
+	for (b = 0; b < ctx->nout; b++) {
+	    sre = sim = 0;
+	    n = 0;
+
+	    for (c = ctx->starts[b]; c < ctx->ends[b]; c++) {
+		if (f[c] == 0)
+		    continue;
+		sre += d[2*c];
+		sim += d[2*c+1];
+		n++;
+	    }
+
+	    if (n == 0)
+		od[2*b] = od[2*b+1] = 0;
+	    else {
+		od[2*b] = sre / n;
+		od[2*b+1] = sim / n;
+	    }
+
+	    of[b] = n >= ctx->nmin[b];
+	}
+    }
+}
+
+
+PyObject *
+py_chan_bin (PyObject *self, PyObject *args)
+{
+    PyObject *data, *flags, *starts, *ends, *nmin, *outdata, *outflags;
+    chan_ctx ctx;
+    npy_intp b;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!O!O!O!", &PyArray_Type, &data,
+			   &PyArray_Type, &flags, &PyArray_Type, &starts,
+			   &PyArray_Type, &ends, &PyArray_Type, &nmin,
+			   &PyArray_Type, &outdata, &PyArray_Type, &outflags))
+	return NULL;
+
+    KERN_CHECK (data, NPY_CFLOAT, "data");
+    KERN_CHECK (flags, NPY_INT, "flags");
+    KERN_CHECK (starts, NPY_INTP, "starts");
+    KERN_CHECK (ends, NPY_INTP, "ends");
+    KERN_CHECK (nmin, NPY_INT, "nmin");
+    KERN_CHECK_OUT (outdata, NPY_CFLOAT, "outdata");
+    KERN_CHECK_OUT (outflags, NPY_INT, "outflags");
+
+    if (PyArray_NDIM (data) != 2) {
+	PyErr_SetString (PyExc_ValueError, "data must be two-dimensional");
+	return NULL;
+    }
+
+    ctx.nrec = PyArray_DIM (data, 0);
+    ctx.nchan = PyArray_DIM (data, 1);
+    ctx.nout = PyArray_SIZE (starts);
+
+    KERN_CHECK_SIZE (flags, ctx.nrec * ctx.nchan, "flags");
+    KERN_CHECK_SIZE (ends, ctx.nout, "ends");
+    KERN_CHECK_SIZE (nmin, ctx.nout, "nmin");
+    KERN_CHECK_SIZE (outdata, ctx.nrec * ctx.nout, "outdata");
+    KERN_CHECK_SIZE (outflags, ctx.nrec * ctx.nout, "outflags");
+
+    ctx.starts = PyArray_DATA (starts);
+    ctx.ends = PyArray_DATA (ends);
+
+    for (b = 0; b < ctx.nout; b++) {
+	if (ctx.starts[b] < 0 || ctx.ends[b] > ctx.nchan ||
+	    ctx.starts[b] > ctx.ends[b]) {
+	    PyErr_Format (PyExc_ValueError, "bin %ld [%ld, %ld) doesn't fit "
+			  "in %ld channels", (long) b, (long) ctx.starts[b],
+			  (long) ctx.ends[b], (long) ctx.nchan);
+	    return NULL;
+	}
+    }
+
+    ctx.nmin = PyArray_DATA (nmin);
+    ctx.data = PyArray_DATA (data);
+    ctx.flags = PyArray_DATA (flags);
+    ctx.outdata = PyArray_DATA (outdata);
+    ctx.outflags = PyArray_DATA (outflags);
+
+    kern_parallel (ctx.nrec, 16384 / (ctx.nchan + 1) + 1, chan_work, &ctx);
+
+    Py_RETURN_NONE;
+}
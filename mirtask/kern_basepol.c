@@ -0,0 +1,514 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Baseline, antpol, basepol, and PBP32 conversions over whole arrays.
+ * These mirror the scalar functions in mirtask/util.py (and MIRIAD's
+ * basants and antbas); see the comments there for the definitions of
+ * the encodings. */
+
+#include "kernels.h"
+
+#include <math.h>
+
+/* These are cheap, so don't bother threading small arrays. */
+#define GRAIN 65536
+
+#define POL_MIN -8
+#define POL_MAX 6
+#define BAD_POL 0xFF
+
+/* Largest MIRIAD antenna number that fits in a PBP32. */
+#define PBP32_MAX_ANT 0x2000
+
+/* Indexed by pol + 8; see _polToFPol in util.py. */
+static const unsigned char pol_to_fpols[] = {
+    0x10, 0x01, 0x11, 0x00, /* YX XY YY XX */
+    0x32, 0x23, 0x33, 0x22, /* LR RL LL RR */
+    0x44, /* II */
+    0x44, 0x55, 0x66, 0x77, /* I Q U V */
+    0x55, 0x66 /* QQ UU */
+};
+
+/* The reverse; see _fpolToPol in util.py. */
+static int
+fpols_to_pol (int fps)
+{
+    switch (fps) {
+    case 0x00: return -5; /* XX */
+    case 0x01: return -7; /* XY */
+    case 0x10: return -8; /* YX */
+    case 0x11: return -6; /* YY */
+    case 0x22: return -1; /* RR */
+    case 0x23: return -3; /* RL */
+    case 0x32: return -4; /* LR */
+    case 0x33: return -2; /* LL */
+    case 0x44: return 1; /* I */
+    case 0x55: return 2; /* Q */
+    case 0x66: return 3; /* U */
+    case 0x77: return 4; /* V */
+    }
+
+    return BAD_POL;
+}
+
+
+/* Same logic as MIRIAD's basants. Returns nonzero if the result isn't a
+ * legal antenna pair. */
+static int
+decode_one (double bl, int *m1, int *m2)
+{
+    long ibl = (long) floor (bl + 0.5);
+
+    if (ibl > 65536) {
+	ibl -= 65536;
+	*m1 = (int) (ibl / 2048);
+	*m2 = (int) (ibl % 2048);
+    } else {
+	*m1 = (int) (ibl / 256);
+	*m2 = (int) (ibl % 256);
+    }
+
+    return *m1 < 1 || *m1 > *m2;
+}
+
+
+typedef struct {
+    const double *bl;
+    const int *m1, *m2, *pol;
+    const unsigned int *pbp32;
+    int *om1, *om2, *opol, *oap1, *oap2;
+    double *obl;
+    unsigned int *opbp32;
+    int check;
+    npy_intp bad[KERN_MAX_THREADS];
+} basepol_ctx;
+
+
+static void
+decode_baselines_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    basepol_ctx *ctx = (basepol_ctx *) vctx;
+    npy_intp i;
+
+    for (i = start; i < end; i++)
+	if (decode_one (ctx->bl[i], &ctx->om1[i], &ctx->om2[i]) && ctx->check)
+	    KERN_NOTE_ERROR (ctx, tid, i);
+}
+
+PyObject *
+py_decode_baselines (PyObject *self, PyObject *args)
+{
+    PyObject *bl, *m1, *m2;
+    basepol_ctx ctx;
+    npy_intp n, bad;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!i", &PyArray_Type, &bl,
+			   &PyArray_Type, &m1, &PyArray_Type, &m2, &ctx.check))
+	return NULL;
+
+    KERN_CHECK (bl, NPY_DOUBLE, "bl");
+    KERN_CHECK_OUT (m1, NPY_INT, "m1");
+    KERN_CHECK_OUT (m2, NPY_INT, "m2");
+
+    n = PyArray_SIZE (bl);
+    KERN_CHECK_SIZE (m1, n, "m1");
+    KERN_CHECK_SIZE (m2, n, "m2");
+
+    ctx.bl = PyArray_DATA (bl);
+    ctx.om1 = PyArray_DATA (m1);
+    ctx.om2 = PyArray_DATA (m2);
+    kern_clear_errors (ctx.bad);
+
+    kern_parallel (n, GRAIN, decode_baselines_work, &ctx);
+
+    if ((bad = kern_first_error (ctx.bad)) >= 0) {
+	PyErr_Format (PyExc_ValueError, "invalid baseline number %ld "
+		      "(item %ld)", (long) ctx.bl[bad], (long) bad);
+	return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+static void
+encode_baselines_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    basepol_ctx *ctx = (basepol_ctx *) vctx;
+    npy_intp i;
+    int m1, m2;
+
+    for (i = start; i < end; i++) {
+	m1 = ctx->m1[i];
+	m2 = ctx->m2[i];
+
+	if (m1 < 1 || m1 > m2 || m2 > 2047) {
+	    KERN_NOTE_ERROR (ctx, tid, i);
+	    ctx->obl[i] = 0;
+	} else if (m2 > 255)
+	    ctx->obl[i] = 2048. * m1 + m2 + 65536;
+	else
+	    ctx->obl[i] = 256. * m1 + m2;
+    }
+}
+
+PyObject *
+py_encode_baselines (PyObject *self, PyObject *args)
+{
+    PyObject *m1, *m2, *bl;
+    basepol_ctx ctx;
+    npy_intp n, bad;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!", &PyArray_Type, &m1,
+			   &PyArray_Type, &m2, &PyArray_Type, &bl))
+	return NULL;
+
+    KERN_CHECK (m1, NPY_INT, "m1");
+    KERN_CHECK (m2, NPY_INT, "m2");
+    KERN_CHECK_OUT (bl, NPY_DOUBLE, "bl");
+
+    n = PyArray_SIZE (m1);
+    KERN_CHECK_SIZE (m2, n, "m2");
+    KERN_CHECK_SIZE (bl, n, "bl");
+
+    ctx.m1 = PyArray_DATA (m1);
+    ctx.m2 = PyArray_DATA (m2);
+    ctx.obl = PyArray_DATA (bl);
+    kern_clear_errors (ctx.bad);
+
+    kern_parallel (n, GRAIN, encode_baselines_work, &ctx);
+
+    if ((bad = kern_first_error (ctx.bad)) >= 0) {
+	PyErr_Format (PyExc_ValueError, "cannot encode antenna pair %d-%d "
+		      "(item %ld)", ctx.m1[bad], ctx.m2[bad], (long) bad);
+	return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+static void
+aap_to_bp_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    basepol_ctx *ctx = (basepol_ctx *) vctx;
+    npy_intp i;
+    int fps;
+
+    for (i = start; i < end; i++) {
+	if (ctx->m1[i] < 1 || ctx->m2[i] < 1 || ctx->pol[i] < POL_MIN ||
+	    ctx->pol[i] > POL_MAX) {
+	    KERN_NOTE_ERROR (ctx, tid, i);
+	    ctx->oap1[i] = ctx->oap2[i] = -1;
+	    continue;
+	}
+
+	fps = pol_to_fpols[ctx->pol[i] - POL_MIN];
+	ctx->oap1[i] = ((ctx->m1[i] - 1) << 3) + ((fps >> 4) & 0x07);
+	ctx->oap2[i] = ((ctx->m2[i] - 1) << 3) + (fps & 0x07);
+    }
+}
+
+PyObject *
+py_aap_to_bp (PyObject *self, PyObject *args)
+{
+    PyObject *m1, *m2, *pol, *ap1, *ap2;
+    basepol_ctx ctx;
+    npy_intp n, bad;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!O!", &PyArray_Type, &m1,
+			   &PyArray_Type, &m2, &PyArray_Type, &pol,
+			   &PyArray_Type, &ap1, &PyArray_Type, &ap2))
+	return NULL;
+
+    KERN_CHECK (m1, NPY_INT, "m1");
+    KERN_CHECK (m2, NPY_INT, "m2");
+    KERN_CHECK (pol, NPY_INT, "pol");
+    KERN_CHECK_OUT (ap1, NPY_INT, "ap1");
+    KERN_CHECK_OUT (ap2, NPY_INT, "ap2");
+
+    n = PyArray_SIZE (m1);
+    KERN_CHECK_SIZE (m2, n, "m2");
+    KERN_CHECK_SIZE (pol, n, "pol");
+    KERN_CHECK_SIZE (ap1, n, "ap1");
+    KERN_CHECK_SIZE (ap2, n, "ap2");
+
+    ctx.m1 = PyArray_DATA (m1);
+    ctx.m2 = PyArray_DATA (m2);
+    ctx.pol = PyArray_DATA (pol);
+    ctx.oap1 = PyArray_DATA (ap1);
+    ctx.oap2 = PyArray_DATA (ap2);
+    kern_clear_errors (ctx.bad);
+
+    kern_parallel (n, GRAIN, aap_to_bp_work, &ctx);
+
+    if ((bad = kern_first_error (ctx.bad)) >= 0) {
+	PyErr_Format (PyExc_ValueError, "illegal antennas/polarization "
+		      "%d, %d, %d (item %ld)", ctx.m1[bad], ctx.m2[bad],
+		      ctx.pol[bad], (long) bad);
+	return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+/* Note that here ctx->m1 and ctx->m2 hold the input antpols. */
+
+static void
+bp_to_aap_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    basepol_ctx *ctx = (basepol_ctx *) vctx;
+    npy_intp i;
+    int ap1, ap2, pol;
+
+    for (i = start; i < end; i++) {
+	ap1 = ctx->m1[i];
+	ap2 = ctx->m2[i];
+	pol = BAD_POL;
+
+	if (ap1 >= 0 && ap2 >= 0)
+	    pol = fpols_to_pol (((ap1 & 0x7) << 4) + (ap2 & 0x7));
+
+	if (pol == BAD_POL)
+	    KERN_NOTE_ERROR (ctx, tid, i);
+
+	ctx->om1[i] = (ap1 >> 3) + 1;
+	ctx->om2[i] = (ap2 >> 3) + 1;
+	ctx->opol[i] = pol;
+    }
+}
+
+PyObject *
+py_bp_to_aap (PyObject *self, PyObject *args)
+{
+    PyObject *ap1, *ap2, *m1, *m2, *pol;
+    basepol_ctx ctx;
+    npy_intp n, bad;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!O!", &PyArray_Type, &ap1,
+			   &PyArray_Type, &ap2, &PyArray_Type, &m1,
+			   &PyArray_Type, &m2, &PyArray_Type, &pol))
+	return NULL;
+
+    KERN_CHECK (ap1, NPY_INT, "ap1");
+    KERN_CHECK (ap2, NPY_INT, "ap2");
+    KERN_CHECK_OUT (m1, NPY_INT, "m1");
+    KERN_CHECK_OUT (m2, NPY_INT, "m2");
+    KERN_CHECK_OUT (pol, NPY_INT, "pol");
+
+    n = PyArray_SIZE (ap1);
+    KERN_CHECK_SIZE (ap2, n, "ap2");
+    KERN_CHECK_SIZE (m1, n, "m1");
+    KERN_CHECK_SIZE (m2, n, "m2");
+    KERN_CHECK_SIZE (pol, n, "pol");
+
+    ctx.m1 = PyArray_DATA (ap1);
+    ctx.m2 = PyArray_DATA (ap2);
+    ctx.om1 = PyArray_DATA (m1);
+    ctx.om2 = PyArray_DATA (m2);
+    ctx.opol = PyArray_DATA (pol);
+    kern_clear_errors (ctx.bad);
+
+    kern_parallel (n, GRAIN, bp_to_aap_work, &ctx);
+
+    if ((bad = kern_first_error (ctx.bad)) >= 0) {
+	PyErr_Format (PyExc_ValueError, "illegal basepol %d, %d (item %ld)",
+		      ctx.m1[bad], ctx.m2[bad], (long) bad);
+	return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+/* The columnar equivalent of mir2bp and mir2pbp32: a baseline number
+ * and polarization code for each record. Either the basepol or PBP32
+ * outputs may be NULL. */
+
+static void
+blpol_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    basepol_ctx *ctx = (basepol_ctx *) vctx;
+    npy_intp i;
+    int m1, m2, pol, fps;
+
+    for (i = start; i < end; i++) {
+	pol = ctx->pol[i];
+
+	if (decode_one (ctx->bl[i], &m1, &m2) || pol < POL_MIN ||
+	    pol > POL_MAX || (ctx->opbp32 != NULL && (m1 > PBP32_MAX_ANT ||
+						      m2 > PBP32_MAX_ANT))) {
+	    KERN_NOTE_ERROR (ctx, tid, i);
+	    m1 = m2 = 1;
+	    pol = 1;
+	}
+
+	fps = pol_to_fpols[pol - POL_MIN];
+
+	if (ctx->oap1 != NULL) {
+	    ctx->oap1[i] = ((m1 - 1) << 3) + ((fps >> 4) & 0x07);
+	    ctx->oap2[i] = ((m2 - 1) << 3) + (fps & 0x07);
+	}
+
+	if (ctx->opbp32 != NULL)
+	    ctx->opbp32[i] = (((unsigned int) m1 - 1) << 19) +
+		((fps & 0x70) << 12) + (((unsigned int) m2 - 1) << 3) +
+		(fps & 0x7);
+    }
+}
+
+PyObject *
+py_blpol_to_bp (PyObject *self, PyObject *args)
+{
+    PyObject *bl, *pol, *ap1, *ap2;
+    basepol_ctx ctx;
+    npy_intp n, bad;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!", &PyArray_Type, &bl,
+			   &PyArray_Type, &pol, &PyArray_Type, &ap1,
+			   &PyArray_Type, &ap2))
+	return NULL;
+
+    KERN_CHECK (bl, NPY_DOUBLE, "bl");
+    KERN_CHECK (pol, NPY_INT, "pol");
+    KERN_CHECK_OUT (ap1, NPY_INT, "ap1");
+    KERN_CHECK_OUT (ap2, NPY_INT, "ap2");
+
+    n = PyArray_SIZE (bl);
+    KERN_CHECK_SIZE (pol, n, "pol");
+    KERN_CHECK_SIZE (ap1, n, "ap1");
+    KERN_CHECK_SIZE (ap2, n, "ap2");
+
+    ctx.bl = PyArray_DATA (bl);
+    ctx.pol = PyArray_DATA (pol);
+    ctx.oap1 = PyArray_DATA (ap1);
+    ctx.oap2 = PyArray_DATA (ap2);
+    ctx.opbp32 = NULL;
+    kern_clear_errors (ctx.bad);
+
+    kern_parallel (n, GRAIN, blpol_work, &ctx);
+
+    if ((bad = kern_first_error (ctx.bad)) >= 0) {
+	PyErr_Format (PyExc_ValueError, "invalid baseline/polarization "
+		      "%ld, %d (item %ld)", (long) ctx.bl[bad], ctx.pol[bad],
+		      (long) bad);
+	return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyObject *
+py_blpol_to_pbp32 (PyObject *self, PyObject *args)
+{
+    PyObject *bl, *pol, *pbp32;
+    basepol_ctx ctx;
+    npy_intp n, bad;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!", &PyArray_Type, &bl,
+			   &PyArray_Type, &pol, &PyArray_Type, &pbp32))
+	return NULL;
+
+    KERN_CHECK (bl, NPY_DOUBLE, "bl");
+    KERN_CHECK (pol, NPY_INT, "pol");
+    KERN_CHECK_OUT (pbp32, NPY_UINT, "pbp32");
+
+    n = PyArray_SIZE (bl);
+    KERN_CHECK_SIZE (pol, n, "pol");
+    KERN_CHECK_SIZE (pbp32, n, "pbp32");
+
+    ctx.bl = PyArray_DATA (bl);
+    ctx.pol = PyArray_DATA (pol);
+    ctx.oap1 = ctx.oap2 = NULL;
+    ctx.opbp32 = PyArray_DATA (pbp32);
+    kern_clear_errors (ctx.bad);
+
+    kern_parallel (n, GRAIN, blpol_work, &ctx);
+
+    if ((bad = kern_first_error (ctx.bad)) >= 0) {
+	PyErr_Format (PyExc_ValueError, "cannot encode baseline/polarization "
+		      "%ld, %d as PBP32 (item %ld)", (long) ctx.bl[bad],
+		      ctx.pol[bad], (long) bad);
+	return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+static void
+pbp32_to_aap_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    basepol_ctx *ctx = (basepol_ctx *) vctx;
+    npy_intp i;
+    unsigned int p;
+    int pol;
+
+    for (i = start; i < end; i++) {
+	p = ctx->pbp32[i];
+	pol = fpols_to_pol (((p >> 12) & 0x70) + (p & 0x7));
+
+	if (pol == BAD_POL)
+	    KERN_NOTE_ERROR (ctx, tid, i);
+
+	ctx->om1[i] = ((p >> 19) & 0x1FFF) + 1;
+	ctx->om2[i] = ((p >> 3) & 0x1FFF) + 1;
+	ctx->opol[i] = pol;
+    }
+}
+
+PyObject *
+py_pbp32_to_aap (PyObject *self, PyObject *args)
+{
+    PyObject *pbp32, *m1, *m2, *pol;
+    basepol_ctx ctx;
+    npy_intp n, bad;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!", &PyArray_Type, &pbp32,
+			   &PyArray_Type, &m1, &PyArray_Type, &m2,
+			   &PyArray_Type, &pol))
+	return NULL;
+
+    KERN_CHECK (pbp32, NPY_UINT, "pbp32");
+    KERN_CHECK_OUT (m1, NPY_INT, "m1");
+    KERN_CHECK_OUT (m2, NPY_INT, "m2");
+    KERN_CHECK_OUT (pol, NPY_INT, "pol");
+
+    n = PyArray_SIZE (pbp32);
+    KERN_CHECK_SIZE (m1, n, "m1");
+    KERN_CHECK_SIZE (m2, n, "m2");
+    KERN_CHECK_SIZE (pol, n, "pol");
+
+    ctx.pbp32 = PyArray_DATA (pbp32);
+    ctx.om1 = PyArray_DATA (m1);
+    ctx.om2 = PyArray_DATA (m2);
+    ctx.opol = PyArray_DATA (pol);
+    kern_clear_errors (ctx.bad);
+
+    kern_parallel (n, GRAIN, pbp32_to_aap_work, &ctx);
+
+    if ((bad = kern_first_error (ctx.bad)) >= 0) {
+	PyErr_Format (PyExc_ValueError, "illegal PBP32 0x%x (item %ld)",
+		      ctx.pbp32[bad], (long) bad);
+	return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
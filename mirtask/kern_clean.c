@@ -0,0 +1,394 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* CLEAN minor cycles.
+ *
+ * Hogbom: the planes of a cube are independent, so they're handed out
+ * to threads whole. Within a plane, we keep the maximum of each row;
+ * subtracting a beam patch only changes the rows under the patch, so
+ * each iteration costs the patch area plus one pass over the row
+ * maxima, rather than a search of the whole plane.
+ *
+ * Clark: the minor cycle works on a list of the brightest pixels with
+ * a small beam patch; the major cycle, done in Python with FFTs,
+ * subtracts the accumulated components from the whole plane.
+ *
+ * The beam has its peak at pixel (bcy, bcx) and a component at (y, x)
+ * is subtracted at offsets of at most (py, px) pixels. */
+
+#include "kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define CLEAN_POSITIVE 1 /* only find positive components */
+#define CLEAN_NEGSTOP 2 /* stop at the first negative component */
+
+typedef struct {
+    int ny, nx;
+    float *resid, *model;
+    const npy_bool *region; /* may be NULL */
+    const float *beam;
+    int nby, nbx, bcy, bcx, py, px;
+    double gain, cutoff;
+    npy_intp niter;
+    int flags;
+    npy_intp *niters;
+    float *peaks;
+    npy_intp bad[KERN_MAX_THREADS];
+} hogbom_ctx;
+
+
+static double
+score (int flags, double v)
+{
+    if (flags & CLEAN_POSITIVE)
+	return v;
+    return fabs (v);
+}
+
+
+/* Update the maximum of row @y. Rows with nothing to search get a
+ * maximum of -1. */
+
+static void
+row_max (const hogbom_ctx *ctx, const float *resid, const npy_bool *region,
+	 int y, float *rowmax, int *rowarg)
+{
+    const float *r = resid + (npy_intp) y * ctx->nx;
+    double best = -1, s;
+    int x, arg = -1;
+
+    for (x = 0; x < ctx->nx; x++) {
+	if (region != NULL && !region[(npy_intp) y * ctx->nx + x])
+	    continue;
+
+	s = score (ctx->flags, r[x]);
+	if (s > best) {
+	    best = s;
+	    arg = x;
+	}
+    }
+
+    rowmax[y] = (float) best;
+    rowarg[y] = arg;
+}
+
+
+static void
+hogbom_plane (const hogbom_ctx *ctx, npy_intp p, float *rowmax, int *rowarg)
+{
+    npy_intp plsize = (npy_intp) ctx->ny * ctx->nx, it;
+    float *resid = ctx->resid + p * plsize;
+    float *model = ctx->model + p * plsize;
+    const float *brow;
+    float *rrow;
+    double comp;
+    int y, x, j, i, best, ylo, yhi, xlo, xhi;
+
+    for (y = 0; y < ctx->ny; y++)
+	row_max (ctx, resid, ctx->region, y, rowmax, rowarg);
+
+    for (it = 0; it < ctx->niter; it++) {
+	best = 0;
+	for (y = 1; y < ctx->ny; y++)
+	    if (rowmax[y] > rowmax[best])
+		best = y;
+
+	if (rowmax[best] < 0 || rowmax[best] <= ctx->cutoff)
+	    break;
+
+	y = best;
+	x = rowarg[y];
+	comp = ctx->gain * resid[(npy_intp) y * ctx->nx + x];
+
+	if ((ctx->flags & CLEAN_NEGSTOP) && comp < 0)
+	    break;
+
+	model[(npy_intp) y * ctx->nx + x] += (float) comp;
+
+	/* The rows and columns under both the patch and the beam. */
+
+	ylo = y - ctx->py;
+	if (ylo < y - ctx->bcy)
+	    ylo = y - ctx->bcy;
+	if (ylo < 0)
+	    ylo = 0;
+	yhi = y + ctx->py + 1;
+	if (yhi > y - ctx->bcy + ctx->nby)
+	    yhi = y - ctx->bcy + ctx->nby;
+	if (yhi > ctx->ny)
+	    yhi = ctx->ny;
+
+	xlo = x - ctx->px;
+	if (xlo < x - ctx->bcx)
+	    xlo = x - ctx->bcx;
+	if (xlo < 0)
+	    xlo = 0;
+	xhi = x + ctx->px + 1;
+	if (xhi > x - ctx->bcx + ctx->nbx)
+	    xhi = x - ctx->bcx + ctx->nbx;
+	if (xhi > ctx->nx)
+	    xhi = ctx->nx;
+
+	for (j = ylo; j < yhi; j++) {
+	    rrow = resid + (npy_intp) j * ctx->nx;
+	    brow = ctx->beam + (npy_intp) (j - y + ctx->bcy) * ctx->nbx
+		+ ctx->bcx - x;
+
+	    for (i = xlo; i < xhi; i++)
+		rrow[i] -= (float) (comp * brow[i]);
+
+	    row_max (ctx, resid, ctx->region, j, rowmax, rowarg);
+	}
+    }
+
+    ctx->niters[p] = it;
+
+    best = 0;
+    for (y = 1; y < ctx->ny; y++)
+	if (rowmax[y] > rowmax[best])
+	    best = y;
+    ctx->peaks[p] = rowmax[best] < 0 ? 0 : rowmax[best];
+}
+
+
+static void
+hogbom_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    hogbom_ctx *ctx = (hogbom_ctx *) vctx;
+    float *rowmax;
+    int *rowarg;
+    npy_intp p;
+
+    rowmax = malloc (ctx->ny * sizeof (float));
+    rowarg = malloc (ctx->ny * sizeof (int));
+
+    if (rowmax == NULL || rowarg == NULL)
+	KERN_NOTE_ERROR (ctx, tid, start);
+    else {
+	for (p = start; p < end; p++)
+	    hogbom_plane (ctx, p, rowmax, rowarg);
+    }
+
+    free (rowmax);
+    free (rowarg);
+}
+
+
+static int
+check_beam (PyObject *beam, int bcy, int bcx)
+{
+    if (PyArray_NDIM (beam) != 2) {
+	PyErr_SetString (PyExc_ValueError, "beam must be 2D");
+	return 1;
+    }
+
+    if (bcy < 0 || bcx < 0 || bcy >= PyArray_DIM (beam, 0) ||
+	bcx >= PyArray_DIM (beam, 1)) {
+	PyErr_SetString (PyExc_ValueError, "beam center is outside the beam");
+	return 1;
+    }
+
+    return 0;
+}
+
+
+PyObject *
+py_hogbom (PyObject *self, PyObject *args)
+{
+    PyObject *resid, *model, *region, *beam, *niters, *peaks;
+    hogbom_ctx ctx;
+    npy_intp nplane;
+    long lniter;
+
+    if (!PyArg_ParseTuple (args, "O!O!OO!iiiiddliO!O!", &PyArray_Type, &resid,
+			   &PyArray_Type, &model, &region, &PyArray_Type,
+			   &beam, &ctx.bcy, &ctx.bcx, &ctx.py, &ctx.px,
+			   &ctx.gain, &ctx.cutoff, &lniter, &ctx.flags,
+			   &PyArray_Type, &niters, &PyArray_Type, &peaks))
+	return NULL;
+
+    KERN_CHECK_OUT (resid, NPY_FLOAT, "resid");
+    KERN_CHECK_OUT (model, NPY_FLOAT, "model");
+    KERN_CHECK (beam, NPY_FLOAT, "beam");
+    KERN_CHECK_OUT (niters, NPY_INTP, "niters");
+    KERN_CHECK_OUT (peaks, NPY_FLOAT, "peaks");
+
+    if (PyArray_NDIM (resid) != 3) {
+	PyErr_SetString (PyExc_ValueError, "resid must be 3D");
+	return NULL;
+    }
+
+    if (check_beam (beam, ctx.bcy, ctx.bcx))
+	return NULL;
+
+    nplane = PyArray_DIM (resid, 0);
+    ctx.ny = (int) PyArray_DIM (resid, 1);
+    ctx.nx = (int) PyArray_DIM (resid, 2);
+    ctx.nby = (int) PyArray_DIM (beam, 0);
+    ctx.nbx = (int) PyArray_DIM (beam, 1);
+    ctx.niter = lniter;
+
+    KERN_CHECK_SIZE (model, PyArray_SIZE (resid), "model");
+    KERN_CHECK_SIZE (niters, nplane, "niters");
+    KERN_CHECK_SIZE (peaks, nplane, "peaks");
+
+    if (region == Py_None)
+	ctx.region = NULL;
+    else if (!PyArray_Check (region)) {
+	PyErr_SetString (PyExc_TypeError, "region must be an ndarray or None");
+	return NULL;
+    } else {
+	KERN_CHECK (region, NPY_BOOL, "region");
+	KERN_CHECK_SIZE (region, (npy_intp) ctx.ny * ctx.nx, "region");
+	ctx.region = PyArray_DATA (region);
+    }
+
+    if (ctx.py < 0 || ctx.px < 0) {
+	PyErr_SetString (PyExc_ValueError, "beam patch size must be nonnegative");
+	return NULL;
+    }
+
+    ctx.resid = PyArray_DATA (resid);
+    ctx.model = PyArray_DATA (model);
+    ctx.beam = PyArray_DATA (beam);
+    ctx.niters = PyArray_DATA (niters);
+    ctx.peaks = PyArray_DATA (peaks);
+
+    if (ctx.ny == 0 || ctx.nx == 0) {
+	Py_RETURN_NONE;
+    }
+
+    kern_clear_errors (ctx.bad);
+    kern_parallel (nplane, 1, hogbom_work, &ctx);
+
+    if (kern_first_error (ctx.bad) >= 0)
+	return PyErr_NoMemory ();
+
+    Py_RETURN_NONE;
+}
+
+
+typedef struct {
+    npy_intp n;
+    float *vals, *comps;
+    const int *iy, *ix;
+    const float *beam;
+    int nby, nbx, bcy, bcx, py, px;
+    double gain, limit;
+    npy_intp niter, ndone;
+    int flags;
+} clark_ctx;
+
+
+static void
+clark_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    clark_ctx *ctx = (clark_ctx *) vctx;
+    npy_intp it, k, m, best;
+    double s, bests, comp;
+    int dy, dx;
+
+    for (it = 0; it < ctx->niter; it++) {
+	best = -1;
+	bests = ctx->limit;
+
+	for (k = 0; k < ctx->n; k++) {
+	    s = score (ctx->flags, ctx->vals[k]);
+	    if (s > bests) {
+		bests = s;
+		best = k;
+	    }
+	}
+
+	if (best < 0)
+	    break;
+
+	comp = ctx->gain * ctx->vals[best];
+
+	if ((ctx->flags & CLEAN_NEGSTOP) && comp < 0)
+	    break;
+
+	ctx->comps[best] += (float) comp;
+
+	for (m = 0; m < ctx->n; m++) {
+	    dy = ctx->iy[m] - ctx->iy[best];
+	    dx = ctx->ix[m] - ctx->ix[best];
+
+	    if (dy < -ctx->py || dy > ctx->py || dx < -ctx->px || dx > ctx->px)
+		continue;
+
+	    dy += ctx->bcy;
+	    dx += ctx->bcx;
+
+	    if (dy < 0 || dx < 0 || dy >= ctx->nby || dx >= ctx->nbx)
+		continue;
+
+	    ctx->vals[m] -= (float) (comp * ctx->beam[(npy_intp) dy * ctx->nbx + dx]);
+	}
+    }
+
+    ctx->ndone = it;
+}
+
+
+PyObject *
+py_clark_minor (PyObject *self, PyObject *args)
+{
+    PyObject *vals, *iy, *ix, *beam, *comps;
+    clark_ctx ctx;
+    long lniter;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!iiiiddliO!", &PyArray_Type, &vals,
+			   &PyArray_Type, &iy, &PyArray_Type, &ix,
+			   &PyArray_Type, &beam, &ctx.bcy, &ctx.bcx, &ctx.py,
+			   &ctx.px, &ctx.gain, &ctx.limit, &lniter, &ctx.flags,
+			   &PyArray_Type, &comps))
+	return NULL;
+
+    KERN_CHECK_OUT (vals, NPY_FLOAT, "vals");
+    KERN_CHECK (iy, NPY_INT, "iy");
+    KERN_CHECK (ix, NPY_INT, "ix");
+    KERN_CHECK (beam, NPY_FLOAT, "beam");
+    KERN_CHECK_OUT (comps, NPY_FLOAT, "comps");
+
+    if (check_beam (beam, ctx.bcy, ctx.bcx))
+	return NULL;
+
+    ctx.n = PyArray_SIZE (vals);
+    KERN_CHECK_SIZE (iy, ctx.n, "iy");
+    KERN_CHECK_SIZE (ix, ctx.n, "ix");
+    KERN_CHECK_SIZE (comps, ctx.n, "comps");
+
+    ctx.vals = PyArray_DATA (vals);
+    ctx.comps = PyArray_DATA (comps);
+    ctx.iy = PyArray_DATA (iy);
+    ctx.ix = PyArray_DATA (ix);
+    ctx.beam = PyArray_DATA (beam);
+    ctx.nby = (int) PyArray_DIM (beam, 0);
+    ctx.nbx = (int) PyArray_DIM (beam, 1);
+    ctx.niter = lniter;
+    ctx.ndone = 0;
+
+    /* One work unit, just so that the GIL is released. */
+    kern_parallel (1, 1, clark_work, &ctx);
+
+    return Py_BuildValue ("l", (long) ctx.ndone);
+}
@@ -0,0 +1,232 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Closure quantities of one integration.
+ *
+ * The data come as a (nbl, npol, nchan) block, and the closures are
+ * described by a table of rows into it: three baselines per triangle
+ * (ij, jk, ik) and four per quad (ij, kl, ik, jl). A row of -1 means
+ * that the baseline is missing, and the closure is skipped.
+ *
+ * For triangles we accumulate the bispectrum V_ij V_jk conj(V_ik), its
+ * amplitude, and the number of channels that went in; for quads, the
+ * log of the closure amplitude |V_ij V_kl| / |V_ik V_jl| and its
+ * square. The sums are added to whatever is already in the output
+ * arrays, so averaging in time is just a matter of calling again.
+ * Every closure owns its own sums, so the closures are split between
+ * threads. */
+
+#include "kernels.h"
+
+#include <math.h>
+
+typedef struct {
+    npy_intp nclos, nbl, npol, nchan;
+    const npy_intp *index;
+    const float *data; /* complex64, interleaved */
+    const int *flags;
+    double *sum; /* bispectrum (complex128, interleaved) or log amplitude */
+    double *sum2; /* bispectrum amplitude or squared log amplitude */
+    double *count;
+} clos_ctx;
+
+
+static void
+triple_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    clos_ctx *ctx = (clos_ctx *) vctx;
+    npy_intp t, p, c, o, nchan = ctx->nchan;
+    const npy_intp *idx;
+    const float *d1, *d2, *d3;
+    const int *f1, *f2, *f3;
+    double re, im, bre, bim, sre, sim, samp, n;
+
+    for (t = start; t < end; t++) {
+	idx = ctx->index + 3 * t;
+	if (idx[0] < 0 || idx[1] < 0 || idx[2] < 0)
+	    continue;
+
+	for (p = 0; p < ctx->npol; p++) {
+	    o = (idx[0] * ctx->npol + p) * nchan;
+	    d1 = ctx->data + 2 * o;
+	    f1 = ctx->flags + o;
+	    o = (idx[1] * ctx->npol + p) * nchan;
+	    d2 = ctx->data + 2 * o;
+	    f2 = ctx->flags + o;
+	    o = (idx[2] * ctx->npol + p) * nchan;
+	    d3 = ctx->data + 2 * o;
+	    f3 = ctx->flags + o;
+
+	    sre = sim = samp = n = 0;
+
+	    for (c = 0; c < nchan; c++) {
+		if (f1[c] == 0 || f2[c] == 0 || f3[c] == 0)
+		    continue;
+
+		/* V_ij V_jk, then times conj(V_ik). */
+		re = (double) d1[2*c] * d2[2*c] - (double) d1[2*c+1] * d2[2*c+1];
+		im = (double) d1[2*c] * d2[2*c+1] + (double) d1[2*c+1] * d2[2*c];
+		bre = re * d3[2*c] + im * d3[2*c+1];
+		bim = im * d3[2*c] - re * d3[2*c+1];
+
+		sre += bre;
+		sim += bim;
+		samp += sqrt (bre * bre + bim * bim);
+		n++;
+	    }
+
+	    o = t * ctx->npol + p;
+	    ctx->sum[2*o] += sre;
+	    ctx->sum[2*o+1] += sim;
+	    ctx->sum2[o] += samp;
+	    ctx->count[o] += n;
+	}
+    }
+}
+
+
+static double
+sqamp (const float *d, npy_intp c)
+{
+    return (double) d[2*c] * d[2*c] + (double) d[2*c+1] * d[2*c+1];
+}
+
+
+static void
+quad_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    clos_ctx *ctx = (clos_ctx *) vctx;
+    npy_intp q, p, c, i, o, nchan = ctx->nchan;
+    const npy_intp *idx;
+    const float *d[4];
+    const int *f[4];
+    double num, den, l, sl, sl2, n;
+
+    for (q = start; q < end; q++) {
+	idx = ctx->index + 4 * q;
+	if (idx[0] < 0 || idx[1] < 0 || idx[2] < 0 || idx[3] < 0)
+	    continue;
+
+	for (p = 0; p < ctx->npol; p++) {
+	    for (i = 0; i < 4; i++) {
+		o = (idx[i] * ctx->npol + p) * nchan;
+		d[i] = ctx->data + 2 * o;
+		f[i] = ctx->flags + o;
+	    }
+
+	    sl = sl2 = n = 0;
+
+	    for (c = 0; c < nchan; c++) {
+		if (f[0][c] == 0 || f[1][c] == 0 || f[2][c] == 0 || f[3][c] == 0)
+		    continue;
+
+		/* Work with squared amplitudes to avoid the square roots;
+		 * the log takes care of the factor of two. */
+		num = sqamp (d[0], c) * sqamp (d[1], c);
+		den = sqamp (d[2], c) * sqamp (d[3], c);
+		if (num == 0 || den == 0)
+		    continue;
+
+		l = 0.5 * log (num / den);
+		sl += l;
+		sl2 += l * l;
+		n++;
+	    }
+
+	    o = q * ctx->npol + p;
+	    ctx->sum[o] += sl;
+	    ctx->sum2[o] += sl2;
+	    ctx->count[o] += n;
+	}
+    }
+}
+
+
+static PyObject *
+closure_common (PyObject *args, int nper, int sumtype, kern_work_func func)
+{
+    PyObject *data, *flags, *index, *sum, *sum2, *count;
+    clos_ctx ctx;
+    npy_intp i;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!O!O!", &PyArray_Type, &data,
+			   &PyArray_Type, &flags, &PyArray_Type, &index,
+			   &PyArray_Type, &sum, &PyArray_Type, &sum2,
+			   &PyArray_Type, &count))
+	return NULL;
+
+    KERN_CHECK (data, NPY_CFLOAT, "data");
+    KERN_CHECK (flags, NPY_INT, "flags");
+    KERN_CHECK (index, NPY_INTP, "index");
+    KERN_CHECK_OUT (sum, sumtype, "sum");
+    KERN_CHECK_OUT (sum2, NPY_DOUBLE, "sum2");
+    KERN_CHECK_OUT (count, NPY_DOUBLE, "count");
+
+    if (PyArray_NDIM (data) != 3) {
+	PyErr_SetString (PyExc_ValueError, "data must be three-dimensional");
+	return NULL;
+    }
+
+    ctx.nbl = PyArray_DIM (data, 0);
+    ctx.npol = PyArray_DIM (data, 1);
+    ctx.nchan = PyArray_DIM (data, 2);
+    ctx.nclos = PyArray_SIZE (index) / nper;
+
+    KERN_CHECK_SIZE (flags, ctx.nbl * ctx.npol * ctx.nchan, "flags");
+    KERN_CHECK_SIZE (index, ctx.nclos * nper, "index");
+    KERN_CHECK_SIZE (sum, ctx.nclos * ctx.npol, "sum");
+    KERN_CHECK_SIZE (sum2, ctx.nclos * ctx.npol, "sum2");
+    KERN_CHECK_SIZE (count, ctx.nclos * ctx.npol, "count");
+
+    ctx.index = PyArray_DATA (index);
+
+    for (i = 0; i < ctx.nclos * nper; i++) {
+	if (ctx.index[i] >= ctx.nbl) {
+	    PyErr_Format (PyExc_ValueError, "baseline row %ld of closure %ld "
+			  "is out of range", (long) ctx.index[i],
+			  (long) (i / nper));
+	    return NULL;
+	}
+    }
+
+    ctx.data = PyArray_DATA (data);
+    ctx.flags = PyArray_DATA (flags);
+    ctx.sum = PyArray_DATA (sum);
+    ctx.sum2 = PyArray_DATA (sum2);
+    ctx.count = PyArray_DATA (count);
+
+    kern_parallel (ctx.nclos, 16384 / (ctx.npol * ctx.nchan + 1) + 1, func,
+		   &ctx);
+
+    Py_RETURN_NONE;
+}
+
+
+PyObject *
+py_closure_triples (PyObject *self, PyObject *args)
+{
+    return closure_common (args, 3, NPY_CDOUBLE, triple_work);
+}
+
+
+PyObject *
+py_closure_quads (PyObject *self, PyObject *args)
+{
+    return closure_common (args, 4, NPY_DOUBLE, quad_work);
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Direct Fourier transform of a list of point and Gaussian components
+ * into model visibilities.
+ *
+ * For a component at (l, m), the phase of a record's visibility is
+ * -2 pi tau f, where tau = u l + v m + w (n - 1) is a delay in
+ * nanoseconds and f is the channel frequency in GHz. Across a run of
+ * evenly spaced channels the phasor therefore advances by a constant
+ * factor, so we only call sin and cos at the start of each run and
+ * then rotate incrementally. The phasor is recomputed exactly every
+ * RESYNC channels so that rounding errors can't build up.
+ *
+ * The spectral and Gaussian amplitude factors that don't depend on the
+ * record are tabulated per component and channel up front.
+ *
+ * Records are split between threads. Each thread accumulates the model
+ * for one record at a time into private scratch space and then applies
+ * it to the output according to the mode. */
+
+#include "kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define RESYNC 64
+
+#define MODE_MODEL 0
+#define MODE_SUBTRACT 1
+#define MODE_DIVIDE 2
+
+/* Component parameters: l, m, then the Gaussian shape as the
+ * coefficients of u^2, uv, and v^2 (in ns^-2 GHz^-2) in the exponent of
+ * its transform; all zero for points. The fluxes are folded into the
+ * amplitude table. */
+#define NCPAR 5
+
+typedef struct {
+    npy_intp nrec, nchan, ncomp;
+    const double *uvw, *freq, *comps;
+    const double *amp; /* ncomp * nchan: spectral factors times flux */
+    const npy_intp *runs; /* start of each run of evenly spaced channels */
+    npy_intp nruns;
+    int mode;
+    float *data; /* complex64, interleaved */
+    int *flags; /* may be NULL */
+    npy_intp bad[KERN_MAX_THREADS];
+} dft_ctx;
+
+
+static void
+dft_record (const dft_ctx *ctx, npy_intp i, double *acc)
+{
+    const double *uvw = ctx->uvw + 3 * i;
+    const double *cp, *amp;
+    npy_intp k, r, c, c0, c1;
+    double l, m, n, tau, gu, gv, guv, q, f, df;
+    double pre = 1, pim = 0, sre, sim, t, g;
+
+    for (c = 0; c < 2 * ctx->nchan; c++)
+	acc[c] = 0;
+
+    for (k = 0; k < ctx->ncomp; k++) {
+	cp = ctx->comps + NCPAR * k;
+	amp = ctx->amp + k * ctx->nchan;
+	l = cp[0];
+	m = cp[1];
+	n = sqrt (1 - l * l - m * m);
+	tau = uvw[0] * l + uvw[1] * m + uvw[2] * (n - 1);
+
+	gu = cp[2];
+	guv = cp[3];
+	gv = cp[4];
+	q = gu * uvw[0] * uvw[0] + guv * uvw[0] * uvw[1] + gv * uvw[1] * uvw[1];
+
+	for (r = 0; r < ctx->nruns; r++) {
+	    c0 = ctx->runs[r];
+	    c1 = ctx->runs[r + 1];
+	    df = c1 - c0 > 1 ? ctx->freq[c0 + 1] - ctx->freq[c0] : 0;
+	    sre = cos (-2 * M_PI * tau * df);
+	    sim = sin (-2 * M_PI * tau * df);
+
+	    for (c = c0; c < c1; c++) {
+		if ((c - c0) % RESYNC == 0) {
+		    pre = cos (-2 * M_PI * tau * ctx->freq[c]);
+		    pim = sin (-2 * M_PI * tau * ctx->freq[c]);
+		} else {
+		    t = pre * sre - pim * sim;
+		    pim = pre * sim + pim * sre;
+		    pre = t;
+		}
+
+		g = amp[c];
+		if (q != 0) {
+		    f = ctx->freq[c];
+		    g *= exp (-q * f * f);
+		}
+
+		acc[2*c] += g * pre;
+		acc[2*c+1] += g * pim;
+	    }
+	}
+    }
+}
+
+
+static void
+dft_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    dft_ctx *ctx = (dft_ctx *) vctx;
+    double *acc, mre, mim, dre, dim, mag2;
+    float *d;
+    npy_intp i, c;
+
+    if ((acc = malloc (2 * ctx->nchan * sizeof (double))) == NULL) {
+	KERN_NOTE_ERROR (ctx, tid, start);
+	return;
+    }
+
+    for (i = start; i < end; i++) {
+	dft_record (ctx, i, acc);
+	d = ctx->data + 2 * i * ctx->nchan;
+
+	for (c = 0; c < ctx->nchan; c++) {
+	    mre = acc[2*c];
+	    mim = acc[2*c+1];
+
+	    switch (ctx->mode) {
+	    case MODE_MODEL:
+		d[2*c] = (float) mre;
+		d[2*c+1] = (float) mim;
+		break;
+	    case MODE_SUBTRACT:
+		d[2*c] -= (float) mre;
+		d[2*c+1] -= (float) mim;
+		break;
+	    case MODE_DIVIDE:
+		mag2 = mre * mre + mim * mim;
+
+		if (mag2 == 0) {
+		    d[2*c] = d[2*c+1] = 0;
+		    if (ctx->flags != NULL)
+			ctx->flags[i * ctx->nchan + c] = 0;
+		} else {
+		    dre = d[2*c];
+		    dim = d[2*c+1];
+		    d[2*c] = (float) ((dre * mre + dim * mim) / mag2);
+		    d[2*c+1] = (float) ((dim * mre - dre * mim) / mag2);
+		}
+		break;
+	    }
+	}
+    }
+
+    free (acc);
+}
+
+
+/* Split the channels into runs with constant spacing. */
+
+static npy_intp
+find_runs (const double *freq, npy_intp nchan, npy_intp *runs)
+{
+    npy_intp c, nruns = 0;
+    double df = 0;
+
+    runs[0] = 0;
+
+    for (c = 1; c < nchan; c++) {
+	if (c - runs[nruns] == 1)
+	    df = freq[c] - freq[c - 1];
+	else if (fabs ((freq[c] - freq[c - 1]) - df) > 1e-9 * fabs (freq[c]))
+	    runs[++nruns] = c;
+    }
+
+    runs[++nruns] = nchan;
+    return nruns;
+}
+
+
+PyObject *
+py_dft_predict (PyObject *self, PyObject *args)
+{
+    PyObject *uvw, *freq, *comps, *amp, *data, *flags;
+    dft_ctx ctx;
+    npy_intp *runs;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!iO!O", &PyArray_Type, &uvw,
+			   &PyArray_Type, &freq, &PyArray_Type, &comps,
+			   &PyArray_Type, &amp, &ctx.mode, &PyArray_Type,
+			   &data, &flags))
+	return NULL;
+
+    KERN_CHECK (uvw, NPY_DOUBLE, "uvw");
+    KERN_CHECK (freq, NPY_DOUBLE, "freq");
+    KERN_CHECK (comps, NPY_DOUBLE, "comps");
+    KERN_CHECK (amp, NPY_DOUBLE, "amp");
+    KERN_CHECK_OUT (data, NPY_CFLOAT, "data");
+
+    if (ctx.mode < MODE_MODEL || ctx.mode > MODE_DIVIDE) {
+	PyErr_Format (PyExc_ValueError, "unknown prediction mode %d", ctx.mode);
+	return NULL;
+    }
+
+    ctx.nrec = PyArray_SIZE (uvw) / 3;
+    ctx.nchan = PyArray_SIZE (freq);
+    ctx.ncomp = PyArray_SIZE (comps) / NCPAR;
+
+    KERN_CHECK_SIZE (uvw, 3 * ctx.nrec, "uvw");
+    KERN_CHECK_SIZE (comps, NCPAR * ctx.ncomp, "comps");
+    KERN_CHECK_SIZE (amp, ctx.ncomp * ctx.nchan, "amp");
+    KERN_CHECK_SIZE (data, ctx.nrec * ctx.nchan, "data");
+
+    if (flags == Py_None)
+	ctx.flags = NULL;
+    else if (!PyArray_Check (flags)) {
+	PyErr_SetString (PyExc_TypeError, "flags must be an ndarray or None");
+	return NULL;
+    } else {
+	KERN_CHECK_OUT (flags, NPY_INT, "flags");
+	KERN_CHECK_SIZE (flags, ctx.nrec * ctx.nchan, "flags");
+	ctx.flags = PyArray_DATA (flags);
+    }
+
+    ctx.uvw = PyArray_DATA (uvw);
+    ctx.freq = PyArray_DATA (freq);
+    ctx.comps = PyArray_DATA (comps);
+    ctx.amp = PyArray_DATA (amp);
+    ctx.data = PyArray_DATA (data);
+
+    if (ctx.nchan == 0 || ctx.nrec == 0) {
+	Py_RETURN_NONE;
+    }
+
+    if ((runs = PyMem_Malloc ((ctx.nchan + 1) * sizeof (npy_intp))) == NULL)
+	return PyErr_NoMemory ();
+
+    ctx.nruns = find_runs (ctx.freq, ctx.nchan, runs);
+    ctx.runs = runs;
+
+    kern_clear_errors (ctx.bad);
+    kern_parallel (ctx.nrec, 16384 / (ctx.nchan * (ctx.ncomp + 1)) + 1,
+		   dft_work, &ctx);
+    PyMem_Free (runs);
+
+    if (kern_first_error (ctx.bad) >= 0)
+	return PyErr_NoMemory ();
+
+    Py_RETURN_NONE;
+}
@@ -0,0 +1,389 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Unnormalized complex FFTs along one axis of a multidimensional
+ * array, with the independent lines spread over threads.
+ *
+ * Power-of-two lengths use an iterative radix-2 transform. Other
+ * lengths are done with Bluestein's algorithm, which turns the DFT into
+ * a circular convolution of power-of-two length. The tables needed for
+ * a given length (a "plan") are built while we hold the GIL and are
+ * cached, so the threads only ever read them. Transforms with sign +1
+ * are done by conjugating before and after a forward transform.
+ *
+ * Lines are transformed in blocks of adjacent columns so that
+ * transforms along an outer axis of a C-ordered array don't read
+ * memory with a stride of a whole row for every element. */
+
+#include "kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FFT_BLOCK 8
+#define FFT_CACHE_SIZE 16
+
+typedef struct {
+    npy_intp n; /* transform length */
+    npy_intp m; /* power-of-two length of the core transform */
+    npy_intp *rev; /* m-element bit-reversal permutation */
+    double *tw; /* m/2 complex twiddles, exp (-2 pi i k / m) */
+    double *chirp; /* Bluestein only: n complex, exp (i pi j^2 / n) */
+    double *bfft; /* Bluestein only: m complex, FFT of the chirp filter */
+} fft_plan;
+
+static fft_plan *plan_cache[FFT_CACHE_SIZE];
+
+
+/* The core in-place power-of-two transform of @x, with sign -1. */
+
+static void
+fft_pow2 (const fft_plan *plan, double *x)
+{
+    npy_intp m = plan->m, i, j, k, len, half, step;
+    double tre, tim, wre, wim, *a, *b;
+
+    for (i = 0; i < m; i++) {
+	j = plan->rev[i];
+
+	if (j > i) {
+	    tre = x[2*i];
+	    tim = x[2*i+1];
+	    x[2*i] = x[2*j];
+	    x[2*i+1] = x[2*j+1];
+	    x[2*j] = tre;
+	    x[2*j+1] = tim;
+	}
+    }
+
+    for (len = 2; len <= m; len <<= 1) {
+	half = len >> 1;
+	step = m / len;
+
+	for (i = 0; i < m; i += len) {
+	    for (k = 0; k < half; k++) {
+		wre = plan->tw[2*k*step];
+		wim = plan->tw[2*k*step+1];
+		a = x + 2 * (i + k);
+		b = x + 2 * (i + k + half);
+		tre = b[0] * wre - b[1] * wim;
+		tim = b[0] * wim + b[1] * wre;
+		b[0] = a[0] - tre;
+		b[1] = a[1] - tim;
+		a[0] += tre;
+		a[1] += tim;
+	    }
+	}
+    }
+}
+
+
+/* Forward transform of @x using Bluestein's algorithm. @work must hold
+ * plan->m complex values. */
+
+static void
+fft_bluestein (const fft_plan *plan, double *x, double *work)
+{
+    npy_intp n = plan->n, m = plan->m, j;
+    double re, im, cre, cim;
+
+    for (j = 0; j < n; j++) {
+	cre = plan->chirp[2*j];
+	cim = -plan->chirp[2*j+1];
+	work[2*j] = x[2*j] * cre - x[2*j+1] * cim;
+	work[2*j+1] = x[2*j] * cim + x[2*j+1] * cre;
+    }
+
+    memset (work + 2 * n, 0, 2 * (m - n) * sizeof (double));
+    fft_pow2 (plan, work);
+
+    /* Multiply by the filter and inverse-transform, using the conjugation
+     * trick: ifft (y) = conj (fft (conj (y))) / m. */
+
+    for (j = 0; j < m; j++) {
+	re = work[2*j] * plan->bfft[2*j] - work[2*j+1] * plan->bfft[2*j+1];
+	im = work[2*j] * plan->bfft[2*j+1] + work[2*j+1] * plan->bfft[2*j];
+	work[2*j] = re;
+	work[2*j+1] = -im;
+    }
+
+    fft_pow2 (plan, work);
+
+    for (j = 0; j < n; j++) {
+	re = work[2*j] / m;
+	im = -work[2*j+1] / m;
+	cre = plan->chirp[2*j];
+	cim = -plan->chirp[2*j+1];
+	x[2*j] = re * cre - im * cim;
+	x[2*j+1] = re * cim + im * cre;
+    }
+}
+
+
+static void
+plan_free (fft_plan *plan)
+{
+    if (plan == NULL)
+	return;
+
+    free (plan->rev);
+    free (plan->tw);
+    free (plan->chirp);
+    free (plan->bfft);
+    free (plan);
+}
+
+
+static fft_plan *
+plan_new (npy_intp n)
+{
+    fft_plan *plan;
+    npy_intp m, i, j, bits, k;
+    npy_int64 j2;
+    double theta;
+
+    if ((plan = calloc (1, sizeof (fft_plan))) == NULL)
+	return NULL;
+
+    plan->n = n;
+
+    if ((n & (n - 1)) == 0)
+	m = n;
+    else {
+	m = 1;
+	while (m < 2 * n - 1)
+	    m <<= 1;
+    }
+
+    plan->m = m;
+
+    for (bits = 0; ((npy_intp) 1 << bits) < m; bits++)
+	;
+
+    plan->rev = malloc (m * sizeof (npy_intp));
+    plan->tw = malloc ((m / 2 + 1) * 2 * sizeof (double));
+
+    if (plan->rev == NULL || plan->tw == NULL)
+	goto fail;
+
+    for (i = 0; i < m; i++) {
+	k = 0;
+	for (j = 0; j < bits; j++)
+	    if (i & ((npy_intp) 1 << j))
+		k |= (npy_intp) 1 << (bits - 1 - j);
+	plan->rev[i] = k;
+    }
+
+    for (i = 0; i < m / 2 + 1; i++) {
+	theta = -2 * M_PI * i / m;
+	plan->tw[2*i] = cos (theta);
+	plan->tw[2*i+1] = sin (theta);
+    }
+
+    if (m == n)
+	return plan;
+
+    plan->chirp = malloc (2 * n * sizeof (double));
+    plan->bfft = calloc (2 * m, sizeof (double));
+
+    if (plan->chirp == NULL || plan->bfft == NULL)
+	goto fail;
+
+    /* j^2 is reduced modulo 2n exactly, in integers, to keep the phases
+     * accurate for long transforms. */
+
+    for (j = 0; j < n; j++) {
+	j2 = ((npy_int64) j * j) % (2 * (npy_int64) n);
+	theta = M_PI * (double) j2 / n;
+	plan->chirp[2*j] = cos (theta);
+	plan->chirp[2*j+1] = sin (theta);
+    }
+
+    plan->bfft[0] = plan->chirp[0];
+    plan->bfft[1] = plan->chirp[1];
+
+    for (j = 1; j < n; j++) {
+	plan->bfft[2*j] = plan->bfft[2*(m-j)] = plan->chirp[2*j];
+	plan->bfft[2*j+1] = plan->bfft[2*(m-j)+1] = plan->chirp[2*j+1];
+    }
+
+    fft_pow2 (plan, plan->bfft);
+    return plan;
+
+fail:
+    plan_free (plan);
+    return NULL;
+}
+
+
+/* Find or build the plan for length @n. Must be called with the GIL
+ * held, which is what protects the cache. If the cache is full, the
+ * caller gets a private plan and *owned is set. */
+
+static fft_plan *
+plan_get (npy_intp n, int *owned)
+{
+    fft_plan *plan;
+    int i;
+
+    *owned = 0;
+
+    for (i = 0; i < FFT_CACHE_SIZE; i++) {
+	if (plan_cache[i] == NULL)
+	    break;
+	if (plan_cache[i]->n == n)
+	    return plan_cache[i];
+    }
+
+    if ((plan = plan_new (n)) == NULL)
+	return NULL;
+
+    if (i < FFT_CACHE_SIZE)
+	plan_cache[i] = plan;
+    else
+	*owned = 1;
+
+    return plan;
+}
+
+
+typedef struct {
+    const fft_plan *plan;
+    double *data; /* complex128, interleaved */
+    npy_intp n, inner;
+    int sign;
+    npy_intp bad[KERN_MAX_THREADS];
+} fft_ctx;
+
+
+static void
+fft_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    fft_ctx *ctx = (fft_ctx *) vctx;
+    const fft_plan *plan = ctx->plan;
+    npy_intp n = ctx->n, inner = ctx->inner, l, o, c, nb, b, k;
+    double *lines, *work, *base, *p, *q;
+
+    lines = malloc ((FFT_BLOCK * n + plan->m) * 2 * sizeof (double));
+    if (lines == NULL) {
+	KERN_NOTE_ERROR (ctx, tid, start);
+	return;
+    }
+
+    work = lines + 2 * FFT_BLOCK * n;
+
+    for (l = start; l < end; l += nb) {
+	o = l / inner;
+	c = l % inner;
+
+	nb = FFT_BLOCK;
+	if (nb > end - l)
+	    nb = end - l;
+	if (nb > inner - c)
+	    nb = inner - c;
+
+	base = ctx->data + 2 * (o * n * inner + c);
+
+	for (k = 0; k < n; k++) {
+	    p = base + 2 * k * inner;
+	    for (b = 0; b < nb; b++) {
+		q = lines + 2 * (b * n + k);
+		q[0] = p[2*b];
+		q[1] = ctx->sign > 0 ? -p[2*b+1] : p[2*b+1];
+	    }
+	}
+
+	for (b = 0; b < nb; b++) {
+	    if (plan->chirp == NULL)
+		fft_pow2 (plan, lines + 2 * b * n);
+	    else
+		fft_bluestein (plan, lines + 2 * b * n, work);
+	}
+
+	for (k = 0; k < n; k++) {
+	    p = base + 2 * k * inner;
+	    for (b = 0; b < nb; b++) {
+		q = lines + 2 * (b * n + k);
+		p[2*b] = q[0];
+		p[2*b+1] = ctx->sign > 0 ? -q[1] : q[1];
+	    }
+	}
+    }
+
+    free (lines);
+}
+
+
+PyObject *
+py_fft_lines (PyObject *self, PyObject *args)
+{
+    PyObject *arr;
+    fft_ctx ctx;
+    fft_plan *plan;
+    npy_intp outer, n, inner;
+    long louter, ln, linner;
+    int owned;
+
+    if (!PyArg_ParseTuple (args, "O!llli", &PyArray_Type, &arr, &louter,
+			   &ln, &linner, &ctx.sign))
+	return NULL;
+
+    KERN_CHECK_OUT (arr, NPY_CDOUBLE, "arr");
+
+    outer = louter;
+    n = ln;
+    inner = linner;
+
+    if (outer < 0 || n < 0 || inner < 0) {
+	PyErr_SetString (PyExc_ValueError, "array dimensions must be nonnegative");
+	return NULL;
+    }
+
+    if (ctx.sign != 1 && ctx.sign != -1) {
+	PyErr_SetString (PyExc_ValueError, "transform sign must be 1 or -1");
+	return NULL;
+    }
+
+    KERN_CHECK_SIZE (arr, outer * n * inner, "arr");
+
+    if (n < 2 || outer * inner == 0) {
+	Py_RETURN_NONE;
+    }
+
+    if ((plan = plan_get (n, &owned)) == NULL)
+	return PyErr_NoMemory ();
+
+    ctx.plan = plan;
+    ctx.data = PyArray_DATA (arr);
+    ctx.n = n;
+    ctx.inner = inner;
+    kern_clear_errors (ctx.bad);
+
+    /* Aim for a few tens of thousands of butterflies per work unit. */
+    kern_parallel (outer * inner, 1 + 16384 / n, fft_work, &ctx);
+
+    if (owned)
+	plan_free (plan);
+
+    if (kern_first_error (ctx.bad) >= 0)
+	return PyErr_NoMemory ();
+
+    Py_RETURN_NONE;
+}
@@ -0,0 +1,459 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Interference flagging of (time, channel) waterfalls with the
+ * SumThreshold method (Offringa et al. 2010, MNRAS 405, 155).
+ *
+ * Each pass works on the visibility amplitudes with a smooth background
+ * subtracted: a running median of the good samples along each
+ * spectrum, smoothed in turn by a running median along time. The
+ * residuals are scaled by a robust noise estimate (1.4826 times their
+ * median absolute value), and then runs of M = 1, 2, 4, ... samples
+ * along each axis are flagged if their sum exceeds M chi_M, with chi_M
+ * = chi_1 / rho^log2(M). Samples that are already flagged count as
+ * exactly chi_M, so a long run of mildly bright samples next to a
+ * strong spike gets flagged too. Only positive excursions are flagged, since
+ * interference adds power. The whole thing is repeated a few times so
+ * that the background and noise estimates are made without the
+ * interference found in the previous pass.
+ *
+ * Window sums are kept as running sums, so each window length costs
+ * O(1) per sample. Along the time axis the running sums of all the
+ * channels are advanced together, which keeps the inner loop
+ * contiguous and vectorizable. The waterfalls are independent, so
+ * each thread takes a share of them. */
+
+#include "kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    npy_intp nwf, ntime, nchan;
+    const float *data; /* complex64, interleaved */
+    int *flags;
+    double chi1, rho;
+    npy_intp maxwin, medhw, medhwt;
+    int niter;
+    npy_intp bad[KERN_MAX_THREADS];
+} flag_ctx;
+
+
+/* Hoare's selection: reorder @v so that v[k] is the (k+1)'th smallest
+ * value, and return it. */
+
+static float
+select_kth (float *v, npy_intp n, npy_intp k)
+{
+    npy_intp lo = 0, hi = n - 1, i, j;
+    float pivot, tmp;
+
+    while (lo < hi) {
+	pivot = v[(lo + hi) / 2];
+	i = lo;
+	j = hi;
+
+	while (i <= j) {
+	    while (v[i] < pivot)
+		i++;
+	    while (v[j] > pivot)
+		j--;
+	    if (i <= j) {
+		tmp = v[i];
+		v[i] = v[j];
+		v[j] = tmp;
+		i++;
+		j--;
+	    }
+	}
+
+	if (k <= j)
+	    hi = j;
+	else if (k >= i)
+	    lo = i;
+	else
+	    break;
+    }
+
+    return v[k];
+}
+
+
+/* Sorted windows for running medians. Values go in and come out one
+ * at a time, so keeping the window sorted by insertion costs O(w) per
+ * step with no unpredictable branching to speak of. */
+
+static void
+win_insert (float *w, npy_intp *n, float x)
+{
+    npy_intp i = *n;
+
+    while (i > 0 && w[i-1] > x) {
+	w[i] = w[i-1];
+	i--;
+    }
+
+    w[i] = x;
+    (*n)++;
+}
+
+
+static void
+win_remove (float *w, npy_intp *n, float x)
+{
+    npy_intp i = 0;
+
+    while (i < *n && w[i] != x)
+	i++;
+
+    if (i == *n)
+	return;
+
+    for (; i + 1 < *n; i++)
+	w[i] = w[i+1];
+
+    (*n)--;
+}
+
+
+/* Work out the background of the amplitudes @amp and write the scaled
+ * residuals into @res. The background is a running median along each
+ * spectrum followed by a running median of that along time, which
+ * follows the bandpass without soaking up either narrowband or
+ * broadband interference. @valid and @scratch are ntime * nchan
+ * elements long; @win and @nwin hold nchan sorted windows. Returns
+ * nonzero if there's nothing left to flag. */
+
+static int
+residuals (flag_ctx *ctx, const float *amp, const char *mask, float *res,
+	   char *valid, float *scratch, float *win, npy_intp *nwin)
+{
+    npy_intp t, c, k, n, nchan = ctx->nchan, ntime = ctx->ntime;
+    npy_intp hw = ctx->medhw, hwt = ctx->medhwt, wlen = 2 * hwt + 1;
+    npy_intp ntot = ntime * nchan;
+    const float *a, *b;
+    const char *m, *v;
+    float *r, *w, sigma;
+    char *o;
+
+    /* Along frequency, from @amp into @res, one spectrum at a time. */
+
+    for (t = 0; t < ntime; t++) {
+	a = amp + t * nchan;
+	m = mask + t * nchan;
+	r = res + t * nchan;
+	o = valid + t * nchan;
+	n = 0;
+
+	for (k = 0; k <= hw && k < nchan; k++)
+	    if (!m[k])
+		win_insert (win, &n, a[k]);
+
+	for (c = 0; c < nchan; c++) {
+	    o[c] = n > 0;
+	    if (n > 0)
+		r[c] = win[n / 2];
+
+	    if (c - hw >= 0 && !m[c-hw])
+		win_remove (win, &n, a[c-hw]);
+	    if (c + hw + 1 < nchan && !m[c+hw+1])
+		win_insert (win, &n, a[c+hw+1]);
+	}
+    }
+
+    /* Along time, from @res into @scratch, advancing the windows of all
+     * of the channels together. */
+
+    for (c = 0; c < nchan; c++)
+	nwin[c] = 0;
+
+    for (t = 0; t <= hwt && t < ntime; t++) {
+	b = res + t * nchan;
+	v = valid + t * nchan;
+	for (c = 0; c < nchan; c++)
+	    if (v[c])
+		win_insert (win + c * wlen, nwin + c, b[c]);
+    }
+
+    for (t = 0; t < ntime; t++) {
+	r = scratch + t * nchan;
+	a = amp + t * nchan;
+
+	for (c = 0; c < nchan; c++) {
+	    w = win + c * wlen;
+	    r[c] = nwin[c] > 0 ? a[c] - w[nwin[c] / 2] : 0;
+	}
+
+	if (t - hwt >= 0) {
+	    b = res + (t - hwt) * nchan;
+	    v = valid + (t - hwt) * nchan;
+	    for (c = 0; c < nchan; c++)
+		if (v[c])
+		    win_remove (win + c * wlen, nwin + c, b[c]);
+	}
+
+	if (t + hwt + 1 < ntime) {
+	    b = res + (t + hwt + 1) * nchan;
+	    v = valid + (t + hwt + 1) * nchan;
+	    for (c = 0; c < nchan; c++)
+		if (v[c])
+		    win_insert (win + c * wlen, nwin + c, b[c]);
+	}
+    }
+
+    /* The noise level, from the median absolute residual. */
+
+    memcpy (res, scratch, ntot * sizeof (float));
+    n = 0;
+
+    for (k = 0; k < ntot; k++)
+	if (!mask[k])
+	    scratch[n++] = fabsf (res[k]);
+
+    if (n == 0)
+	return 1;
+
+    sigma = 1.4826 * select_kth (scratch, n, n / 2);
+    if (sigma <= 0)
+	return 1;
+
+    for (k = 0; k < ntot; k++)
+	res[k] /= sigma;
+
+    return 0;
+}
+
+
+/* One SumThreshold step along the channel axis: sums of @M consecutive
+ * channels in each spectrum. */
+
+static void
+sumthresh_chan (flag_ctx *ctx, const float *res, const char *mask,
+		char *out, npy_intp M, double chi)
+{
+    npy_intp t, c, k, marked, nchan = ctx->nchan;
+    const float *r;
+    const char *m;
+    char *o;
+    double sum, limit = M * chi;
+
+    if (M > nchan)
+	return;
+
+    for (t = 0; t < ctx->ntime; t++) {
+	r = res + t * nchan;
+	m = mask + t * nchan;
+	o = out + t * nchan;
+	sum = 0;
+
+	for (c = 0; c < M; c++)
+	    sum += m[c] ? chi : r[c];
+
+	marked = 0;
+
+	for (c = 0; ; c++) {
+	    if (sum > limit) {
+		for (k = c > marked ? c : marked; k < c + M; k++)
+		    o[k] = 1;
+		marked = c + M;
+	    }
+
+	    if (c + M >= nchan)
+		break;
+
+	    sum += (m[c+M] ? chi : r[c+M]) - (m[c] ? chi : r[c]);
+	}
+    }
+}
+
+
+/* The same along the time axis, advancing the sums of all channels at
+ * once. @sums and @marked are scratch space of @nchan elements. */
+
+static void
+sumthresh_time (flag_ctx *ctx, const float *res, const char *mask,
+		char *out, npy_intp M, double chi, double *sums,
+		npy_intp *marked)
+{
+    npy_intp t, c, k, nchan = ctx->nchan;
+    const float *rin, *rout;
+    const char *min, *mout;
+    double limit = M * chi;
+
+    if (M > ctx->ntime)
+	return;
+
+    for (c = 0; c < nchan; c++) {
+	sums[c] = 0;
+	marked[c] = 0;
+    }
+
+    for (t = 0; t < M; t++) {
+	rin = res + t * nchan;
+	min = mask + t * nchan;
+	for (c = 0; c < nchan; c++)
+	    sums[c] += min[c] ? chi : rin[c];
+    }
+
+    for (t = 0; ; t++) {
+	for (c = 0; c < nchan; c++) {
+	    if (sums[c] <= limit)
+		continue;
+
+	    for (k = t > marked[c] ? t : marked[c]; k < t + M; k++)
+		out[k * nchan + c] = 1;
+	    marked[c] = t + M;
+	}
+
+	if (t + M >= ctx->ntime)
+	    break;
+
+	rin = res + (t + M) * nchan;
+	min = mask + (t + M) * nchan;
+	rout = res + t * nchan;
+	mout = mask + t * nchan;
+
+	for (c = 0; c < nchan; c++)
+	    sums[c] += (min[c] ? chi : rin[c]) - (mout[c] ? chi : rout[c]);
+    }
+}
+
+
+static void
+flag_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    flag_ctx *ctx = (flag_ctx *) vctx;
+    npy_intp w, k, M, ntot = ctx->ntime * ctx->nchan, nwin;
+    float *amp, *res, *scratch, *win;
+    char *mask, *out;
+    double *sums, chi;
+    npy_intp *marked;
+    const float *d;
+    int *f, iter;
+
+    nwin = ctx->nchan * (2 * ctx->medhwt + 1);
+    if (nwin < 2 * ctx->medhw + 1)
+	nwin = 2 * ctx->medhw + 1;
+
+    amp = malloc ((3 * ntot + nwin) * sizeof (float));
+    mask = malloc (2 * ntot);
+    sums = malloc (ctx->nchan * (sizeof (double) + sizeof (npy_intp)));
+
+    if (amp == NULL || mask == NULL || sums == NULL) {
+	KERN_NOTE_ERROR (ctx, tid, start);
+	free (amp);
+	free (mask);
+	free (sums);
+	return;
+    }
+
+    res = amp + ntot;
+    scratch = res + ntot;
+    win = scratch + ntot;
+    out = mask + ntot;
+    marked = (npy_intp *) (sums + ctx->nchan);
+
+    for (w = start; w < end; w++) {
+	d = ctx->data + 2 * w * ntot;
+	f = ctx->flags + w * ntot;
+
+	/* NaNs would never leave the median windows, so treat them as
+	 * flagged. */
+
+	for (k = 0; k < ntot; k++) {
+	    amp[k] = sqrtf (d[2*k] * d[2*k] + d[2*k+1] * d[2*k+1]);
+	    mask[k] = f[k] == 0 || amp[k] != amp[k];
+	}
+
+	for (iter = 0; iter < ctx->niter; iter++) {
+	    if (residuals (ctx, amp, mask, res, out, scratch, win, marked))
+		break;
+
+	    memcpy (out, mask, ntot);
+
+	    for (M = 1; M <= ctx->maxwin; M *= 2) {
+		chi = ctx->chi1 / pow (ctx->rho, log ((double) M) / log (2.));
+		sumthresh_time (ctx, res, mask, out, M, chi, sums, marked);
+		sumthresh_chan (ctx, res, mask, out, M, chi);
+		memcpy (mask, out, ntot);
+	    }
+	}
+
+	for (k = 0; k < ntot; k++)
+	    if (mask[k])
+		f[k] = 0;
+    }
+
+    free (amp);
+    free (mask);
+    free (sums);
+}
+
+
+PyObject *
+py_sumthreshold (PyObject *self, PyObject *args)
+{
+    PyObject *data, *flags;
+    flag_ctx ctx;
+    long maxwin, medhw, medhwt;
+
+    if (!PyArg_ParseTuple (args, "O!O!ddllli", &PyArray_Type, &data,
+			   &PyArray_Type, &flags, &ctx.chi1, &ctx.rho,
+			   &maxwin, &medhw, &medhwt, &ctx.niter))
+	return NULL;
+
+    KERN_CHECK (data, NPY_CFLOAT, "data");
+    KERN_CHECK_OUT (flags, NPY_INT, "flags");
+
+    if (PyArray_NDIM (data) != 3) {
+	PyErr_SetString (PyExc_ValueError, "data must be three-dimensional");
+	return NULL;
+    }
+
+    if (ctx.chi1 <= 0 || ctx.rho < 1 || maxwin < 1 || medhw < 0 ||
+	medhwt < 0) {
+	PyErr_SetString (PyExc_ValueError, "bad SumThreshold parameters");
+	return NULL;
+    }
+
+    ctx.nwf = PyArray_DIM (data, 0);
+    ctx.ntime = PyArray_DIM (data, 1);
+    ctx.nchan = PyArray_DIM (data, 2);
+    ctx.maxwin = maxwin;
+    ctx.medhw = medhw;
+    ctx.medhwt = medhwt;
+
+    KERN_CHECK_SIZE (flags, ctx.nwf * ctx.ntime * ctx.nchan, "flags");
+
+    if (ctx.ntime * ctx.nchan == 0) {
+	Py_RETURN_NONE;
+    }
+
+    ctx.data = PyArray_DATA (data);
+    ctx.flags = PyArray_DATA (flags);
+    kern_clear_errors (ctx.bad);
+
+    kern_parallel (ctx.nwf, 1, flag_work, &ctx);
+
+    if (kern_first_error (ctx.bad) >= 0)
+	return PyErr_NoMemory ();
+
+    Py_RETURN_NONE;
+}
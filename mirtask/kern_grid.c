@@ -0,0 +1,391 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Convolutional gridding of visibilities, using a tabulated gridding
+ * function such as the one returned by util.sphGridFunc.
+ *
+ * The grid is split into horizontal bands of rows, one per thread, so
+ * that no two threads ever write to the same grid cell. Every thread
+ * looks at every visibility, but skips those whose footprint can't
+ * touch its band; since a channel's v coordinate scales with its
+ * frequency, whole records can usually be skipped at once. The band
+ * boundaries are chosen from a histogram of the samples' rows so that
+ * the threads get similar amounts of work.
+ *
+ * Coordinates: u and v are given in nanoseconds and scaled to
+ * wavelengths by each channel's frequency in GHz. Cell (nv/2, nu/2)
+ * of the grid is the origin of the uv plane, as after an fftshift. */
+
+#include "kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define MAX_WIDTH 16
+
+typedef struct {
+    npy_intp nvis, nchan;
+    const double *u, *v, *freq;
+    const float *data; /* complex64, interleaved */
+    const float *wt;
+    const double *gcf;
+    int nsamp, width, hermitian;
+    double du, dv, fmin, fmax;
+    int nu, nv;
+    double *grid; /* complex128, interleaved */
+    double *wgrid; /* may be NULL */
+    int *bands; /* nbands + 1 row boundaries */
+    double sumwt[KERN_MAX_THREADS];
+    npy_intp ndropped[KERN_MAX_THREADS];
+} grid_ctx;
+
+
+/* The first row or column touched by a sample at fractional pixel
+ * position @p. */
+
+static int
+footprint_start (double p, int width)
+{
+    return (int) ceil (p - 0.5 * width);
+}
+
+
+static double
+gcf_lookup (const grid_ctx *ctx, double offset)
+{
+    int idx;
+
+    idx = (int) floor ((ctx->nsamp / ctx->width) * offset +
+		       ctx->nsamp / 2 + 0.5);
+    if (idx < 0)
+	idx = 0;
+    if (idx >= ctx->nsamp)
+	idx = ctx->nsamp - 1;
+    return ctx->gcf[idx];
+}
+
+
+/* Is a sample's footprint entirely on the grid? */
+
+static int
+on_grid (const grid_ctx *ctx, double pu, double pv)
+{
+    int u0 = footprint_start (pu, ctx->width);
+    int v0 = footprint_start (pv, ctx->width);
+
+    return u0 >= 0 && v0 >= 0 && u0 + ctx->width <= ctx->nu &&
+	v0 + ctx->width <= ctx->nv;
+}
+
+
+/* Add one sample to rows [r0, r1) of the grid. */
+
+static void
+grid_one (grid_ctx *ctx, int r0, int r1, double pu, double pv, double re,
+	  double im, double w)
+{
+    double ku[MAX_WIDTH], kv, f;
+    int u0, v0, i, j, rlo, rhi;
+    double *row;
+
+    v0 = footprint_start (pv, ctx->width);
+    rlo = v0 > r0 ? v0 : r0;
+    rhi = v0 + ctx->width < r1 ? v0 + ctx->width : r1;
+
+    if (rlo >= rhi)
+	return;
+
+    u0 = footprint_start (pu, ctx->width);
+
+    for (i = 0; i < ctx->width; i++)
+	ku[i] = gcf_lookup (ctx, u0 + i - pu);
+
+    for (j = rlo; j < rhi; j++) {
+	kv = w * gcf_lookup (ctx, j - pv);
+	row = ctx->grid + 2 * ((npy_intp) j * ctx->nu + u0);
+
+	for (i = 0; i < ctx->width; i++) {
+	    f = kv * ku[i];
+	    row[2 * i] += f * re;
+	    row[2 * i + 1] += f * im;
+	}
+
+	if (ctx->wgrid != NULL) {
+	    row = ctx->wgrid + (npy_intp) j * ctx->nu + u0;
+	    for (i = 0; i < ctx->width; i++)
+		row[i] += kv * ku[i];
+	}
+    }
+}
+
+
+/* The row that "owns" a sample, for bookkeeping purposes. */
+
+static int
+owner_row (const grid_ctx *ctx, double pv)
+{
+    int r = (int) floor (pv);
+
+    if (r < 0)
+	return 0;
+    if (r >= ctx->nv)
+	return ctx->nv - 1;
+    return r;
+}
+
+
+/* Might a record with the given v coordinate touch rows [r0, r1)? */
+
+static int
+record_touches (const grid_ctx *ctx, double v, int r0, int r1)
+{
+    double lo, hi, halfw = 0.5 * ctx->width + 1;
+
+    lo = v * (v < 0 ? ctx->fmax : ctx->fmin) / ctx->dv + ctx->nv / 2;
+    hi = v * (v < 0 ? ctx->fmin : ctx->fmax) / ctx->dv + ctx->nv / 2;
+
+    if (hi + halfw >= r0 && lo - halfw < r1)
+	return 1;
+
+    if (!ctx->hermitian)
+	return 0;
+
+    /* The mirrored samples lie in [2 (nv/2) - hi, 2 (nv/2) - lo]. */
+    return 2 * (ctx->nv / 2) - lo + halfw >= r0 &&
+	2 * (ctx->nv / 2) - hi - halfw < r1;
+}
+
+
+static void
+grid_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    grid_ctx *ctx = (grid_ctx *) vctx;
+    npy_intp b, i, c, k, ndropped = 0;
+    int r0, r1, own;
+    double f, pu, pv, w, re, im, sumwt = 0;
+
+    for (b = start; b < end; b++) {
+	r0 = ctx->bands[b];
+	r1 = ctx->bands[b + 1];
+
+	for (i = 0; i < ctx->nvis; i++) {
+	    if (!record_touches (ctx, ctx->v[i], r0, r1))
+		continue;
+
+	    for (c = 0; c < ctx->nchan; c++) {
+		k = i * ctx->nchan + c;
+		w = ctx->wt[k];
+
+		if (w == 0)
+		    continue;
+
+		f = ctx->freq[c];
+		pu = ctx->u[i] * f / ctx->du + ctx->nu / 2;
+		pv = ctx->v[i] * f / ctx->dv + ctx->nv / 2;
+		own = owner_row (ctx, pv);
+
+		if (!on_grid (ctx, pu, pv) ||
+		    (ctx->hermitian && !on_grid (ctx, 2 * (ctx->nu / 2) - pu,
+						   2 * (ctx->nv / 2) - pv))) {
+		    if (own >= r0 && own < r1)
+			ndropped++;
+		    continue;
+		}
+
+		if (own >= r0 && own < r1)
+		    sumwt += w;
+
+		re = ctx->data[2 * k];
+		im = ctx->data[2 * k + 1];
+		grid_one (ctx, r0, r1, pu, pv, re, im, w);
+
+		if (ctx->hermitian)
+		    grid_one (ctx, r0, r1, 2 * (ctx->nu / 2) - pu,
+			      2 * (ctx->nv / 2) - pv, re, -im, w);
+	    }
+	}
+    }
+
+    ctx->sumwt[tid] = sumwt;
+    ctx->ndropped[tid] = ndropped;
+}
+
+
+/* Choose band boundaries so that each band has about the same number
+ * of samples. We histogram the owner rows of the samples and then cut
+ * the cumulative distribution into equal pieces. */
+
+static int
+choose_bands (grid_ctx *ctx, int nbands)
+{
+    npy_intp *hist, total = 0, accum = 0, i, c;
+    double pv;
+    int r, b;
+
+    hist = calloc (ctx->nv, sizeof (npy_intp));
+    if (hist == NULL)
+	return 1;
+
+    for (i = 0; i < ctx->nvis; i++) {
+	for (c = 0; c < ctx->nchan; c++) {
+	    if (ctx->wt[i * ctx->nchan + c] == 0)
+		continue;
+
+	    pv = ctx->v[i] * ctx->freq[c] / ctx->dv;
+	    hist[owner_row (ctx, pv + ctx->nv / 2)]++;
+	    total++;
+
+	    if (ctx->hermitian) {
+		hist[owner_row (ctx, ctx->nv / 2 - pv)]++;
+		total++;
+	    }
+	}
+    }
+
+    ctx->bands[0] = 0;
+    b = 1;
+
+    for (r = 0; r < ctx->nv && b < nbands; r++) {
+	accum += hist[r];
+	if (accum * nbands >= total * b)
+	    ctx->bands[b++] = r + 1;
+    }
+
+    while (b <= nbands)
+	ctx->bands[b++] = ctx->nv;
+
+    free (hist);
+    return 0;
+}
+
+
+PyObject *
+py_grid_vis (PyObject *self, PyObject *args)
+{
+    PyObject *u, *v, *freq, *data, *wt, *gcf, *grid, *wgrid;
+    grid_ctx ctx;
+    npy_intp nsamples, ndropped = 0, c;
+    double sumwt = 0;
+    int i, nbands;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!O!O!iddiO!O", &PyArray_Type, &u,
+			   &PyArray_Type, &v, &PyArray_Type, &freq,
+			   &PyArray_Type, &data, &PyArray_Type, &wt,
+			   &PyArray_Type, &gcf, &ctx.width, &ctx.du, &ctx.dv,
+			   &ctx.hermitian, &PyArray_Type, &grid, &wgrid))
+	return NULL;
+
+    KERN_CHECK (u, NPY_DOUBLE, "u");
+    KERN_CHECK (v, NPY_DOUBLE, "v");
+    KERN_CHECK (freq, NPY_DOUBLE, "freq");
+    KERN_CHECK (data, NPY_CFLOAT, "data");
+    KERN_CHECK (wt, NPY_FLOAT, "wt");
+    KERN_CHECK (gcf, NPY_DOUBLE, "gcf");
+    KERN_CHECK_OUT (grid, NPY_CDOUBLE, "grid");
+
+    if (wgrid == Py_None)
+	ctx.wgrid = NULL;
+    else if (!PyArray_Check (wgrid)) {
+	PyErr_SetString (PyExc_TypeError, "wgrid must be an ndarray or None");
+	return NULL;
+    } else {
+	KERN_CHECK_OUT (wgrid, NPY_DOUBLE, "wgrid");
+	KERN_CHECK_SIZE (wgrid, PyArray_SIZE (grid), "wgrid");
+	ctx.wgrid = PyArray_DATA (wgrid);
+    }
+
+    if (PyArray_NDIM (grid) != 2) {
+	PyErr_SetString (PyExc_ValueError, "grid must be 2D");
+	return NULL;
+    }
+
+    if (ctx.width < 1 || ctx.width > MAX_WIDTH) {
+	PyErr_Format (PyExc_ValueError, "gridding function width must be "
+		      "between 1 and %d", MAX_WIDTH);
+	return NULL;
+    }
+
+    if (!(ctx.du > 0) || !(ctx.dv > 0)) {
+	PyErr_SetString (PyExc_ValueError, "grid cell sizes must be positive");
+	return NULL;
+    }
+
+    ctx.nvis = PyArray_SIZE (u);
+    ctx.nchan = PyArray_SIZE (freq);
+    ctx.nsamp = (int) PyArray_SIZE (gcf);
+    ctx.nv = (int) PyArray_DIM (grid, 0);
+    ctx.nu = (int) PyArray_DIM (grid, 1);
+    nsamples = ctx.nvis * ctx.nchan;
+
+    KERN_CHECK_SIZE (v, ctx.nvis, "v");
+    KERN_CHECK_SIZE (data, nsamples, "data");
+    KERN_CHECK_SIZE (wt, nsamples, "wt");
+
+    if (ctx.nsamp < ctx.width) {
+	PyErr_SetString (PyExc_ValueError, "gridding function table too small");
+	return NULL;
+    }
+
+    ctx.u = PyArray_DATA (u);
+    ctx.v = PyArray_DATA (v);
+    ctx.freq = PyArray_DATA (freq);
+    ctx.data = PyArray_DATA (data);
+    ctx.wt = PyArray_DATA (wt);
+    ctx.gcf = PyArray_DATA (gcf);
+    ctx.grid = PyArray_DATA (grid);
+
+    if (ctx.nchan == 0 || ctx.nvis == 0)
+	return Py_BuildValue ("(dl)", 0., 0L);
+
+    ctx.fmin = ctx.fmax = ctx.freq[0];
+    for (c = 1; c < ctx.nchan; c++) {
+	if (ctx.freq[c] < ctx.fmin)
+	    ctx.fmin = ctx.freq[c];
+	if (ctx.freq[c] > ctx.fmax)
+	    ctx.fmax = ctx.freq[c];
+    }
+
+    nbands = kern_threads_for (nsamples, 4096);
+    if (nbands > ctx.nv)
+	nbands = ctx.nv;
+
+    ctx.bands = PyMem_Malloc ((nbands + 1) * sizeof (int));
+    if (ctx.bands == NULL)
+	return PyErr_NoMemory ();
+
+    if (choose_bands (&ctx, nbands)) {
+	PyMem_Free (ctx.bands);
+	return PyErr_NoMemory ();
+    }
+
+    for (i = 0; i < KERN_MAX_THREADS; i++) {
+	ctx.sumwt[i] = 0;
+	ctx.ndropped[i] = 0;
+    }
+
+    kern_parallel (nbands, 1, grid_work, &ctx);
+    PyMem_Free (ctx.bands);
+
+    for (i = 0; i < KERN_MAX_THREADS; i++) {
+	sumwt += ctx.sumwt[i];
+	ndropped += ctx.ndropped[i];
+    }
+
+    return Py_BuildValue ("(dl)", sumwt, (long) ndropped);
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Fast hashing of files in fixed-size chunks, for the dataset hash
+ * manifests in miriad.py. Each chunk is hashed independently with
+ * XXH64 (seed zero), a non-cryptographic hash that runs at memory
+ * speed, so the chunks are shared out between threads. The input is
+ * usually a memory map of the file, so the threads also overlap the
+ * reading of the file. The words are assembled byte by byte so that
+ * the digests are the same on all platforms. */
+
+#include "kernels.h"
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+typedef struct {
+    const unsigned char *data;
+    npy_intp size, chunksize;
+    npy_uint64 *digests;
+} hash_ctx;
+
+
+static npy_uint64
+read64 (const unsigned char *p)
+{
+    return ((npy_uint64) p[0] | ((npy_uint64) p[1] << 8) |
+	    ((npy_uint64) p[2] << 16) | ((npy_uint64) p[3] << 24) |
+	    ((npy_uint64) p[4] << 32) | ((npy_uint64) p[5] << 40) |
+	    ((npy_uint64) p[6] << 48) | ((npy_uint64) p[7] << 56));
+}
+
+
+static npy_uint64
+read32 (const unsigned char *p)
+{
+    return ((npy_uint64) p[0] | ((npy_uint64) p[1] << 8) |
+	    ((npy_uint64) p[2] << 16) | ((npy_uint64) p[3] << 24));
+}
+
+
+static npy_uint64
+xxh_round (npy_uint64 acc, npy_uint64 input)
+{
+    acc += input * P2;
+    acc = ROTL (acc, 31);
+    return acc * P1;
+}
+
+
+static npy_uint64
+xxh_merge (npy_uint64 acc, npy_uint64 val)
+{
+    acc ^= xxh_round (0, val);
+    return acc * P1 + P4;
+}
+
+
+static npy_uint64
+xxh64 (const unsigned char *p, npy_intp len)
+{
+    const unsigned char *end = p + len;
+    npy_uint64 h, v1, v2, v3, v4;
+
+    if (len >= 32) {
+	const unsigned char *limit = end - 32;
+
+	v1 = P1 + P2;
+	v2 = P2;
+	v3 = 0;
+	v4 = -P1;
+
+	do {
+	    v1 = xxh_round (v1, read64 (p));
+	    v2 = xxh_round (v2, read64 (p + 8));
+	    v3 = xxh_round (v3, read64 (p + 16));
+	    v4 = xxh_round (v4, read64 (p + 24));
+	    p += 32;
+	} while (p <= limit);
+
+	h = ROTL (v1, 1) + ROTL (v2, 7) + ROTL (v3, 12) + ROTL (v4, 18);
+	h = xxh_merge (h, v1);
+	h = xxh_merge (h, v2);
+	h = xxh_merge (h, v3);
+	h = xxh_merge (h, v4);
+    } else
+	h = P5;
+
+    h += (npy_uint64) len;
+
+    while (p + 8 <= end) {
+	h ^= xxh_round (0, read64 (p));
+	h = ROTL (h, 27) * P1 + P4;
+	p += 8;
+    }
+
+    if (p + 4 <= end) {
+	h ^= read32 (p) * P1;
+	h = ROTL (h, 23) * P2 + P3;
+	p += 4;
+    }
+
+    while (p < end) {
+	h ^= (*p) * P5;
+	h = ROTL (h, 11) * P1;
+	p++;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+static void
+hash_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    hash_ctx *ctx = (hash_ctx *) vctx;
+    npy_intp i, ofs, len;
+
+    for (i = start; i < end; i++) {
+	ofs = i * ctx->chunksize;
+	len = ctx->size - ofs;
+	if (len > ctx->chunksize)
+	    len = ctx->chunksize;
+	ctx->digests[i] = xxh64 (ctx->data + ofs, len);
+    }
+}
+
+
+PyObject *
+py_hash_chunks (PyObject *self, PyObject *args)
+{
+    PyObject *data, *digests;
+    hash_ctx ctx;
+    npy_intp nchunk;
+    Py_ssize_t chunksize;
+
+    if (!PyArg_ParseTuple (args, "O!nO!", &PyArray_Type, &data,
+			   &chunksize, &PyArray_Type, &digests))
+	return NULL;
+
+    KERN_CHECK (data, NPY_UBYTE, "data");
+    KERN_CHECK_OUT (digests, NPY_UINT64, "digests");
+
+    if (chunksize < 1) {
+	PyErr_SetString (PyExc_ValueError, "chunksize must be positive");
+	return NULL;
+    }
+
+    ctx.chunksize = chunksize;
+    ctx.size = PyArray_NBYTES (data);
+    nchunk = (ctx.size + ctx.chunksize - 1) / ctx.chunksize;
+    KERN_CHECK_SIZE (digests, nchunk, "digests");
+
+    ctx.data = PyArray_DATA (data);
+    ctx.digests = PyArray_DATA (digests);
+
+    kern_parallel (nchunk, 65536 / ctx.chunksize + 1, hash_work, &ctx);
+
+    Py_RETURN_NONE;
+}
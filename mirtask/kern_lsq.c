@@ -0,0 +1,730 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Levenberg-Marquardt nonlinear least squares over many independent
+ * small problems at once. There are two ways in:
+ *
+ * - lm_step, lm_update, and lm_covar do the linear algebra and
+ *   bookkeeping of one iteration for a set of problems, leaving the
+ *   evaluation of residuals and derivatives to a vectorized Python
+ *   function. See util.nlLeastSquaresBatch.
+ *
+ * - lm_fit_model runs complete fits of one of a few built-in models
+ *   without returning to Python at all. See util.fitModelBatch.
+ *
+ * The conventions follow nlLeastSquares: we minimize the sum of
+ * the squared "normalized residuals" r, and the derivative array has
+ * shape (nunk, neqn) with jac[i,j] = d(r[j]) / d(params[i]). The
+ * outcome codes also match: 0 = converged, 1 = singular matrix, 2 =
+ * too many iterations, 3 = unable to improve chi squared. A code of -1
+ * means that the problem is still being iterated. */
+
+#include "kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define STATUS_RUNNING -1
+#define STATUS_OK 0
+#define STATUS_SINGULAR 1
+#define STATUS_MAXITER 2
+#define STATUS_NOIMPROVE 3
+
+#define LAMBDA_INIT 1e-3
+#define LAMBDA_MIN 1e-12
+#define LAMBDA_MAX 1e10
+
+#define MODEL_GAUSSIAN 0
+#define MODEL_POLYNOMIAL 1
+#define MODEL_EXPONENTIAL 2
+#define MODEL_SINUSOID 3
+
+
+/* Linear algebra. The matrices are tiny (nunk x nunk), so nothing
+ * clever. */
+
+static void
+normal_equations (int nunk, int neqn, const double *jac, const double *r,
+		  double *a, double *g)
+{
+    int i, k, j;
+    const double *ji, *jk;
+    double s;
+
+    for (i = 0; i < nunk; i++) {
+	ji = jac + i * neqn;
+
+	for (k = 0; k <= i; k++) {
+	    jk = jac + k * neqn;
+	    s = 0;
+	    for (j = 0; j < neqn; j++)
+		s += ji[j] * jk[j];
+	    a[i * nunk + k] = a[k * nunk + i] = s;
+	}
+
+	s = 0;
+	for (j = 0; j < neqn; j++)
+	    s += ji[j] * r[j];
+	g[i] = s;
+    }
+}
+
+
+/* In-place Cholesky decomposition of a symmetric matrix into its
+ * lower-triangular factor. Returns nonzero if the matrix isn't
+ * positive definite. */
+
+static int
+cholesky (int n, double *a)
+{
+    int i, j, k;
+    double s;
+
+    for (j = 0; j < n; j++) {
+	s = a[j * n + j];
+	for (k = 0; k < j; k++)
+	    s -= a[j * n + k] * a[j * n + k];
+
+	if (!(s > 0))
+	    return 1;
+
+	a[j * n + j] = sqrt (s);
+
+	for (i = j + 1; i < n; i++) {
+	    s = a[i * n + j];
+	    for (k = 0; k < j; k++)
+		s -= a[i * n + k] * a[j * n + k];
+	    a[i * n + j] = s / a[j * n + j];
+	}
+    }
+
+    return 0;
+}
+
+
+/* Solve L L^T x = b given the factor from cholesky(). */
+
+static void
+cholesky_solve (int n, const double *l, const double *b, double *x)
+{
+    int i, k;
+    double s;
+
+    for (i = 0; i < n; i++) {
+	s = b[i];
+	for (k = 0; k < i; k++)
+	    s -= l[i * n + k] * x[k];
+	x[i] = s / l[i * n + i];
+    }
+
+    for (i = n - 1; i >= 0; i--) {
+	s = x[i];
+	for (k = i + 1; k < n; k++)
+	    s -= l[k * n + i] * x[k];
+	x[i] = s / l[i * n + i];
+    }
+}
+
+
+/* Compute the Marquardt step: solve (A + lambda diag(A)) delta = -g.
+ * @work must have room for nunk * (nunk + 1) doubles. */
+
+static int
+damped_step (int nunk, const double *a, const double *g, double lambda,
+	     double *work, double *delta)
+{
+    double *l = work, *b = work + nunk * nunk;
+    int i;
+
+    memcpy (l, a, nunk * nunk * sizeof (double));
+
+    for (i = 0; i < nunk; i++) {
+	l[i * nunk + i] *= 1 + lambda;
+	b[i] = -g[i];
+    }
+
+    if (cholesky (nunk, l))
+	return 1;
+
+    cholesky_solve (nunk, l, b, delta);
+    return 0;
+}
+
+
+/* Invert A = J J^T to get the parameter covariance matrix. If A is
+ * singular, the result is filled with NaNs. @work must have room for
+ * nunk * (nunk + 2) doubles. */
+
+static void
+covariance (int nunk, int neqn, const double *jac, double *work, double *covar)
+{
+    double *l = work, *e = work + nunk * nunk, *col = e + nunk;
+    int i, k;
+
+    for (i = 0; i < nunk; i++)
+	e[i] = 0;
+
+    normal_equations (nunk, neqn, jac, e, l, col);
+
+    if (cholesky (nunk, l)) {
+	for (i = 0; i < nunk * nunk; i++)
+	    covar[i] = NAN;
+	return;
+    }
+
+    for (i = 0; i < nunk; i++) {
+	e[i] = 1;
+	cholesky_solve (nunk, l, e, col);
+	e[i] = 0;
+
+	for (k = 0; k < nunk; k++)
+	    covar[k * nunk + i] = col[k];
+    }
+}
+
+
+static double
+sum_squares (int n, const double *r)
+{
+    double s = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+	s += r[i] * r[i];
+
+    return s;
+}
+
+
+/* The accept/reject logic shared by both entry points. Given the chi
+ * squared of a trial step, decide what to do. Returns nonzero if the
+ * trial was accepted, in which case the caller should copy the trial
+ * parameters and residuals over the current ones. */
+
+typedef struct {
+    int maxiter;
+    double abscrit, relcrit;
+} lm_criteria;
+
+static int
+lm_judge (int nunk, const double *params, const double *trial,
+	  double trialchisq, double *chisq, double *lambda, int *iters,
+	  int *status, const lm_criteria *crit)
+{
+    double sumd = 0, sump = 0;
+    int i, accepted = 0;
+
+    (*iters)++;
+
+    if (trialchisq < *chisq) {
+	accepted = 1;
+
+	for (i = 0; i < nunk; i++) {
+	    sumd += fabs (trial[i] - params[i]);
+	    sump += fabs (trial[i]);
+	}
+
+	*chisq = trialchisq;
+	*lambda *= 0.1;
+	if (*lambda < LAMBDA_MIN)
+	    *lambda = LAMBDA_MIN;
+
+	if (*chisq < crit->abscrit || sumd < crit->relcrit * sump) {
+	    *status = STATUS_OK;
+	    return accepted;
+	}
+    } else {
+	*lambda *= 10;
+	if (*lambda > LAMBDA_MAX) {
+	    *status = STATUS_NOIMPROVE;
+	    return accepted;
+	}
+    }
+
+    if (*iters >= crit->maxiter)
+	*status = STATUS_MAXITER;
+
+    return accepted;
+}
+
+
+/* Iteration with residuals computed in Python. */
+
+typedef struct {
+    const npy_intp *active;
+    int nunk, neqn;
+    const double *jac, *resid, *tresid;
+    double *params, *trial, *lambda, *chisq;
+    int *status, *iters, *needjac;
+    lm_criteria crit;
+} lm_batch_ctx;
+
+static void
+lm_step_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    lm_batch_ctx *ctx = (lm_batch_ctx *) vctx;
+    int nunk = ctx->nunk, neqn = ctx->neqn;
+    double *a, *g, *work;
+    npy_intp i, p;
+    int k;
+
+    a = malloc (sizeof (double) * nunk * (2 * nunk + 2));
+    if (a == NULL) {
+	/* Nothing better to do than give up on these problems. */
+	for (i = start; i < end; i++)
+	    ctx->status[ctx->active[i]] = STATUS_SINGULAR;
+	return;
+    }
+
+    g = a + nunk * nunk;
+    work = g + nunk;
+
+    for (i = start; i < end; i++) {
+	p = ctx->active[i];
+
+	normal_equations (nunk, neqn, ctx->jac + p * nunk * neqn,
+			  ctx->resid + p * neqn, a, g);
+
+	if (damped_step (nunk, a, g, ctx->lambda[p], work,
+			 ctx->trial + p * nunk)) {
+	    ctx->status[p] = STATUS_SINGULAR;
+	    continue;
+	}
+
+	for (k = 0; k < nunk; k++)
+	    ctx->trial[p * nunk + k] += ctx->params[p * nunk + k];
+    }
+
+    free (a);
+}
+
+PyObject *
+py_lm_step (PyObject *self, PyObject *args)
+{
+    PyObject *active, *jac, *resid, *params, *lambda, *trial, *status;
+    lm_batch_ctx ctx;
+    npy_intp nprob;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!O!O!O!", &PyArray_Type, &active,
+			   &PyArray_Type, &jac, &PyArray_Type, &resid,
+			   &PyArray_Type, &params, &PyArray_Type, &lambda,
+			   &PyArray_Type, &trial, &PyArray_Type, &status))
+	return NULL;
+
+    KERN_CHECK (active, NPY_INTP, "active");
+    KERN_CHECK (jac, NPY_DOUBLE, "jac");
+    KERN_CHECK (resid, NPY_DOUBLE, "resid");
+    KERN_CHECK (params, NPY_DOUBLE, "params");
+    KERN_CHECK (lambda, NPY_DOUBLE, "lambda");
+    KERN_CHECK_OUT (trial, NPY_DOUBLE, "trial");
+    KERN_CHECK_OUT (status, NPY_INT, "status");
+
+    if (PyArray_NDIM (params) != 2 || PyArray_NDIM (resid) != 2) {
+	PyErr_SetString (PyExc_ValueError, "params and resid must be 2D");
+	return NULL;
+    }
+
+    nprob = PyArray_DIM (params, 0);
+    ctx.nunk = (int) PyArray_DIM (params, 1);
+    ctx.neqn = (int) PyArray_DIM (resid, 1);
+    KERN_CHECK_SIZE (resid, nprob * ctx.neqn, "resid");
+    KERN_CHECK_SIZE (jac, nprob * ctx.nunk * ctx.neqn, "jac");
+    KERN_CHECK_SIZE (lambda, nprob, "lambda");
+    KERN_CHECK_SIZE (trial, nprob * ctx.nunk, "trial");
+    KERN_CHECK_SIZE (status, nprob, "status");
+
+    ctx.active = PyArray_DATA (active);
+    ctx.jac = PyArray_DATA (jac);
+    ctx.resid = PyArray_DATA (resid);
+    ctx.params = PyArray_DATA (params);
+    ctx.lambda = PyArray_DATA (lambda);
+    ctx.trial = PyArray_DATA (trial);
+    ctx.status = PyArray_DATA (status);
+
+    kern_parallel (PyArray_SIZE (active), 64, lm_step_work, &ctx);
+    Py_RETURN_NONE;
+}
+
+
+/* Here ctx->tresid is compact: row i corresponds to problem active[i]. */
+
+static void
+lm_update_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    lm_batch_ctx *ctx = (lm_batch_ctx *) vctx;
+    int nunk = ctx->nunk, neqn = ctx->neqn;
+    const double *tr;
+    npy_intp i, p;
+
+    for (i = start; i < end; i++) {
+	p = ctx->active[i];
+	tr = ctx->tresid + i * neqn;
+
+	ctx->needjac[p] = lm_judge (nunk, ctx->params + p * nunk,
+				    ctx->trial + p * nunk,
+				    sum_squares (neqn, tr), ctx->chisq + p,
+				    ctx->lambda + p, ctx->iters + p,
+				    ctx->status + p, &ctx->crit);
+
+	if (ctx->needjac[p]) {
+	    memcpy (ctx->params + p * nunk, ctx->trial + p * nunk,
+		    nunk * sizeof (double));
+	    memcpy ((double *) ctx->resid + p * neqn, tr,
+		    neqn * sizeof (double));
+	}
+    }
+}
+
+PyObject *
+py_lm_update (PyObject *self, PyObject *args)
+{
+    PyObject *active, *tresid, *resid, *params, *trial, *lambda, *chisq;
+    PyObject *status, *iters, *needjac;
+    lm_batch_ctx ctx;
+    npy_intp nprob, nact;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!O!O!O!O!O!O!idd",
+			   &PyArray_Type, &active, &PyArray_Type, &tresid,
+			   &PyArray_Type, &resid, &PyArray_Type, &params,
+			   &PyArray_Type, &trial, &PyArray_Type, &lambda,
+			   &PyArray_Type, &chisq, &PyArray_Type, &status,
+			   &PyArray_Type, &iters, &PyArray_Type, &needjac,
+			   &ctx.crit.maxiter, &ctx.crit.abscrit,
+			   &ctx.crit.relcrit))
+	return NULL;
+
+    KERN_CHECK (active, NPY_INTP, "active");
+    KERN_CHECK (tresid, NPY_DOUBLE, "tresid");
+    KERN_CHECK_OUT (resid, NPY_DOUBLE, "resid");
+    KERN_CHECK_OUT (params, NPY_DOUBLE, "params");
+    KERN_CHECK (trial, NPY_DOUBLE, "trial");
+    KERN_CHECK_OUT (lambda, NPY_DOUBLE, "lambda");
+    KERN_CHECK_OUT (chisq, NPY_DOUBLE, "chisq");
+    KERN_CHECK_OUT (status, NPY_INT, "status");
+    KERN_CHECK_OUT (iters, NPY_INT, "iters");
+    KERN_CHECK_OUT (needjac, NPY_INT, "needjac");
+
+    if (PyArray_NDIM (params) != 2 || PyArray_NDIM (resid) != 2) {
+	PyErr_SetString (PyExc_ValueError, "params and resid must be 2D");
+	return NULL;
+    }
+
+    nprob = PyArray_DIM (params, 0);
+    nact = PyArray_SIZE (active);
+    ctx.nunk = (int) PyArray_DIM (params, 1);
+    ctx.neqn = (int) PyArray_DIM (resid, 1);
+    KERN_CHECK_SIZE (tresid, nact * ctx.neqn, "tresid");
+    KERN_CHECK_SIZE (resid, nprob * ctx.neqn, "resid");
+    KERN_CHECK_SIZE (trial, nprob * ctx.nunk, "trial");
+    KERN_CHECK_SIZE (lambda, nprob, "lambda");
+    KERN_CHECK_SIZE (chisq, nprob, "chisq");
+    KERN_CHECK_SIZE (status, nprob, "status");
+    KERN_CHECK_SIZE (iters, nprob, "iters");
+    KERN_CHECK_SIZE (needjac, nprob, "needjac");
+
+    ctx.active = PyArray_DATA (active);
+    ctx.tresid = PyArray_DATA (tresid);
+    ctx.resid = PyArray_DATA (resid);
+    ctx.params = PyArray_DATA (params);
+    ctx.trial = PyArray_DATA (trial);
+    ctx.lambda = PyArray_DATA (lambda);
+    ctx.chisq = PyArray_DATA (chisq);
+    ctx.status = PyArray_DATA (status);
+    ctx.iters = PyArray_DATA (iters);
+    ctx.needjac = PyArray_DATA (needjac);
+
+    kern_parallel (nact, 256, lm_update_work, &ctx);
+    Py_RETURN_NONE;
+}
+
+
+typedef struct {
+    int nunk, neqn;
+    const double *jac;
+    double *covar;
+} lm_covar_ctx;
+
+static void
+lm_covar_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    lm_covar_ctx *ctx = (lm_covar_ctx *) vctx;
+    int nunk = ctx->nunk, neqn = ctx->neqn;
+    double *work;
+    npy_intp p;
+
+    work = malloc (sizeof (double) * nunk * (nunk + 2));
+    if (work == NULL) {
+	for (p = start * nunk * nunk; p < end * nunk * nunk; p++)
+	    ctx->covar[p] = NAN;
+	return;
+    }
+
+    for (p = start; p < end; p++)
+	covariance (nunk, neqn, ctx->jac + p * nunk * neqn, work,
+		    ctx->covar + p * nunk * nunk);
+
+    free (work);
+}
+
+PyObject *
+py_lm_covar (PyObject *self, PyObject *args)
+{
+    PyObject *jac, *covar;
+    lm_covar_ctx ctx;
+    npy_intp nprob;
+
+    if (!PyArg_ParseTuple (args, "O!O!", &PyArray_Type, &jac,
+			   &PyArray_Type, &covar))
+	return NULL;
+
+    KERN_CHECK (jac, NPY_DOUBLE, "jac");
+    KERN_CHECK_OUT (covar, NPY_DOUBLE, "covar");
+
+    if (PyArray_NDIM (jac) != 3) {
+	PyErr_SetString (PyExc_ValueError, "jac must be 3D");
+	return NULL;
+    }
+
+    nprob = PyArray_DIM (jac, 0);
+    ctx.nunk = (int) PyArray_DIM (jac, 1);
+    ctx.neqn = (int) PyArray_DIM (jac, 2);
+    KERN_CHECK_SIZE (covar, nprob * ctx.nunk * ctx.nunk, "covar");
+
+    ctx.jac = PyArray_DATA (jac);
+    ctx.covar = PyArray_DATA (covar);
+
+    kern_parallel (nprob, 64, lm_covar_work, &ctx);
+    Py_RETURN_NONE;
+}
+
+
+/* Built-in models. Each computes the normalized residuals
+ * r = w * (model (x) - y) and, if @jac is non-NULL, their
+ * derivatives. Points with w = 0 are thereby ignored. The
+ * optional trailing parameter of the Gaussian, exponential, and
+ * sinusoid models is a constant offset. */
+
+static void
+model_eval (int model, int nunk, int neqn, const double *p, const double *x,
+	    const double *y, const double *w, double *r, double *jac)
+{
+    double m, e, dx, arg, s, c, xk;
+    int j, k;
+
+    for (j = 0; j < neqn; j++) {
+	switch (model) {
+	case MODEL_GAUSSIAN:
+	    dx = x[j] - p[1];
+	    e = exp (-0.5 * dx * dx / (p[2] * p[2]));
+	    m = p[0] * e;
+	    if (jac != NULL) {
+		jac[0 * neqn + j] = w[j] * e;
+		jac[1 * neqn + j] = w[j] * m * dx / (p[2] * p[2]);
+		jac[2 * neqn + j] = w[j] * m * dx * dx / (p[2] * p[2] * p[2]);
+	    }
+	    break;
+	case MODEL_POLYNOMIAL:
+	    m = 0;
+	    xk = 1;
+	    for (k = 0; k < nunk; k++) {
+		m += p[k] * xk;
+		if (jac != NULL)
+		    jac[k * neqn + j] = w[j] * xk;
+		xk *= x[j];
+	    }
+	    break;
+	case MODEL_EXPONENTIAL:
+	    e = exp (p[1] * x[j]);
+	    m = p[0] * e;
+	    if (jac != NULL) {
+		jac[0 * neqn + j] = w[j] * e;
+		jac[1 * neqn + j] = w[j] * m * x[j];
+	    }
+	    break;
+	case MODEL_SINUSOID:
+	default:
+	    arg = 2 * M_PI * p[1] * x[j] + p[2];
+	    s = sin (arg);
+	    c = cos (arg);
+	    m = p[0] * s;
+	    if (jac != NULL) {
+		jac[0 * neqn + j] = w[j] * s;
+		jac[1 * neqn + j] = w[j] * p[0] * c * 2 * M_PI * x[j];
+		jac[2 * neqn + j] = w[j] * p[0] * c;
+	    }
+	    break;
+	}
+
+	/* Constant offset? The polynomial has handled all of its
+	 * parameters already. */
+
+	if (model != MODEL_POLYNOMIAL) {
+	    k = (model == MODEL_EXPONENTIAL) ? 2 : 3;
+	    if (nunk > k) {
+		m += p[k];
+		if (jac != NULL)
+		    jac[k * neqn + j] = w[j];
+	    }
+	}
+
+	r[j] = w[j] * (m - y[j]);
+    }
+}
+
+
+typedef struct {
+    int model, nunk, neqn;
+    const double *x, *y, *w;
+    double *params, *resid, *chisq, *covar;
+    int *status, *iters;
+    lm_criteria crit;
+} lm_model_ctx;
+
+static void
+lm_model_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    lm_model_ctx *ctx = (lm_model_ctx *) vctx;
+    int nunk = ctx->nunk, neqn = ctx->neqn, *status;
+    const double *x, *y, *w;
+    double *scratch, *jac, *tr, *a, *g, *trial, *work, *p, *r, lambda, tchisq;
+    npy_intp i;
+    int k;
+
+    scratch = malloc (sizeof (double) * (nunk * neqn + neqn +
+					 nunk * (3 * nunk + 4)));
+    if (scratch == NULL) {
+	for (i = start; i < end; i++)
+	    ctx->status[i] = STATUS_SINGULAR;
+	return;
+    }
+
+    jac = scratch;
+    tr = jac + nunk * neqn;
+    a = tr + neqn;
+    g = a + nunk * nunk;
+    trial = g + nunk;
+    work = trial + nunk;
+
+    for (i = start; i < end; i++) {
+	x = ctx->x + i * neqn;
+	y = ctx->y + i * neqn;
+	w = ctx->w + i * neqn;
+	p = ctx->params + i * nunk;
+	r = ctx->resid + i * neqn;
+	status = ctx->status + i;
+
+	model_eval (ctx->model, nunk, neqn, p, x, y, w, r, jac);
+	ctx->chisq[i] = sum_squares (neqn, r);
+	ctx->iters[i] = 0;
+	lambda = LAMBDA_INIT;
+	*status = (ctx->chisq[i] < ctx->crit.abscrit) ? STATUS_OK : STATUS_RUNNING;
+
+	while (*status == STATUS_RUNNING) {
+	    normal_equations (nunk, neqn, jac, r, a, g);
+
+	    if (damped_step (nunk, a, g, lambda, work, trial)) {
+		*status = STATUS_SINGULAR;
+		break;
+	    }
+
+	    for (k = 0; k < nunk; k++)
+		trial[k] += p[k];
+
+	    model_eval (ctx->model, nunk, neqn, trial, x, y, w, tr, NULL);
+	    tchisq = sum_squares (neqn, tr);
+
+	    if (lm_judge (nunk, p, trial, tchisq, ctx->chisq + i, &lambda,
+			  ctx->iters + i, status, &ctx->crit)) {
+		memcpy (p, trial, nunk * sizeof (double));
+		model_eval (ctx->model, nunk, neqn, p, x, y, w, r, jac);
+	    }
+	}
+
+	covariance (nunk, neqn, jac, work, ctx->covar + i * nunk * nunk);
+    }
+
+    free (scratch);
+}
+
+PyObject *
+py_lm_fit_model (PyObject *self, PyObject *args)
+{
+    PyObject *x, *y, *w, *params, *resid, *chisq, *status, *iters, *covar;
+    lm_model_ctx ctx;
+    npy_intp nprob;
+
+    if (!PyArg_ParseTuple (args, "iO!O!O!O!O!O!O!O!O!idd", &ctx.model,
+			   &PyArray_Type, &x, &PyArray_Type, &y,
+			   &PyArray_Type, &w, &PyArray_Type, &params,
+			   &PyArray_Type, &resid, &PyArray_Type, &chisq,
+			   &PyArray_Type, &status, &PyArray_Type, &iters,
+			   &PyArray_Type, &covar, &ctx.crit.maxiter,
+			   &ctx.crit.abscrit, &ctx.crit.relcrit))
+	return NULL;
+
+    KERN_CHECK (x, NPY_DOUBLE, "x");
+    KERN_CHECK (y, NPY_DOUBLE, "y");
+    KERN_CHECK (w, NPY_DOUBLE, "w");
+    KERN_CHECK_OUT (params, NPY_DOUBLE, "params");
+    KERN_CHECK_OUT (resid, NPY_DOUBLE, "resid");
+    KERN_CHECK_OUT (chisq, NPY_DOUBLE, "chisq");
+    KERN_CHECK_OUT (status, NPY_INT, "status");
+    KERN_CHECK_OUT (iters, NPY_INT, "iters");
+    KERN_CHECK_OUT (covar, NPY_DOUBLE, "covar");
+
+    if (ctx.model < MODEL_GAUSSIAN || ctx.model > MODEL_SINUSOID) {
+	PyErr_Format (PyExc_ValueError, "unknown model number %d", ctx.model);
+	return NULL;
+    }
+
+    if (PyArray_NDIM (params) != 2 || PyArray_NDIM (y) != 2) {
+	PyErr_SetString (PyExc_ValueError, "params and y must be 2D");
+	return NULL;
+    }
+
+    nprob = PyArray_DIM (params, 0);
+    ctx.nunk = (int) PyArray_DIM (params, 1);
+    ctx.neqn = (int) PyArray_DIM (y, 1);
+    KERN_CHECK_SIZE (x, nprob * ctx.neqn, "x");
+    KERN_CHECK_SIZE (y, nprob * ctx.neqn, "y");
+    KERN_CHECK_SIZE (w, nprob * ctx.neqn, "w");
+    KERN_CHECK_SIZE (resid, nprob * ctx.neqn, "resid");
+    KERN_CHECK_SIZE (chisq, nprob, "chisq");
+    KERN_CHECK_SIZE (status, nprob, "status");
+    KERN_CHECK_SIZE (iters, nprob, "iters");
+    KERN_CHECK_SIZE (covar, nprob * ctx.nunk * ctx.nunk, "covar");
+
+    ctx.x = PyArray_DATA (x);
+    ctx.y = PyArray_DATA (y);
+    ctx.w = PyArray_DATA (w);
+    ctx.params = PyArray_DATA (params);
+    ctx.resid = PyArray_DATA (resid);
+    ctx.chisq = PyArray_DATA (chisq);
+    ctx.status = PyArray_DATA (status);
+    ctx.iters = PyArray_DATA (iters);
+    ctx.covar = PyArray_DATA (covar);
+
+    kern_parallel (nprob, 16, lm_model_work, &ctx);
+    Py_RETURN_NONE;
+}
@@ -0,0 +1,360 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compression of columns of UV data for the archive format (see
+ * archive.py).
+ *
+ * Each column is a C-contiguous array whose first axis runs over
+ * records. It is optionally delta-encoded along the records, treating
+ * the elements as unsigned integers of their own width so that the
+ * round trip is exact even for floating-point values; then its bytes
+ * are shuffled so that byte k of every element is stored together,
+ * which puts the slowly varying high-order bytes of numeric data next
+ * to each other; and then the result is deflated with zlib. Decoding
+ * undoes the steps in reverse.
+ *
+ * Many columns are handed over at once and each is processed
+ * independently, so the columns are shared out between threads. zlib
+ * is reentrant as long as each stream is used by one thread. */
+
+#include "kernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+typedef struct {
+    npy_intp nitem;
+    char **raw; /* the uncompressed columns */
+    npy_intp *rawsize, *rows, *itemsize;
+    const int *delta;
+    unsigned char **packed; /* the compressed columns */
+    npy_intp *packsize; /* buffer sizes; after encoding, the used sizes */
+    int level;
+    npy_intp bad[KERN_MAX_THREADS]; /* out of memory */
+    npy_intp zbad[KERN_MAX_THREADS]; /* zlib failure */
+} pack_ctx;
+
+
+/* Delta-encode or -decode along the records, treating each element as
+ * an unsigned integer of width @isz. Wrapping arithmetic keeps the
+ * round trip exact. */
+
+#define DELTA_LOOP(type) do {					\
+	type *v = (type *) buf;					\
+	npy_intp i, n = rows * width;				\
+	if (encode) {						\
+	    for (i = n - 1; i >= width; i--)			\
+		v[i] = (type) (v[i] - v[i - width]);		\
+	} else {						\
+	    for (i = width; i < n; i++)				\
+		v[i] = (type) (v[i] + v[i - width]);		\
+	}							\
+    } while (0)
+
+static void
+delta_code (char *buf, npy_intp size, npy_intp rows, npy_intp isz, int encode)
+{
+    npy_intp width;
+
+    if (rows < 2)
+	return;
+
+    width = size / (rows * isz);
+
+    switch (isz) {
+    case 1:
+	DELTA_LOOP (npy_uint8);
+	break;
+    case 2:
+	DELTA_LOOP (npy_uint16);
+	break;
+    case 4:
+	DELTA_LOOP (npy_uint32);
+	break;
+    case 8:
+	DELTA_LOOP (npy_uint64);
+	break;
+    }
+}
+
+
+static void
+shuffle (const char *src, char *dest, npy_intp size, npy_intp isz)
+{
+    npy_intp i, k, n = size / isz;
+
+    for (k = 0; k < isz; k++)
+	for (i = 0; i < n; i++)
+	    dest[k * n + i] = src[i * isz + k];
+}
+
+
+static void
+unshuffle (const char *src, char *dest, npy_intp size, npy_intp isz)
+{
+    npy_intp i, k, n = size / isz;
+
+    for (k = 0; k < isz; k++)
+	for (i = 0; i < n; i++)
+	    dest[i * isz + k] = src[k * n + i];
+}
+
+
+static void
+encode_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    pack_ctx *ctx = (pack_ctx *) vctx;
+    npy_intp j, size, isz;
+    char *tmp, *sh;
+    uLongf outlen;
+
+    for (j = start; j < end; j++) {
+	size = ctx->rawsize[j];
+	isz = ctx->itemsize[j];
+	tmp = malloc (2 * size + 1);
+	if (tmp == NULL) {
+	    KERN_NOTE_ERROR (ctx, tid, j);
+	    return;
+	}
+
+	sh = tmp + size;
+	memcpy (tmp, ctx->raw[j], size);
+	if (ctx->delta[j])
+	    delta_code (tmp, size, ctx->rows[j], isz, 1);
+	shuffle (tmp, sh, size, isz);
+
+	outlen = (uLongf) ctx->packsize[j];
+	if (compress2 (ctx->packed[j], &outlen, (Bytef *) sh, (uLong) size,
+		       ctx->level) != Z_OK) {
+	    if (ctx->zbad[tid] < 0)
+		ctx->zbad[tid] = j;
+	} else
+	    ctx->packsize[j] = (npy_intp) outlen;
+
+	free (tmp);
+    }
+}
+
+
+static void
+decode_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    pack_ctx *ctx = (pack_ctx *) vctx;
+    npy_intp j, size, isz;
+    char *tmp;
+    uLongf outlen;
+
+    for (j = start; j < end; j++) {
+	size = ctx->rawsize[j];
+	tmp = malloc (size + 1);
+	if (tmp == NULL) {
+	    KERN_NOTE_ERROR (ctx, tid, j);
+	    return;
+	}
+
+	outlen = (uLongf) size;
+	if (uncompress ((Bytef *) tmp, &outlen, ctx->packed[j],
+			(uLong) ctx->packsize[j]) != Z_OK
+	    || (npy_intp) outlen != size) {
+	    if (ctx->zbad[tid] < 0)
+		ctx->zbad[tid] = j;
+	} else {
+	    isz = ctx->itemsize[j];
+	    unshuffle (tmp, ctx->raw[j], size, isz);
+	    if (ctx->delta[j])
+		delta_code (ctx->raw[j], size, ctx->rows[j], isz, 0);
+	}
+
+	free (tmp);
+    }
+}
+
+
+/* Gather the columns and buffers from the argument lists. When
+ * @decoding, the columns are written to and the buffers read;
+ * otherwise the other way around. */
+
+static int
+pack_setup (pack_ctx *ctx, PyObject *raws, PyObject *packs, PyObject *deltas,
+	    int decoding)
+{
+    npy_intp j, n;
+    PyObject *a, *p;
+    int isz;
+
+    if (kern_check_array (deltas, NPY_INT, "deltas", 0))
+	return 1;
+
+    if (!PyList_Check (raws) || !PyList_Check (packs)) {
+	PyErr_SetString (PyExc_TypeError, "columns and buffers must be lists");
+	return 1;
+    }
+
+    n = PyList_Size (raws);
+    if (PyList_Size (packs) != n) {
+	PyErr_SetString (PyExc_ValueError, "need one buffer per column");
+	return 1;
+    }
+
+    if (kern_check_size (deltas, n, "deltas"))
+	return 1;
+
+    ctx->nitem = n;
+    ctx->delta = PyArray_DATA (deltas);
+    ctx->raw = PyMem_Malloc ((n + 1) * sizeof (char *));
+    ctx->packed = PyMem_Malloc ((n + 1) * sizeof (unsigned char *));
+    ctx->rawsize = PyMem_Malloc (4 * (n + 1) * sizeof (npy_intp));
+    if (ctx->raw == NULL || ctx->packed == NULL || ctx->rawsize == NULL) {
+	PyErr_NoMemory ();
+	return 1;
+    }
+
+    ctx->rows = ctx->rawsize + n + 1;
+    ctx->itemsize = ctx->rows + n + 1;
+    ctx->packsize = ctx->itemsize + n + 1;
+
+    for (j = 0; j < n; j++) {
+	a = PyList_GetItem (raws, j);
+	p = PyList_GetItem (packs, j);
+
+	if (!PyArray_Check (a) || !PyArray_ISCARRAY_RO (a) ||
+	    (decoding && !PyArray_ISWRITEABLE (a)) || PyArray_NDIM (a) < 1) {
+	    PyErr_Format (PyExc_ValueError, "column %ld must be a C-contiguous "
+			  "%sarray of at least one dimension", (long) j,
+			  decoding ? "writeable " : "");
+	    return 1;
+	}
+
+	if (!PyArray_Check (p) || PyArray_TYPE (p) != NPY_UBYTE ||
+	    !PyArray_ISCARRAY_RO (p) || PyArray_NDIM (p) != 1 ||
+	    (!decoding && !PyArray_ISWRITEABLE (p))) {
+	    PyErr_Format (PyExc_ValueError, "buffer %ld must be a C-contiguous "
+			  "%sone-dimensional uint8 array", (long) j,
+			  decoding ? "" : "writeable ");
+	    return 1;
+	}
+
+	isz = PyArray_ITEMSIZE (a);
+	if (ctx->delta[j] && isz != 1 && isz != 2 && isz != 4 && isz != 8) {
+	    PyErr_Format (PyExc_ValueError, "can't delta-encode column %ld "
+			  "with %d-byte elements", (long) j, isz);
+	    return 1;
+	}
+
+	ctx->raw[j] = PyArray_DATA (a);
+	ctx->rawsize[j] = PyArray_NBYTES (a);
+	ctx->rows[j] = PyArray_DIM (a, 0);
+	ctx->itemsize[j] = isz;
+	ctx->packed[j] = PyArray_DATA (p);
+	ctx->packsize[j] = PyArray_DIM (p, 0);
+    }
+
+    kern_clear_errors (ctx->bad);
+    kern_clear_errors (ctx->zbad);
+    return 0;
+}
+
+
+static void
+pack_free (pack_ctx *ctx)
+{
+    PyMem_Free (ctx->raw);
+    PyMem_Free (ctx->packed);
+    PyMem_Free (ctx->rawsize);
+}
+
+
+static int
+pack_run (pack_ctx *ctx, kern_work_func func, const char *what)
+{
+    npy_intp j;
+
+    kern_parallel (ctx->nitem, 1, func, ctx);
+
+    if (kern_first_error (ctx->bad) >= 0) {
+	PyErr_NoMemory ();
+	return 1;
+    }
+
+    j = kern_first_error (ctx->zbad);
+    if (j >= 0) {
+	PyErr_Format (PyExc_ValueError, "couldn't %s column %ld", what,
+		      (long) j);
+	return 1;
+    }
+
+    return 0;
+}
+
+
+PyObject *
+py_pack_encode (PyObject *self, PyObject *args)
+{
+    PyObject *raws, *packs, *sizes, *deltas;
+    pack_ctx ctx;
+    npy_intp j, *out;
+    int level;
+
+    if (!PyArg_ParseTuple (args, "OOO!O!i", &raws, &packs, &PyArray_Type,
+			   &sizes, &PyArray_Type, &deltas, &level))
+	return NULL;
+
+    KERN_CHECK_OUT (sizes, NPY_INTP, "sizes");
+
+    memset (&ctx, 0, sizeof (ctx));
+    ctx.level = level;
+
+    if (pack_setup (&ctx, raws, packs, deltas, 0) ||
+	kern_check_size (sizes, ctx.nitem, "sizes") ||
+	pack_run (&ctx, encode_work, "compress")) {
+	pack_free (&ctx);
+	return NULL;
+    }
+
+    out = PyArray_DATA (sizes);
+    for (j = 0; j < ctx.nitem; j++)
+	out[j] = ctx.packsize[j];
+
+    pack_free (&ctx);
+    Py_RETURN_NONE;
+}
+
+
+PyObject *
+py_pack_decode (PyObject *self, PyObject *args)
+{
+    PyObject *packs, *raws, *deltas;
+    pack_ctx ctx;
+
+    if (!PyArg_ParseTuple (args, "OOO!", &packs, &raws, &PyArray_Type,
+			   &deltas))
+	return NULL;
+
+    memset (&ctx, 0, sizeof (ctx));
+
+    if (pack_setup (&ctx, raws, packs, deltas, 1) ||
+	pack_run (&ctx, decode_work, "decompress")) {
+	pack_free (&ctx);
+	return NULL;
+    }
+
+    pack_free (&ctx);
+    Py_RETURN_NONE;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Antenna shadowing, after the test done by MIRIAD's uvchkshadow. For
+ * each time we project every antenna position onto the (u, v, w) frame
+ * of the pointing center once, and then an antenna is shadowed if any
+ * other antenna is both closer to the source (larger w) and within the
+ * shadowing diameter in the (u, v) plane. Baselines are shadowed if
+ * either of their antennas is, which the caller works out from the
+ * per-antenna answers. The times are independent, so they are split
+ * between threads. */
+
+#include "kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+typedef struct {
+    npy_intp ntime, nant;
+    const double *antpos; /* x[nant], y[nant], z[nant] */
+    const double *ha, *dec;
+    double limit2;
+    int *out;
+    npy_intp bad[KERN_MAX_THREADS];
+} shadow_ctx;
+
+
+static void
+shadow_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    shadow_ctx *ctx = (shadow_ctx *) vctx;
+    npy_intp t, i, j, nant = ctx->nant;
+    const double *x = ctx->antpos, *y = x + nant, *z = y + nant;
+    double *u, *v, *w, sinha, cosha, sind, cosd, du, dv;
+    char *present;
+    int *out;
+
+    u = malloc (3 * nant * sizeof (double) + nant);
+    if (u == NULL) {
+	KERN_NOTE_ERROR (ctx, tid, start);
+	return;
+    }
+
+    v = u + nant;
+    w = v + nant;
+    present = (char *) (w + nant);
+
+    /* Antennas with no position recorded are taken to be absent. */
+
+    for (i = 0; i < nant; i++)
+	present[i] = x[i] != 0 || y[i] != 0 || z[i] != 0;
+
+    for (t = start; t < end; t++) {
+	sinha = sin (ctx->ha[t]);
+	cosha = cos (ctx->ha[t]);
+	sind = sin (ctx->dec[t]);
+	cosd = cos (ctx->dec[t]);
+	out = ctx->out + t * nant;
+
+	for (i = 0; i < nant; i++) {
+	    u[i] = x[i] * sinha + y[i] * cosha;
+	    v[i] = -x[i] * sind * cosha + y[i] * sind * sinha + z[i] * cosd;
+	    w[i] = x[i] * cosd * cosha - y[i] * cosd * sinha + z[i] * sind;
+	}
+
+	for (i = 0; i < nant; i++) {
+	    out[i] = 0;
+	    if (!present[i])
+		continue;
+
+	    for (j = 0; j < nant; j++) {
+		if (j == i || !present[j] || w[j] <= w[i])
+		    continue;
+
+		du = u[j] - u[i];
+		dv = v[j] - v[i];
+		if (du * du + dv * dv < ctx->limit2) {
+		    out[i] = 1;
+		    break;
+		}
+	    }
+	}
+    }
+
+    free (u);
+}
+
+
+PyObject *
+py_shadow_ants (PyObject *self, PyObject *args)
+{
+    PyObject *antpos, *ha, *dec, *out;
+    shadow_ctx ctx;
+    double limit;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!dO!", &PyArray_Type, &antpos,
+			   &PyArray_Type, &ha, &PyArray_Type, &dec, &limit,
+			   &PyArray_Type, &out))
+	return NULL;
+
+    KERN_CHECK (antpos, NPY_DOUBLE, "antpos");
+    KERN_CHECK (ha, NPY_DOUBLE, "ha");
+    KERN_CHECK (dec, NPY_DOUBLE, "dec");
+    KERN_CHECK_OUT (out, NPY_INT, "out");
+
+    ctx.nant = PyArray_SIZE (antpos) / 3;
+    ctx.ntime = PyArray_SIZE (ha);
+
+    KERN_CHECK_SIZE (antpos, 3 * ctx.nant, "antpos");
+    KERN_CHECK_SIZE (dec, ctx.ntime, "dec");
+    KERN_CHECK_SIZE (out, ctx.ntime * ctx.nant, "out");
+
+    ctx.antpos = PyArray_DATA (antpos);
+    ctx.ha = PyArray_DATA (ha);
+    ctx.dec = PyArray_DATA (dec);
+    ctx.limit2 = limit * limit;
+    ctx.out = PyArray_DATA (out);
+    kern_clear_errors (ctx.bad);
+
+    kern_parallel (ctx.ntime, 65536 / (ctx.nant * ctx.nant + 1) + 1,
+		   shadow_work, &ctx);
+
+    if (kern_first_error (ctx.bad) >= 0)
+	return PyErr_NoMemory ();
+
+    Py_RETURN_NONE;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Running statistics of visibilities per (baseline, pol, channel).
+ *
+ * The accumulators use Welford's update, so the means and the sums of
+ * squared deviations stay accurate however many samples go in. The
+ * complex visibilities and their amplitudes are tracked separately,
+ * along with the extremes of the amplitudes. Records are assigned to
+ * accumulator slots by the caller with the averaging hash table (see
+ * kern_aver.c), and, as there, several records of a batch can land in
+ * the same slot, so the channels are split between threads rather
+ * than the records. */
+
+#include "kernels.h"
+
+#include <math.h>
+
+typedef struct {
+    npy_intp nrec, nchan;
+    const npy_intp *slots;
+    const float *data; /* complex64, interleaved */
+    const int *flags;
+    npy_int64 *count;
+    double *mean; /* complex128, interleaved */
+    double *m2, *amean, *am2, *amin, *amax;
+} stats_ctx;
+
+
+static void
+stats_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    stats_ctx *ctx = (stats_ctx *) vctx;
+    npy_intp i, c, k, base;
+    const float *d;
+    const int *f;
+    double n, re, im, dre, dim, a, da, *mu;
+
+    for (i = 0; i < ctx->nrec; i++) {
+	d = ctx->data + 2 * i * ctx->nchan;
+	f = ctx->flags + i * ctx->nchan;
+	base = ctx->slots[i] * ctx->nchan;
+
+	for (c = start; c < end; c++) {
+	    if (f[c] == 0)
+		continue;
+
+	    k = base + c;
+	    n = (double) ++ctx->count[k];
+	    mu = ctx->mean + 2 * k;
+
+	    re = d[2*c];
+	    im = d[2*c+1];
+	    dre = re - mu[0];
+	    dim = im - mu[1];
+	    mu[0] += dre / n;
+	    mu[1] += dim / n;
+	    ctx->m2[k] += dre * (re - mu[0]) + dim * (im - mu[1]);
+
+	    a = sqrt (re * re + im * im);
+	    da = a - ctx->amean[k];
+	    ctx->amean[k] += da / n;
+	    ctx->am2[k] += da * (a - ctx->amean[k]);
+
+	    if (a < ctx->amin[k])
+		ctx->amin[k] = a;
+	    if (a > ctx->amax[k])
+		ctx->amax[k] = a;
+	}
+    }
+}
+
+
+PyObject *
+py_stats_accum (PyObject *self, PyObject *args)
+{
+    PyObject *slots, *data, *flags, *count, *mean, *m2, *amean, *am2;
+    PyObject *amin, *amax;
+    stats_ctx ctx;
+    npy_intp nslot, i;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!O!O!O!O!O!O!", &PyArray_Type,
+			   &slots, &PyArray_Type, &data, &PyArray_Type,
+			   &flags, &PyArray_Type, &count, &PyArray_Type,
+			   &mean, &PyArray_Type, &m2, &PyArray_Type, &amean,
+			   &PyArray_Type, &am2, &PyArray_Type, &amin,
+			   &PyArray_Type, &amax))
+	return NULL;
+
+    KERN_CHECK (slots, NPY_INTP, "slots");
+    KERN_CHECK (data, NPY_CFLOAT, "data");
+    KERN_CHECK (flags, NPY_INT, "flags");
+    KERN_CHECK_OUT (count, NPY_INT64, "count");
+    KERN_CHECK_OUT (mean, NPY_CDOUBLE, "mean");
+    KERN_CHECK_OUT (m2, NPY_DOUBLE, "m2");
+    KERN_CHECK_OUT (amean, NPY_DOUBLE, "amean");
+    KERN_CHECK_OUT (am2, NPY_DOUBLE, "am2");
+    KERN_CHECK_OUT (amin, NPY_DOUBLE, "amin");
+    KERN_CHECK_OUT (amax, NPY_DOUBLE, "amax");
+
+    if (PyArray_NDIM (data) != 2 || PyArray_NDIM (count) != 2) {
+	PyErr_SetString (PyExc_ValueError, "data and count must be "
+			 "two-dimensional");
+	return NULL;
+    }
+
+    ctx.nrec = PyArray_DIM (data, 0);
+    ctx.nchan = PyArray_DIM (data, 1);
+    nslot = PyArray_DIM (count, 0);
+
+    KERN_CHECK_SIZE (slots, ctx.nrec, "slots");
+    KERN_CHECK_SIZE (flags, ctx.nrec * ctx.nchan, "flags");
+    KERN_CHECK_SIZE (count, nslot * ctx.nchan, "count");
+    KERN_CHECK_SIZE (mean, nslot * ctx.nchan, "mean");
+    KERN_CHECK_SIZE (m2, nslot * ctx.nchan, "m2");
+    KERN_CHECK_SIZE (amean, nslot * ctx.nchan, "amean");
+    KERN_CHECK_SIZE (am2, nslot * ctx.nchan, "am2");
+    KERN_CHECK_SIZE (amin, nslot * ctx.nchan, "amin");
+    KERN_CHECK_SIZE (amax, nslot * ctx.nchan, "amax");
+
+    ctx.slots = PyArray_DATA (slots);
+    ctx.data = PyArray_DATA (data);
+    ctx.flags = PyArray_DATA (flags);
+    ctx.count = PyArray_DATA (count);
+    ctx.mean = PyArray_DATA (mean);
+    ctx.m2 = PyArray_DATA (m2);
+    ctx.amean = PyArray_DATA (amean);
+    ctx.am2 = PyArray_DATA (am2);
+    ctx.amin = PyArray_DATA (amin);
+    ctx.amax = PyArray_DATA (amax);
+
+    for (i = 0; i < ctx.nrec; i++) {
+	if (ctx.slots[i] < 0 || ctx.slots[i] >= nslot) {
+	    PyErr_Format (PyExc_ValueError, "slot %ld of record %ld is out "
+			  "of range", (long) ctx.slots[i], (long) i);
+	    return NULL;
+	}
+    }
+
+    if (ctx.nrec > 0)
+	kern_parallel (ctx.nchan, 65536 / ctx.nrec + 1, stats_work, &ctx);
+
+    Py_RETURN_NONE;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Linear conversions between polarization products, such as forming
+ * Stokes parameters from XX, YY, XY, and YX, for every channel of many
+ * baselines at once. The caller works out the complex coefficients
+ * relating the output products to the input ones (see stokes.py); an
+ * output sample is flagged unless every input with a nonzero
+ * coefficient is good. Each row (baseline) is independent, so the
+ * rows are split between threads. */
+
+#include "kernels.h"
+
+typedef struct {
+    npy_intp nrow, nin, nout, nchan;
+    const float *data; /* complex64, interleaved */
+    const int *flags;
+    const double *coeffs; /* complex128, interleaved */
+    float *outdata;
+    int *outflags;
+} stokes_ctx;
+
+
+static void
+stokes_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    stokes_ctx *ctx = (stokes_ctx *) vctx;
+    npy_intp r, o, p, c, nchan = ctx->nchan;
+    const float *d;
+    const int *f;
+    const double *k;
+    float *od;
+    int *of;
+    double cre, cim;
+
+    for (r = start; r < end; r++) {
+	for (o = 0; o < ctx->nout; o++) {
+	    od = ctx->outdata + 2 * (r * ctx->nout + o) * nchan;
+	    of = ctx->outflags + (r * ctx->nout + o) * nchan;
+	    k = ctx->coeffs + 2 * o * ctx->nin;
+
+	    for (c = 0; c < nchan; c++) {
+		od[2*c] = od[2*c+1] = 0;
+		of[c] = 1;
+	    }
+
+	    for (p = 0; p < ctx->nin; p++) {
+		cre = k[2*p];
+		cim = k[2*p+1];
+		if (cre == 0 && cim == 0)
+		    continue;
+
+		d = ctx->data + 2 * (r * ctx->nin + p) * nchan;
+		f = ctx->flags + (r * ctx->nin + p) * nchan;
+
+		for (c = 0; c < nchan; c++) {
+		    od[2*c] += cre * d[2*c] - cim * d[2*c+1];
+		    od[2*c+1] += cre * d[2*c+1] + cim * d[2*c];
+		    of[c] &= f[c] != 0;
+		}
+	    }
+
+	    for (c = 0; c < nchan; c++) {
+		if (!of[c])
+		    od[2*c] = od[2*c+1] = 0;
+	    }
+	}
+    }
+}
+
+
+PyObject *
+py_stokes_convert (PyObject *self, PyObject *args)
+{
+    PyObject *data, *flags, *coeffs, *outdata, *outflags;
+    stokes_ctx ctx;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!O!", &PyArray_Type, &data,
+			   &PyArray_Type, &flags, &PyArray_Type, &coeffs,
+			   &PyArray_Type, &outdata, &PyArray_Type, &outflags))
+	return NULL;
+
+    KERN_CHECK (data, NPY_CFLOAT, "data");
+    KERN_CHECK (flags, NPY_INT, "flags");
+    KERN_CHECK (coeffs, NPY_CDOUBLE, "coeffs");
+    KERN_CHECK_OUT (outdata, NPY_CFLOAT, "outdata");
+    KERN_CHECK_OUT (outflags, NPY_INT, "outflags");
+
+    if (PyArray_NDIM (data) != 3 || PyArray_NDIM (coeffs) != 2) {
+	PyErr_SetString (PyExc_ValueError, "data must be three-dimensional "
+			 "and coeffs two-dimensional");
+	return NULL;
+    }
+
+    ctx.nrow = PyArray_DIM (data, 0);
+    ctx.nin = PyArray_DIM (data, 1);
+    ctx.nchan = PyArray_DIM (data, 2);
+    ctx.nout = PyArray_DIM (coeffs, 0);
+
+    if (PyArray_DIM (coeffs, 1) != ctx.nin) {
+	PyErr_SetString (PyExc_ValueError, "coeffs must have one column per "
+			 "input polarization");
+	return NULL;
+    }
+
+    KERN_CHECK_SIZE (flags, ctx.nrow * ctx.nin * ctx.nchan, "flags");
+    KERN_CHECK_SIZE (outdata, ctx.nrow * ctx.nout * ctx.nchan, "outdata");
+    KERN_CHECK_SIZE (outflags, ctx.nrow * ctx.nout * ctx.nchan, "outflags");
+
+    ctx.data = PyArray_DATA (data);
+    ctx.flags = PyArray_DATA (flags);
+    ctx.coeffs = PyArray_DATA (coeffs);
+    ctx.outdata = PyArray_DATA (outdata);
+    ctx.outflags = PyArray_DATA (outflags);
+
+    kern_parallel (ctx.nrow, 16384 / (ctx.nchan * ctx.nout + 1) + 1,
+		   stokes_work, &ctx);
+
+    Py_RETURN_NONE;
+}
@@ -0,0 +1,294 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Imaging weights: uniform and robust (Briggs) weighting, which
+ * downweight visibilities according to the total weight that lands in
+ * their uv cell.
+ *
+ * The density grid is a histogram of the visibility weights. Each
+ * thread histograms its share of the records into a private grid, and
+ * the private grids are then summed into the output in a second
+ * parallel pass over rows. The private grids cost memory and a
+ * reduction proportional to the grid size, so we only use extra
+ * threads when there are enough samples to pay for them.
+ *
+ * Cells follow the conventions of kern_grid.c: cell (nv/2, nu/2) is
+ * the uv origin, and a sample belongs to the cell nearest its
+ * fractional pixel position. */
+
+#include "kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define MODE_UNIFORM 0
+#define MODE_ROBUST 1
+
+typedef struct {
+    npy_intp nvis, nchan;
+    const double *u, *v, *freq;
+    const float *wt;
+    double du, dv;
+    int nu, nv, hermitian;
+    double *density;
+    double *grids[KERN_MAX_THREADS]; /* [0] is the output */
+    int ngrids;
+    int mode;
+    double f2;
+    float *out;
+} weight_ctx;
+
+
+/* The index of the cell containing the sample at fractional pixel
+ * position (pu, pv), or -1 if it's off the grid. */
+
+static npy_intp
+cell_index (const weight_ctx *ctx, double pu, double pv)
+{
+    int iu = (int) floor (pu + 0.5);
+    int iv = (int) floor (pv + 0.5);
+
+    if (iu < 0 || iv < 0 || iu >= ctx->nu || iv >= ctx->nv)
+	return -1;
+
+    return (npy_intp) iv * ctx->nu + iu;
+}
+
+
+static void
+histogram_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    weight_ctx *ctx = (weight_ctx *) vctx;
+    double *grid = ctx->grids[tid];
+    double f, pu, pv, w;
+    npy_intp i, c, idx;
+
+    for (i = start; i < end; i++) {
+	for (c = 0; c < ctx->nchan; c++) {
+	    w = ctx->wt[i * ctx->nchan + c];
+
+	    if (w == 0)
+		continue;
+
+	    f = ctx->freq[c];
+	    pu = ctx->u[i] * f / ctx->du + ctx->nu / 2;
+	    pv = ctx->v[i] * f / ctx->dv + ctx->nv / 2;
+
+	    if ((idx = cell_index (ctx, pu, pv)) >= 0)
+		grid[idx] += w;
+
+	    if (ctx->hermitian) {
+		idx = cell_index (ctx, 2 * (ctx->nu / 2) - pu,
+				  2 * (ctx->nv / 2) - pv);
+		if (idx >= 0)
+		    grid[idx] += w;
+	    }
+	}
+    }
+}
+
+
+static void
+reduce_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    weight_ctx *ctx = (weight_ctx *) vctx;
+    npy_intp i;
+    int g;
+
+    for (g = 1; g < ctx->ngrids; g++) {
+	const double *src = ctx->grids[g];
+
+	for (i = start; i < end; i++)
+	    ctx->density[i] += src[i];
+    }
+}
+
+
+PyObject *
+py_density_grid (PyObject *self, PyObject *args)
+{
+    PyObject *u, *v, *freq, *wt, *density;
+    weight_ctx ctx;
+    npy_intp ncells, grain;
+    int i;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!ddiO!", &PyArray_Type, &u,
+			   &PyArray_Type, &v, &PyArray_Type, &freq,
+			   &PyArray_Type, &wt, &ctx.du, &ctx.dv,
+			   &ctx.hermitian, &PyArray_Type, &density))
+	return NULL;
+
+    KERN_CHECK (u, NPY_DOUBLE, "u");
+    KERN_CHECK (v, NPY_DOUBLE, "v");
+    KERN_CHECK (freq, NPY_DOUBLE, "freq");
+    KERN_CHECK (wt, NPY_FLOAT, "wt");
+    KERN_CHECK_OUT (density, NPY_DOUBLE, "density");
+
+    if (PyArray_NDIM (density) != 2) {
+	PyErr_SetString (PyExc_ValueError, "density must be 2D");
+	return NULL;
+    }
+
+    if (!(ctx.du > 0) || !(ctx.dv > 0)) {
+	PyErr_SetString (PyExc_ValueError, "grid cell sizes must be positive");
+	return NULL;
+    }
+
+    ctx.nvis = PyArray_SIZE (u);
+    ctx.nchan = PyArray_SIZE (freq);
+    ctx.nv = (int) PyArray_DIM (density, 0);
+    ctx.nu = (int) PyArray_DIM (density, 1);
+    ncells = PyArray_SIZE (density);
+
+    KERN_CHECK_SIZE (v, ctx.nvis, "v");
+    KERN_CHECK_SIZE (wt, ctx.nvis * ctx.nchan, "wt");
+
+    ctx.u = PyArray_DATA (u);
+    ctx.v = PyArray_DATA (v);
+    ctx.freq = PyArray_DATA (freq);
+    ctx.wt = PyArray_DATA (wt);
+    ctx.density = PyArray_DATA (density);
+
+    if (ctx.nvis == 0 || ctx.nchan == 0) {
+	Py_RETURN_NONE;
+    }
+
+    /* Each extra thread costs about ncells of zeroing and summing, so
+     * make sure it has at least that many samples to histogram. */
+
+    grain = (4096 + ncells) / ctx.nchan + 1;
+    ctx.ngrids = kern_threads_for (ctx.nvis, grain);
+    ctx.grids[0] = ctx.density;
+
+    for (i = 1; i < ctx.ngrids; i++) {
+	ctx.grids[i] = calloc (ncells, sizeof (double));
+
+	if (ctx.grids[i] == NULL) {
+	    while (--i > 0)
+		free (ctx.grids[i]);
+	    return PyErr_NoMemory ();
+	}
+    }
+
+    kern_parallel (ctx.nvis, grain, histogram_work, &ctx);
+
+    if (ctx.ngrids > 1) {
+	kern_parallel (ncells, 16384, reduce_work, &ctx);
+
+	for (i = 1; i < ctx.ngrids; i++)
+	    free (ctx.grids[i]);
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+static void
+weight_work (void *vctx, int tid, npy_intp start, npy_intp end)
+{
+    weight_ctx *ctx = (weight_ctx *) vctx;
+    double f, pu, pv, w, d;
+    npy_intp i, c, k, idx;
+
+    for (i = start; i < end; i++) {
+	for (c = 0; c < ctx->nchan; c++) {
+	    k = i * ctx->nchan + c;
+	    w = ctx->wt[k];
+
+	    if (w == 0) {
+		ctx->out[k] = 0;
+		continue;
+	    }
+
+	    f = ctx->freq[c];
+	    pu = ctx->u[i] * f / ctx->du + ctx->nu / 2;
+	    pv = ctx->v[i] * f / ctx->dv + ctx->nv / 2;
+
+	    if ((idx = cell_index (ctx, pu, pv)) < 0) {
+		ctx->out[k] = 0;
+		continue;
+	    }
+
+	    d = ctx->density[idx];
+
+	    if (ctx->mode == MODE_UNIFORM)
+		ctx->out[k] = d > 0 ? w / d : 0;
+	    else
+		ctx->out[k] = w / (1 + d * ctx->f2);
+	}
+    }
+}
+
+
+PyObject *
+py_density_weights (PyObject *self, PyObject *args)
+{
+    PyObject *u, *v, *freq, *wt, *density, *out;
+    weight_ctx ctx;
+
+    if (!PyArg_ParseTuple (args, "O!O!O!O!ddO!idO!", &PyArray_Type, &u,
+			   &PyArray_Type, &v, &PyArray_Type, &freq,
+			   &PyArray_Type, &wt, &ctx.du, &ctx.dv,
+			   &PyArray_Type, &density, &ctx.mode, &ctx.f2,
+			   &PyArray_Type, &out))
+	return NULL;
+
+    KERN_CHECK (u, NPY_DOUBLE, "u");
+    KERN_CHECK (v, NPY_DOUBLE, "v");
+    KERN_CHECK (freq, NPY_DOUBLE, "freq");
+    KERN_CHECK (wt, NPY_FLOAT, "wt");
+    KERN_CHECK (density, NPY_DOUBLE, "density");
+    KERN_CHECK_OUT (out, NPY_FLOAT, "out");
+
+    if (PyArray_NDIM (density) != 2) {
+	PyErr_SetString (PyExc_ValueError, "density must be 2D");
+	return NULL;
+    }
+
+    if (!(ctx.du > 0) || !(ctx.dv > 0)) {
+	PyErr_SetString (PyExc_ValueError, "grid cell sizes must be positive");
+	return NULL;
+    }
+
+    if (ctx.mode != MODE_UNIFORM && ctx.mode != MODE_ROBUST) {
+	PyErr_Format (PyExc_ValueError, "unknown weighting mode %d", ctx.mode);
+	return NULL;
+    }
+
+    ctx.nvis = PyArray_SIZE (u);
+    ctx.nchan = PyArray_SIZE (freq);
+    ctx.nv = (int) PyArray_DIM (density, 0);
+    ctx.nu = (int) PyArray_DIM (density, 1);
+
+    KERN_CHECK_SIZE (v, ctx.nvis, "v");
+    KERN_CHECK_SIZE (wt, ctx.nvis * ctx.nchan, "wt");
+    KERN_CHECK_SIZE (out, ctx.nvis * ctx.nchan, "out");
+
+    ctx.u = PyArray_DATA (u);
+    ctx.v = PyArray_DATA (v);
+    ctx.freq = PyArray_DATA (freq);
+    ctx.wt = PyArray_DATA (wt);
+    ctx.density = PyArray_DATA (density);
+    ctx.out = PyArray_DATA (out);
+
+    if (ctx.nchan > 0)
+	kern_parallel (ctx.nvis, 4096 / ctx.nchan + 1, weight_work, &ctx);
+
+    Py_RETURN_NONE;
+}
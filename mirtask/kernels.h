@@ -0,0 +1,167 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Private header for the _kernels module: compute loops over whole
+ * arrays of visibility metadata and data that would be too slow to run
+ * record-by-record in Python. Nothing here depends on MIRIAD, so the
+ * kernels never need to worry about bug() longjmps and are free to run
+ * with the GIL released.
+ *
+ * As with mirtasksupport.h, this must be included before any system
+ * headers since it #includes Python.h.
+ */
+
+#ifndef _MIR_KERNELS_H
+#define _MIR_KERNELS_H
+
+#include <Python.h>
+
+#define PY_ARRAY_UNIQUE_SYMBOL py_mirtask_kernels_array_api
+#ifndef __MIR_KERNELS_MODULE_C
+#define NO_IMPORT_ARRAY
+#endif
+#include "numpy/arrayobject.h"
+
+/* kernsupport.c */
+
+/* Upper limit on the number of worker threads we'll ever spawn. */
+#define KERN_MAX_THREADS 64
+
+/* A unit of parallel work: process items [start, end) of the problem.
+ * @tid is in [0, nthreads) and can be used to index per-thread
+ * scratch space. Work functions run without the GIL and so must not
+ * touch any Python objects. */
+typedef void (*kern_work_func) (void *ctx, int tid, npy_intp start, npy_intp end);
+
+extern int kern_nthreads;
+
+extern void kern_init_threads (void);
+extern int kern_threads_for (npy_intp n, npy_intp grain);
+extern void kern_parallel (npy_intp n, npy_intp grain, kern_work_func func,
+			   void *ctx);
+
+extern void kern_clear_errors (npy_intp *bad);
+extern npy_intp kern_first_error (const npy_intp *bad);
+
+#define KERN_NOTE_ERROR(ctx, tid, i) \
+    do { if ((ctx)->bad[tid] < 0) (ctx)->bad[tid] = (i); } while (0)
+
+extern int kern_check_array (PyObject *array, int typenum, char *argname,
+			     int writable);
+extern int kern_check_size (PyObject *array, npy_intp size, char *argname);
+
+/* KERN_CHECK for arrays that are only read, KERN_CHECK_OUT for those
+ * that the kernel writes into. */
+
+#define KERN_CHECK(array, typenum, argname) \
+    if (kern_check_array (array, typenum, argname, 0)) return NULL
+
+#define KERN_CHECK_OUT(array, typenum, argname) \
+    if (kern_check_array (array, typenum, argname, 1)) return NULL
+
+#define KERN_CHECK_SIZE(array, size, argname) \
+    if (kern_check_size (array, size, argname)) return NULL
+
+/* Python entry points, collected into the method table in
+ * _kernelsmodule.c. */
+
+/* kern_basepol.c */
+
+extern PyObject *py_decode_baselines (PyObject *self, PyObject *args);
+extern PyObject *py_encode_baselines (PyObject *self, PyObject *args);
+extern PyObject *py_aap_to_bp (PyObject *self, PyObject *args);
+extern PyObject *py_bp_to_aap (PyObject *self, PyObject *args);
+extern PyObject *py_blpol_to_bp (PyObject *self, PyObject *args);
+extern PyObject *py_blpol_to_pbp32 (PyObject *self, PyObject *args);
+extern PyObject *py_pbp32_to_aap (PyObject *self, PyObject *args);
+
+/* kern_astro.c */
+
+extern PyObject *py_jd_format (PyObject *self, PyObject *args);
+extern PyObject *py_jd_to_lst (PyObject *self, PyObject *args);
+extern PyObject *py_precess (PyObject *self, PyObject *args);
+extern PyObject *py_equ_to_horizon (PyObject *self, PyObject *args);
+
+/* kern_lsq.c */
+
+extern PyObject *py_lm_step (PyObject *self, PyObject *args);
+extern PyObject *py_lm_update (PyObject *self, PyObject *args);
+extern PyObject *py_lm_covar (PyObject *self, PyObject *args);
+extern PyObject *py_lm_fit_model (PyObject *self, PyObject *args);
+
+/* kern_grid.c */
+
+extern PyObject *py_grid_vis (PyObject *self, PyObject *args);
+
+/* kern_dft.c */
+
+extern PyObject *py_dft_predict (PyObject *self, PyObject *args);
+
+/* kern_fft.c */
+
+extern PyObject *py_fft_lines (PyObject *self, PyObject *args);
+
+/* kern_weight.c */
+
+extern PyObject *py_density_grid (PyObject *self, PyObject *args);
+extern PyObject *py_density_weights (PyObject *self, PyObject *args);
+
+/* kern_aver.c */
+
+extern PyObject *py_aver_slots (PyObject *self, PyObject *args);
+extern PyObject *py_aver_accum (PyObject *self, PyObject *args);
+extern PyObject *py_chan_bin (PyObject *self, PyObject *args);
+
+/* kern_closure.c */
+
+extern PyObject *py_closure_triples (PyObject *self, PyObject *args);
+extern PyObject *py_closure_quads (PyObject *self, PyObject *args);
+
+/* kern_shadow.c */
+
+extern PyObject *py_shadow_ants (PyObject *self, PyObject *args);
+
+/* kern_flag.c */
+
+extern PyObject *py_sumthreshold (PyObject *self, PyObject *args);
+
+/* kern_stats.c */
+
+extern PyObject *py_stats_accum (PyObject *self, PyObject *args);
+
+/* kern_stokes.c */
+
+extern PyObject *py_stokes_convert (PyObject *self, PyObject *args);
+
+/* kern_clean.c */
+
+extern PyObject *py_hogbom (PyObject *self, PyObject *args);
+extern PyObject *py_clark_minor (PyObject *self, PyObject *args);
+
+/* kern_hash.c */
+
+extern PyObject *py_hash_chunks (PyObject *self, PyObject *args);
+
+/* kern_pack.c */
+
+extern PyObject *py_pack_encode (PyObject *self, PyObject *args);
+extern PyObject *py_pack_decode (PyObject *self, PyObject *args);
+
+#endif
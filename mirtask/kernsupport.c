@@ -0,0 +1,216 @@
+/*
+ * Copyright 2009-2012 Peter Williams
+ *
+ * This file is part of miriad-python.
+ *
+ * Miriad-python is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Miriad-python is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kernels.h"
+
+#include <stdlib.h> /* getenv, strtol */
+#include <unistd.h> /* sysconf */
+#include <pthread.h>
+
+/* Threading. We keep things as simple as possible: every parallel
+ * operation is a "for" loop over a range of items, which we split into
+ * contiguous chunks, one per thread. The calling thread does the first
+ * chunk itself. Threads are created per call rather than pooled; the
+ * kernels are only worth parallelizing when they do far more work than
+ * a pthread_create costs. */
+
+int kern_nthreads = 1;
+
+void
+kern_init_threads (void)
+{
+    char *env;
+    long n = 0;
+
+    env = getenv ("MIRPY_NTHREADS");
+    if (env != NULL)
+	n = strtol (env, NULL, 10);
+
+#ifdef _SC_NPROCESSORS_ONLN
+    if (n < 1)
+	n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+
+    if (n < 1)
+	n = 1;
+    if (n > KERN_MAX_THREADS)
+	n = KERN_MAX_THREADS;
+
+    kern_nthreads = (int) n;
+}
+
+
+/* How many threads will kern_parallel use for this problem? Callers
+ * that need per-thread scratch space use this to size it. */
+
+int
+kern_threads_for (npy_intp n, npy_intp grain)
+{
+    npy_intp nt;
+
+    if (grain < 1)
+	grain = 1;
+
+    nt = n / grain;
+
+    if (nt > kern_nthreads)
+	nt = kern_nthreads;
+    if (nt < 1)
+	nt = 1;
+
+    return (int) nt;
+}
+
+
+typedef struct {
+    kern_work_func func;
+    void *ctx;
+    int tid;
+    npy_intp start, end;
+} kern_job;
+
+static void *
+kern_job_run (void *arg)
+{
+    kern_job *job = (kern_job *) arg;
+
+    if (job->end > job->start)
+	job->func (job->ctx, job->tid, job->start, job->end);
+    return NULL;
+}
+
+
+/* Run @func over [0, n), using up to kern_nthreads threads but never
+ * giving a thread fewer than @grain items. The GIL is released for the
+ * duration, so this must be called with it held. If a thread can't be
+ * started, its chunk is run on the calling thread instead; there's no
+ * failure mode visible to the caller. */
+
+void
+kern_parallel (npy_intp n, npy_intp grain, kern_work_func func, void *ctx)
+{
+    kern_job jobs[KERN_MAX_THREADS];
+    pthread_t threads[KERN_MAX_THREADS];
+    int i, nt, nstarted;
+
+    if (n <= 0)
+	return;
+
+    nt = kern_threads_for (n, grain);
+
+    for (i = 0; i < nt; i++) {
+	jobs[i].func = func;
+	jobs[i].ctx = ctx;
+	jobs[i].tid = i;
+	jobs[i].start = (n * i) / nt;
+	jobs[i].end = (n * (i + 1)) / nt;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+
+    for (nstarted = 1; nstarted < nt; nstarted++)
+	if (pthread_create (&threads[nstarted], NULL, kern_job_run,
+			    &jobs[nstarted]))
+	    break;
+
+    kern_job_run (&jobs[0]);
+
+    for (i = nstarted; i < nt; i++)
+	kern_job_run (&jobs[i]);
+
+    for (i = 1; i < nstarted; i++)
+	pthread_join (threads[i], NULL);
+
+    Py_END_ALLOW_THREADS
+}
+
+
+/* Errors in the kernels are reported by the index of the first bad
+ * item in the whole array, so each thread remembers the first bad item
+ * in its chunk. Since chunks are assigned in order, the first thread
+ * with an error has the lowest bad index. */
+
+void
+kern_clear_errors (npy_intp *bad)
+{
+    int i;
+
+    for (i = 0; i < KERN_MAX_THREADS; i++)
+	bad[i] = -1;
+}
+
+npy_intp
+kern_first_error (const npy_intp *bad)
+{
+    int i;
+
+    for (i = 0; i < KERN_MAX_THREADS; i++)
+	if (bad[i] >= 0)
+	    return bad[i];
+
+    return -1;
+}
+
+
+/* Array-checking utilities. Unlike _miriad_c, where the checks are by
+ * kind and size, here we want exactly one numpy type since the
+ * kernels do arithmetic on the contents. The Python wrappers are
+ * responsible for converting their inputs appropriately. Arrays that
+ * a kernel writes into must also be @writable. */
+
+int
+kern_check_array (PyObject *array, int typenum, char *argname, int writable)
+{
+    PyArray_Descr *descr;
+
+    if (!PyArray_EquivTypenums (PyArray_TYPE (array), typenum)) {
+	descr = PyArray_DescrFromType (typenum);
+	PyErr_Format (PyExc_ValueError, "%s must be an ndarray of type '%c'",
+		      argname, descr->type);
+	Py_DECREF (descr);
+	return 1;
+    }
+
+    if (!PyArray_ISCARRAY_RO (array)) {
+	PyErr_Format (PyExc_ValueError, "%s must be a contiguous, aligned "
+		      "ndarray", argname);
+	return 1;
+    }
+
+    if (writable && !PyArray_ISWRITEABLE (array)) {
+	PyErr_Format (PyExc_ValueError, "%s must be a writeable ndarray",
+		      argname);
+	return 1;
+    }
+
+    return 0;
+}
+
+
+int
+kern_check_size (PyObject *array, npy_intp size, char *argname)
+{
+    if (PyArray_SIZE (array) != size) {
+	PyErr_Format (PyExc_ValueError, "%s must have %ld elements; got %ld",
+		      argname, (long) size, (long) PyArray_SIZE (array));
+	return 1;
+    }
+
+    return 0;
+}
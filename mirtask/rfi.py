@@ -0,0 +1,243 @@
+'''mirtask.rfi - automatic flagging of radio-frequency interference'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import numpy as N
+from mirtask import _kernels
+
+__all__ = ['sumThreshold', 'flagWaterfalls', 'waterfallFlagBoxes',
+           'flagDataset']
+
+
+def sumThreshold (data, flags, threshold=6., rho=1.5, maxWindow=64,
+                  medianChans=15, medianTimes=15, niter=2):
+    """Find interference in waterfalls with the SumThreshold method.
+
+:arg data: the visibilities
+:type data: (*ntime*, *nchan*) or (*nwf*, *ntime*, *nchan*) complex
+  array-like
+:arg flags: the existing flags, nonzero for good data, of the same shape
+:type flags: int or bool array-like
+:arg float threshold: the threshold for single samples, in units of the
+  noise level
+:arg float rho: the factor by which the threshold per sample drops each
+  time the window length doubles
+:arg int maxWindow: the longest window to try, in samples
+:arg int medianChans: the width of the running median used to
+  estimate the background along frequency, in channels
+:arg int medianTimes: the width of the running median used to smooth
+  the background along time, in integrations
+:arg int niter: the number of times to reestimate the background and
+  the noise and flag again
+:rtype: int32 ndarray
+:returns: the new flags, of the same shape as *data*
+
+This implements the SumThreshold algorithm of Offringa et al. (2010,
+MNRAS 405, 155) in the native :mod:`mirtask._kernels` module. For each
+waterfall, the background is estimated with a running median along
+each spectrum, which is then smoothed with a running median along
+time, so that it follows the bandpass but neither narrowband nor
+broadband interference. The amplitudes have the background subtracted
+and are scaled by a robust estimate of the noise (1.4826 times the
+median absolute residual). Then, for window lengths *M* of
+1, 2, 4, ... up to *maxWindow*, any *M* consecutive samples along
+either the time or the frequency axis are flagged if their mean
+exceeds *threshold* / *rho* ** log2(*M*). Samples that are already
+flagged are taken to sit right at the threshold, so that interference
+tends to get flagged out to its edges. Only excess power is flagged.
+
+The waterfalls are shared out between threads, and the GIL is released
+while they are processed.
+"""
+    data = N.ascontiguousarray (data, dtype=N.complex64)
+    shape = data.shape
+    if data.ndim == 2:
+        data = data.reshape ((1, ) + shape)
+    elif data.ndim != 3:
+        raise ValueError ('data must be two- or three-dimensional')
+
+    flags = N.array (flags, dtype=N.int32)
+    if flags.shape != shape:
+        raise ValueError ('flags must have the same shape as data')
+
+    if maxWindow < 1 or medianChans < 1 or medianTimes < 1:
+        raise ValueError ('window sizes must be positive')
+
+    _kernels.sumthreshold (data, flags, float (threshold), float (rho),
+                           int (maxWindow), int (medianChans) // 2,
+                           int (medianTimes) // 2, int (niter))
+    return flags
+
+
+def flagWaterfalls (wf, **kwargs):
+    """Flag interference in a set of waterfalls.
+
+:arg wf: the waterfalls
+:type wf: :class:`mirtask.waterfall.WaterfallSet`
+:arg kwargs: parameters for :func:`sumThreshold`
+:rtype: (*nwf*, *ntime*, *nchan*) bool ndarray
+:returns: a mask that is true for the samples that were newly flagged
+
+The **flags** attribute of *wf* is updated.
+"""
+    new = sumThreshold (wf.data, wf.flags, **kwargs)
+    hit = (new == 0) & (wf.flags != 0)
+    wf.flags = new
+    return hit
+
+
+def waterfallFlagBoxes (wf, mask):
+    """Convert a waterfall mask into flagging edits.
+
+:arg wf: the waterfalls
+:type wf: :class:`mirtask.waterfall.WaterfallSet`
+:arg mask: the samples to flag
+:type mask: (*nwf*, *ntime*, *nchan*) bool array-like
+:rtype: (*n*, 4) int64 ndarray
+:returns: the edits, as ``(rec0, rec1, chan0, chan1)`` rows that can
+  be passed to :meth:`mirtask.FlagEditor.flagRanges`
+
+Each row of each waterfall turns into one edit per run of consecutive
+flagged channels. Samples without a record behind them are ignored.
+"""
+    mask = N.asarray (mask, dtype=N.bool_)
+    if mask.shape != wf.data.shape:
+        raise ValueError ('mask must have shape %r' % (wf.data.shape, ))
+
+    visno = wf.visno.reshape (-1)
+    mask = mask.reshape ((visno.size, -1))
+    rows = N.nonzero ((visno >= 0) & mask.any (axis=1))[0]
+    if rows.size == 0:
+        return N.zeros ((0, 4), dtype=N.int64)
+
+    m = N.zeros ((rows.size, mask.shape[1] + 2), dtype=N.int8)
+    m[:,1:-1] = mask[rows]
+    edges = N.diff (m, axis=1)
+    r0, c0 = N.nonzero (edges == 1)
+    r1, c1 = N.nonzero (edges == -1)
+
+    boxes = N.empty ((r0.size, 4), dtype=N.int64)
+    boxes[:,0] = visno[rows[r0]]
+    boxes[:,1] = boxes[:,0] + 1
+    boxes[:,2] = c0
+    boxes[:,3] = c1
+    return boxes
+
+
+# The rough number of bytes that flagging needs per waterfall sample:
+# the data and flags, the new flags from sumThreshold, and the masks
+# made from them.
+
+_BYTES_PER_SAMPLE = 20
+
+def _scanPairs (vis, pols, select, batchSize):
+    from mirtask import uvdat, util
+
+    table = util.SlotTable ()
+    nchan = 0
+
+    for inp, batch in uvdat.setupAndReadBatches (vis, '', nocal=True,
+                                                 nopass=True, nopol=True,
+                                                 select=select,
+                                                 batchSize=batchSize):
+        n = batch.count
+        bl, pol = batch.baseline[:n], batch.pol[:n]
+        if pols is not None:
+            keep = (pol[:,N.newaxis] == pols).any (axis=1)
+            bl, pol = bl[keep], pol[keep]
+        table.lookup (bl, pol)
+        nchan = batch.nchan
+
+    n = table.count
+    return table.baseline[:n].copy (), table.pol[:n].copy (), nchan
+
+
+def flagDataset (vis, pols=None, select=None, chunkSize=4194304,
+                 batchSize=1024, maxMemory=512*1024*1024, **kwargs):
+    """Flag interference in a UV dataset.
+
+:arg vis: the dataset to flag
+:type vis: :class:`miriad.VisData`
+:arg pols: the polarizations to look at, as codes or names, or
+  :const:`None` for all of them
+:type pols: iterable of int or str, or :const:`None`
+:arg select: a UV selection, as for the "select" keyword, or
+  :const:`None` to look at all of the data
+:type select: str or :const:`None`
+:arg int chunkSize: the most flags to rewrite at once, as in
+  :class:`mirtask.FlagEditor`
+:arg int batchSize: the number of records to read at once
+:arg int maxMemory: roughly the most memory, in bytes, to use for
+  the waterfalls of one group of baselines
+:arg kwargs: parameters for :func:`sumThreshold`
+:rtype: int
+:returns: the number of flags that were changed from good to bad
+
+The dataset is first read through to find its baselines and
+polarizations. The baselines are then split into groups whose
+waterfalls fit in *maxMemory*, and for each group the data are read
+into waterfalls with :func:`mirtask.waterfall.buildWaterfalls`,
+without applying any calibration, and searched with
+:func:`sumThreshold`, so the dataset is read once to find the
+baselines and then once per group. The new flags of all of the
+groups are then written straight into the "flags" item of the dataset
+with a :class:`mirtask.FlagEditor`, so its flags are rewritten once.
+Every record must have the same channels.
+"""
+    from miriad import VisData
+    from mirtask import FlagEditor, util, waterfall
+
+    if not isinstance (vis, VisData):
+        vis = VisData (str (vis))
+
+    if pols is not None:
+        pols = N.array ([util.polarizationNumber (p)
+                         if isinstance (p, basestring) else p
+                         for p in pols], dtype=N.int32)
+
+    bl, pol, nchan = _scanPairs (vis, pols, select, batchSize)
+    if bl.size == 0:
+        return 0
+
+    ubl = N.unique (bl)
+    upol = N.unique (pol)
+    ntime = waterfall.scanTimes (vis).size
+    perbl = upol.size * ntime * max (nchan, 1) * _BYTES_PER_SAMPLE
+    ngroup = max (int (maxMemory // perbl), 1)
+    ant1, ant2 = util.decodeBaselineArray (ubl)
+    boxes = []
+
+    for i in xrange (0, ubl.size, ngroup):
+        group = zip (ant1[i:i+ngroup], ant2[i:i+ngroup])
+        wf = waterfall.buildWaterfalls (vis, baselines=group, pols=upol,
+                                        batchSize=batchSize, nocal=True,
+                                        nopass=True, nopol=True,
+                                        select=select)
+        boxes.append (waterfallFlagBoxes (wf, flagWaterfalls (wf, **kwargs)))
+        del wf # so that two groups' waterfalls aren't held at once
+
+    boxes = N.concatenate (boxes)
+    if boxes.shape[0] == 0:
+        return 0
+
+    hnd = vis.open ('rw')
+    try:
+        return FlagEditor (hnd, nchan,
+                           chunkSize=chunkSize).flagRanges (boxes).apply ()
+    finally:
+        hnd.close ()
@@ -0,0 +1,238 @@
+'''mirtask.stokes - convert between polarization products'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import numpy as N
+from mirtask import _kernels, util
+
+__all__ = ['parsePols', 'conversionMatrix', 'StokesConverter',
+           'convertSnapshots']
+
+
+# Each polarization product as a combination of the Stokes parameters
+# I, Q, U, and V, in the usual (IAU) conventions: XX = I + Q,
+# XY = U + iV, RR = I + V, RL = Q + iU, and so on.
+
+_stokesRows = {
+    util.POL_I: (1, 0, 0, 0),
+    util.POL_Q: (0, 1, 0, 0),
+    util.POL_U: (0, 0, 1, 0),
+    util.POL_V: (0, 0, 0, 1),
+    util.POL_XX: (1, 1, 0, 0),
+    util.POL_YY: (1, -1, 0, 0),
+    util.POL_XY: (0, 0, 1, 1j),
+    util.POL_YX: (0, 0, 1, -1j),
+    util.POL_RR: (1, 0, 0, 1),
+    util.POL_LL: (1, 0, 0, -1),
+    util.POL_RL: (0, 1, 1j, 0),
+    util.POL_LR: (0, 1, -1j, 0),
+}
+
+
+def parsePols (pols):
+    """Parse a list of polarizations.
+
+:arg pols: the polarizations, as a comma-separated string of names
+  such as "i,q,u,v", or as a sequence of names or codes
+:type pols: str or sequence
+:rtype: int32 ndarray
+:returns: the polarization codes
+"""
+    if isinstance (pols, basestring):
+        pols = [p.strip () for p in pols.split (',') if len (p.strip ())]
+
+    return N.array ([util.polarizationNumber (p.upper ())
+                     if isinstance (p, basestring) else int (p)
+                     for p in pols], dtype=N.int32)
+
+
+def conversionMatrix (inpols, outpols):
+    """Work out how to form some polarization products from others.
+
+:arg inpols: the codes of the available products
+:type inpols: sequence of int
+:arg outpols: the codes of the products to form
+:type outpols: sequence of int
+:rtype: (*nout*, *nin*) complex128 ndarray
+:returns: the coefficients: output product *i* is the sum over *j* of
+  ``coeffs[i,j]`` times input product *j*
+:raises: :exc:`ValueError` if an output can't be formed exactly from
+  the inputs
+
+Any of the Stokes parameters, the linear products, and the circular
+products can be converted to any other, as long as the inputs contain
+the necessary information: for instance, I and Q can be formed from XX
+and YY, and XX from I and Q, but U needs XY and YX. Mixed feeds and
+the "II", "QQ", and "UU" codes aren't supported.
+"""
+    def rows (pols):
+        try:
+            return N.array ([_stokesRows[p] for p in pols],
+                            dtype=N.complex128).reshape ((-1, 4))
+        except KeyError, e:
+            raise ValueError ('can\'t convert polarization %s' %
+                              util.polarizationName (e.args[0]))
+
+    if not len (inpols):
+        raise ValueError ('no input polarizations')
+
+    a = rows (inpols)
+    b = rows (outpols)
+
+    # The outputs are b s and the inputs are a s, for Stokes vector s,
+    # so we need c with c a = b.
+
+    c = N.dot (b, N.linalg.pinv (a))
+    resid = N.abs (N.dot (c, a) - b).max (axis=1)
+    bad = N.nonzero (resid > 1e-6)[0]
+    if bad.size:
+        raise ValueError ('can\'t form %s from %s' %
+                          (util.polarizationName (outpols[bad[0]]),
+                           ', '.join (util.polarizationName (p)
+                                      for p in inpols)))
+
+    c.real[N.abs (c.real) < 1e-9] = 0
+    c.imag[N.abs (c.imag) < 1e-9] = 0
+    return c
+
+
+class StokesConverter (object):
+    """:synopsis: convert the polarizations of snapshots of UV data
+
+:arg outpols: the polarizations to produce; see :func:`parsePols`
+:type outpols: str or sequence
+
+A :class:`StokesConverter` turns :class:`mirtask.uvdat.VisSnapshot`
+objects holding one set of polarization products into new snapshots
+holding another, such as XX, YY, XY, and YX into I, Q, U, and V, or
+back again. The conversion is done in native code for all of the
+baselines and channels of a snapshot at once, with the baselines
+shared out between threads (see :func:`mirtask.util.setNumThreads`).
+An output sample is flagged unless all of the input samples it
+depends on are unflagged. The coefficients are worked out once for
+each distinct set of input polarizations.
+
+Since this works on snapshots that have already been read in, the
+data can be read once, calibrated and without Stokes processing, and
+then converted to whichever polarizations are wanted, as often as
+needed, without going back through UVDAT.
+"""
+
+    def __init__ (self, outpols):
+        self.outpols = parsePols (outpols)
+        self._coeffs = {}
+
+
+    def coeffs (self, inpols):
+        """Get the conversion coefficients for a set of inputs.
+
+:arg inpols: the codes of the input polarizations
+:type inpols: sequence of int
+:rtype: (*nout*, *nin*) complex128 ndarray
+:returns: the coefficients, as in :func:`conversionMatrix`
+"""
+        key = tuple (int (p) for p in inpols)
+        c = self._coeffs.get (key)
+        if c is None:
+            c = self._coeffs[key] = conversionMatrix (key, self.outpols)
+        return c
+
+
+    def convert (self, data, flags, inpols):
+        """Convert arrays of polarization products.
+
+:arg data: the visibilities, indexed by row, polarization, and channel
+:type data: (*nrow*, *nin*, *nchan*) complex array-like
+:arg flags: the flags, nonzero for good data
+:type flags: (*nrow*, *nin*, *nchan*) int array-like
+:arg inpols: the codes of the polarizations along the second axis
+:type inpols: sequence of int
+:rtype: ``(data, flags)``
+:returns: (*nrow*, *nout*, *nchan*) complex64 and int32 arrays of the
+  converted visibilities and flags
+"""
+        c = self.coeffs (inpols)
+        data = N.ascontiguousarray (data, dtype=N.complex64)
+        flags = N.ascontiguousarray (flags, dtype=N.int32)
+        if data.ndim != 3 or flags.shape != data.shape:
+            raise ValueError ('data and flags must have the same '
+                              'three-dimensional shape')
+
+        shape = (data.shape[0], c.shape[0], data.shape[2])
+        outdata = N.empty (shape, dtype=N.complex64)
+        outflags = N.empty (shape, dtype=N.int32)
+        _kernels.stokes_convert (data, flags, c, outdata, outflags)
+        return outdata, outflags
+
+
+    def convertSnapshot (self, snap):
+        """Convert the polarizations of a snapshot.
+
+:arg snap: the snapshot
+:type snap: :class:`mirtask.uvdat.VisSnapshot`
+:rtype: :class:`mirtask.uvdat.VisSnapshot`
+:returns: a new snapshot with the polarizations given to the
+  constructor, which doesn't share any arrays with *snap*
+
+An output product is present for a baseline if all of the inputs it
+depends on are. Its variance is the sum of those of the inputs,
+weighted by the squared magnitudes of their coefficients.
+"""
+        from mirtask.uvdat import VisSnapshot
+
+        c = self.coeffs (snap.pols)
+        used = (c != 0)
+        out = VisSnapshot ()
+        out.time, out.hasW = snap.time, snap.hasW
+        out.freqs, out.vars = snap.freqs, snap.vars
+        out.spec = snap.spec
+        out.nbl, out.nchan = snap.nbl, snap.nchan
+        out.npol = self.outpols.size
+
+        for name in ('baseline', 'ant1', 'ant2', 'uvw'):
+            setattr (out, name, getattr (snap, name).copy ())
+
+        out.pols = self.outpols.copy ()
+        out.data, out.flags = self.convert (snap.data, snap.flags, snap.pols)
+        out.present = ((~snap.present[:,N.newaxis,:] & used).sum (axis=2)
+                       == 0)
+        out.variance = N.dot (snap.variance, (N.abs (c)**2).T)
+        out.flags[~out.present] = 0
+        return out
+
+
+def convertSnapshots (snapshots, outpols):
+    """Convert the polarizations of a stream of snapshots.
+
+:arg snapshots: the snapshots
+:type snapshots: iterable of :class:`mirtask.uvdat.VisSnapshot`, or
+  of ``(handle, snapshot)`` tuples as yielded by
+  :func:`mirtask.uvdat.readSnapshots`
+:arg outpols: the polarizations to produce; see :func:`parsePols`
+:type outpols: str or sequence
+:rtype: generator of :class:`mirtask.uvdat.VisSnapshot`, or of
+  ``(handle, snapshot)`` tuples if that's what came in
+:returns: the converted snapshots
+"""
+    conv = StokesConverter (outpols)
+
+    for item in snapshots:
+        if isinstance (item, tuple):
+            yield item[0], conv.convertSnapshot (item[1])
+        else:
+            yield conv.convertSnapshot (item)
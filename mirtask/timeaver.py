@@ -0,0 +1,485 @@
+'''mirtask.timeaver - average UV data in time'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import numpy as N
+from mirtask import _kernels, util
+from mirtask.uvdat import VisBatch, _sameVars
+
+__all__ = ['TimeAverager', 'DEFAULT_TRACKVARS', 'averageData']
+
+
+# The speed of light, in meters per nanosecond.
+
+_CNS = 0.299792458
+
+# The default cap on the averaging interval of short baselines, as a
+# multiple of the basic interval.
+
+DEFAULT_MAXFACTOR = 16
+
+# The UV variables that are watched while averaging and copied into
+# the output. A change in any of them ends all of the averages in
+# progress.
+
+DEFAULT_TRACKVARS = ('antpos dec epoch inttime ischan nants nschan nspect '
+                     'obsdec obsra ra restfreq sdf sfreq source telescop '
+                     'veldop vsource').split ()
+
+
+def _joinRows (batches, which):
+    # Make a batch out of rows *which* of *batches* laid end to end.
+    # The batches must all come from the same averaging epoch.
+
+    b0 = batches[0]
+    out = VisBatch (which.size, b0.nchan, b0.hasW, b0.freqs, b0.spec)
+    out.count = which.size
+    out.vars = b0.vars
+
+    for name in ('uvw', 'time', 'baseline', 'data', 'flags', 'pol',
+                 'variance', 'visno', 'specid', 'inttime'):
+        if len (batches) == 1:
+            col = getattr (b0, name)
+        else:
+            col = N.concatenate ([getattr (b, name) for b in batches])
+        setattr (out, name, col[which])
+
+    return out
+
+
+class TimeAverager (object):
+    """:synopsis: average batches of UV records in time
+
+:arg float interval: the averaging interval, in minutes
+:arg refLength: the baseline length, in meters, at and above which
+  *interval* is used; or :const:`None` (the default) to use *interval*
+  for every baseline
+:arg maxInterval: the longest interval to use for short baselines, in
+  minutes; defaults to :data:`DEFAULT_MAXFACTOR` times *interval*
+
+A :class:`TimeAverager` averages the records of a stream of
+:class:`mirtask.uvdat.VisBatch` objects, like UVAVER, and hands back
+the averaged records as new batches. Each (baseline, pol) pair has
+its own accumulator, found through a hash table in native code, and
+the spectra of a whole batch are added into the accumulators at once,
+with the channels shared out between threads (see
+:func:`mirtask.util.setNumThreads`).
+
+Time is divided into intervals counted from the first record seen. An
+average ends when the first record of a later interval arrives, when
+the channel frequencies change, or when the variables recorded in the
+batches' **vars** snapshots change (see the *trackVars* argument of
+:func:`mirtask.uvdat.readBatches`).
+
+If *refLength* is given, averaging is baseline-dependent: the smearing
+caused by averaging is proportional to the baseline length, so
+shorter baselines can be averaged for longer. A baseline of length *b*
+is averaged over *n* basic intervals, with *n* the integer part of
+*refLength* / *b*, limited to between one and *maxInterval* /
+*interval*. The lengths are measured from the first record of each
+baseline, using the *w* coordinate if the batches have it.
+
+The visibilities are averaged with weights of the inverse variance of
+each record, or equal weights if the variance is unknown; flagged
+channels are left out. A channel with no good data in an average is
+zeroed and flagged. The *u*, *v*, *w* coordinates and times of the
+output records are the plain means of those of the input records.
+
+The averaged records come out in order of time, then baseline and pol,
+across batches as well as within them, as long as the input is in
+time order. To manage that, an average that ends is held back until
+none of those still in progress can come before it, so with
+baseline-dependent averaging the output can lag the input by up to
+*maxInterval*. The output batches' **vars** attributes are the snapshots that applied to their input
+records, they have **visno** values of -1, and they have an extra
+attribute, **inttime**, a *nrec*-element float32 array of the total
+integration times of the input records that went into each average, if
+"inttime" is one of the tracked variables, or zero otherwise.
+"""
+
+    def __init__ (self, interval, refLength=None, maxInterval=None):
+        if not interval > 0:
+            raise ValueError ('averaging interval must be positive')
+
+        self.interval = float (interval)
+        self._dt = self.interval / 1440
+
+        if refLength is None:
+            self._reflen = None
+            self._maxfactor = 1
+        else:
+            self._reflen = float (refLength) / _CNS
+            if maxInterval is None:
+                self._maxfactor = DEFAULT_MAXFACTOR
+            else:
+                self._maxfactor = max (int (maxInterval / self.interval), 1)
+
+        self._vars = None
+        self._nchan = None
+        self._freqs = None
+        self._spec = None
+        self._hasW = None
+        self._held = []
+        self._start (0)
+
+
+    def _start (self, nchan):
+        self._tref = None
+        self._table = util.SlotTable (64)
+        self._alloc (64, nchan)
+
+
+    def _alloc (self, cap, nchan, n=0):
+        for name, shape, dtype in self._slotspecs:
+            dims = [cap] + [d or nchan for d in shape]
+            new = N.zeros (dims, dtype=dtype)
+            if n > 0:
+                new[:n] = getattr (self, '_' + name)[:n]
+            setattr (self, '_' + name, new)
+
+    # The per-slot state, besides the baseline and pol, which live in
+    # the slot table. The first describes the slot; the rest are
+    # accumulators that are zeroed when an average ends. The shapes
+    # give the per-slot dimensions, with 0 standing for the number of
+    # channels.
+
+    _slotspecs = [('factor', (), N.int64), ('bin', (), N.int64),
+                  ('count', (), N.int64), ('uvwsum', (3, ), N.double),
+                  ('tsum', (), N.double), ('varinv', (), N.double),
+                  ('nunknown', (), N.int64), ('inttime', (), N.double),
+                  ('sums', (0, ), N.complex128), ('wsum', (0, ), N.double)]
+
+
+    def _lookup (self, batch):
+        n = batch.count
+        nused = self._table.count
+        slots, first = self._table.lookup (batch.baseline[:n], batch.pol[:n])
+        nnew = self._table.count
+        if nnew == nused:
+            return slots
+
+        if nnew > self._factor.size:
+            cap = self._factor.size
+            while nnew > cap:
+                cap *= 2
+            self._alloc (cap, self._nchan, nused)
+
+        # Set up the new slots from their first records.
+
+        s = N.arange (nused, nnew)
+
+        if self._reflen is None:
+            self._factor[s] = 1
+        else:
+            uvw = batch.uvw[first]
+            if not batch.hasW:
+                uvw = uvw[:,:2]
+            length = N.sqrt ((uvw**2).sum (axis=1))
+            f = N.empty (s.size)
+            f.fill (self._maxfactor)
+            nz = length > 0
+            f[nz] = N.floor (self._reflen / length[nz])
+            self._factor[s] = N.clip (f, 1, self._maxfactor)
+
+        return slots
+
+
+    def _newEpoch (self, batch):
+        # Batches with the same spectral setup share their frequencies,
+        # so the arrays only need comparing when the setups differ.
+        sameSpec = batch.spec is not None and batch.spec is self._spec
+        return not (batch.nchan == self._nchan and batch.hasW == self._hasW and
+                    (sameSpec or N.array_equal (batch.freqs, self._freqs)) and
+                    _sameVars (batch.vars, self._vars))
+
+
+    def add (self, batch):
+        """Add a batch of records to the averages.
+
+:arg batch: the records
+:type batch: :class:`mirtask.uvdat.VisBatch`
+:rtype: list of :class:`mirtask.uvdat.VisBatch`
+:returns: batches of averaged records that are ready to be handed
+  back after this batch; often empty
+"""
+        out = []
+
+        if self._newEpoch (batch):
+            out += self.flush ()
+            self._vars = batch.vars
+            self._nchan = batch.nchan
+            self._freqs = N.array (batch.freqs)
+            self._spec = batch.spec
+            self._hasW = batch.hasW
+            self._start (batch.nchan)
+
+        n = batch.count
+        if n == 0:
+            return out
+
+        slots = self._lookup (batch)
+        time = batch.time[:n]
+        if self._tref is None:
+            self._tref = time[0]
+
+        wt = N.ones (n, dtype=N.double)
+        var = batch.variance[:n]
+        known = var > 0
+        wt[known] = 1. / var[known]
+
+        inttime = 0.
+        if 'inttime' in self._vars:
+            inttime = float (self._vars['inttime'][1][0])
+
+        data = N.ascontiguousarray (batch.data[:n], dtype=N.complex64)
+        flags = N.ascontiguousarray (batch.flags[:n], dtype=N.int32)
+        base = N.floor ((time - self._tref) / self._dt).astype (N.int64)
+
+        # Work through runs of records in the same basic interval, first
+        # ending any averages whose intervals are over.
+
+        edges = N.concatenate (([0], N.nonzero (base[1:] != base[:-1])[0] + 1,
+                                [n]))
+
+        for i0, i1 in zip (edges[:-1], edges[1:]):
+            b = base[i0]
+            ns = self._table.count
+            ended = N.nonzero ((self._count[:ns] > 0) &
+                               (self._bin[:ns] != b // self._factor[:ns]))[0]
+            if ended.size:
+                self._held.append (self._flushSlots (ended))
+
+            s = slots[i0:i1]
+            cnt = N.bincount (s, minlength=ns)
+            self._bin[s] = b // self._factor[s]
+            self._count[:ns] += cnt
+            for j in xrange (3):
+                self._uvwsum[:ns,j] += N.bincount (s, batch.uvw[i0:i1,j],
+                                                   minlength=ns)
+            self._tsum[:ns] += N.bincount (s, time[i0:i1], minlength=ns)
+            self._varinv[:ns] += N.bincount (s, N.where (known[i0:i1],
+                                                         wt[i0:i1], 0),
+                                             minlength=ns)
+            self._nunknown[:ns] += N.bincount (s[~known[i0:i1]], minlength=ns)
+            self._inttime[:ns] += inttime * cnt
+
+            _kernels.aver_accum (s, wt[i0:i1], data[i0:i1], flags[i0:i1],
+                                 self._sums, self._wsum)
+
+        # Later records can't be any earlier than this batch's last
+        # one, and more of them only move the mean time of an average
+        # in progress later, so nothing still to come can be earlier
+        # than the horizon.
+
+        horizon = time[-1]
+        ns = self._table.count
+        active = self._count[:ns] > 0
+        if active.any ():
+            horizon = min (horizon, (self._tsum[:ns][active] /
+                                     self._count[:ns][active]).min ())
+
+        return out + self._release (horizon)
+
+
+    def _release (self, horizon=None):
+        # Hand back the held averages that are earlier than *horizon*,
+        # or all of them if it's None, in order of time, baseline, and
+        # pol. The output times are the mean times of the records, so
+        # that's what has to be in order in the output dataset.
+
+        if not len (self._held):
+            return []
+
+        held = self._held
+        time = N.concatenate ([b.time for b in held])
+        bl = N.concatenate ([b.baseline for b in held])
+        pol = N.concatenate ([b.pol for b in held])
+        order = N.lexsort ((pol, bl, time))
+
+        if horizon is None:
+            nready = order.size
+        else:
+            nready = N.searchsorted (time[order], horizon)
+
+        if nready == 0:
+            return []
+
+        out = _joinRows (held, order[:nready])
+        if nready < order.size:
+            self._held = [_joinRows (held, order[nready:])]
+        else:
+            self._held = []
+        return [out]
+
+
+    def _flushSlots (self, idx):
+        bl = self._table.baseline
+        pol = self._table.pol
+        count = self._count[idx]
+        tmean = self._tsum[idx] / count
+        m = idx.size
+
+        out = VisBatch (m, self._nchan, self._hasW, self._freqs, self._spec)
+        out.count = m
+        out.vars = self._vars
+        out.uvw[:] = self._uvwsum[idx] / count[:,N.newaxis]
+        out.time[:] = tmean
+        out.baseline[:] = bl[idx]
+        out.pol[:] = pol[idx]
+        out.visno.fill (-1)
+
+        wsum = self._wsum[idx]
+        good = wsum > 0
+        out.data[:] = self._sums[idx] / N.where (good, wsum, 1)
+        out.flags[:] = good
+
+        out.variance.fill (0)
+        known = (self._nunknown[idx] == 0) & (self._varinv[idx] > 0)
+        out.variance[known] = 1. / self._varinv[idx][known]
+        out.inttime = self._inttime[idx].astype (N.float32)
+
+        for name, shape, dtype in self._slotspecs[1:]:
+            getattr (self, '_' + name)[idx] = 0
+
+        return out
+
+
+    def flush (self):
+        """End all of the averages in progress.
+
+:rtype: list of :class:`mirtask.uvdat.VisBatch`
+:returns: a batch of the averaged records, including any that were
+  being held back, or an empty list if there are none
+"""
+        active = N.nonzero (self._count[:self._table.count] > 0)[0]
+        if active.size:
+            self._held.append (self._flushSlots (active))
+        return self._release ()
+
+
+    def averageBatches (self, batches):
+        """Average a stream of batches as they're read.
+
+:arg batches: a stream of ``(handle, batch)`` tuples, as returned by
+  :func:`mirtask.uvdat.readBatches`
+:rtype: generator of :class:`mirtask.uvdat.VisBatch`
+:returns: the averaged records
+
+The averages still in progress at the end of the stream are flushed.
+"""
+        for inp, batch in batches:
+            for out in self.add (batch):
+                yield out
+
+        for out in self.flush ():
+            yield out
+
+
+def averageData (toread, out, interval, refLength=None, maxInterval=None,
+                 trackVars=DEFAULT_TRACKVARS, banner=None, batchSize=1024,
+                 **uvdargs):
+    """Time-average UV data into a new dataset.
+
+:arg toread: the dataset or datasets to read
+:type toread: :class:`miriad.VisData`, or iterable thereof
+:arg out: the dataset to create
+:type out: :class:`miriad.VisData`
+:arg float interval: the averaging interval, in minutes
+:arg refLength: see :class:`TimeAverager`
+:arg maxInterval: see :class:`TimeAverager`
+:arg trackVars: the UV variables to copy into the output, a change in
+  any of which ends the averages in progress; defaults to
+  :data:`DEFAULT_TRACKVARS`
+:type trackVars: iterable of str
+:arg banner: a line to write into the history of *out*, or
+  :const:`None` for a default
+:arg int batchSize: the number of records to read at once
+:arg uvdargs: extra arguments for the UVDAT subsystem, as in
+  :func:`mirtask.uvdat.setupAndReadBatches`
+:rtype: :const:`None`
+
+The data are read in batches with :func:`mirtask.uvdat.setupAndReadBatches`,
+averaged with a :class:`TimeAverager`, and written out in batches with
+:meth:`mirtask.UVDataSet.writeBatch`, all in one pass and without
+running UVAVER. Calibrations are applied as the data are read, as
+usual. Only the variables in *trackVars* and the per-record "pol",
+"npol", and "inttime" variables are written, and the *line* argument
+isn't supported, since the spectral variables are copied as they are.
+If something goes wrong, *out* is deleted.
+"""
+    from mirtask import uvdat
+
+    if 'line' in uvdargs:
+        raise ValueError ('averageData does not support line selection')
+
+    averager = TimeAverager (interval, refLength, maxInterval)
+
+    if banner is None:
+        banner = 'PYTHON timeaver: interval=%g' % averager.interval
+        if refLength is not None:
+            banner += ' refLength=%g maxInterval=%g' % (refLength,
+                averager.interval * averager._maxfactor)
+
+    outhnd = out.open ('c')
+
+    try:
+        outhnd.setPreambleType ('uvw', 'time', 'baseline')
+        state = {'vars': None, 'npol': None}
+
+        def write (batch):
+            if batch.vars is not state['vars']:
+                outhnd.writeVars (batch.vars)
+                state['vars'] = batch.vars
+
+            npol = N.unique (batch.pol).size
+            if npol != state['npol']:
+                outhnd.writeVarInt ('npol', npol)
+                state['npol'] = npol
+
+            outhnd.writeBatch (batch, batch.inttime)
+
+        first = True
+        gen = uvdat.setupAndReadBatches (toread, '3', batchSize=batchSize,
+                                         trackVars=trackVars, **uvdargs)
+
+        for inp, batch in gen:
+            if first:
+                first = False
+                info = inp.probeVar ('corr')
+                if info is not None and info[0] in 'rjc':
+                    outhnd.setCorrelationType (info[0])
+                else:
+                    outhnd.setCorrelationType ('r')
+
+                inp.copyItem (outhnd, 'history')
+                outhnd.openHistory ()
+                outhnd.writeHistory (banner)
+                outhnd.closeHistory ()
+
+            for avg in averager.add (batch):
+                write (avg)
+
+        for avg in averager.flush ():
+            write (avg)
+
+        outhnd.close ()
+    except Exception:
+        if outhnd.isOpen ():
+            outhnd.close ()
+        out.delete ()
+        raise
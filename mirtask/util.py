@@ -18,7 +18,7 @@
 # along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
 
 import numpy as N
-from mirtask import _miriad_f
+from mirtask import _miriad_f, _kernels
 
 # Banner printing (and Id string decoding)
 
@@ -686,6 +686,360 @@ def parsePBP32 (text):
     return ((m1 - 1) << 19) + (fp1 << 16) + ((m2 - 1) << 3) + fp2
 
 
+# Vectorized versions of the above, for converting whole columns of UV
+# metadata at once. The heavy lifting is done in the _kernels
+# extension, which works on arrays of any size and spreads large ones
+# over multiple threads. Where the scalar functions would raise an
+# exception for a bad value, these raise a ValueError mentioning the
+# index of the first bad item. Note that apAnt, apFPol, and antpol2ap
+# already work elementwise on integer ndarrays.
+
+def getNumThreads ():
+    """Get the number of threads used by the vectorized compute kernels.
+
+:rtype: int
+:returns: the maximum number of threads that will be used
+
+The default is the number of processors online, or the value of the
+environment variable :envvar:`MIRPY_NTHREADS` if it is set when
+:mod:`mirtask.util` is first imported. Small problems are always
+processed on a single thread.
+"""
+    return _kernels.get_nthreads ()
+
+
+def setNumThreads (n):
+    """Set the number of threads used by the vectorized compute kernels.
+
+:arg int n: the maximum number of threads to use; must be positive.
+:returns: :const:`None`
+
+See :func:`getNumThreads`. Setting *n* to 1 disables threading.
+"""
+    _kernels.set_nthreads (int (n))
+
+
+def _ints (a):
+    return N.ascontiguousarray (a, dtype=N.intc)
+
+
+def decodeBaselineArray (encoded, check=True, out=None):
+    """Decode an array of encoded baseline numbers into antenna numbers.
+
+:arg encoded: the encoded baselines, as found in the fifth element
+  of UV preambles
+:type encoded: array-like of float
+:arg bool check: whether to raise an exception for invalid baselines
+:arg out: a pair of contiguous int arrays with as many elements as
+  *encoded* into which to decode, or :const:`None` to allocate new
+  ones
+:type out: (int ndarray, int ndarray) or :const:`None`
+:rtype: (int ndarray, int ndarray)
+:returns: the one-based antenna numbers *m1* and *m2*, each with the
+  same shape as *encoded*, or *out* if it was given
+:raises: :exc:`ValueError` if *check* is true and one of the values
+  does not decode to an antenna pair with ``1 <= m1 <= m2``
+
+The vectorized equivalent of :func:`decodeBaseline`.
+"""
+    bl = N.ascontiguousarray (encoded, dtype=N.double)
+    if out is None:
+        m1 = N.empty (bl.shape, dtype=N.intc)
+        m2 = N.empty (bl.shape, dtype=N.intc)
+    else:
+        m1, m2 = out
+    _kernels.decode_baselines (bl, m1, m2, int (bool (check)))
+    return m1, m2
+
+
+def encodeBaselineArray (m1, m2):
+    """Encode arrays of antenna numbers into baseline numbers.
+
+:arg m1: the first antenna numbers (one-based)
+:type m1: array-like of int
+:arg m2: the second antenna numbers (one-based); must broadcast
+  against *m1*
+:type m2: array-like of int
+:rtype: double ndarray
+:returns: the encoded baselines, suitable for use in UV preambles
+:raises: :exc:`ValueError` if any pair doesn't satisfy ``1 <= m1 <= m2
+  <= 2047``
+
+The vectorized equivalent of :func:`encodeBaseline`.
+"""
+    m1, m2 = N.broadcast_arrays (m1, m2)
+    m1, m2 = _ints (m1), _ints (m2)
+    bl = N.empty (m1.shape, dtype=N.double)
+    _kernels.encode_baselines (m1, m2, bl)
+    return bl
+
+
+def aap2bpArray (m1, m2, pol):
+    """Create basepols from arrays of antenna numbers and polarizations.
+
+:arg m1: the first antenna numbers (one-based)
+:type m1: array-like of int
+:arg m2: the second antenna numbers (one-based)
+:type m2: array-like of int
+:arg pol: the FITS/MIRIAD polarization codes
+:type pol: array-like of int
+:rtype: (int ndarray, int ndarray)
+:returns: the antpol arrays *ap1* and *ap2* making up the basepols
+:raises: :exc:`ValueError` if an antenna number is below one or a
+  polarization code is unknown
+
+The vectorized equivalent of :func:`aap2bp`. The three input arrays
+are broadcast against each other, so, for instance, *pol* may be a
+scalar.
+"""
+    m1, m2, pol = N.broadcast_arrays (m1, m2, pol)
+    m1, m2, pol = _ints (m1), _ints (m2), _ints (pol)
+    ap1 = N.empty (m1.shape, dtype=N.intc)
+    ap2 = N.empty (m1.shape, dtype=N.intc)
+    _kernels.aap_to_bp (m1, m2, pol, ap1, ap2)
+    return ap1, ap2
+
+
+def bp2aapArray (ap1, ap2):
+    """Convert arrays of basepols into antenna numbers and polarizations.
+
+:arg ap1: the first antpols of the basepols
+:type ap1: array-like of int
+:arg ap2: the second antpols of the basepols
+:type ap2: array-like of int
+:rtype: (int ndarray, int ndarray, int ndarray)
+:returns: the arrays (*m1*, *m2*, *pol*)
+:raises: :exc:`ValueError` if an antpol is negative or a pair of
+  feed polarizations has no FITS polarization code
+
+The vectorized equivalent of :func:`bp2aap`.
+"""
+    ap1, ap2 = N.broadcast_arrays (ap1, ap2)
+    ap1, ap2 = _ints (ap1), _ints (ap2)
+    m1 = N.empty (ap1.shape, dtype=N.intc)
+    m2 = N.empty (ap1.shape, dtype=N.intc)
+    pol = N.empty (ap1.shape, dtype=N.intc)
+    _kernels.bp_to_aap (ap1, ap2, m1, m2, pol)
+    return m1, m2, pol
+
+
+def blpol2bpArray (bl, pol):
+    """Convert arrays of baseline numbers and polarizations into basepols.
+
+:arg bl: the encoded baselines, as found in UV preambles
+:type bl: array-like of float
+:arg pol: the FITS/MIRIAD polarization codes
+:type pol: array-like of int
+:rtype: (int ndarray, int ndarray)
+:returns: the antpol arrays *ap1* and *ap2* making up the basepols
+:raises: :exc:`ValueError` if a baseline is invalid or a polarization
+  code is unknown
+
+The columnar equivalent of :func:`mir2bp`: given the baseline and
+polarization of every record in a chunk of UV data, compute all of
+their basepols in one go.
+"""
+    bl, pol = N.broadcast_arrays (bl, pol)
+    bl = N.ascontiguousarray (bl, dtype=N.double)
+    pol = _ints (pol)
+    ap1 = N.empty (bl.shape, dtype=N.intc)
+    ap2 = N.empty (bl.shape, dtype=N.intc)
+    _kernels.blpol_to_bp (bl, pol, ap1, ap2)
+    return ap1, ap2
+
+
+def blpol2pbp32Array (bl, pol):
+    """Convert arrays of baseline numbers and polarizations into PBP32s.
+
+:arg bl: the encoded baselines, as found in UV preambles
+:type bl: array-like of float
+:arg pol: the FITS/MIRIAD polarization codes
+:type pol: array-like of int
+:rtype: uint32 ndarray
+:returns: the packed basepols
+:raises: :exc:`ValueError` if a baseline is invalid, involves an
+  antenna number above 8192, or a polarization code is unknown
+
+The columnar equivalent of :func:`mir2pbp32`. Because each basepol
+becomes a single integer, the result is convenient for grouping and
+sorting records; see :func:`groupByKey`.
+"""
+    bl, pol = N.broadcast_arrays (bl, pol)
+    bl = N.ascontiguousarray (bl, dtype=N.double)
+    pol = _ints (pol)
+    pbp32 = N.empty (bl.shape, dtype=N.uintc)
+    _kernels.blpol_to_pbp32 (bl, pol, pbp32)
+    return pbp32
+
+
+def _pbp32s (pbp32):
+    pbp32 = N.asarray (pbp32)
+
+    if pbp32.size and (pbp32.min () < 0 or pbp32.max () > 0xFFFFFFFF):
+        raise ValueError ('illegal PBP32 value in array')
+
+    return N.ascontiguousarray (pbp32, dtype=N.uintc)
+
+
+def pbp32ToAAPArray (pbp32):
+    """Convert an array of PBP32s into antenna numbers and polarizations.
+
+:arg pbp32: the packed basepols
+:type pbp32: array-like of int
+:rtype: (int ndarray, int ndarray, int ndarray)
+:returns: the arrays (*m1*, *m2*, *pol*)
+:raises: :exc:`ValueError` if a value is not a legal PBP32 or
+  its pair of feed polarizations has no FITS polarization code
+"""
+    pbp32 = _pbp32s (pbp32)
+    m1 = N.empty (pbp32.shape, dtype=N.intc)
+    m2 = N.empty (pbp32.shape, dtype=N.intc)
+    pol = N.empty (pbp32.shape, dtype=N.intc)
+    _kernels.pbp32_to_aap (pbp32, m1, m2, pol)
+    return m1, m2, pol
+
+
+def pbp32ToBPArray (pbp32):
+    """Convert an array of PBP32s into basepols.
+
+:arg pbp32: the packed basepols
+:type pbp32: array-like of int
+:rtype: (int ndarray, int ndarray)
+:returns: the antpol arrays *ap1* and *ap2*
+:raises: :exc:`ValueError` if a value is not a legal PBP32
+
+The vectorized equivalent of :func:`pbp32ToBP`.
+"""
+    pbp32 = _pbp32s (pbp32)
+    ap1 = ((pbp32 >> 16) & 0xFFFF).astype (N.intc)
+    ap2 = (pbp32 & 0xFFFF).astype (N.intc)
+    return ap1, ap2
+
+
+def bpToPBP32Array (ap1, ap2):
+    """Convert arrays of basepols into PBP32s.
+
+:arg ap1: the first antpols of the basepols
+:type ap1: array-like of int
+:arg ap2: the second antpols of the basepols
+:type ap2: array-like of int
+:rtype: uint32 ndarray
+:returns: the packed basepols
+:raises: :exc:`ValueError` if an antpol is negative or too large to
+  be stored in a PBP32
+
+The vectorized equivalent of :func:`bpToPBP32`.
+"""
+    ap1, ap2 = N.broadcast_arrays (N.asarray (ap1), N.asarray (ap2))
+
+    if ap1.size:
+        if min (ap1.min (), ap2.min ()) < 0:
+            raise ValueError ('negative antpol in array')
+        if max (ap1.max (), ap2.max ()) > 0xFFFF:
+            raise ValueError ('cannot store antpol > 0xFFFF in PBP32')
+
+    return ((ap1.astype (N.uintc) << 16) + ap2.astype (N.uintc)).astype (N.uintc)
+
+
+def bpIsIntenArray (ap1, ap2):
+    """Test whether basepols are intensity-type.
+
+:arg ap1: the first antpols of the basepols
+:type ap1: array-like of int
+:arg ap2: the second antpols of the basepols
+:type ap2: array-like of int
+:rtype: bool ndarray
+:returns: whether each basepol is intensity-type
+
+The vectorized equivalent of :func:`bpIsInten`. No checking is done
+on the validity of the antpols.
+"""
+    fp1 = N.asarray (ap1) & 0x7
+    fp2 = N.asarray (ap2) & 0x7
+    return (fp1 < 5) & (fp1 == fp2)
+
+
+def pbp32IsIntenArray (pbp32):
+    """Test whether PBP32s are intensity-type.
+
+:arg pbp32: the packed basepols
+:type pbp32: array-like of int
+:rtype: bool ndarray
+:returns: whether each PBP32 is intensity-type
+
+The vectorized equivalent of :func:`pbp32IsInten`. No checking is
+done on the validity of the values.
+"""
+    pbp32 = N.asarray (pbp32)
+    fp1 = (pbp32 >> 16) & 0x7
+    fp2 = pbp32 & 0x7
+    return (fp1 < 5) & (fp1 == fp2)
+
+
+_polNameTable = N.array ([_polNames[p] for p in xrange (POL_YX, POL_UU + 1)])
+
+def polarizationNameArray (pols):
+    """Look up the names of an array of polarization codes.
+
+:arg pols: MIRIAD polarization codes
+:type pols: array-like of int
+:rtype: string ndarray
+:returns: the textual descriptions of the codes
+:raises: :exc:`ValueError` if any code is unknown
+
+The vectorized equivalent of :func:`polarizationName`.
+"""
+    pols = N.asarray (pols)
+
+    if pols.size and (pols.min () < POL_YX or pols.max () > POL_UU):
+        raise ValueError ('unknown polarization code in array')
+
+    return _polNameTable[pols - POL_YX]
+
+
+def polarizationIsIntenArray (pols):
+    """Test whether polarization codes are intensity-type.
+
+:arg pols: MIRIAD polarization codes
+:type pols: array-like of int
+:rtype: bool ndarray
+:returns: whether each code is I, XX, YY, RR, or LL
+
+The vectorized equivalent of :func:`polarizationIsInten`.
+"""
+    pols = N.asarray (pols)
+    return ((pols == POL_I) | (pols == POL_RR) | (pols == POL_LL) |
+            (pols == POL_XX) | (pols == POL_YY))
+
+
+def groupByKey (keys):
+    """Group the indices of an array by the value of its elements.
+
+:arg keys: the values to group by; e.g., the output of
+  :func:`blpol2pbp32Array`
+:type keys: 1D array-like
+:rtype: (ndarray, list of int ndarray)
+:returns: a tuple (*uniq*, *groups*), where *uniq* contains the
+  distinct values of *keys* in sorted order and *groups[i]* contains
+  the indices of the elements of *keys* equal to *uniq[i]*
+
+Within each group the indices are in increasing order, so if *keys*
+is a column of records in time order, so is each group.
+"""
+    keys = N.asarray (keys)
+    if keys.ndim != 1:
+        raise ValueError ('"keys" must be one-dimensional')
+
+    if keys.size == 0:
+        return keys.copy (), []
+
+    order = N.argsort (keys, kind='mergesort')
+    skeys = keys[order]
+    bounds = N.flatnonzero (skeys[1:] != skeys[:-1]) + 1
+    uniq = skeys[N.concatenate (([0], bounds))]
+    return uniq, N.split (order, bounds)
+
+
 # Date stuff
 
 def jdToFull (jd, form='H'):
@@ -757,6 +1111,67 @@ moderate accuracy only, e.g. good to a few seconds (I think?)."""
 
     return _miriad_f.dayjul (calendar)
 
+
+def _doubles (*args):
+    return [N.ascontiguousarray (a, dtype=N.double)
+            for a in N.broadcast_arrays (*args)]
+
+
+def jdToFullArray (jd, form='H'):
+    """Return textual representations of an array of Julian dates.
+
+:arg jd: the Julian dates
+:type jd: array-like of double
+:arg character form: the output format; see :func:`jdToFull`.
+  Defaults to "H".
+:rtype: string ndarray
+:returns: the textualizations of the dates, with the same shape as *jd*
+:raises: :exc:`ValueError` if *form* is not a known format
+
+The vectorized equivalent of :func:`jdToFull`, using the same
+calendar algorithm as MIRIAD's JULDAY. Large arrays are formatted
+using multiple threads.
+"""
+    jd = N.ascontiguousarray (jd, dtype=N.double)
+    out = N.empty (jd.shape, dtype='S24')
+    _kernels.jd_format (jd, str (form), out)
+    return out
+
+
+def jdToPartialArray (jd):
+    """Return the time-of-day portions of an array of Julian dates.
+
+:arg jd: the Julian dates
+:type jd: array-like of double
+:rtype: string ndarray
+:returns: strings of the form 'HH:MM:SS'
+
+The vectorized equivalent of :func:`jdToPartial`.
+"""
+    jd = N.ascontiguousarray (jd, dtype=N.double)
+    out = N.empty (jd.shape, dtype='S8')
+    _kernels.jd_format (jd, 'P', out)
+    return out
+
+
+def jdToLSTArray (jd, longitude):
+    """Compute local mean sidereal times for an array of Julian dates.
+
+:arg jd: the Julian dates
+:type jd: array-like of double
+:arg longitude: the observatory longitude in radians, east positive;
+  broadcast against *jd*
+:type longitude: array-like of double
+:rtype: double ndarray
+:returns: the local mean sidereal times in radians, between 0 and 2pi
+
+Uses the same algorithm as MIRIAD's JULLST.
+"""
+    jd, longitude = _doubles (jd, longitude)
+    lst = N.empty (jd.shape, dtype=N.double)
+    _kernels.jd_to_lst (jd, longitude, lst)
+    return lst
+
 # Wrapper around NLLSQU, the non-linear least squares solver
 
 def nlLeastSquares (guess, neqn, func, derivative=None,
@@ -983,6 +1398,300 @@ linear equations simultaneously, where the i'th equation is::
     return c
 
 
+# Batched nonlinear least squares: many small independent problems
+# solved at once with Levenberg-Marquardt. The iteration bookkeeping
+# and linear algebra run in _kernels, spread over the available
+# threads.
+
+def _lsqCriteria (nunk, neqn, maxIter, absCrit, relCrit):
+    if neqn < nunk:
+        raise RuntimeError ('Not enough equations to solve problem')
+
+    if maxIter is None:
+        maxIter = 200 * nunk
+    else:
+        maxIter = int (maxIter)
+        if maxIter <= 0: raise ValueError ('"maxIter" must be positive')
+
+    if absCrit is None:
+        absCrit = neqn - nunk
+    else:
+        absCrit = float (absCrit)
+        if absCrit <= 0: raise ValueError ('"criterion" must be positive')
+
+    if relCrit is None:
+        relCrit = nunk * 1e-4
+    else:
+        relCrit = float (relCrit)
+        if relCrit <= 0: raise ValueError ('"relCrit" must be positive')
+
+    return maxIter, float (absCrit), relCrit
+
+
+def _rChiSq (normResids, nunk):
+    neqn = normResids.shape[1]
+
+    if neqn == nunk:
+        return N.zeros (normResids.shape[0])
+    return (normResids**2).sum (1) / (neqn - nunk)
+
+
+def nlLeastSquaresBatch (guesses, neqn, func, derivative=None,
+                         maxIter=None, absCrit=None, relCrit=None,
+                         stepSizes=None):
+    """\
+Optimize parameters of many independent problems by nonlinear least
+squares.
+
+:type guesses: 2D ndarray
+:arg guesses: the initial guesses of the parameters, of shape
+  (*nprob*, *nunk*): one row per problem.
+:arg int neqn: the number of equations in each problem
+:arg callable func: a vectorized function evaluating the fit residuals
+  of a set of problems. Prototype below.
+:arg callable derivative: an optional vectorized function giving the
+  derivatives of *func* with regards to changes in the parameters.
+  Prototype below. If unspecified, the derivatives will be
+  approximated by forward differences and *stepSizes* must be given.
+:arg int/None maxIter: the maximum number of iterations to perform
+  on any one problem. Defaults to 200 times *nunk*.
+:arg float/None absCrit: absolute termination criterion, as in
+  :func:`nlLeastSquares`. Defaults to ``neqn - nunk``.
+:arg float/None relCrit: relative termination criterion, as in
+  :func:`nlLeastSquares`. Defaults to ``nunk * 1e-4``.
+:type stepSizes: ndarray
+:arg stepSizes: if *derivative* isn't given, the parameter step sizes
+  to use when evaluating the derivatives numerically; either of shape
+  (*nunk*,) or (*nprob*, *nunk*).
+:rtype: (int ndarray, 2D ndarray, 2D ndarray, 1D ndarray, 3D ndarray)
+:returns: tuple of (*success*, *best*, *normResids*, *rchisq*, *covar*),
+  described below.
+
+This is the many-problem counterpart to :func:`nlLeastSquares`, for
+cases such as fitting a line profile to every pixel of a cube or a
+bandpass to every antenna, where the Python overhead of fitting the
+problems one at a time would dominate. Each iteration evaluates
+*func* once for all of the problems that have yet to converge; the
+Levenberg-Marquardt steps themselves are computed in compiled code
+using multiple threads (see :func:`setNumThreads`). The computation
+is done in double precision.
+
+The argument *func* is a function taking three arguments, *params*,
+*normResids*, and *which*, and returning :const:`None`.
+
+:type params: 2D ndarray
+:arg params: the current guesses of the parameters, of shape
+  (*nact*, *nunk*)
+:type normResids: 2D ndarray
+:arg normResids: an output argument of shape (*nact*, *neqn*), to be
+  filled in as described in :func:`nlLeastSquares`
+:type which: 1D integer ndarray
+:arg which: the indices of the problems being evaluated, of size
+  *nact*. Row *i* of *params* is the parameter set for problem
+  ``which[i]``, which is generally needed to look up the data of the
+  problem.
+
+The optional argument *derivative* is a function taking three
+arguments, *params*, *dfdx*, and *which*, with *dfdx* being an output
+argument of shape (*nact*, *nunk*, *neqn*)::
+
+  dfdx[k,i,j] = d(normResids[k,j]) / d(params[k,i]) .
+
+The return value is a tuple (*success*, *best*, *normResids*,
+*rchisq*, *covar*):
+
+* **success** -- an integer array of size *nprob* giving the outcome of
+  each fit, using the codes described in :func:`nlLeastSquares`.
+  Unlike that function, failed fits never raise an exception.
+* **best** -- an array of shape (*nprob*, *nunk*) giving the best-fit
+  parameters.
+* **normResids** -- an array of shape (*nprob*, *neqn*) giving the
+  normalized residuals at the best-fit parameters.
+* **rchisq** -- an array of size *nprob* giving the reduced chi
+  squared of each fit.
+* **covar** -- an array of shape (*nprob*, *nunk*, *nunk*) giving the
+  parameter covariance matrix of each fit, the inverse of ``dfdx
+  dfdx^T`` at the best-fit parameters. This assumes that *normResids*
+  are properly normalized; multiply by *rchisq* to get the covariance
+  implied by the scatter of the data. If the matrix is singular, its
+  entries are NaN.
+"""
+    guesses = N.array (guesses, dtype=N.double, ndmin=2)
+    if guesses.ndim != 2:
+        raise ValueError ('Least squares guesses must be 2-dimensional')
+    nprob, nunk = guesses.shape
+
+    neqn = int (neqn)
+    maxIter, absCrit, relCrit = _lsqCriteria (nunk, neqn, maxIter, absCrit,
+                                              relCrit)
+
+    if not callable (func):
+        raise TypeError ('"func" is not callable?!')
+
+    if derivative is not None:
+        if not callable (derivative):
+            raise TypeError ('"derivative" is not callable?!')
+    else:
+        if stepSizes is None:
+            raise ValueError ('"stepSizes" must be given if "derivative" is not')
+        stepSizes = N.asarray (stepSizes, dtype=N.double)
+        if stepSizes.shape not in ((nunk, ), (nprob, nunk)):
+            raise ValueError ('"stepSizes" array is wrong shape!')
+        stepSizes = stepSizes * N.ones ((nprob, 1))
+
+        def derivative (params, dfdx, which):
+            r0 = N.empty ((which.size, neqn))
+            r1 = N.empty ((which.size, neqn))
+            func (params, r0, which)
+
+            for i in xrange (nunk):
+                h = stepSizes[which,i]
+                p = params.copy ()
+                p[:,i] += h
+                func (p, r1, which)
+                dfdx[:,i] = (r1 - r0) / h[:,N.newaxis]
+
+    # Working arrays. All but "trial" and "needjac" are indexed by
+    # problem number; the kernels take lists of which problems to
+    # work on.
+
+    params = guesses
+    trial = N.empty_like (params)
+    resid = N.empty ((nprob, neqn))
+    jac = N.empty ((nprob, nunk, neqn))
+    lam = N.empty (nprob)
+    lam.fill (1e-3)
+    status = N.empty (nprob, dtype=N.intc)
+    status.fill (-1)
+    iters = N.zeros (nprob, dtype=N.intc)
+    needjac = N.ones (nprob, dtype=N.intc)
+
+    everything = N.arange (nprob, dtype=N.intp)
+    func (params, resid, everything)
+    chisq = (resid**2).sum (1)
+    status[chisq < absCrit] = 0
+
+    while True:
+        active = N.flatnonzero (status < 0).astype (N.intp)
+        if active.size == 0:
+            break
+
+        stale = active[needjac[active] != 0]
+        if stale.size:
+            d = N.empty ((stale.size, nunk, neqn))
+            derivative (params[stale], d, stale)
+            jac[stale] = d
+
+        _kernels.lm_step (active, jac, resid, params, lam, trial, status)
+
+        active = active[status[active] < 0]
+        if active.size == 0:
+            break
+
+        tresid = N.empty ((active.size, neqn))
+        func (trial[active], tresid, active)
+        _kernels.lm_update (active, tresid, resid, params, trial, lam,
+                            chisq, status, iters, needjac, maxIter,
+                            absCrit, relCrit)
+
+    # Covariances at the final parameters.
+
+    derivative (params, jac, everything)
+    covar = N.empty ((nprob, nunk, nunk))
+    _kernels.lm_covar (jac, covar)
+
+    return status, params, resid, _rChiSq (resid, nunk), covar
+
+
+_lsqModels = {
+    'gaussian': (0, (3, 4)),
+    'polynomial': (1, None),
+    'exponential': (2, (2, 3)),
+    'sinusoid': (3, (3, 4)),
+}
+
+def fitModelBatch (model, guesses, x, data, sigma=None, maxIter=None,
+                   absCrit=None, relCrit=None):
+    """\
+Fit a built-in model to many independent data sets at once.
+
+:arg str model: the name of the model; see below
+:type guesses: ndarray
+:arg guesses: the initial guesses of the model parameters, of shape
+  (*nprob*, *nunk*), or (*nunk*,) to use the same guess for every
+  problem
+:type x: ndarray
+:arg x: the independent variable, broadcastable to shape (*nprob*,
+  *neqn*); a 1D array of size *neqn* is used for every problem
+:type data: 2D ndarray
+:arg data: the data values, of shape (*nprob*, *neqn*)
+:type sigma: ndarray or None
+:arg sigma: the uncertainties of the data values, broadcastable to the
+  shape of *data*. Infinite values cause the corresponding points to
+  be ignored. Defaults to 1.
+:arg int/None maxIter: as in :func:`nlLeastSquaresBatch`
+:arg float/None absCrit: as in :func:`nlLeastSquaresBatch`
+:arg float/None relCrit: as in :func:`nlLeastSquaresBatch`
+:rtype: (int ndarray, 2D ndarray, 2D ndarray, 1D ndarray, 3D ndarray)
+:returns: tuple of (*success*, *best*, *normResids*, *rchisq*, *covar*),
+  as in :func:`nlLeastSquaresBatch`
+:raises: :exc:`ValueError` if *model* is unknown or *nunk* doesn't
+  suit it
+
+Unlike :func:`nlLeastSquaresBatch`, the fits run entirely in compiled
+code, with no Python callbacks, and so are much faster. The available
+models and their parameters are:
+
+* **gaussian** -- ``p[0] * exp (-0.5 * ((x - p[1]) / p[2])**2)``
+* **polynomial** -- ``p[0] + p[1] * x + p[2] * x**2 + ...``, with as
+  many terms as there are parameters
+* **exponential** -- ``p[0] * exp (p[1] * x)``
+* **sinusoid** -- ``p[0] * sin (2 * pi * p[1] * x + p[2])``
+
+The gaussian, exponential, and sinusoid models accept one additional
+optional parameter, which is a constant offset added to the model.
+"""
+    if model not in _lsqModels:
+        raise ValueError ('unknown least-squares model "%s"' % model)
+    modelnum, nunks = _lsqModels[model]
+
+    data = N.asarray (data, dtype=N.double)
+    if data.ndim != 2:
+        raise ValueError ('"data" must be of shape (nprob, neqn)')
+    nprob, neqn = data.shape
+
+    params = N.asarray (guesses, dtype=N.double)
+    if params.ndim == 1:
+        params = params * N.ones ((nprob, 1))
+    elif params.ndim == 2 and params.shape[0] == nprob:
+        params = params.copy ()
+    else:
+        raise ValueError ('"guesses" must be of shape (nunk,) or (nprob, nunk)')
+    nunk = params.shape[1]
+
+    if nunks is not None and nunk not in nunks:
+        raise ValueError ('model "%s" takes %s parameters, not %d' %
+                          (model, ' or '.join (str (n) for n in nunks),
+                           nunk))
+
+    if sigma is None:
+        sigma = 1.
+
+    x, data, w = _doubles (x, data, 1. / N.asarray (sigma, dtype=N.double))
+    maxIter, absCrit, relCrit = _lsqCriteria (nunk, neqn, maxIter, absCrit,
+                                              relCrit)
+
+    resid = N.empty ((nprob, neqn))
+    chisq = N.empty (nprob)
+    status = N.empty (nprob, dtype=N.intc)
+    iters = N.empty (nprob, dtype=N.intc)
+    covar = N.empty ((nprob, nunk, nunk))
+
+    _kernels.lm_fit_model (modelnum, x, data, w, params, resid, chisq,
+                           status, iters, covar, maxIter, absCrit, relCrit)
+    return status, params, resid, _rChiSq (resid, nunk), covar
+
+
 # Coordinate foo
 
 def precess (jd1, ra1, dec1, jd2):
@@ -1025,6 +1734,104 @@ function, which I suspect will be superior to the MIRIAD function.
     return _miriad_f.azel (ra, dec, lst, lat)
 
 
+def precessArray (jd1, ra1, dec1, jd2):
+    """Precess arrays of coordinates from one Julian date to another.
+
+:arg jd1: the JDs of the input coordinates
+:type jd1: array-like of double
+:arg ra1: the input RAs in radians
+:type ra1: array-like of double
+:arg dec1: the input decs in radians
+:type dec1: array-like of double
+:arg jd2: the JDs to precess to
+:type jd2: array-like of double
+:rtype: (double ndarray, double ndarray)
+:returns: the output RAs and decs in radians
+
+The vectorized equivalent of :func:`precess`, using the same
+algorithm. All of the arguments are broadcast against each other, so,
+for instance, the two epochs may be scalars.
+"""
+    jd1, ra1, dec1, jd2 = _doubles (jd1, ra1, dec1, jd2)
+    ra2 = N.empty (jd1.shape, dtype=N.double)
+    dec2 = N.empty (jd1.shape, dtype=N.double)
+    _kernels.precess (jd1, ra1, dec1, jd2, ra2, dec2)
+    return ra2, dec2
+
+
+def equToHorizonArray (ra, dec, lst, lat):
+    """Convert arrays of equatorial coordinates to horizon coordinates.
+
+:arg ra: the apparent RAs in radians
+:type ra: array-like of double
+:arg dec: the apparent decs in radians
+:type dec: array-like of double
+:arg lst: the local sidereal times in radians
+:type lst: array-like of double
+:arg lat: the geodetic latitude of the observatory in radians
+:type lat: array-like of double
+:rtype: (double ndarray, double ndarray)
+:returns: the azimuths (between 0 and 2pi) and elevations in radians
+
+The vectorized equivalent of :func:`equToHorizon`. All of the
+arguments are broadcast against each other, so typically *lat* and
+perhaps *ra* and *dec* are scalars while *lst* is a column with one
+entry per UV record.
+"""
+    ra, dec, lst, lat = _doubles (ra, dec, lst, lat)
+    az = N.empty (ra.shape, dtype=N.double)
+    el = N.empty (ra.shape, dtype=N.double)
+    _kernels.equ_to_horizon (ra, dec, lst, lat, az, el)
+    return az, el
+
+
+def hourAngleArray (ra, lst):
+    """Compute hour angles.
+
+:arg ra: the apparent RAs in radians
+:type ra: array-like of double
+:arg lst: the local sidereal times in radians
+:type lst: array-like of double
+:rtype: double ndarray
+:returns: the hour angles in radians, between -pi and pi
+"""
+    ha = N.asarray (lst, dtype=N.double) - N.asarray (ra, dtype=N.double)
+    return N.remainder (ha + N.pi, 2 * N.pi) - N.pi
+
+
+def shadowedAntennasArray (antpos, ha, dec, diameter):
+    """Determine which antennas are shadowed at a series of times.
+
+:arg antpos: the antenna positions, in the layout of the MIRIAD
+  "antpos" UV variable: equatorial coordinates in nanoseconds, with
+  all of the X coordinates, then all of the Y, then all of the Z
+:type antpos: array-like of double, 3 * *nant* elements
+:arg ha: the hour angles of the pointing center, in radians
+:type ha: array-like of double
+:arg dec: the apparent declinations of the pointing center, in
+  radians; broadcast against *ha*
+:type dec: array-like of double
+:arg float diameter: the diameter within which an antenna is
+  considered shadowed, in meters
+:rtype: (*ntime*, *nant*) bool ndarray
+:returns: whether each antenna is shadowed at each time
+
+An antenna is shadowed if another antenna is closer to the source and
+within *diameter* of it in projection, as in MIRIAD's "shadow" UV
+selection. Antennas with positions of zero are taken to be absent, and
+neither shadow nor are shadowed. The projected positions are computed
+once per time and shared between all of the antenna pairs.
+"""
+    antpos = N.ascontiguousarray (antpos, dtype=N.double).ravel ()
+    if antpos.size % 3 != 0:
+        raise ValueError ('antpos must have three coordinates per antenna')
+
+    ha, dec = [a.ravel () for a in _doubles (ha, dec)]
+    out = N.empty ((ha.size, antpos.size // 3), dtype=N.intc)
+    _kernels.shadow_ants (antpos, ha, dec, diameter / 0.299792458, out)
+    return out.astype (N.bool_)
+
+
 # Spheroidal convolution functions
 
 def sphGridFunc (nsamp, width, alpha):
@@ -1087,3 +1894,215 @@ how *alpha* affects the spheroidal function used but it's probably not
 hard to look up.
 """
     return _miriad_f.corrfun ('spheroidal', axislen, width, alpha)
+
+
+def fftInPlace (arr, axes=(-2, -1), sign=-1):
+    """Compute an unnormalized complex FFT of an array in place.
+
+:arg arr: the data to transform; modified in place
+:type arr: C-contiguous complex128 ndarray
+:arg axes: the axes along which to transform; default is the last two
+:type axes: int or sequence of int
+:arg int sign: the sign of the exponent of the transform: -1 (the
+  default) for a forward transform, +1 for a backward one
+:returns: *arr*
+
+This computes the same thing as :func:`numpy.fft.fftn` with *sign* =
+-1, or ``numpy.fft.ifftn`` times the number of transformed elements with
+*sign* = +1. The transform is done in a native module, with the lines
+along each axis split between threads (see :func:`setNumThreads`).
+Lengths that are powers of two are the fastest, but any length is
+allowed. No shifting of the origin is done.
+"""
+    if not isinstance (arr, N.ndarray):
+        raise TypeError ('fftInPlace needs an ndarray')
+
+    sign = int (sign)
+    if sign not in (-1, 1):
+        raise ValueError ('"sign" must be -1 or +1')
+
+    shape = arr.shape
+
+    for ax in N.atleast_1d (axes):
+        ax = int (ax)
+        if ax < 0:
+            ax += arr.ndim
+        if ax < 0 or ax >= arr.ndim:
+            raise ValueError ('illegal axis %d for %d-dimensional array' %
+                              (ax, arr.ndim))
+
+        outer = int (N.prod (shape[:ax]))
+        inner = int (N.prod (shape[ax+1:]))
+        _kernels.fft_lines (arr, outer, shape[ax], inner, sign)
+
+    return arr
+
+
+def _specArrays (data, flags):
+    data = N.ascontiguousarray (data, dtype=N.complex64)
+    flags = N.ascontiguousarray (flags, dtype=N.int32)
+
+    if data.ndim == 1:
+        data = data.reshape ((1, -1))
+    if flags.shape != data.shape:
+        flags = flags.reshape (data.shape)
+
+    return data, flags
+
+
+def binChannels (data, flags, starts, ends, nmin=1):
+    """Average visibility spectra over arbitrary ranges of channels.
+
+:arg data: the spectra
+:type data: (*nrec*, *nchan*) array-like of complex64
+:arg flags: the flags of the spectra; nonzero values indicate good data
+:type flags: (*nrec*, *nchan*) array-like of int32
+:arg starts: the first input channel of each output channel, counting
+  from zero
+:type starts: *nout*-element array-like of int
+:arg ends: one past the last input channel of each output channel
+:type ends: *nout*-element array-like of int
+:arg nmin: the smallest number of good channels that each output
+  channel can have without being flagged
+:type nmin: int or *nout*-element array-like of int
+:rtype: tuple of (ndarray, ndarray)
+:returns: the averaged spectra, a (*nrec*, *nout*) complex64 array,
+  and their flags, an int32 array of the same shape
+
+Output channel *i* is the mean of the good input channels from
+*starts[i]* up to but not including *ends[i]*, or zero if there are
+none. The ranges may have different widths, leave gaps, or overlap,
+so this can average several spectral windows in different ways at
+once. All the records are reduced in one call to a native module,
+with the records split between threads (see :func:`setNumThreads`).
+"""
+    data, flags = _specArrays (data, flags)
+    starts = N.ascontiguousarray (starts, dtype=N.intp).ravel ()
+    ends = N.ascontiguousarray (ends, dtype=N.intp).ravel ()
+    nmin = N.zeros (starts.size, dtype=N.intc) + N.asarray (nmin, dtype=N.intc)
+
+    shape = (data.shape[0], starts.size)
+    outdata = N.empty (shape, dtype=N.complex64)
+    outflags = N.empty (shape, dtype=N.int32)
+    _kernels.chan_bin (data, flags, starts, ends, nmin, outdata, outflags)
+    return outdata, outflags
+
+
+def averageChannels (data, flags, naver, nmin=1):
+    """Average blocks of visibility spectra in channel space.
+
+:arg data: the spectra
+:type data: (*nrec*, *nchan*) array-like of complex64
+:arg flags: the flags of the spectra; nonzero values indicate good data
+:type flags: (*nrec*, *nchan*) array-like of int32
+:arg int naver: the number of adjacent channels to average together;
+  must divide evenly into *nchan*
+:arg int nmin: the smallest number of good channels that a bin can
+  have without being flagged
+:rtype: tuple of (ndarray, ndarray)
+:returns: the averaged spectra, a (*nrec*, *nchan* / *naver*) complex64
+  array, and their flags, an int32 array of the same shape
+
+Each output channel is the mean of the good input channels in its bin,
+or zero if there are none. This is a special case of
+:func:`binChannels`.
+"""
+    data, flags = _specArrays (data, flags)
+
+    naver = int (naver)
+    if naver < 1 or data.shape[1] % naver != 0:
+        raise ValueError ('cannot average %d channels in groups of %d' %
+                          (data.shape[1], naver))
+
+    starts = N.arange (0, data.shape[1], naver)
+    return binChannels (data, flags, starts, starts + naver, nmin)
+
+
+class SlotTable (object):
+    """Number baseline-polarization pairs densely.
+
+:arg int size: the number of pairs to allow room for initially
+
+Each distinct pair of encoded baseline and polarization code passed to
+:meth:`lookup` is given the next free slot number, starting at zero,
+and keeps it for the life of the table. This is how the time averager
+and its relatives give each of their accumulators a row. The pairs
+are hashed by the native module, and the table grows as needed.
+
+Attributes:
+
+* **count** -- the number of slots handed out.
+* **baseline** -- a double array of the encoded baselines of the
+  slots; only the first **count** elements are meaningful.
+* **pol** -- an int32 array of the polarization codes of the slots,
+  likewise.
+"""
+
+    def __init__ (self, size=64):
+        size = max (int (size), 1)
+        self.count = 0
+        self.baseline = N.zeros (size, dtype=N.double)
+        self.pol = N.zeros (size, dtype=N.int32)
+        self._keys = -N.ones (4 * size, dtype=N.int64)
+        self._vals = N.empty (4 * size, dtype=N.intp)
+
+
+    def lookup (self, baseline, pol):
+        """Find or make the slots of a set of pairs.
+
+:arg baseline: the encoded baselines
+:type baseline: *n*-element array-like of double
+:arg pol: the polarization codes
+:type pol: *n*-element array-like of int32
+:rtype: tuple of (ndarray, ndarray)
+:returns: the slot numbers of the pairs, a *n*-element intp array, and
+  the indices of the pairs that were given new slots, in order of slot
+  number
+
+Any new slots are numbered from the old value of **count** upward, so
+the second return value has **count** minus that value elements.
+"""
+        bl = N.ascontiguousarray (baseline, dtype=N.double).ravel ()
+        pol = N.ascontiguousarray (pol, dtype=N.int32).ravel ()
+        n = bl.size
+        nused = self.count
+
+        if 2 * (nused + n) >= self._keys.size:
+            # Grow the hash table and re-enter the existing slots, which
+            # keep their numbers since they go back in the same order.
+            cap = self._keys.size
+            while 2 * (nused + n) >= cap:
+                cap *= 2
+            self._keys = -N.ones (cap, dtype=N.int64)
+            self._vals = N.empty (cap, dtype=N.intp)
+            scratch = N.empty (nused, dtype=N.intp)
+            _kernels.aver_slots (self._keys, self._vals,
+                                 self.baseline[:nused], self.pol[:nused],
+                                 0, scratch)
+
+        slots = N.empty (n, dtype=N.intp)
+        nnew = _kernels.aver_slots (self._keys, self._vals, bl, pol, nused,
+                                    slots)
+        if nnew == nused:
+            return slots, N.empty (0, dtype=N.intp)
+
+        if nnew > self.baseline.size:
+            cap = self.baseline.size
+            while nnew > cap:
+                cap *= 2
+            self.baseline = N.concatenate ((self.baseline[:nused],
+                                            N.zeros (cap - nused)))
+            self.pol = N.concatenate ((self.pol[:nused],
+                                       N.zeros (cap - nused, dtype=N.int32)))
+
+        # New slots are handed out in order of first appearance, so the
+        # first occurrences sorted by slot are the records that opened
+        # them.
+
+        new = N.nonzero (slots >= nused)[0]
+        s, first = N.unique (slots[new], return_index=True)
+        first = new[first]
+        self.baseline[s] = bl[first]
+        self.pol[s] = pol[first]
+        self.count = nnew
+        return slots, first
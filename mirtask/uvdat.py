@@ -28,7 +28,7 @@ __all__ = []
 # but can be on import
 
 try:
-    from _uvdat_compat_default import _inputSets, _read_gen
+    from _uvdat_compat_default import _inputSets, _read_gen, _read_batch_gen
 except SyntaxError:
     import sys
     v = sys.version_info[0] * 1000 + sys.version_info[1]
@@ -36,7 +36,7 @@ except SyntaxError:
         # Genuine syntax error!
         raise
     del v, sys
-    from _uvdat_compat_24 import _inputSets, _read_gen
+    from _uvdat_compat_24 import _inputSets, _read_gen, _read_batch_gen
 
 
 class UVDatDataSet (UVDataSet):
@@ -264,6 +264,977 @@ Character       Feature behavior
                 elements and include the *w* coordinate.
 ==========      ==================
 """
+    _setup (toread, uvdOptions, nopass, nocal, nopol, select, line, stokes,
+            ref)
+    return _read_gen (saveFlags, UVDatDataSet, maxchan)
+
+
+# The UV variables that determine the channel frequencies of a record.
+
+SPECTRAL_VARS = ('nspect', 'nschan', 'ischan', 'sfreq', 'sdf', 'restfreq',
+                 'nwide', 'wfreq', 'wwidth')
+
+def _readonly (arr):
+    arr.flags.writeable = False
+    return arr
+
+
+class SpectralConfig (object):
+    """:synopsis: the channel axes of one spectral setup
+
+A :class:`SpectralConfig` describes the channels of every record read
+with one setting of the spectral variables (see
+:data:`SPECTRAL_VARS`) and of the line selection. It is made by a
+:class:`SpectralCache`, which hands out the same object to all of the
+records that share the setup, so that the axes are only computed once
+and can be compared by identity. Its arrays are shared and read-only;
+copy them before modifying them.
+
+Attributes:
+
+* **id** -- a small integer identifying the setup, unique within its
+  cache.
+* **nchan** -- the number of channels in each record.
+* **lineinfo** -- the line information, as returned by
+  :meth:`mirtask.UVDataSet.getLineInfo`.
+* **vars** -- a snapshot of the :data:`SPECTRAL_VARS`, as returned by
+  :meth:`mirtask.UVDataSet.snapshotVars`.
+* **freqs** -- a *nchan*-element double array of the sky frequencies
+  of the channels, in GHz.
+* **wavelengths** -- a *nchan*-element double array of the
+  corresponding wavelengths, in meters. Multiplying *u*, *v*, or *w* in
+  nanoseconds by **freqs** gives it in wavelengths.
+* **restfreqs** -- a *nchan*-element double array of the rest
+  frequencies of the spectral windows that the channels fall in, in
+  GHz, or zero where there is none (e.g., for wideband data).
+* **velocities** -- a *nchan*-element double array of the radio
+  velocities of the channels relative to their rest frequencies, in
+  km/s, or NaN where the rest frequency is unknown. These are in the
+  frame of the sky frequencies, i.e. topocentric unless the telescope
+  tracked the Doppler shift; subtract the *veldop* variable to get the
+  velocities in its rest frame, as UVINFO does.
+"""
+
+    def __init__ (self, id, freqs, lineinfo, vars):
+        nchan = freqs.size
+        self.id = id
+        self.nchan = nchan
+        self.lineinfo = _readonly (lineinfo)
+        self.vars = vars
+
+        pos = freqs > 0
+        wl = N.zeros (nchan)
+        wl[pos] = 0.299792458 / freqs[pos]
+
+        rest = self._restFreqs (freqs)
+        known = rest > 0
+        vel = N.empty (nchan)
+        vel.fill (N.nan)
+        vel[known] = 299792.458 * (1 - freqs[known] / rest[known])
+
+        self.freqs = _readonly (freqs)
+        self.wavelengths = _readonly (wl)
+        self.restfreqs = _readonly (rest)
+        self.velocities = _readonly (vel)
+
+
+    def _restFreqs (self, freqs):
+        # Assign each channel to the spectral window whose frequency
+        # range is nearest to it; a channel can't be matched up by
+        # number, since the line selection may have skipped, averaged,
+        # or resampled the channels.
+
+        from mirtask.util import LINETYPE_WIDE
+
+        rest = N.zeros (freqs.size)
+        v = self.vars
+        if 'restfreq' not in v or 'sfreq' not in v or 'sdf' not in v:
+            return rest
+        if 'nschan' not in v or self.lineinfo[0] == LINETYPE_WIDE:
+            return rest
+
+        nwin = min (v['restfreq'][1].size, v['sfreq'][1].size,
+                    v['sdf'][1].size, v['nschan'][1].size)
+        if nwin == 0:
+            return rest
+
+        sfreq = v['sfreq'][1][:nwin]
+        sdf = v['sdf'][1][:nwin]
+        end = sfreq + sdf * (v['nschan'][1][:nwin] - 1)
+        lo = N.minimum (sfreq, end) - 0.5 * N.abs (sdf)
+        hi = N.maximum (sfreq, end) + 0.5 * N.abs (sdf)
+
+        f = freqs[:,N.newaxis]
+        dist = N.maximum (N.maximum (lo - f, f - hi), 0)
+        rest[:] = v['restfreq'][1][:nwin][dist.argmin (axis=1)]
+        return rest
+
+
+class SpectralCache (object):
+    """:synopsis: share the channel axes of spectral setups between records
+
+:arg int maxSize: the largest number of setups to remember
+
+A :class:`SpectralCache` maps the spectral setup of the current record
+of a dataset to a :class:`SpectralConfig`, creating it the first time
+that the setup is seen. Setups are keyed on the values of the
+:data:`SPECTRAL_VARS`, the number of channels, and the line
+information, so data that switch back and forth between a few
+frequency settings only ever build a few sets of axes. The IDs count
+up from zero in the order that the setups are first seen; once more
+than *maxSize* have been seen, the oldest are forgotten, and come back
+with new IDs if they turn up again.
+
+The batch and snapshot readers (:func:`readBatches`,
+:func:`readSnapshots`, and their variants) look up each batch's setup
+in a cache, a fresh one per read unless one is passed in with their
+*specCache* argument. Passing the same cache to several reads makes
+the IDs consistent between them. The readers watch the
+:data:`SPECTRAL_VARS` with a variable tracker of their own, apart from
+their *trackVars*, so a setup is only looked up again when one of them
+or the number of channels changes.
+"""
+
+    vars = SPECTRAL_VARS
+
+    def __init__ (self, maxSize=256):
+        self.maxSize = maxSize
+        self._bykey = {}
+        self._byid = {}
+        self._oldest = self._next = 0
+
+
+    def lookup (self, handle, nchan=None):
+        """Get the spectral setup of the current record.
+
+:arg handle: the dataset
+:type handle: :class:`mirtask.UVDataSet`
+:arg int nchan: the number of channels in the record; if :const:`None`
+  (the default), it is determined with
+  :meth:`mirtask.UVDataSet.getLineInfo`
+:rtype: :class:`SpectralConfig`
+:returns: the setup
+"""
+        info = handle.getLineInfo ()
+        if nchan is None:
+            nchan = int (info[1])
+
+        vars = handle.snapshotVars (self.vars)
+        key = self._key (nchan, info, vars)
+        spec = self._bykey.get (key)
+        if spec is None:
+            spec = self._insert (key, handle.getSkyFrequencies (nchan), info,
+                                 vars)
+        return spec
+
+
+    def intern (self, freqs, lineinfo, vars):
+        """Get the spectral setup matching some recorded values.
+
+:arg freqs: the sky frequencies of the channels, in GHz
+:type freqs: double ndarray
+:arg lineinfo: the line information, as in :attr:`SpectralConfig.lineinfo`
+:type lineinfo: integer ndarray
+:arg dict vars: the snapshot of the :data:`SPECTRAL_VARS`
+:rtype: :class:`SpectralConfig`
+:returns: the setup
+
+This is for setups saved from an earlier read, such as by
+:mod:`mirtask.viscache`, which should map to the same
+:class:`SpectralConfig` objects as the setups read from datasets.
+"""
+        freqs = N.array (freqs, dtype=N.double)
+        lineinfo = N.array (lineinfo)
+        key = self._key (freqs.size, lineinfo, vars)
+        spec = self._bykey.get (key)
+        if spec is None:
+            spec = self._insert (key, freqs, lineinfo, vars)
+        return spec
+
+
+    def _key (self, nchan, lineinfo, vars):
+        key = (nchan, tuple (lineinfo.tolist ()))
+        for name in sorted (vars.iterkeys ()):
+            key += ((name, tuple (vars[name][1].tolist ())), )
+        return key
+
+
+    def _insert (self, key, freqs, lineinfo, vars):
+        if len (self._byid) >= self.maxSize:
+            old = self._byid.pop (self._oldest)
+            del self._bykey[old._key]
+            self._oldest += 1
+
+        spec = SpectralConfig (self._next, freqs, lineinfo, vars)
+        spec._key = key
+        self._bykey[key] = self._byid[spec.id] = spec
+        self._next += 1
+        return spec
+
+
+    def __getitem__ (self, id):
+        return self._byid[id]
+
+
+    def __len__ (self):
+        return len (self._byid)
+
+
+class VisBatch (object):
+    """:synopsis: a block of consecutive UV data records
+
+A :class:`VisBatch` holds a number of UV data records read in by
+:func:`readBatches` or :func:`setupAndReadBatches`, with each quantity
+stored as a column so that whole batches can be processed at once.
+All of the records in a batch come from the same dataset and have the
+same number of channels, and they are given the spectral setup of the
+first record of the batch. If the spectral variables change partway
+through a batch, for instance as the sky frequencies of Doppler-tracked
+data drift, the batch carries on, and the new setup applies from the
+next batch.
+
+Attributes:
+
+* **count** -- the number of records in the batch, *nrec*.
+* **nchan** -- the number of channels in each record.
+* **npol** -- the number of polarizations that UVDAT reports for the
+  records, as from :func:`getNPol`, or 0 if unknown. Batches from the
+  readers end when this changes.
+* **hasW** -- whether the *w* coordinates were read in. If not, the
+  *w* column of *uvw* is zero.
+* **uvw** -- a (*nrec*, 3) double array of the *u*, *v*, and *w*
+  coordinates of the records, in the units delivered by UVDAT
+  (nanoseconds unless the *w* option is used).
+* **time** -- a *nrec*-element double array of the record timestamps,
+  as Julian dates.
+* **baseline** -- a *nrec*-element double array of the encoded
+  baselines; see :func:`mirtask.util.decodeBaselineArray`.
+* **data** -- a (*nrec*, *nchan*) complex64 array of the visibilities.
+* **flags** -- a (*nrec*, *nchan*) int32 array of the flags; nonzero
+  values indicate good data, as usual.
+* **pol** -- a *nrec*-element int32 array of the polarization codes.
+* **variance** -- a *nrec*-element double array of the record
+  variances, as returned by :func:`getVariance`.
+* **visno** -- a *nrec*-element integer array of the record serial
+  numbers, as returned by :func:`getVisNum`.
+* **freqs** -- a *nchan*-element double array of the sky frequencies
+  of the channels, in GHz. For batches from the readers this is
+  **spec.freqs**, which is shared and read-only.
+* **spec** -- the :class:`SpectralConfig` of the records, or
+  :const:`None` if unknown.
+* **specid** -- a *nrec*-element int32 array of the IDs of the
+  spectral setups of the records, or -1 where unknown. All of the
+  records in a batch are given the same setup, but this lets the IDs
+  be carried along with the records when batches are split up or
+  combined.
+* **vars** -- a snapshot of the variables named in the *trackVars*
+  argument of :func:`readBatches`, as returned by
+  :meth:`mirtask.UVDataSet.snapshotVars`. Consecutive batches share
+  the same snapshot object until one of the variables changes.
+"""
+
+    def __init__ (self, size, nchan, hasW, freqs, spec=None):
+        self.count = 0
+        self.nchan = nchan
+        self.npol = 0
+        self.hasW = hasW
+        self.freqs = freqs
+        self.spec = spec
+        self.specid = N.empty (size, dtype=N.int32)
+        self.specid.fill (-1 if spec is None else spec.id)
+        self.uvw = N.zeros ((size, 3), dtype=N.double)
+        self.time = N.empty (size, dtype=N.double)
+        self.baseline = N.empty (size, dtype=N.double)
+        self.data = N.empty ((size, nchan), dtype=N.complex64)
+        self.flags = N.empty ((size, nchan), dtype=N.int32)
+        self.pol = N.empty (size, dtype=N.int32)
+        self.variance = N.empty (size, dtype=N.double)
+        self.visno = N.empty (size, dtype=N.int)
+        self.vars = {}
+
+
+    def _appendBlock (self, block, n):
+        i = self.count
+        j = i + n
+        p = block.preambles
+
+        if self.hasW:
+            self.uvw[i:j] = p[:n,:3]
+            self.time[i:j] = p[:n,3]
+            self.baseline[i:j] = p[:n,4]
+        else:
+            self.uvw[i:j,:2] = p[:n,:2]
+            self.time[i:j] = p[:n,2]
+            self.baseline[i:j] = p[:n,3]
+
+        self.data[i:j] = block.data[:n,:self.nchan]
+        self.flags[i:j] = block.flags[:n,:self.nchan]
+        self.pol[i:j] = block.pols[:n]
+        self.variance[i:j] = block.variances[:n]
+        self.visno[i:j] = block.visnos[:n] - 1
+        self.count = j
+
+
+    def _trim (self):
+        n = self.count
+
+        if n < self.time.size:
+            for name in ('uvw', 'time', 'baseline', 'data', 'flags', 'pol',
+                         'variance', 'visno', 'specid'):
+                setattr (self, name, getattr (self, name)[:n])
+
+        return self
+
+
+    def weights (self):
+        """Compute per-channel visibility weights.
+
+:rtype: (*nrec*, *nchan*) float32 ndarray
+:returns: the weights
+
+The weight of each unflagged channel is the inverse of the variance of
+its record, or 1 if the variance is unknown (i.e., zero). Flagged
+channels have zero weight.
+"""
+        w = N.ones (self.count, dtype=N.double)
+        known = self.variance > 0
+        w[known] = 1. / self.variance[known]
+        return N.where (self.flags != 0, w[:,N.newaxis], 0).astype (N.float32)
+
+
+    def shadowed (self, diameter):
+        """Determine which records are shadowed.
+
+:arg float diameter: the diameter within which an antenna is
+  considered shadowed, in meters
+:rtype: *nrec*-element bool ndarray
+:returns: whether each record has a shadowed antenna
+:raises: :exc:`ValueError` if the variables in :data:`SHADOW_VARS`
+  weren't tracked when the batch was read
+
+The vectorized equivalent of :meth:`mirtask.UVDataSet.baselineShadowed`;
+see :func:`mirtask.util.shadowedAntennasArray`. The antenna geometry is
+worked out once for each distinct timestamp in the batch.
+"""
+        return _shadowMask (self.vars, self.time, self.baseline, diameter)
+
+
+# The UV variables needed to work out antenna shadowing.
+
+SHADOW_VARS = ('antpos', 'longitu', 'obsdec', 'obsra')
+
+def _shadowMask (vars, time, baseline, diameter):
+    from mirtask import util
+
+    missing = [v for v in SHADOW_VARS if v not in vars]
+    if len (missing):
+        raise ValueError ('shadowing needs the UV variable(s) %s; include '
+                          'SHADOW_VARS in trackVars' % ', '.join (missing))
+
+    antpos = vars['antpos'][1]
+    lon = vars['longitu'][1][0]
+    ra = vars['obsra'][1][0]
+    dec = vars['obsdec'][1][0]
+
+    utimes, tidx = N.unique (time, return_inverse=True)
+    ha = util.hourAngleArray (ra, util.jdToLSTArray (utimes, lon))
+    shadow = util.shadowedAntennasArray (antpos, ha, dec, diameter)
+
+    m1, m2 = util.decodeBaselineArray (baseline)
+    nant = shadow.shape[1]
+    if m1.size and max (m1.max (), m2.max ()) > nant:
+        raise ValueError ('antenna number larger than the %d antennas in '
+                          'antpos' % nant)
+
+    return shadow[tidx,m1-1] | shadow[tidx,m2-1]
+
+
+def _sameVars (a, b):
+    if a is b:
+        return True
+    if a is None or b is None or len (a) != len (b):
+        return False
+
+    for name, (type, value) in a.iteritems ():
+        other = b.get (name)
+        if other is None or other[0] != type:
+            return False
+        if type == 'a':
+            if value != other[1]:
+                return False
+        elif not N.array_equal (value, other[1]):
+            return False
+
+    return True
+
+
+# The UV variables that aren't watched when a reader is asked to watch
+# all of them. UVDAT hands out the preamble, polarization, and data
+# of each record itself, and the times change with every integration,
+# so they would end every batch; they can be worked out from the
+# record timestamps instead (see mirtask.util.jdToLSTArray).
+
+UNTRACKED_VARS = ('baseline', 'coord', 'corr', 'lst', 'nchan', 'npol',
+                  'pol', 'time', 'ut', 'wcorr')
+
+def _allVars (handle):
+    item = handle.getItem ('vartable', 'r')
+    text = item.read (0, str, item.getSize ())
+    item.close ()
+
+    names = []
+    for line in text.splitlines ():
+        a = line.split ()
+        if len (a) == 2 and a[1] not in UNTRACKED_VARS:
+            names.append (a[1])
+    return tuple (names)
+
+
+def _trackArg (trackVars):
+    if trackVars is None:
+        return None
+    return tuple (trackVars)
+
+
+class _BatchReader (object):
+    """Gathers the records of one UVDAT input dataset into VisBatches.
+
+The records are pulled out of UVDAT a block at a time by the Fortran
+routine uvdatrdb, which also fetches their polarizations, variances,
+and serial numbers, so there are no per-record calls from Python. A
+block stops early after a record on which a tracked variable changes
+or the number of channels or polarizations changes. That record is
+kept in slot 0 of the block buffers as the start of the next block,
+and since UVDAT has just read it, the dataset handle holds the
+variable values that apply to it; that is when the new values are
+snapshotted.
+"""
+
+    def __init__ (self, handle, batchSize, maxchan, trackVars, specCache):
+        self.handle = handle
+        self.batchSize = batchSize
+        self.maxchan = maxchan
+        self.specCache = specCache
+
+        if trackVars is None:
+            trackVars = _allVars (handle)
+        self.trackVars = trackVars
+
+        # The spectral variables have a tracker of their own, so that
+        # changes in the trackVars alone don't cause spectral lookups.
+        # Bit 0 of the change mask from uvdatrdb is for this tracker,
+        # and bit 1 for the trackVars one, if there is one.
+
+        self.specTracker = handle.makeVarTracker ()
+        self.specTracker.track (*specCache.vars)
+        vhans = [self.specTracker.vhnd]
+
+        if len (trackVars):
+            self.tracker = handle.makeVarTracker ()
+            self.tracker.track (*trackVars)
+            vhans.append (self.tracker.vhnd)
+
+        self.vhans = N.asarray (vhans, dtype=N.int32)
+
+        # Keep the block buffers to a few megabytes even for large
+        # channel counts.
+        nblock = max (1, min (batchSize, (1 << 18) // maxchan))
+        self.preambles = N.zeros ((nblock, 5), dtype=N.double)
+        self.data = N.zeros ((nblock, maxchan), dtype=N.complex64)
+        self.flags = N.zeros ((nblock, maxchan), dtype=N.int32)
+        self.pols = N.zeros (nblock, dtype=N.int32)
+        self.variances = N.zeros (nblock, dtype=N.float32)
+        self.visnos = N.zeros (nblock, dtype=N.int32)
+
+        self.pending = False
+        self.eof = False
+        self.nchan = 0
+        self.npol = 0
+        self.chg = 0
+        self.snap = None
+        self.spec = None
+        self.specStale = True
+
+
+    def _fill (self, start, limit):
+        # Returns (nrec, nlast, nplast, chg, eof) as from uvdatrdb.
+        # Element 5 of the preamble is only written if UVDAT returns
+        # five elements, so whether it has been can be detected.
+        self.preambles[start:limit,4] = N.nan
+        return _miriad_f.uvdatrdb (start, self.nchan, self.npol, self.vhans,
+                                   self.maxchan, limit,
+                                   self.preambles.reshape (-1),
+                                   self.data.reshape (-1),
+                                   self.flags.reshape (-1), self.pols,
+                                   self.variances, self.visnos)
+
+
+    def _keep (self, i, nchan, npol, chg):
+        # Move the record in slot i to slot 0 to start the next block.
+        if i > 0:
+            self.preambles[0] = self.preambles[i]
+            self.data[0,:nchan] = self.data[i,:nchan]
+            self.flags[0,:nchan] = self.flags[i,:nchan]
+            self.pols[0] = self.pols[i]
+            self.variances[0] = self.variances[i]
+            self.visnos[0] = self.visnos[i]
+
+        self.pending = True
+        self.chg = chg
+        self.npol = npol
+        if nchan != self.nchan:
+            self.nchan = nchan
+            self.specStale = True
+
+
+    def _varsChanged (self, chg):
+        # Called with the handle at the record on which a tracker
+        # fired. Returns whether the batch must end, i.e. whether any
+        # of the trackVars changed, as opposed to just the spectral
+        # variables.
+        if chg & 1:
+            self.specStale = True
+        if not chg & 2:
+            return False
+
+        snap = self.handle.snapshotVars (self.trackVars)
+        if self.snap is not None and _sameVars (snap, self.snap):
+            return False
+        self.snap = snap
+        return True
+
+
+    def next (self):
+        """Return the next batch, or None at the end of the dataset."""
+
+        if not self.pending:
+            if self.eof:
+                return None
+            nrec, nlast, nplast, chg, eof = self._fill (0, 1)
+            if nrec == 0:
+                self.eof = True
+                return None
+            self._keep (0, nlast, nplast, chg)
+
+        # The handle is at the record in slot 0, which starts the batch.
+
+        if self.chg:
+            self._varsChanged (self.chg)
+            self.chg = 0
+        if self.snap is None:
+            self.snap = self.handle.snapshotVars (self.trackVars)
+        if self.specStale:
+            self.spec = self.specCache.lookup (self.handle, self.nchan)
+            self.specStale = False
+
+        batch = VisBatch (self.batchSize, self.nchan,
+                          not N.isnan (self.preambles[0,4]),
+                          self.spec.freqs, self.spec)
+        batch.npol = self.npol
+        batch.vars = self.snap
+        nblock = self.preambles.shape[0]
+
+        while True:
+            start = int (self.pending)
+            limit = min (nblock, self.batchSize - batch.count)
+
+            if limit > start:
+                nrec, nlast, nplast, chg, eof = self._fill (start, limit)
+            else:
+                nrec, nlast, nplast, chg, eof = (start, self.nchan, self.npol,
+                                                 0, False)
+
+            stop = not eof and nrec > start and (chg or nlast != self.nchan or
+                                                 nplast != self.npol)
+            batch._appendBlock (self, nrec - 1 if stop else nrec)
+            self.pending = False
+
+            if eof:
+                self.eof = True
+                return batch._trim ()
+
+            if stop:
+                nchan, npol = self.nchan, self.npol
+                self._keep (nrec - 1, nlast, nplast, chg)
+                if nlast != nchan or nplast != npol:
+                    return batch._trim ()
+                # Changes in the spectral variables alone, such as the
+                # drift of the sky frequencies of Doppler-tracked
+                # data, don't end the batch; the next batch picks up
+                # the new setup.
+                self.chg = 0
+                if self._varsChanged (chg):
+                    return batch._trim ()
+
+            if batch.count == self.batchSize:
+                return batch._trim ()
+
+
+def readBatches (batchSize=1024, maxchan=4096, trackVars=(), specCache=None):
+    """Read in data via the UVDAT subsystem in batches of records.
+
+:arg int batchSize: the maximum number of records in each batch
+:arg int maxchan: the maximum number of spectral channels that can be
+  read in at once
+:arg trackVars: the names of extra UV variables to watch, or
+  :const:`None` to watch all of the variables of each input dataset
+  other than those in :data:`UNTRACKED_VARS`
+:type trackVars: iterable of str or :const:`None`
+:arg specCache: the cache in which to look up the spectral setups of
+  the batches; if :const:`None` (the default), a new one is used
+:type specCache: :class:`SpectralCache`
+:rtype: generator of ``(handle, batch)``
+:returns: generator yielding tuples of a :class:`UVDatDataSet` and a
+  :class:`VisBatch`
+
+This is like :func:`read`, but gathers the UV records into
+:class:`VisBatch` objects that can be handed to array-at-a-time
+processing code such as :class:`mirtask.imaging.Gridder`. The records
+are read from UVDAT a block at a time, along with their polarizations,
+variances, and serial numbers, in one call into MIRIAD per block. A
+batch is ended early at the end of each input dataset and whenever the
+number of channels or polarizations or any of the variables in
+*trackVars* changes. The
+values of the *trackVars* variables that apply to a batch are recorded
+in its **vars** attribute, since the dataset handle has moved on by
+the time the batch is yielded. Each batch is newly allocated, so it
+remains valid after the generator moves on. The spectral setup of each
+batch is recorded in its **spec** attribute. It is looked up once, at
+the start of the batch, and only if the spectral variables or the
+number of channels have changed since the previous lookup; batches
+with the same setup share their axes. A change in the spectral
+variables alone doesn't end a batch (see :class:`VisBatch`).
+
+Rewriting flags while reading is not supported.
+"""
+    if specCache is None:
+        specCache = SpectralCache ()
+    return _read_batch_gen (UVDatDataSet, _BatchReader,
+                            (int (batchSize), maxchan,
+                             _trackArg (trackVars), specCache))
+
+
+def setupAndReadBatches (toread, uvdOptions, nopass=False, nocal=False,
+                         nopol=False, select=None, line=None, stokes=None,
+                         ref=None, batchSize=1024, maxchan=4096,
+                         trackVars=(), specCache=None):
+    """Set up the UVDAT subsystem manually and read in the data in batches.
+
+The arguments are as in :func:`setupAndRead` and :func:`readBatches`
+(without *saveFlags*), and the return value is as in
+:func:`readBatches`.
+"""
+    _setup (toread, uvdOptions, nopass, nocal, nopol, select, line, stokes,
+            ref)
+    if specCache is None:
+        specCache = SpectralCache ()
+    return _read_batch_gen (UVDatDataSet, _BatchReader,
+                            (int (batchSize), maxchan,
+                             _trackArg (trackVars), specCache))
+
+
+class VisSnapshot (object):
+    """:synopsis: all of the UV data records sharing one timestamp
+
+A :class:`VisSnapshot` holds one integration's worth of data read in
+by :func:`readSnapshots` or :func:`setupAndReadSnapshots`, arranged
+as a matrix of baselines and polarizations. It is filled from the
+columns of :class:`VisBatch` objects, so the records behind it come
+out of UVDAT through the same block reads as batches do. The
+baselines are sorted by antenna numbers, and the polarizations are in
+the order in which they first appear in the data.
+Baseline-polarization combinations that don't appear in the
+integration are marked absent and have all of their channels
+flagged.
+
+Attributes:
+
+* **time** -- the timestamp of the integration, as a Julian date.
+* **nbl** -- the number of distinct baselines.
+* **npol** -- the number of distinct polarizations.
+* **nchan** -- the number of channels in each record.
+* **hasW** -- whether the *w* coordinates were read in.
+* **freqs** -- a *nchan*-element double array of the sky frequencies
+  of the channels, in GHz.
+* **spec** -- the :class:`SpectralConfig` of the integration, or
+  :const:`None` if unknown.
+* **vars** -- the variable snapshot that applies to the integration;
+  see :class:`VisBatch`.
+* **baseline** -- a *nbl*-element double array of the encoded
+  baselines.
+* **ant1**, **ant2** -- *nbl*-element int arrays of the one-based
+  antenna numbers of the baselines.
+* **pols** -- a *npol*-element int32 array of the polarization codes.
+* **uvw** -- a (*nbl*, 3) double array of the baseline coordinates.
+* **data** -- a (*nbl*, *npol*, *nchan*) complex64 array of the
+  visibilities.
+* **flags** -- a (*nbl*, *npol*, *nchan*) int32 array of the flags;
+  nonzero values indicate good data.
+* **present** -- a (*nbl*, *npol*) bool array that is true for the
+  combinations that appear in the data.
+* **variance** -- a (*nbl*, *npol*) double array of the record
+  variances.
+
+The arrays are reused from one integration to the next, so they are
+only valid until the reader moves on; use :meth:`copy` to keep a
+snapshot around. If a baseline-polarization combination appears more
+than once in an integration, the last record wins.
+"""
+
+    _arrays = ('baseline', 'ant1', 'ant2', 'pols', 'uvw', 'data', 'flags',
+               'present', 'variance')
+
+    def __init__ (self):
+        self.time = None
+        self.nbl = self.npol = self.nchan = 0
+        self.hasW = False
+        self.freqs = None
+        self.spec = None
+        self.vars = {}
+        self._bufs = {}
+
+
+    def _view (self, name, shape, dtype):
+        size = 1
+        for n in shape:
+            size *= n
+
+        buf = self._bufs.get (name)
+        if buf is None or buf.size < size:
+            # Grow geometrically so that slowly increasing baseline
+            # counts don't reallocate every integration.
+            alloc = size
+            if buf is not None:
+                alloc = max (size, 2 * buf.size)
+            buf = self._bufs[name] = N.empty (alloc, dtype=dtype)
+
+        return buf[:size].reshape (shape)
+
+
+    def _fill (self, pending):
+        from mirtask.util import decodeBaselineArray
+
+        first = pending[0][0]
+        if len (pending) == 1:
+            b, lo, hi = pending[0]
+            bl, pol, uvw = b.baseline[lo:hi], b.pol[lo:hi], b.uvw[lo:hi]
+            data, flags = b.data[lo:hi], b.flags[lo:hi]
+            variance = b.variance[lo:hi]
+        else:
+            def gather (name):
+                return N.concatenate ([getattr (b, name)[lo:hi]
+                                       for b, lo, hi in pending])
+            bl, pol, uvw = gather ('baseline'), gather ('pol'), gather ('uvw')
+            data, flags = gather ('data'), gather ('flags')
+            variance = gather ('variance')
+
+        ubl, blidx = N.unique (bl, return_inverse=True)
+        upol, pfirst, polidx = N.unique (pol, return_index=True,
+                                         return_inverse=True)
+        order = N.argsort (pfirst)
+        rank = N.empty (order.size, dtype=N.intp)
+        rank[order] = N.arange (order.size)
+        polidx = rank[polidx]
+
+        nbl, npol, nchan = ubl.size, upol.size, first.nchan
+        self.time = first.time[pending[0][1]]
+        self.nbl, self.npol, self.nchan = nbl, npol, nchan
+        self.hasW = first.hasW
+        self.freqs = first.freqs
+        self.spec = first.spec
+        self.vars = first.vars
+
+        self.baseline = self._view ('baseline', (nbl, ), N.double)
+        self.baseline[:] = ubl
+        self.ant1 = self._view ('ant1', (nbl, ), N.intc)
+        self.ant2 = self._view ('ant2', (nbl, ), N.intc)
+        decodeBaselineArray (ubl, out=(self.ant1, self.ant2))
+        self.pols = self._view ('pols', (npol, ), N.int32)
+        self.pols[:] = upol[order]
+
+        self.uvw = self._view ('uvw', (nbl, 3), N.double)
+        self.uvw[blidx] = uvw
+
+        self.data = self._view ('data', (nbl, npol, nchan), N.complex64)
+        self.flags = self._view ('flags', (nbl, npol, nchan), N.int32)
+        self.present = self._view ('present', (nbl, npol), N.bool_)
+        self.variance = self._view ('variance', (nbl, npol), N.double)
+        self.data.fill (0)
+        self.flags.fill (0)
+        self.present.fill (False)
+        self.variance.fill (0)
+
+        self.data[blidx,polidx] = data
+        self.flags[blidx,polidx] = flags
+        self.present[blidx,polidx] = True
+        self.variance[blidx,polidx] = variance
+        return self
+
+
+    def copy (self):
+        """Make a copy of the snapshot that doesn't share its arrays.
+
+:rtype: :class:`VisSnapshot`
+:returns: the copy
+"""
+        c = VisSnapshot ()
+        c.time, c.hasW = self.time, self.hasW
+        c.freqs, c.vars = self.freqs, self.vars
+        c.spec = self.spec
+        c.nbl, c.npol, c.nchan = self.nbl, self.npol, self.nchan
+
+        for name in self._arrays:
+            setattr (c, name, getattr (self, name).copy ())
+
+        return c
+
+
+    def weights (self):
+        """Compute per-channel visibility weights.
+
+:rtype: (*nbl*, *npol*, *nchan*) float32 ndarray
+:returns: the weights
+
+As in :meth:`VisBatch.weights`: unflagged channels are weighted by the
+inverse of their record's variance, or 1 if it is unknown, and
+flagged or absent channels get zero weight.
+"""
+        w = N.ones (self.variance.shape, dtype=N.double)
+        known = self.variance > 0
+        w[known] = 1. / self.variance[known]
+        return N.where (self.flags != 0, w[...,N.newaxis], 0).astype (N.float32)
+
+
+    def shadowed (self, diameter):
+        """Determine which baselines are shadowed.
+
+:arg float diameter: the shadowing diameter, in meters
+:rtype: *nbl*-element bool ndarray
+:returns: whether each baseline has a shadowed antenna
+
+As in :meth:`VisBatch.shadowed`.
+"""
+        t = N.empty (self.nbl, dtype=N.double)
+        t.fill (self.time)
+        return _shadowMask (self.vars, t, self.baseline, diameter)
+
+
+def _read_snapshot_gen (batches):
+    snap = VisSnapshot ()
+    pending = []
+    phandle = None
+
+    for handle, batch in batches:
+        if pending:
+            pb, plo, phi = pending[-1]
+            if (handle is not phandle or batch.vars is not pb.vars or
+                batch.nchan != pb.nchan or batch.time[0] != pb.time[phi - 1]):
+                yield phandle, snap._fill (pending)
+                pending = []
+
+        phandle = handle
+        t = batch.time
+        bounds = list (N.flatnonzero (t[1:] != t[:-1]) + 1) + [batch.count]
+        start = 0
+
+        for end in bounds:
+            if start > 0:
+                yield handle, snap._fill (pending)
+                pending = []
+            pending.append ((batch, start, end))
+            start = end
+
+    if pending:
+        yield phandle, snap._fill (pending)
+
+
+def readSnapshots (batchSize=1024, maxchan=4096, trackVars=(),
+                   specCache=None):
+    """Read in data via the UVDAT subsystem one integration at a time.
+
+:arg int batchSize: the number of records to read at once
+:arg int maxchan: the maximum number of spectral channels that can be
+  read in at once
+:arg trackVars: the names of extra UV variables to watch, or
+  :const:`None` to watch all of them, as in :func:`readBatches`
+:type trackVars: iterable of str or :const:`None`
+:arg specCache: the cache in which to look up the spectral setups
+:type specCache: :class:`SpectralCache`
+:rtype: generator of ``(handle, snapshot)``
+:returns: generator yielding tuples of a :class:`UVDatDataSet` and a
+  :class:`VisSnapshot`
+
+This reads the data with :func:`readBatches`, which pulls the records
+out of UVDAT a block at a time with one call into MIRIAD per block,
+and groups consecutive records with the same timestamp into a
+:class:`VisSnapshot`, so that code that needs all of the baselines of
+an integration together doesn't have to collect them itself. An
+integration is also ended whenever a new batch would be, apart from a
+batch filling up: at the end of an input dataset, or if the number of
+channels or polarizations or any of the watched variables changes.
+
+The same :class:`VisSnapshot` object is yielded every time, refilled
+with the next integration, so that its arrays can be reused.
+"""
+    return _read_snapshot_gen (readBatches (batchSize, maxchan, trackVars,
+                                            specCache))
+
+
+def setupAndReadSnapshots (toread, uvdOptions, nopass=False, nocal=False,
+                           nopol=False, select=None, line=None, stokes=None,
+                           ref=None, batchSize=1024, maxchan=4096,
+                           trackVars=(), specCache=None):
+    """Set up the UVDAT subsystem manually and read in the data one
+integration at a time.
+
+The arguments are as in :func:`setupAndReadBatches`, and the return
+value is as in :func:`readSnapshots`.
+"""
+    return _read_snapshot_gen (setupAndReadBatches (toread, uvdOptions,
+                                                    nopass, nocal, nopol,
+                                                    select, line, stokes,
+                                                    ref, batchSize, maxchan,
+                                                    trackVars, specCache))
+
+
+def setupAndFindShadowed (toread, uvdOptions, diameter, batchSize=1024,
+                          **uvdargs):
+    """Find the shadowed records of UV data in one pass.
+
+:arg toread: the name(s) of the dataset or datasets to read
+:type toread: stringable or iterable of stringable
+:arg uvdOptions: extra options controlling the behavior of the UVDAT
+  subsytem
+:type uvdOptions: :class:`str`
+:arg float diameter: the shadowing diameter, in meters
+:arg int batchSize: the number of records to read at once
+:arg uvdargs: extra arguments for :func:`setupAndReadBatches`
+:rtype: (int ndarray, bool ndarray)
+:returns: the serial numbers of the records read, as in
+  :func:`getVisNum`, and whether each is shadowed
+
+This reads the data with :func:`setupAndReadBatches`, tracking
+:data:`SHADOW_VARS`, and works out the shadowing of each batch with
+:meth:`VisBatch.shadowed`, without any per-record calls into MIRIAD.
+Serial numbers restart with each input dataset, so this is most useful
+when reading one dataset at a time.
+"""
+    visnos = []
+    masks = []
+    gen = setupAndReadBatches (toread, uvdOptions, batchSize=batchSize,
+                               trackVars=SHADOW_VARS, **uvdargs)
+
+    for inp, batch in gen:
+        visnos.append (batch.visno)
+        masks.append (batch.shadowed (diameter))
+
+    if not len (visnos):
+        return N.zeros (0, dtype=N.int), N.zeros (0, dtype=N.bool_)
+    return N.concatenate (visnos), N.concatenate (masks)
+
+
+def _setup (toread, uvdOptions, nopass, nocal, nopol, select, line, stokes,
+            ref):
     args = ['vis=' + commasplice (toread)]
     flags = uvdOptions + 'dslr'
     options = set ()
@@ -288,7 +1259,6 @@ Character       Feature behavior
 
     from keys import KeySpec
     KeySpec ().uvdat (flags).process (args)
-    return _read_gen (saveFlags, UVDatDataSet, maxchan)
 
 
 # Variable probes
@@ -0,0 +1,104 @@
+c Copyright 2009-2012 Peter Williams
+c
+c This file is part of miriad-python.
+c
+c Miriad-python is free software: you can redistribute it and/or
+c modify it under the terms of the GNU General Public License as
+c published by the Free Software Foundation, either version 3 of the
+c License, or (at your option) any later version.
+c
+c Miriad-python is distributed in the hope that it will be useful, but
+c WITHOUT ANY WARRANTY; without even the implied warranty of
+c MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+c General Public License for more details.
+c
+c You should have received a copy of the GNU General Public License
+c along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+c
+c Block reads through UVDAT for the batch reader in uvdat.py. UVDAT
+c keeps its state in Fortran and hands out one record per call, and
+c the polarization, variance, and serial number of each record take
+c further calls; doing all of that here turns several Python-level
+c calls per record into one per block.
+c
+c************************************************************************
+      subroutine uvdatrdb(start,nchan,npol,nvhan,vhans,maxchan,maxrec,
+     *  preambles,data,flags,pols,vars,visnos,nrec,nlast,nplast,chg,eof)
+c
+      integer start,nchan,npol,nvhan,vhans(nvhan),maxchan,maxrec
+      double precision preambles(5,maxrec)
+      complex data(maxchan,maxrec)
+      logical flags(maxchan,maxrec)
+      integer pols(maxrec),visnos(maxrec)
+      real vars(maxrec)
+      integer nrec,nlast,nplast,chg
+      logical eof
+c
+c  Read records into slots start+1 to maxrec. Reading stops early
+c  after a record on which any of the variable trackers reports a
+c  change, or whose number of channels or polarizations differs from
+c  nchan or npol; that record is still stored, so that the caller can
+c  start its next block with it.
+c
+c  Input:
+c    start      The number of slots that are already filled.
+c    nchan      The expected number of channels, or 0 if any number
+c               will do for the first record read.
+c    npol       The expected number of polarizations, as from UVDAT's
+c               "npol", or 0 likewise.
+c    nvhan      The number of variable trackers.
+c    vhans      The variable tracker handles, from uvvarini.
+c    maxchan    The size of the channel axis of data and flags.
+c    maxrec     The number of slots.
+c  Output:
+c    preambles  The preambles, as from uvdatrd. Element 5 of each is
+c               left alone if UVDAT returns four-element preambles.
+c    data       The correlation data.
+c    flags      The flags.
+c    pols       The polarization code of each record.
+c    vars       The variance of each record.
+c    visnos     The serial number of each record.
+c    nrec       The number of slots filled, including the first start.
+c    nlast      The number of channels in the last record read.
+c    nplast     The number of polarizations of the last record read.
+c    chg        Bit k-1 is set if tracker k reported a change on the
+c               last record read.
+c    eof        True if the end of the data was reached.
+c------------------------------------------------------------------------
+      integer i,k,nread,nexp,np,npexp
+      logical uvvarupd
+      external uvvarupd
+c
+      nrec = start
+      nlast = 0
+      nplast = 0
+      chg = 0
+      eof = .false.
+      nexp = nchan
+      npexp = npol
+c
+      do i = start+1,maxrec
+        call uvdatrd(preambles(1,i),data(1,i),flags(1,i),maxchan,nread)
+        if(nread.eq.0)then
+          eof = .true.
+          return
+        endif
+c
+        call uvdatgti('pol',pols(i))
+        call uvdatgtr('variance',vars(i))
+        call uvdatgti('visno',visnos(i))
+        call uvdatgti('npol',np)
+        nrec = i
+        nlast = nread
+        nplast = np
+c
+        do k = 1,nvhan
+          if(uvvarupd(vhans(k))) chg = chg + 2**(k-1)
+        enddo
+c
+        if(nexp.eq.0) nexp = nread
+        if(npexp.eq.0) npexp = np
+        if(chg.ne.0.or.nread.ne.nexp.or.np.ne.npexp) return
+      enddo
+c
+      end
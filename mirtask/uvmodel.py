@@ -0,0 +1,223 @@
+'''mirtask.uvmodel - predict model visibilities of component lists'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import numpy as N
+from mirtask import _kernels
+
+__all__ = ['ComponentList']
+
+
+_MODE_MODEL = 0
+_MODE_SUBTRACT = 1
+_MODE_DIVIDE = 2
+
+
+class ComponentList (object):
+    """:synopsis: a list of sky components whose visibilities can be predicted
+
+:arg float reffreq: the reference frequency of the component fluxes
+  and spectral indices, in GHz; defaults to 1
+
+A :class:`ComponentList` holds point sources and elliptical Gaussians
+and computes their visibilities by a direct Fourier transform, like
+UVMODEL. Component positions are offsets from the phase center in
+radians, with *l* increasing to the east and *m* to the north. The
+fluxes scale with frequency as ``flux * (freq / reffreq)**alpha``.
+
+The transform is done in compiled code, with the records shared out
+between threads (see :func:`mirtask.util.setNumThreads`). Within a
+record, the phases of each component are computed once per run of
+evenly spaced channels and then rotated from channel to channel, so
+spectra with many channels are cheap.
+
+Components are added with :meth:`addPoint` and :meth:`addGaussian`.
+The visibilities can be computed directly with :meth:`predict`, or
+applied to the data as they're read: for instance, to subtract the
+model from every batch::
+
+  comps = uvmodel.ComponentList (1.4)
+  comps.addPoint (2.5, 1e-4, -3e-4)
+
+  for inp, batch in comps.subtractBatches (uvdat.readBatches ()):
+      ...
+"""
+
+    def __init__ (self, reffreq=1.):
+        self.reffreq = float (reffreq)
+        self._params = []
+        self._fluxes = []
+        self._alphas = []
+
+
+    def __len__ (self):
+        return len (self._params)
+
+
+    def addPoint (self, flux, l, m, alpha=0.):
+        """Add a point source.
+
+:arg float flux: the flux density at the reference frequency, in Jy
+:arg float l: the eastward offset from the phase center, in radians
+:arg float m: the northward offset from the phase center, in radians
+:arg float alpha: the spectral index
+:returns: *self*
+"""
+        return self.addGaussian (flux, l, m, 0., 0., 0., alpha)
+
+
+    def addGaussian (self, flux, l, m, bmaj, bmin, bpa, alpha=0.):
+        """Add an elliptical Gaussian.
+
+:arg float flux: the total flux density at the reference frequency,
+  in Jy
+:arg float l: the eastward offset from the phase center, in radians
+:arg float m: the northward offset from the phase center, in radians
+:arg float bmaj: the major-axis FWHM, in radians
+:arg float bmin: the minor-axis FWHM, in radians
+:arg float bpa: the position angle of the major axis, in degrees east
+  of north
+:arg float alpha: the spectral index
+:returns: *self*
+"""
+        if l**2 + m**2 >= 1:
+            raise ValueError ('component is beyond the horizon')
+
+        # The transform of the Gaussian is exp (-K (bmaj^2 ua^2 + bmin^2 ub^2))
+        # with (ua, ub) the uv coordinates along its axes, in wavelengths.
+        # Expand that into coefficients of u^2, uv, and v^2, with u and v
+        # in ns, to be scaled by the frequency in GHz squared.
+
+        k = N.pi**2 / (4 * N.log (2))
+        s = N.sin (bpa * N.pi / 180)
+        c = N.cos (bpa * N.pi / 180)
+        gu = k * (bmaj**2 * s**2 + bmin**2 * c**2)
+        guv = k * 2 * s * c * (bmaj**2 - bmin**2)
+        gv = k * (bmaj**2 * c**2 + bmin**2 * s**2)
+
+        self._params.append ((l, m, gu, guv, gv))
+        self._fluxes.append (flux)
+        self._alphas.append (alpha)
+        return self
+
+
+    def _apply (self, uvw, freqs, data, mode, flags=None):
+        uvw = N.ascontiguousarray (uvw, dtype=N.double)
+        freqs = N.ascontiguousarray (freqs, dtype=N.double).ravel ()
+
+        if uvw.ndim != 2 or uvw.shape[1] not in (2, 3):
+            raise ValueError ('uvw must have shape (nrec, 2) or (nrec, 3)')
+        if uvw.shape[1] == 2:
+            uvw = N.concatenate ((uvw, N.zeros ((uvw.shape[0], 1))), axis=1)
+        if data.shape != (uvw.shape[0], freqs.size):
+            raise ValueError ('inconsistent visibility array shapes')
+
+        comps = N.array (self._params, dtype=N.double).reshape ((-1, 5))
+        amp = (N.asarray (self._fluxes, dtype=N.double)[:,N.newaxis] *
+               (freqs / self.reffreq)**N.asarray (self._alphas)[:,N.newaxis])
+        amp = N.ascontiguousarray (amp.reshape ((len (self), freqs.size)))
+
+        _kernels.dft_predict (uvw, freqs, comps, amp, mode, data, flags)
+        return data
+
+
+    def predict (self, uvw, freqs):
+        """Compute model visibilities.
+
+:arg uvw: the *u*, *v*, and optionally *w* coordinates of the records,
+  in nanoseconds
+:type uvw: (*nrec*, 2) or (*nrec*, 3) array-like of double
+:arg freqs: the sky frequencies of the channels, in GHz
+:type freqs: *nchan*-element array-like of double
+:rtype: (*nrec*, *nchan*) complex64 ndarray
+:returns: the model visibilities
+"""
+        uvw = N.asarray (uvw)
+        freqs = N.asarray (freqs).ravel ()
+        data = N.empty ((uvw.shape[0], freqs.size), dtype=N.complex64)
+        return self._apply (uvw, freqs, data, _MODE_MODEL)
+
+
+    def _batchUVW (self, batch):
+        if batch.hasW:
+            return batch.uvw
+        return batch.uvw[:,:2]
+
+
+    def predictBatch (self, batch):
+        """Compute model visibilities for a batch read by :mod:`mirtask.uvdat`.
+
+:arg batch: the records
+:type batch: :class:`mirtask.uvdat.VisBatch`
+:rtype: (*nrec*, *nchan*) complex64 ndarray
+:returns: the model visibilities
+
+The coordinates of the batch must be in nanoseconds; i.e., the data
+must not have been read with the UVDAT *w* option.
+"""
+        return self.predict (self._batchUVW (batch), batch.freqs)
+
+
+    def subtractBatch (self, batch):
+        """Subtract the model from a batch of visibilities in place.
+
+:arg batch: the records
+:type batch: :class:`mirtask.uvdat.VisBatch`
+:returns: *batch*
+"""
+        self._apply (self._batchUVW (batch), batch.freqs, batch.data,
+                     _MODE_SUBTRACT)
+        return batch
+
+
+    def divideBatch (self, batch):
+        """Divide a batch of visibilities by the model in place.
+
+:arg batch: the records
+:type batch: :class:`mirtask.uvdat.VisBatch`
+:returns: *batch*
+
+Samples where the model is zero are zeroed and flagged.
+"""
+        self._apply (self._batchUVW (batch), batch.freqs, batch.data,
+                     _MODE_DIVIDE, batch.flags)
+        return batch
+
+
+    def subtractBatches (self, batches):
+        """Subtract the model from a stream of batches as they're read.
+
+:arg batches: a stream of ``(handle, batch)`` tuples, as returned by
+  :func:`mirtask.uvdat.readBatches`
+:rtype: generator of ``(handle, batch)``
+:returns: the same stream, with the model subtracted from each batch
+"""
+        for inp, batch in batches:
+            yield inp, self.subtractBatch (batch)
+
+
+    def divideBatches (self, batches):
+        """Divide a stream of batches by the model as they're read.
+
+:arg batches: a stream of ``(handle, batch)`` tuples, as returned by
+  :func:`mirtask.uvdat.readBatches`
+:rtype: generator of ``(handle, batch)``
+:returns: the same stream, with each batch divided by the model
+"""
+        for inp, batch in batches:
+            yield inp, self.divideBatch (batch)
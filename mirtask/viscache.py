@@ -0,0 +1,392 @@
+'''mirtask.viscache - cache calibrated UV data next to their dataset'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import os
+import numpy as N
+
+__all__ = ['cacheDirectory', 'cacheKey', 'isCached', 'readCachedBatches',
+           'readCachedSnapshots', 'clearCache']
+
+
+# Bump this whenever the layout of the cache changes, so that old
+# caches are ignored rather than misread.
+
+FORMAT_VERSION = 2
+
+# The per-record columns, their types, and the number of values per
+# record. The data and flags are stored flat, since the number of
+# channels can change from segment to segment; the flags are stored as
+# bytes.
+
+_rowcols = [('time', N.double, 1), ('baseline', N.double, 1),
+            ('uvw', N.double, 3), ('pol', N.int32, 1),
+            ('variance', N.double, 1), ('visno', N.int64, 1)]
+_chancols = [('data', N.complex64), ('flags', N.uint8)]
+
+_uvdatKeys = ('nopass', 'nocal', 'nopol', 'select', 'line', 'stokes', 'ref')
+
+
+def cacheDirectory (vis, cacheDir=None):
+    """Get the directory holding the cached reads of a dataset.
+
+:arg vis: the dataset
+:type vis: :class:`miriad.VisData`
+:arg cacheDir: the directory, or :const:`None` (the default) for a
+  directory next to the dataset, named after it with ".viscache"
+  appended
+:type cacheDir: str or :const:`None`
+:rtype: str
+:returns: the directory, which may not exist
+"""
+    if cacheDir is not None:
+        return str (cacheDir)
+    return vis.base.rstrip (os.sep) + '.viscache'
+
+
+def cacheKey (vis, uvdOptions='', maxchan=4096, trackVars=(), **uvdargs):
+    """Compute the key of a cached read.
+
+:arg vis: the dataset
+:type vis: :class:`miriad.VisData`
+:arg str uvdOptions: options for the UVDAT subsystem
+:arg int maxchan: the maximum number of channels per record
+:arg trackVars: the names of extra UV variables to watch, or
+  :const:`None` to watch all of them
+:type trackVars: iterable of str or :const:`None`
+:arg uvdargs: extra arguments for the UVDAT subsystem, as in
+  :func:`mirtask.uvdat.setupAndReadBatches`
+:rtype: str
+:returns: the key, as a hexadecimal string
+
+The key covers :meth:`miriad.VisData.quickHash` of the dataset, which
+includes its calibration tables, and every argument that affects what
+UVDAT delivers. The batch size doesn't matter, since the cache stores
+records rather than batches.
+"""
+    import hashlib
+    from mirtask.uvdat import _trackArg
+
+    bad = [k for k in uvdargs if k not in _uvdatKeys]
+    if len (bad):
+        raise TypeError ('unexpected UVDAT argument(s) %s' % ', '.join (bad))
+
+    h = hashlib.sha1 ()
+    h.update ('viscache %d\0' % FORMAT_VERSION)
+    vis.quickHash (hash=h)
+    h.update (repr ((str (uvdOptions), int (maxchan), _trackArg (trackVars))))
+
+    for k in _uvdatKeys:
+        v = uvdargs.get (k)
+        if v is not None and not isinstance (v, bool):
+            v = str (v)
+        h.update ('\0%s=%r' % (k, v))
+
+    return h.hexdigest ()
+
+
+def isCached (vis, uvdOptions='', cacheDir=None, maxchan=4096, trackVars=(),
+              **uvdargs):
+    """Check whether a read of a dataset is cached.
+
+The arguments are as in :func:`readCachedBatches`.
+
+:rtype: bool
+:returns: whether the read would come from the cache
+"""
+    key = cacheKey (vis, uvdOptions, maxchan, trackVars, **uvdargs)
+    return os.path.exists (os.path.join (cacheDirectory (vis, cacheDir), key,
+                                         'index'))
+
+
+def clearCache (vis, cacheDir=None):
+    """Delete all of the cached reads of a dataset.
+
+:arg vis: the dataset
+:type vis: :class:`miriad.VisData`
+:arg cacheDir: the cache directory; see :func:`cacheDirectory`
+:type cacheDir: str or :const:`None`
+:rtype: :const:`None`
+
+Caches of earlier versions of a dataset are never read again once it
+changes, but they aren't deleted automatically either.
+"""
+    import shutil
+
+    d = cacheDirectory (vis, cacheDir)
+    if os.path.isdir (d):
+        shutil.rmtree (d)
+
+
+class _Segment (object):
+    # A run of records with the same channels, polarization count,
+    # and tracked variables. The offsets are in records and in channel
+    # samples.
+
+    def __init__ (self, batch, rec0, chan0):
+        self.rec0 = rec0
+        self.chan0 = chan0
+        self.count = 0
+        self.nchan = batch.nchan
+        self.npol = batch.npol
+        self.hasW = batch.hasW
+        self.vars = batch.vars
+        self.freqs = N.array (batch.freqs)
+        spec = batch.spec
+        if spec is None:
+            self.lineinfo = self.specvars = None
+        else:
+            self.lineinfo = N.array (spec.lineinfo)
+            self.specvars = spec.vars
+        self._spec = spec
+
+
+    def matches (self, batch):
+        return (batch.nchan == self.nchan and batch.npol == self.npol and
+                batch.hasW == self.hasW and
+                batch.vars is self.vars and batch.spec is self._spec and
+                (batch.spec is not None or
+                 N.array_equal (batch.freqs, self.freqs)))
+
+
+    def __getstate__ (self):
+        state = self.__dict__.copy ()
+        del state['_spec']
+        return state
+
+
+def _writeGen (vis, final, uvdOptions, batchSize, maxchan, trackVars,
+               specCache, uvdargs):
+    import cPickle
+    from mirtask import uvdat
+
+    parent = os.path.dirname (final)
+    if not os.path.isdir (parent):
+        os.makedirs (parent)
+
+    # Write into a private directory and only rename it into place
+    # once it's complete, so that an interrupted read or a concurrent
+    # one never leaves a partial cache where it would be used.
+
+    tmp = '%s.tmp%d' % (final, os.getpid ())
+    _rmtree (tmp)
+    os.mkdir (tmp)
+    files = {}
+    segments = []
+    nrec = nsamp = 0
+
+    try:
+        for name, dtype, width in _rowcols:
+            files[name] = open (os.path.join (tmp, name), 'wb')
+        for name, dtype in _chancols:
+            files[name] = open (os.path.join (tmp, name), 'wb')
+
+        for handle, batch in uvdat.setupAndReadBatches (vis, uvdOptions,
+                                                        batchSize=batchSize,
+                                                        maxchan=maxchan,
+                                                        trackVars=trackVars,
+                                                        specCache=specCache,
+                                                        **uvdargs):
+            n = batch.count
+
+            if not len (segments) or not segments[-1].matches (batch):
+                segments.append (_Segment (batch, nrec, nsamp))
+
+            for name, dtype, width in _rowcols:
+                col = N.asarray (getattr (batch, name)[:n], dtype=dtype)
+                col.tofile (files[name])
+            data = N.asarray (batch.data[:n], dtype=N.complex64)
+            data.tofile (files['data'])
+            (batch.flags[:n] != 0).astype (N.uint8).tofile (files['flags'])
+
+            segments[-1].count += n
+            nrec += n
+            nsamp += n * batch.nchan
+            yield vis, batch
+
+        for f in files.itervalues ():
+            f.close ()
+
+        index = {'version': FORMAT_VERSION, 'nrec': nrec, 'nsamp': nsamp,
+                 'segments': segments}
+        f = open (os.path.join (tmp, 'index'), 'wb')
+        cPickle.dump (index, f, cPickle.HIGHEST_PROTOCOL)
+        f.close ()
+
+        try:
+            os.rename (tmp, final)
+        except OSError:
+            # Someone else finished the same read first.
+            pass
+    except:
+        for f in files.itervalues ():
+            f.close ()
+        _rmtree (tmp)
+        raise
+
+    _rmtree (tmp)
+
+
+def _rmtree (path):
+    import shutil
+    if os.path.isdir (path):
+        shutil.rmtree (path, ignore_errors=True)
+
+
+def _readGen (vis, final, batchSize, specCache):
+    import cPickle
+    from mirtask.uvdat import VisBatch
+
+    f = open (os.path.join (final, 'index'), 'rb')
+    index = cPickle.load (f)
+    f.close ()
+
+    if index['version'] != FORMAT_VERSION:
+        raise ValueError ('cache %s has format version %r, not %d' %
+                          (final, index['version'], FORMAT_VERSION))
+
+    nrec, nsamp = index['nrec'], index['nsamp']
+    if nrec == 0:
+        return
+
+    # Copy-on-write maps, so that code that modifies batches in place,
+    # such as model subtraction, works as usual without touching the
+    # cache.
+
+    cols = {}
+    for name, dtype, width in _rowcols:
+        shape = (nrec, width) if width > 1 else (nrec, )
+        cols[name] = N.memmap (os.path.join (final, name), dtype=dtype,
+                               mode='c', shape=shape)
+    for name, dtype in _chancols:
+        cols[name] = N.memmap (os.path.join (final, name), dtype=dtype,
+                               mode='c', shape=(nsamp, ))
+
+    for seg in index['segments']:
+        if seg.specvars is None:
+            spec, freqs = None, seg.freqs
+        else:
+            spec = specCache.intern (seg.freqs, seg.lineinfo, seg.specvars)
+            freqs = spec.freqs
+
+        for start in xrange (0, seg.count, batchSize):
+            n = min (batchSize, seg.count - start)
+            r0 = seg.rec0 + start
+            c0 = seg.chan0 + start * seg.nchan
+            c1 = c0 + n * seg.nchan
+
+            batch = VisBatch (0, seg.nchan, seg.hasW, freqs, spec)
+            batch.count = n
+            batch.npol = seg.npol
+            batch.vars = seg.vars
+            for name, dtype, width in _rowcols:
+                setattr (batch, name, cols[name][r0:r0+n])
+            batch.data = cols['data'][c0:c1].reshape ((n, seg.nchan))
+            flags = cols['flags'][c0:c1].reshape ((n, seg.nchan))
+            batch.flags = flags.astype (N.int32)
+            batch.specid = N.empty (n, dtype=N.int32)
+            batch.specid.fill (-1 if spec is None else spec.id)
+            yield vis, batch
+
+
+def readCachedBatches (vis, uvdOptions='', cacheDir=None, batchSize=1024,
+                       maxchan=4096, trackVars=(), specCache=None,
+                       **uvdargs):
+    """Read a dataset in batches, through an on-disk cache.
+
+:arg vis: the dataset
+:type vis: :class:`miriad.VisData`
+:arg str uvdOptions: options for the UVDAT subsystem
+:arg cacheDir: the cache directory; see :func:`cacheDirectory`
+:type cacheDir: str or :const:`None`
+:arg int batchSize: the maximum number of records in each batch
+:arg int maxchan: the maximum number of channels per record
+:arg trackVars: the names of extra UV variables to watch, or
+  :const:`None` to watch all of them
+:type trackVars: iterable of str or :const:`None`
+:arg specCache: the cache of spectral setups; see
+  :func:`mirtask.uvdat.readBatches`
+:type specCache: :class:`mirtask.uvdat.SpectralCache`
+:arg uvdargs: extra arguments for the UVDAT subsystem: *nopass*,
+  *nocal*, *nopol*, *select*, *line*, *stokes*, and *ref*, as in
+  :func:`mirtask.uvdat.setupAndReadBatches`
+:rtype: generator of ``(vis, batch)``
+:returns: generator yielding tuples of *vis* and a
+  :class:`mirtask.uvdat.VisBatch`
+
+The first time that a dataset is read with a given set of arguments,
+this reads it with :func:`mirtask.uvdat.setupAndReadBatches` as usual,
+applying the calibrations and selections, and saves the records as
+they go by in a subdirectory of the cache directory named after
+:func:`cacheKey`. Later reads with the same arguments skip UVDAT
+entirely and stream the records from the cache with memory maps,
+which avoids recomputing the gains, bandpass, and leakage corrections
+every time. If the dataset changes, so does its hash, and it is read
+afresh.
+
+The first element of each tuple is *vis* itself rather than an open
+dataset handle, whichever way the data are read, so that code doesn't
+come to depend on the handle being there. The batches are as from
+:func:`mirtask.uvdat.readBatches`, with these differences when they
+come from the cache:
+
+* batches are split wherever the number of channels or polarizations,
+  the spectral setup, or the watched variables change, and at every
+  *batchSize* records, rather than at dataset boundaries;
+* their **npol** is the one recorded when the cache was written;
+* their columns are copy-on-write views of the cache, so that
+  modifying them doesn't change the cache; and
+* the flags are only saved as good or bad.
+
+The cache is only written if the read runs to completion. It is
+keyed on :meth:`miriad.VisData.quickHash`, so it shares that method's
+caveats about which changes to the dataset are noticed; delete stale
+or doubtful caches with :func:`clearCache`.
+"""
+    from mirtask.uvdat import SpectralCache, _trackArg
+
+    if specCache is None:
+        specCache = SpectralCache ()
+
+    vis.checkExists ()
+    trackVars = _trackArg (trackVars)
+    key = cacheKey (vis, uvdOptions, maxchan, trackVars, **uvdargs)
+    final = os.path.join (cacheDirectory (vis, cacheDir), key)
+
+    if os.path.exists (os.path.join (final, 'index')):
+        return _readGen (vis, final, int (batchSize), specCache)
+
+    return _writeGen (vis, final, uvdOptions, int (batchSize), maxchan,
+                      trackVars, specCache, uvdargs)
+
+
+def readCachedSnapshots (vis, uvdOptions='', cacheDir=None, batchSize=1024,
+                         maxchan=4096, trackVars=(), specCache=None,
+                         **uvdargs):
+    """Read a dataset one integration at a time, through an on-disk cache.
+
+The arguments are as in :func:`readCachedBatches`, and the return
+value is as in :func:`mirtask.uvdat.readSnapshots`, except that the
+first element of each tuple is *vis*.
+"""
+    from mirtask.uvdat import _read_snapshot_gen
+
+    return _read_snapshot_gen (readCachedBatches (vis, uvdOptions, cacheDir,
+                                                  batchSize, maxchan,
+                                                  trackVars, specCache,
+                                                  **uvdargs))
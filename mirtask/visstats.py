@@ -0,0 +1,287 @@
+'''mirtask.visstats - running statistics of UV data'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import numpy as N
+from mirtask import _kernels, util
+
+__all__ = ['VisStats', 'StatsAccumulator', 'readStats']
+
+
+class VisStats (object):
+    """:synopsis: statistics of UV data per baseline, pol, and channel
+
+A :class:`VisStats` holds the results of a :class:`StatsAccumulator`,
+with one row for each (baseline, pol) pair, in the order in which the
+pairs first appeared, and one column for each channel. Only unflagged
+data are counted.
+
+Attributes:
+
+* **nrow** -- the number of (baseline, pol) pairs.
+* **nchan** -- the number of channels.
+* **freqs** -- a *nchan*-element double array of the sky frequencies
+  of the channels in the first records seen, in GHz.
+* **baseline** -- a *nrow*-element double array of the encoded
+  baselines.
+* **ant1**, **ant2** -- *nrow*-element int arrays of their one-based
+  antenna numbers.
+* **pol** -- a *nrow*-element int32 array of the polarization codes.
+* **count** -- a (*nrow*, *nchan*) int64 array of the numbers of
+  unflagged samples.
+* **mean** -- a (*nrow*, *nchan*) complex128 array of the mean
+  visibilities.
+* **var** -- a (*nrow*, *nchan*) double array of the sample variances
+  of the visibilities, the mean of ``abs (v - mean)**2`` with *n* - 1
+  in the denominator.
+* **ampMean**, **ampVar** -- (*nrow*, *nchan*) double arrays of the
+  mean and sample variance of the amplitudes.
+* **ampMin**, **ampMax** -- (*nrow*, *nchan*) double arrays of the
+  smallest and largest amplitudes.
+
+Where there are no unflagged samples, all of the statistics are zero,
+and where there is only one, so are the variances.
+"""
+
+    def columns (self):
+        """Get the statistics as a flat table.
+
+:rtype: dict of ndarray
+:returns: a table with one row per (baseline, pol, channel) with any
+  unflagged data, as a dictionary of equal-length columns
+
+The columns are "ant1", "ant2", "pol", "chan" (numbered from zero),
+"freq", and the statistics arrays, named as the attributes.
+"""
+        r, c = N.nonzero (self.count > 0)
+        cols = {'ant1': self.ant1[r], 'ant2': self.ant2[r],
+                'pol': self.pol[r], 'chan': c, 'freq': self.freqs[c]}
+
+        for name in ('count', 'mean', 'var', 'ampMean', 'ampVar',
+                     'ampMin', 'ampMax'):
+            cols[name] = getattr (self, name)[r,c]
+
+        return cols
+
+
+class StatsAccumulator (object):
+    """:synopsis: accumulate statistics of batches of UV data
+
+A :class:`StatsAccumulator` keeps running statistics of the unflagged
+visibilities of each (baseline, pol, channel), like those shown by
+UVSPEC and UVLIST, for a stream of :class:`mirtask.uvdat.VisBatch`
+objects. The accumulators are updated with Welford's method in native
+code, a whole batch at a time, with the channels shared out between
+threads (see :func:`mirtask.util.setNumThreads`). Their size depends
+only on the numbers of (baseline, pol) pairs and channels, not on the
+amount of data.
+
+Accumulators that have seen different data, say different datasets
+read in parallel, can be combined with :meth:`merge`. Every record
+must have the same number of channels; the channel frequencies aren't
+checked, since they drift with Doppler tracking.
+"""
+
+    def __init__ (self):
+        self.nchan = None
+        self.freqs = None
+        self._table = util.SlotTable (64)
+        self._alloc (64, 0)
+
+
+    # The per-slot state, as in mirtask.timeaver.TimeAverager. The
+    # extremes start at infinities so that the native code can just
+    # compare against them.
+
+    _slotspecs = [('count', (0, ), N.int64, 0),
+                  ('mean', (0, ), N.complex128, 0),
+                  ('m2', (0, ), N.double, 0), ('amean', (0, ), N.double, 0),
+                  ('am2', (0, ), N.double, 0),
+                  ('amin', (0, ), N.double, N.inf),
+                  ('amax', (0, ), N.double, -N.inf)]
+
+
+    def _alloc (self, cap, nchan, n=0):
+        for name, shape, dtype, init in self._slotspecs:
+            dims = [cap] + [d or nchan for d in shape]
+            new = N.empty (dims, dtype=dtype)
+            new.fill (init)
+            if n > 0:
+                new[:n] = getattr (self, '_' + name)[:n]
+            setattr (self, '_' + name, new)
+
+
+    def _lookup (self, bl, pol):
+        nused = self._table.count
+        slots = self._table.lookup (bl, pol)[0]
+        nnew = self._table.count
+
+        if nnew > self._count.shape[0]:
+            cap = self._count.shape[0]
+            while nnew > cap:
+                cap *= 2
+            self._alloc (cap, self.nchan, nused)
+
+        return slots
+
+
+    def _setChans (self, nchan, freqs):
+        if self.nchan is None:
+            self.nchan = nchan
+            self.freqs = N.array (freqs)
+            self._alloc (self._count.shape[0], nchan)
+        elif nchan != self.nchan:
+            raise ValueError ('expected %d channels but got %d' %
+                              (self.nchan, nchan))
+
+
+    def add (self, batch):
+        """Add a batch of records to the statistics.
+
+:arg batch: the records
+:type batch: :class:`mirtask.uvdat.VisBatch`
+:rtype: :class:`StatsAccumulator`
+:returns: *self*
+"""
+        n = batch.count
+        if n == 0:
+            return self
+
+        self._setChans (batch.nchan, batch.freqs)
+        bl = N.ascontiguousarray (batch.baseline[:n], dtype=N.double)
+        pol = N.ascontiguousarray (batch.pol[:n], dtype=N.int32)
+        slots = self._lookup (bl, pol)
+
+        data = N.ascontiguousarray (batch.data[:n], dtype=N.complex64)
+        flags = N.ascontiguousarray (batch.flags[:n], dtype=N.int32)
+        _kernels.stats_accum (slots, data, flags, self._count, self._mean,
+                              self._m2, self._amean, self._am2, self._amin,
+                              self._amax)
+        return self
+
+
+    def addBatches (self, batches):
+        """Add a stream of batches to the statistics.
+
+:arg batches: the records
+:type batches: iterable of :class:`mirtask.uvdat.VisBatch`, or of
+  ``(handle, batch)`` tuples as yielded by
+  :func:`mirtask.uvdat.readBatches`
+:rtype: :class:`StatsAccumulator`
+:returns: *self*
+"""
+        for item in batches:
+            if isinstance (item, tuple):
+                item = item[1]
+            self.add (item)
+        return self
+
+
+    def merge (self, other):
+        """Fold the statistics of another accumulator into this one.
+
+:arg other: the other accumulator, which is left unchanged
+:type other: :class:`StatsAccumulator`
+:rtype: :class:`StatsAccumulator`
+:returns: *self*
+
+The means and sums of squared deviations are combined with the
+pairwise formulas of Chan et al., so the result is the same, to
+rounding, as if all of the data had gone through one accumulator.
+"""
+        m = other._table.count
+        if m == 0:
+            return self
+
+        self._setChans (other.nchan, other.freqs)
+        s = self._lookup (other._table.baseline[:m], other._table.pol[:m])
+
+        na = self._count[s].astype (N.double)
+        nb = other._count[:m].astype (N.double)
+        n = na + nb
+        fb = nb / N.maximum (n, 1)
+        cross = na * fb
+
+        d = other._mean[:m] - self._mean[s]
+        self._mean[s] += d * fb
+        self._m2[s] += other._m2[:m] + (d.real**2 + d.imag**2) * cross
+
+        d = other._amean[:m] - self._amean[s]
+        self._amean[s] += d * fb
+        self._am2[s] += other._am2[:m] + d**2 * cross
+
+        self._count[s] += other._count[:m]
+        self._amin[s] = N.minimum (self._amin[s], other._amin[:m])
+        self._amax[s] = N.maximum (self._amax[s], other._amax[:m])
+        return self
+
+
+    def result (self):
+        """Get the statistics accumulated so far.
+
+:rtype: :class:`VisStats`
+:returns: the statistics, as copies that later additions don't affect
+"""
+        n = self._table.count
+        st = VisStats ()
+        st.nrow = n
+        st.nchan = self.nchan or 0
+        st.freqs = self.freqs
+        if st.freqs is None:
+            st.freqs = N.zeros (0)
+        st.baseline = self._table.baseline[:n].copy ()
+        st.pol = self._table.pol[:n].copy ()
+        st.ant1, st.ant2 = util.decodeBaselineArray (st.baseline)
+
+        count = self._count[:n].copy ()
+        none = count == 0
+        dof = N.maximum (count - 1, 1)
+        few = count < 2
+
+        st.count = count
+        st.mean = self._mean[:n].copy ()
+        st.var = N.where (few, 0., self._m2[:n] / dof)
+        st.ampMean = self._amean[:n].copy ()
+        st.ampVar = N.where (few, 0., self._am2[:n] / dof)
+        st.ampMin = N.where (none, 0., self._amin[:n])
+        st.ampMax = N.where (none, 0., self._amax[:n])
+        return st
+
+
+def readStats (toread, uvdOptions='', batchSize=1024, **uvdargs):
+    """Compute statistics of UV data per baseline, pol, and channel.
+
+:arg toread: the dataset or datasets to read
+:type toread: :class:`miriad.VisData`, or iterable thereof
+:arg str uvdOptions: options for the UVDAT subsystem
+:arg int batchSize: the number of records to read at once
+:arg uvdargs: extra arguments for the UVDAT subsystem, as in
+  :func:`mirtask.uvdat.setupAndReadBatches`
+:rtype: :class:`VisStats`
+:returns: the statistics
+
+The data are streamed through a :class:`StatsAccumulator` in one pass,
+so the memory used doesn't grow with the amount of data.
+"""
+    from mirtask import uvdat
+
+    acc = StatsAccumulator ()
+    acc.addBatches (uvdat.setupAndReadBatches (toread, uvdOptions,
+                                               batchSize=batchSize,
+                                               **uvdargs))
+    return acc.result ()
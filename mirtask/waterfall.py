@@ -0,0 +1,290 @@
+'''mirtask.waterfall - time-by-channel arrays of UV data'''
+
+# Copyright 2009-2012 Peter Williams
+#
+# This file is part of miriad-python.
+#
+# Miriad-python is free software: you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# Miriad-python is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with miriad-python.  If not, see <http://www.gnu.org/licenses/>.
+
+import numpy as N
+from mirtask import util
+
+__all__ = ['WaterfallSet', 'scanTimes', 'buildWaterfalls']
+
+
+def scanTimes (toread):
+    """Find the distinct timestamps of some UV datasets.
+
+:arg toread: the dataset or datasets to scan
+:type toread: :class:`miriad.VisData`, or iterable thereof
+:rtype: double ndarray
+:returns: the sorted distinct timestamps, as Julian dates
+
+This skips through the datasets from one change of the "time"
+variable to the next, without decoding the visibilities, so it's much
+quicker than reading the data.
+"""
+    from miriad import VisData, ensureiterable
+
+    times = []
+
+    for vis in ensureiterable (toread):
+        if not isinstance (vis, VisData):
+            vis = VisData (str (vis))
+
+        hnd = vis.open ('rw')
+        try:
+            while hnd.scanUntilChange ('time'):
+                times.append (hnd.getVarDouble ('time'))
+        finally:
+            hnd.close ()
+
+    return N.unique (N.asarray (times, dtype=N.double))
+
+
+class WaterfallSet (object):
+    """:synopsis: time-by-channel arrays of UV data for many baselines
+
+A :class:`WaterfallSet` holds a *waterfall* -- a dense array of the
+visibilities of one baseline and polarization against time and
+channel -- for each of a number of baseline-polarization pairs, all on
+a common time axis. It is built by :func:`buildWaterfalls`.
+
+Attributes:
+
+* **nwf** -- the number of waterfalls.
+* **ntime** -- the number of timestamps.
+* **nchan** -- the number of channels.
+* **time** -- a *ntime*-element double array of the timestamps, as
+  Julian dates, in increasing order.
+* **freqs** -- a *nchan*-element double array of the sky frequencies
+  of the channels, in GHz.
+* **baseline** -- a *nwf*-element double array of the encoded
+  baselines of the waterfalls.
+* **ant1**, **ant2** -- *nwf*-element int arrays of their one-based
+  antenna numbers.
+* **pol** -- a *nwf*-element int32 array of their polarization codes.
+* **data** -- a (*nwf*, *ntime*, *nchan*) complex64 array of the
+  visibilities.
+* **flags** -- a (*nwf*, *ntime*, *nchan*) int32 array of the flags;
+  nonzero values indicate good data. Times with no record are flagged.
+* **visno** -- a (*nwf*, *ntime*) int array of the serial numbers of
+  the records that went into each row, as in
+  :func:`mirtask.uvdat.getVisNum`, or -1 where there was no record.
+  These can be handed to :class:`mirtask.FlagEditor` to write flags
+  back.
+"""
+
+    def index (self, ant1, ant2, pol):
+        """Find a waterfall.
+
+:arg int ant1: the first antenna number
+:arg int ant2: the second antenna number
+:arg pol: the polarization, as a code or a name such as "XX"
+:rtype: int
+:returns: the index of the waterfall along the first axis of **data**
+:raises: :exc:`KeyError` if there is no such waterfall
+"""
+        if isinstance (pol, basestring):
+            pol = util.polarizationNumber (pol)
+
+        w = N.nonzero ((self.ant1 == ant1) & (self.ant2 == ant2) &
+                       (self.pol == pol))[0]
+        if w.size == 0:
+            raise KeyError ((ant1, ant2, pol))
+        return int (w[0])
+
+
+class _Builder (object):
+    """Streams batches of records into preallocated waterfalls. The
+(baseline, pol) pairs are given slot numbers by a
+:class:`mirtask.util.SlotTable`, as in the time averager; if the pairs
+were chosen in advance, they're entered first, and records that land
+in later slots are skipped."""
+
+    def __init__ (self, times, bl, pol, polfilter):
+        self.times = times
+        self.polfilter = polfilter
+        self.nfixed = None
+        self.table = util.SlotTable ()
+        self.nchan = None
+        self.cap = 0
+
+        if bl is not None:
+            self.table.lookup (bl, pol)
+            self.nfixed = self.table.count
+
+
+    def _grow (self, nwf):
+        if nwf <= self.cap:
+            return
+
+        cap = max (nwf, 2 * self.cap)
+        if self.nfixed is not None:
+            cap = self.nfixed
+        shape = (cap, self.times.size, self.nchan)
+
+        data = N.zeros (shape, dtype=N.complex64)
+        flags = N.zeros (shape, dtype=N.int32)
+        visno = -N.ones (shape[:2], dtype=N.int)
+
+        if self.cap > 0:
+            data[:self.cap] = self.data
+            flags[:self.cap] = self.flags
+            visno[:self.cap] = self.visno
+
+        self.data, self.flags, self.visno = data, flags, visno
+        self.cap = cap
+
+
+    def add (self, batch):
+        n = batch.count
+
+        if self.nchan is None:
+            self.nchan = batch.nchan
+            self.freqs = N.array (batch.freqs)
+        elif batch.nchan != self.nchan or not N.array_equal (batch.freqs,
+                                                             self.freqs):
+            raise ValueError ('waterfalls need a constant spectral setup')
+
+        bl = N.ascontiguousarray (batch.baseline[:n], dtype=N.double)
+        pol = N.ascontiguousarray (batch.pol[:n], dtype=N.int32)
+
+        if self.polfilter is None:
+            keep = N.ones (n, dtype=N.bool_)
+        else:
+            keep = (pol[:,N.newaxis] == self.polfilter).any (axis=1)
+            if not keep.all ():
+                bl = N.ascontiguousarray (bl[keep])
+                pol = N.ascontiguousarray (pol[keep])
+
+        slots = N.zeros (n, dtype=N.intp)
+        slots[keep] = self.table.lookup (bl, pol)[0]
+
+        if self.nfixed is None:
+            self._grow (self.table.count)
+        else:
+            self._grow (self.nfixed)
+            keep &= slots < self.nfixed
+
+        rows = N.searchsorted (self.times, batch.time[:n])
+        rows = N.minimum (rows, self.times.size - 1)
+        bad = self.times[rows] != batch.time[:n]
+        if N.any (bad):
+            raise ValueError ('record timestamp %r isn\'t in the scanned '
+                              'time axis' % batch.time[:n][bad][0])
+
+        s, r = slots[keep], rows[keep]
+        self.data[s,r] = batch.data[:n][keep]
+        self.flags[s,r] = batch.flags[:n][keep]
+        self.visno[s,r] = batch.visno[:n][keep]
+
+
+    def finish (self, trim):
+        wf = WaterfallSet ()
+        nwf = self.table.count
+        if self.nfixed is not None:
+            nwf = self.nfixed
+
+        if self.nchan is None:
+            self.nchan = 0
+            self.freqs = N.zeros (0)
+            self._grow (max (nwf, 1))
+
+        keep = slice (None)
+        if trim:
+            rows = N.nonzero ((self.visno[:nwf] >= 0).any (axis=0))[0]
+            if rows.size < self.times.size:
+                keep = rows
+            else:
+                trim = False
+
+        wf.nwf = nwf
+        wf.time = self.times[keep]
+        wf.ntime = wf.time.size
+        wf.nchan = self.nchan
+        wf.freqs = self.freqs
+        wf.baseline = self.table.baseline[:nwf].copy ()
+        wf.pol = self.table.pol[:nwf].copy ()
+        wf.ant1, wf.ant2 = util.decodeBaselineArray (wf.baseline)
+
+        if self.cap == nwf and not trim:
+            wf.data, wf.flags, wf.visno = self.data, self.flags, self.visno
+        else:
+            wf.data = self.data[:nwf][:,keep]
+            wf.flags = self.flags[:nwf][:,keep]
+            wf.visno = self.visno[:nwf][:,keep]
+
+        return wf
+
+
+def buildWaterfalls (toread, baselines=None, pols=None, uvdOptions='',
+                     batchSize=1024, trim=True, **uvdargs):
+    """Build per-baseline waterfalls of UV data.
+
+:arg toread: the dataset or datasets to read
+:type toread: :class:`miriad.VisData`, or iterable thereof
+:arg baselines: the baselines to build waterfalls for, as pairs of
+  antenna numbers, or :const:`None` for all of them
+:type baselines: iterable of ``(ant1, ant2)``, or :const:`None`
+:arg pols: the polarizations to build waterfalls for, as codes or names,
+  or :const:`None` for all of them; must be given if *baselines* is
+:type pols: iterable of int or str, or :const:`None`
+:arg str uvdOptions: options for the UVDAT subsystem
+:arg int batchSize: the number of records to read at once
+:arg bool trim: whether to drop the times that have no data in any of
+  the waterfalls, as happens when a selection is applied
+:arg uvdargs: extra arguments for the UVDAT subsystem, as in
+  :func:`mirtask.uvdat.setupAndReadBatches`
+:rtype: :class:`WaterfallSet`
+:returns: the waterfalls
+
+The timestamps are found first with :func:`scanTimes`, so that the
+waterfalls can be allocated up front, and then the data are read in
+one pass with :func:`mirtask.uvdat.setupAndReadBatches` and scattered
+into place a whole batch at a time. If *baselines* is given, the
+waterfalls come in the order of the baselines, with the polarizations
+varying fastest; otherwise they come in the order in which they first
+appear in the data. Every record must have the same channel
+frequencies.
+"""
+    from mirtask import uvdat
+
+    if baselines is None:
+        pol = None
+        if pols is not None:
+            pol = N.array ([util.polarizationNumber (p)
+                            if isinstance (p, basestring) else p
+                            for p in pols], dtype=N.int32)
+        builder = _Builder (scanTimes (toread), None, None, pol)
+    else:
+        if pols is None:
+            raise ValueError ('pols must be given along with baselines')
+
+        pairs = N.array (list (baselines), dtype=N.intc).reshape ((-1, 2))
+        pcodes = N.array ([util.polarizationNumber (p)
+                           if isinstance (p, basestring) else p
+                           for p in pols], dtype=N.int32)
+
+        bl = N.repeat (util.encodeBaselineArray (pairs[:,0], pairs[:,1]),
+                       pcodes.size)
+        pol = N.tile (pcodes, pairs.shape[0])
+        builder = _Builder (scanTimes (toread), bl, pol, None)
+
+    for inp, batch in uvdat.setupAndReadBatches (toread, uvdOptions,
+                                                 batchSize=batchSize,
+                                                 **uvdargs):
+        builder.add (batch)
+
+    return builder.finish (trim)